@@ -11,7 +11,7 @@
 
 #include "include/rbd_types.h"
 
-CLS_VER(1,3)
+CLS_VER(1,5)
 CLS_NAME(rbd)
 
 cls_handle_t h_class;
@@ -20,6 +20,12 @@ cls_method_handle_t h_snapshot_add;
 cls_method_handle_t h_snapshot_remove;
 cls_method_handle_t h_snapshot_revert;
 cls_method_handle_t h_assign_bid;
+cls_method_handle_t h_object_map_update;
+cls_method_handle_t h_snap_protect;
+cls_method_handle_t h_snap_unprotect;
+cls_method_handle_t h_add_child;
+cls_method_handle_t h_remove_child;
+cls_method_handle_t h_copyup;
 cls_method_handle_t h_test_exec;
 
 static int snap_read_header(cls_method_context_t hctx, bufferlist& bl)
@@ -55,6 +61,24 @@ static int snap_read_header(cls_method_context_t hctx, bufferlist& bl)
   return 0;
 }
 
+static string snap_key(const char *prefix, uint64_t snap_id)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)snap_id);
+  return string(prefix) + buf;
+}
+
+static string child_key(uint64_t snap_id, const string& name)
+{
+  return snap_key(RBD_CHILD_KEY_PREFIX, snap_id) + "_" + name;
+}
+
+static bool snap_is_protected(cls_method_context_t hctx, uint64_t snap_id)
+{
+  bufferlist bl;
+  return cls_cxx_map_read_key(hctx, snap_key(RBD_PROTECTED_KEY_PREFIX, snap_id), &bl) == 0;
+}
+
 int snapshots_list(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
 {
   bufferlist bl;
@@ -285,6 +309,10 @@ int snapshot_remove(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
     CLS_LOG("couldn't find snap %s\n",snap_name);
     return -ENOENT;
   }
+  if (snap_is_protected(hctx, snap.id)) {
+    CLS_LOG("snap %s is protected\n", snap_name);
+    return -EBUSY;
+  }
 
   header->snap_names_len  = header->snap_names_len - (s.length() + 1);
   header->snap_count = header->snap_count - 1;
@@ -321,6 +349,11 @@ int snapshot_remove(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
   if (rc < 0)
     return rc;
 
+  // a clone's record of what this snapshot saw of its parent
+  rc = cls_cxx_map_remove_key(hctx, snap_key(RBD_SNAP_OVERLAP_KEY_PREFIX, snap.id));
+  if (rc < 0 && rc != -ENOENT)
+    return rc;
+
   return 0;
 
 }
@@ -367,6 +400,158 @@ int rbd_assign_bid(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
   return out->length();
 }
 
+/*
+ * set the state of objects [start, end) in an image's object map,
+ * leaving the other objects sharing those bytes alone.  the map is
+ * zero-extended as needed, but must already exist.
+ */
+int object_map_update(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t start, end;
+  __u8 state;
+  bufferlist::iterator iter = in->begin();
+  try {
+    ::decode(start, iter);
+    ::decode(end, iter);
+    ::decode(state, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+  if (start >= end || state > 3)
+    return -EINVAL;
+
+  uint64_t size;
+  int rc = cls_cxx_stat(hctx, &size, NULL);
+  if (rc < 0)
+    return rc;
+
+  uint64_t first = start / 4;
+  uint64_t len = (end - 1) / 4 - first + 1;
+  bufferlist bl;
+  if (first < size) {
+    rc = cls_cxx_read(hctx, first, len, &bl);
+    if (rc < 0)
+      return rc;
+  }
+  bufferptr bp(len);
+  memset(bp.c_str(), 0, len);
+  if (bl.length())
+    bl.copy(0, MIN(bl.length(), len), bp.c_str());
+
+  unsigned char *map = (unsigned char *)bp.c_str();
+  for (uint64_t i = start; i < end; i++) {
+    uint64_t b = i / 4 - first;
+    int shift = (i % 4) * 2;
+    map[b] = (map[b] & ~(3 << shift)) | (state << shift);
+  }
+
+  bufferlist newbl;
+  newbl.push_back(bp);
+  return cls_cxx_write(hctx, first, len, &newbl);
+}
+
+/*
+ * layering.  a clone may only be made from a protected snapshot, and
+ * a snapshot can't be unprotected or removed while clones refer to it.
+ * these run on the parent's header object.
+ */
+int snap_protect(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  bufferlist::iterator iter = in->begin();
+  try {
+    ::decode(snap_id, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  bufferlist bl;
+  int rc = snap_read_header(hctx, bl);
+  if (rc < 0)
+    return rc;
+  struct rbd_obj_header_ondisk *header = (struct rbd_obj_header_ondisk *)bl.c_str();
+  unsigned i;
+  for (i = 0; i < header->snap_count; i++)
+    if (header->snaps[i].id == snap_id)
+      break;
+  if (i == header->snap_count)
+    return -ENOENT;
+
+  bufferlist empty;
+  return cls_cxx_map_write_key(hctx, snap_key(RBD_PROTECTED_KEY_PREFIX, snap_id), &empty);
+}
+
+int snap_unprotect(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  bufferlist::iterator iter = in->begin();
+  try {
+    ::decode(snap_id, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  string start_after;
+  string prefix = snap_key(RBD_CHILD_KEY_PREFIX, snap_id) + "_";
+  map<string, bufferlist> children;
+  int rc = cls_cxx_map_read_keys(hctx, start_after, prefix, 1, &children);
+  if (rc < 0)
+    return rc;
+  if (rc > 0) {
+    CLS_LOG("snap %llx still has clones\n", (unsigned long long)snap_id);
+    return -EBUSY;
+  }
+  return cls_cxx_map_remove_key(hctx, snap_key(RBD_PROTECTED_KEY_PREFIX, snap_id));
+}
+
+int add_child(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  string name;
+  bufferlist::iterator iter = in->begin();
+  try {
+    ::decode(snap_id, iter);
+    ::decode(name, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  if (!snap_is_protected(hctx, snap_id)) {
+    CLS_LOG("snap %llx is not protected\n", (unsigned long long)snap_id);
+    return -EINVAL;
+  }
+  bufferlist empty;
+  return cls_cxx_map_write_key(hctx, child_key(snap_id, name), &empty);
+}
+
+int remove_child(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  string name;
+  bufferlist::iterator iter = in->begin();
+  try {
+    ::decode(snap_id, iter);
+    ::decode(name, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+  return cls_cxx_map_remove_key(hctx, child_key(snap_id, name));
+}
+
+/*
+ * on a clone's data object: write the parent's data unless the object
+ * already exists, so a racing copy-up can't clobber a newer write.
+ */
+int copyup(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  int rc = cls_cxx_stat(hctx, NULL, NULL);
+  if (rc == 0)
+    return 0;
+  if (rc != -ENOENT)
+    return rc;
+  return cls_cxx_write_full(hctx, in);
+}
+
 /* Used for testing rados_exec */
 static int test_exec(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
 {
@@ -389,6 +574,15 @@ void __cls_init()
   /* assign a unique block id for rbd blocks */
   cls_register_cxx_method(h_class, "assign_bid", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, rbd_assign_bid, &h_assign_bid);
 
+  cls_register_cxx_method(h_class, "object_map_update", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, object_map_update, &h_object_map_update);
+
+  /* layering */
+  cls_register_cxx_method(h_class, "snap_protect", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, snap_protect, &h_snap_protect);
+  cls_register_cxx_method(h_class, "snap_unprotect", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, snap_unprotect, &h_snap_unprotect);
+  cls_register_cxx_method(h_class, "add_child", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, add_child, &h_add_child);
+  cls_register_cxx_method(h_class, "remove_child", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, remove_child, &h_remove_child);
+  cls_register_cxx_method(h_class, "copyup", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, copyup, &h_copyup);
+
   cls_register_cxx_method(h_class, "test_exec", CLS_METHOD_RD | CLS_METHOD_PUBLIC, test_exec, &h_test_exec);
 
   return;
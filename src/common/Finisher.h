@@ -69,6 +69,8 @@ class Finisher {
 
   void wait_for_empty();
 
+  bool am_self() { return finisher_thread.am_self(); }
+
   Finisher(CephContext *cct_) : cct(cct_), finisher_lock("Finisher::finisher_lock"),
 	       finisher_stop(false), finisher_running(false), finisher_thread(this) {}
 };
@@ -0,0 +1,236 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "Thread.h"
+#include "TimerWheel.h"
+
+#include "common/Clock.h"
+#include "common/config.h"
+#include "include/Context.h"
+
+#define dout_subsys ceph_subsys_timer
+#undef dout_prefix
+#define dout_prefix *_dout << "timerwheel(" << this << ")."
+
+class TimerWheelThread : public Thread {
+  TimerWheel *parent;
+public:
+  TimerWheelThread(TimerWheel *w) : parent(w) {}
+  void *entry() {
+    parent->timer_thread();
+    return NULL;
+  }
+};
+
+TimerWheel::TimerWheel(CephContext *cct_, Mutex &l, double t, unsigned nslots)
+  : cct(cct_), lock(l), tick(t),
+    thread(NULL),
+    slots(nslots),
+    stopping(false)
+{
+  assert(tick > 0);
+  assert(nslots > 0);
+  cur = to_tick(ceph_clock_now(cct));
+}
+
+TimerWheel::~TimerWheel()
+{
+  assert(thread == NULL);
+}
+
+uint64_t TimerWheel::to_tick(utime_t t) const
+{
+  return (uint64_t)((double)t / tick);
+}
+
+void TimerWheel::init()
+{
+  ldout(cct,10) << "init tick " << tick << " slots " << slots.size() << dendl;
+  thread = new TimerWheelThread(this);
+  thread->create();
+}
+
+void TimerWheel::shutdown()
+{
+  ldout(cct,10) << "shutdown" << dendl;
+  assert(lock.is_locked());
+  cancel_all_events();
+  if (thread) {
+    stopping = true;
+    cond.Signal();
+    lock.Unlock();
+    thread->join();
+    lock.Lock();
+    delete thread;
+    thread = NULL;
+  }
+}
+
+static bool event_before(const TimerWheel::Event& a, const TimerWheel::Event& b)
+{
+  return a.when < b.when;
+}
+
+/*
+ * move everything due by tick now onto the due list.  after a long
+ * sleep we only need to look at each slot once, but then the slots no
+ * longer come up in deadline order, so sort what we collected.  the
+ * sort is stable, so events due on the same tick keep their order.
+ */
+void TimerWheel::advance(uint64_t now)
+{
+  uint64_t n = now - cur;
+  if (n > slots.size())
+    n = slots.size();
+  std::list<Event> ready;
+  for (uint64_t i = 1; i <= n; i++) {
+    int s = (cur + i) % slots.size();
+    std::list<Event>& l = slots[s];
+    std::list<Event>::iterator p = l.begin();
+    while (p != l.end()) {
+      std::list<Event>::iterator q = p++;
+      if (q->when <= now) {
+	q->slot = -1;
+	ready.splice(ready.end(), l, q);   // iterators stay valid
+      }
+    }
+  }
+  if (n == slots.size())
+    ready.sort(event_before);
+  due.splice(due.end(), ready);
+  cur = now;
+}
+
+/*
+ * advance to tick now and run whatever is due.  one at a time, so a
+ * callback may cancel anything still due.
+ */
+void TimerWheel::run(uint64_t now)
+{
+  if (now > cur)
+    advance(now);
+
+  while (!due.empty()) {
+    Context *callback = due.front().callback;
+    events.erase(callback);
+    due.pop_front();
+    ldout(cct,10) << "run executing " << callback << dendl;
+    callback->finish(0);
+    delete callback;
+  }
+}
+
+void TimerWheel::advance_to(utime_t now)
+{
+  assert(lock.is_locked());
+  run(to_tick(now));
+}
+
+void TimerWheel::timer_thread()
+{
+  lock.Lock();
+  ldout(cct,10) << "timer_thread starting" << dendl;
+  while (!stopping) {
+    run(to_tick(ceph_clock_now(cct)));
+
+    if (stopping)
+      break;
+    ldout(cct,20) << "timer_thread going to sleep" << dendl;
+    if (events.empty()) {
+      cond.Wait(lock);
+    } else {
+      utime_t next;
+      next.set_from_double((double)(cur + 1) * tick);
+      cond.WaitUntil(lock, next);
+    }
+  }
+  ldout(cct,10) << "timer_thread exiting" << dendl;
+  lock.Unlock();
+}
+
+void TimerWheel::add_event_after(double seconds, Context *callback)
+{
+  assert(lock.is_locked());
+
+  utime_t when = ceph_clock_now(cct);
+  when += seconds;
+  add_event_at(when, callback);
+}
+
+void TimerWheel::add_event_at(utime_t when, Context *callback)
+{
+  assert(lock.is_locked());
+
+  // round up, so we never fire early
+  uint64_t t = to_tick(when);
+  if ((double)t * tick < (double)when)
+    t++;
+  ldout(cct,10) << "add_event_at " << when << " (tick " << t << ") -> " << callback << dendl;
+
+  /* If you hit this, you tried to insert the same Context* twice. */
+  assert(events.count(callback) == 0);
+
+  bool wake = events.empty();
+  if (t <= cur) {
+    due.push_back(Event(callback, t, -1));
+    events[callback] = --due.end();
+    wake = true;
+  } else {
+    int s = t % slots.size();
+    slots[s].push_back(Event(callback, t, s));
+    events[callback] = --slots[s].end();
+  }
+  if (wake)
+    cond.Signal();
+}
+
+bool TimerWheel::cancel_event(Context *callback)
+{
+  assert(lock.is_locked());
+
+  __gnu_cxx::hash_map<Context*, std::list<Event>::iterator, ContextHash>::iterator p =
+    events.find(callback);
+  if (p == events.end()) {
+    ldout(cct,10) << "cancel_event " << callback << " not found" << dendl;
+    return false;
+  }
+
+  ldout(cct,10) << "cancel_event " << callback << dendl;
+  std::list<Event>::iterator e = p->second;
+  if (e->slot < 0)
+    due.erase(e);
+  else
+    slots[e->slot].erase(e);
+  events.erase(p);
+  delete callback;
+  return true;
+}
+
+void TimerWheel::cancel_all_events()
+{
+  ldout(cct,10) << "cancel_all_events" << dendl;
+  assert(lock.is_locked());
+
+  for (__gnu_cxx::hash_map<Context*, std::list<Event>::iterator, ContextHash>::iterator p =
+	 events.begin();
+       p != events.end();
+       ++p) {
+    ldout(cct,10) << " cancelled " << p->first << dendl;
+    delete p->first;
+  }
+  events.clear();
+  due.clear();
+  for (unsigned i = 0; i < slots.size(); i++)
+    slots[i].clear();
+}
@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_TIMERWHEEL_H
+#define CEPH_TIMERWHEEL_H
+
+#include "Cond.h"
+#include "Mutex.h"
+#include "include/hash.h"
+#include "include/utime.h"
+
+#include <ext/hash_map>
+#include <list>
+#include <vector>
+
+class CephContext;
+class Context;
+class TimerWheelThread;
+
+/**
+ * TimerWheel - hashed timing wheel with the SafeTimer interface
+ *
+ * Events are rounded up to the next tick and hashed into one of a
+ * fixed number of slots, so adding and cancelling are O(1) however
+ * many events are pending.  Events more than one revolution out just
+ * stay in their slot until their tick comes around.  Meant for large
+ * numbers of coarse timeouts that are usually cancelled before they
+ * fire.
+ *
+ * Like SafeTimer, callbacks run in the timer thread with the lock held.
+ */
+class TimerWheel
+{
+  // This class isn't supposed to be copied
+  TimerWheel(const TimerWheel &rhs);
+  TimerWheel& operator=(const TimerWheel &rhs);
+
+public:
+  struct Event {
+    Context *callback;
+    uint64_t when;   ///< in ticks
+    int slot;        ///< -1 once it is due
+    Event(Context *c, uint64_t w, int s) : callback(c), when(w), slot(s) {}
+  };
+
+private:
+  struct ContextHash {
+    size_t operator()(const Context *c) const {
+      return rjhash64((uint64_t)c);
+    }
+  };
+
+  CephContext *cct;
+  Mutex& lock;
+  Cond cond;
+  double tick;
+
+  friend class TimerWheelThread;
+  TimerWheelThread *thread;
+
+  std::vector<std::list<Event> > slots;
+  std::list<Event> due;
+  __gnu_cxx::hash_map<Context*, std::list<Event>::iterator, ContextHash> events;
+  uint64_t cur;    ///< last tick processed
+  bool stopping;
+
+  uint64_t to_tick(utime_t t) const;
+  void advance(uint64_t now);
+  void run(uint64_t now);
+  void timer_thread();
+
+public:
+  TimerWheel(CephContext *cct, Mutex &l, double tick, unsigned nslots = 1024);
+  ~TimerWheel();
+
+  /* Call with the lock UNLOCKED. */
+  void init();
+  /* Call with the lock LOCKED; cancels everything and stops the thread. */
+  void shutdown();
+
+  /* Call with the lock LOCKED.  Runs everything due by now, as the
+   * timer thread would; lets tests drive a wheel without init(). */
+  void advance_to(utime_t now);
+
+  /* Call with the lock LOCKED */
+  void add_event_after(double seconds, Context *callback);
+  void add_event_at(utime_t when, Context *callback);
+  bool cancel_event(Context *callback);
+  void cancel_all_events();
+
+  unsigned size() const {
+    return events.size();
+  }
+};
+
+#endif
@@ -0,0 +1,94 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_TOKENBUCKET_H
+#define CEPH_TOKENBUCKET_H
+
+#include "include/utime.h"
+
+/**
+ * TokenBucket - rate limit something to N units per second
+ *
+ * Tokens accumulate at rate units/sec, up to burst.  Consumers take()
+ * whatever they actually used, which may push the bucket into debt;
+ * nobody new should start while the bucket is empty.  A rate of 0
+ * means unlimited.
+ *
+ * Not thread safe; callers provide their own locking.
+ */
+class TokenBucket {
+  double rate;      ///< units per second; 0 == unlimited
+  double burst;     ///< max tokens we will accumulate
+  double tokens;    ///< current balance; may be negative (debt)
+  utime_t last;     ///< last refill
+
+public:
+  TokenBucket() : rate(0), burst(0), tokens(0) {}
+
+  /// set rate (units/sec) and burst (units); 0 burst means one second's worth
+  void set_rate(double r, double b = 0) {
+    bool was_unlimited = is_unlimited();
+    rate = r;
+    burst = b > 0 ? b : r;
+    if (was_unlimited || tokens > burst)
+      tokens = burst;   // start (or restart) with a full bucket
+  }
+  double get_rate() const { return rate; }
+  double get_burst() const { return burst; }
+  bool is_unlimited() const { return rate <= 0; }
+
+  void refill(utime_t now) {
+    if (last == utime_t() || now < last) {
+      last = now;
+      return;
+    }
+    double el = (double)(now - last);
+    last = now;
+    tokens += el * rate;
+    if (tokens > burst)
+      tokens = burst;
+  }
+
+  double get_tokens(utime_t now) {
+    refill(now);
+    return tokens;
+  }
+
+  /// true if we may start something new
+  bool may_start(utime_t now) {
+    if (is_unlimited())
+      return true;
+    return get_tokens(now) > 0;
+  }
+
+  /// account for c units consumed (may leave the bucket in debt)
+  void take(utime_t now, double c) {
+    if (is_unlimited())
+      return;
+    refill(now);
+    tokens -= c;
+  }
+
+  /// seconds until may_start() will succeed
+  double get_wait(utime_t now) {
+    if (is_unlimited())
+      return 0;
+    double t = get_tokens(now);
+    if (t > 0)
+      return 0;
+    return (-t) / rate;
+  }
+};
+
+#endif
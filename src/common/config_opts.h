@@ -162,6 +162,13 @@ OPTION(objecter_mon_retry_interval, OPT_DOUBLE, 5.0)
 OPTION(objecter_timeout, OPT_DOUBLE, 10.0)    // before we ask for a map
 OPTION(objecter_inflight_op_bytes, OPT_U64, 1024*1024*100) // max in-flight data (both directions)
 OPTION(objecter_inflight_ops, OPT_U64, 1024)               // max in-flight ios
+OPTION(objecter_crush_location, OPT_STR, "")   // where this client is, e.g. "host=foo rack=bar", for nearest-replica reads
+OPTION(objecter_adaptive_window, OPT_BOOL, false)   // limit ops in flight to each osd by its reply latency
+OPTION(objecter_window_initial, OPT_DOUBLE, 1024)   // no lower than objecter_inflight_ops, so nothing changes until an osd is slow
+OPTION(objecter_window_min, OPT_DOUBLE, 4)
+OPTION(objecter_window_max, OPT_DOUBLE, 1024)
+OPTION(objecter_window_latency_ratio, OPT_DOUBLE, 4)   // cut the window when a reply is this many times slower than the best lately
+OPTION(objecter_window_latency_floor, OPT_DOUBLE, .05)  // ... and slower than this (seconds)
 OPTION(journaler_allow_split_entries, OPT_BOOL, true)
 OPTION(journaler_write_head_interval, OPT_INT, 15)
 OPTION(journaler_prefetch_periods, OPT_INT, 10)   // * journal object size
@@ -279,15 +286,32 @@ OPTION(osd_map_cache_bl_size, OPT_INT, 50)
 OPTION(osd_map_cache_bl_inc_size, OPT_INT, 100)
 OPTION(osd_map_message_max, OPT_INT, 100)  // max maps per MOSDMap message
 OPTION(osd_op_threads, OPT_INT, 2)    // 0 == no threading
+OPTION(osd_op_unlocked_reads, OPT_BOOL, true)   // plain head reads drop the pg lock while they hit the disk
+OPTION(osd_op_queue, OPT_STR, "fifo")   // fifo | mclock
+OPTION(osd_op_qos_key, OPT_STR, "client")   // schedule client ops per client | pool
+OPTION(osd_op_qos_client_reservation, OPT_DOUBLE, 0)   // ops/sec; 0 == none
+OPTION(osd_op_qos_client_weight, OPT_DOUBLE, 1)
+OPTION(osd_op_qos_client_limit, OPT_DOUBLE, 0)   // ops/sec; 0 == unlimited
+OPTION(osd_op_qos_osd_reservation, OPT_DOUBLE, 0)   // replication traffic from peer osds
+OPTION(osd_op_qos_osd_weight, OPT_DOUBLE, 10)
+OPTION(osd_op_qos_osd_limit, OPT_DOUBLE, 0)
+OPTION(osd_op_qos_recovery_limit, OPT_DOUBLE, 0)   // recovery ops/sec started; 0 == unlimited
+OPTION(osd_op_qos_scrub_limit, OPT_DOUBLE, 0)   // pg scrubs/sec started; 0 == unlimited
+OPTION(osd_op_qos_cost_bytes, OPT_U64, 1<<20)   // an op costs 1 + bytes/this
 OPTION(osd_disk_threads, OPT_INT, 1)
 OPTION(osd_recovery_threads, OPT_INT, 1)
+OPTION(osd_pg_mapping_threads, OPT_INT, 2)   // threads used to precompute pg mappings for a new map
+OPTION(osd_pg_load_threads, OPT_INT, 4)   // threads used to read pgs off disk at startup
 OPTION(osd_recover_clone_overlap, OPT_BOOL, true)   // preserve clone_overlap during recovery/migration
 OPTION(osd_backfill_scan_min, OPT_INT, 64)
 OPTION(osd_backfill_scan_max, OPT_INT, 512)
+OPTION(osd_backfill_scan_bytes, OPT_U64, 64 << 20)  // aim peer backfill intervals at this much data; 0 == always scan_max
 OPTION(osd_op_thread_timeout, OPT_INT, 30)
 OPTION(osd_backlog_thread_timeout, OPT_INT, 60*60*1)
 OPTION(osd_recovery_thread_timeout, OPT_INT, 30)
 OPTION(osd_snap_trim_thread_timeout, OPT_INT, 60*60*1)
+OPTION(osd_snap_trim_batch, OPT_INT, 8)   // clone trims a pg keeps in flight
+OPTION(osd_snap_trim_max_ops_per_sec, OPT_DOUBLE, 0)  // clone trims per sec per osd; 0 == unlimited
 OPTION(osd_scrub_thread_timeout, OPT_INT, 60)
 OPTION(osd_scrub_finalize_thread_timeout, OPT_INT, 60*10)
 OPTION(osd_remove_thread_timeout, OPT_INT, 60*60)
@@ -309,6 +333,11 @@ OPTION(osd_auto_mark_unfound_lost, OPT_BOOL, false)
 OPTION(osd_recovery_delay_start, OPT_FLOAT, 15)
 OPTION(osd_recovery_max_active, OPT_INT, 5)
 OPTION(osd_recovery_max_chunk, OPT_U64, 1<<20)  // max size of push chunk
+OPTION(osd_recovery_max_push_chunks, OPT_INT, 4)  // max chunks of one object push in flight to a peer
+OPTION(osd_recovery_push_batch_max, OPT_INT, 16)  // max small objects batched into one push message
+OPTION(osd_recovery_max_bytes_per_sec, OPT_U64, 0)  // recovery push budget per osd; 0 == unlimited
+OPTION(osd_recovery_min_bytes_per_sec, OPT_U64, 4<<20)  // floor when backing off for client ops
+OPTION(osd_recovery_client_latency_target, OPT_DOUBLE, 0)  // back off recovery above this avg client op latency (sec); 0 == never
 OPTION(osd_recovery_forget_lost_objects, OPT_BOOL, false)   // off for now
 OPTION(osd_max_scrubs, OPT_INT, 1)
 OPTION(osd_scrub_load_threshold, OPT_FLOAT, 0.5)
@@ -318,6 +347,9 @@ OPTION(osd_auto_weight, OPT_BOOL, false)
 OPTION(osd_class_error_timeout, OPT_DOUBLE, 60.0)  // seconds
 OPTION(osd_class_timeout, OPT_DOUBLE, 60*60.0) // seconds
 OPTION(osd_class_dir, OPT_STR, CEPH_LIBDIR "/rados-classes")
+OPTION(osd_class_preload, OPT_STR, "rbd rgw")   // classes to load at startup
+OPTION(osd_class_stats_dump_max, OPT_INT, 20)   // methods shown by dump_cls_stats
+OPTION(osd_watch_timer_tick, OPT_DOUBLE, .25)   // resolution of watch and notify timeouts
 OPTION(osd_check_for_log_corruption, OPT_BOOL, false)
 OPTION(osd_use_stale_snap, OPT_BOOL, false)
 OPTION(osd_rollback_to_cluster_snap, OPT_STR, "")
@@ -380,6 +412,12 @@ OPTION(rbd_cache_size, OPT_LONGLONG, 32<<20)         // cache size
 OPTION(rbd_cache_max_dirty, OPT_LONGLONG, 24<<20)    // dirty limit
 OPTION(rbd_cache_target_dirty, OPT_LONGLONG, 16<<20) // target dirty limit
 OPTION(rbd_cache_max_dirty_age, OPT_FLOAT, 1.0)      // age in cache before writeback starts
+OPTION(rbd_cache_writethrough_until_flush, OPT_BOOL, false) // write-through until the first flush, for guests that may never flush
+OPTION(rbd_cache_write_around_bytes, OPT_LONGLONG, 0) // writes at least this large bypass the cache, 0 to cache everything
+OPTION(rbd_concurrent_management_ops, OPT_INT, 10)  // ios in flight for copy, export, import
+OPTION(rbd_object_map, OPT_BOOL, false) // create new images with an object map
+OPTION(rbd_readahead_trigger_requests, OPT_INT, 10) // sequential reads before the cache starts readahead
+OPTION(rbd_readahead_max_bytes, OPT_LONGLONG, 512 * 1024) // largest readahead window, 0 to disable
 OPTION(rgw_cache_enabled, OPT_BOOL, true)   // rgw cache enabled
 OPTION(rgw_cache_lru_size, OPT_INT, 10000)   // num of entries in rgw cache
 OPTION(rgw_socket_path, OPT_STR, "")   // path to unix domain socket, if not specified, rgw will not run as external fcgi
@@ -113,6 +113,36 @@ bool CrushWrapper::check_item_loc(CephContext *cct, int item, map<string,string>
   return false;
 }
 
+int CrushWrapper::get_item_locality(int item, const map<string,string>& loc)
+{
+  for (map<int,string>::const_iterator p = type_map.begin(); p != type_map.end(); p++) {
+    if (p->first == 0)
+      continue;
+    map<string,string>::const_iterator q = loc.find(p->second);
+    if (q == loc.end() || !name_exists(q->second.c_str()))
+      continue;
+    int id = get_item_id(q->second.c_str());
+    if (id < 0 && subtree_contains(id, item))
+      return p->first;
+  }
+  return -1;
+}
+
+bool CrushWrapper::subtree_contains(int root, int item) const
+{
+  if (root == item)
+    return true;
+  if (root >= 0)
+    return false;  // root is a leaf
+  const crush_bucket *b = get_bucket(root);
+  if (IS_ERR(b))
+    return false;
+  for (unsigned j = 0; j < b->size; j++)
+    if (subtree_contains(b->items[j], item))
+      return true;
+  return false;
+}
+
 int CrushWrapper::insert_item(CephContext *cct, int item, float weight, string name,
 			      map<string,string>& loc)  // typename -> bucketname
 {
@@ -191,6 +191,21 @@ public:
     return ret;
   }
 
+  /**
+   * how near is an item to a location
+   *
+   * Finds the most specific bucket named in loc that contains item,
+   * anywhere beneath it.
+   *
+   * @param item item id
+   * @param loc location (map of type to bucket names)
+   * @return type id of that bucket (so smaller is nearer), or -1 if none
+   */
+  int get_item_locality(int item, const map<string,string>& loc);
+
+  /// true if item is root or anywhere beneath it
+  bool subtree_contains(int root, int item) const;
+
   /**
    * insert an item into the map at a specific position
    *
@@ -19,6 +19,7 @@
 #define CEPH_FEATURE_OSDREPLYMUX    (1<<12)
 #define CEPH_FEATURE_OSDENC         (1<<13)
 #define CEPH_FEATURE_OMAP           (1<<14)
+#define CEPH_FEATURE_OSD_PUSHBATCH  (1<<15)
 
 /*
  * Features supported.  Should be everything above.
@@ -38,6 +39,7 @@
 	 CEPH_FEATURE_PGPOOL3 |		 \
 	 CEPH_FEATURE_OSDREPLYMUX |	 \
 	 CEPH_FEATURE_OSDENC |		 \
-	 CEPH_FEATURE_OMAP)
+	 CEPH_FEATURE_OMAP |		 \
+	 CEPH_FEATURE_OSD_PUSHBATCH)
 
 #endif
@@ -99,6 +99,19 @@ class LRUList {
     len++;
   }
 
+  void insert_after(LRUObject *pos, LRUObject *o) {
+    o->lru_prev = pos;
+    o->lru_next = pos->lru_next;
+    if (pos->lru_next) {
+      pos->lru_next->lru_prev = o;
+    } else {
+      tail = o;
+    }
+    pos->lru_next = o;
+    o->lru_list = this;
+    len++;
+  }
+
   void remove(LRUObject *o) {
     assert(o->lru_list == this);
     if (o->lru_next)
@@ -184,6 +197,20 @@ class LRU {
     if (o->lru_pinned) lru_num_pinned++;
   }
 
+  // insert right behind another item, so it expires just after it
+  void lru_insert_beside(LRUObject *o, LRUObject *other) {
+    assert(!o->lru);
+    assert(other->lru == this);
+    if (other->lru_list == &lru_pintail && !o->lru_pinned) {
+      lru_insert_bot(o);
+      return;
+    }
+    o->lru = this;
+    other->lru_list->insert_after(other, o);
+    lru_num++;
+    if (o->lru_pinned) lru_num_pinned++;
+  }
+
   /*
   // insert at bottom of lru
   void lru_insert_pintail(LRUObject *o) {
@@ -204,6 +204,12 @@ enum {
 	CEPH_OSD_OP_OMAPCLEAR     = CEPH_OSD_OP_MODE_WR | CEPH_OSD_OP_TYPE_DATA | 23,
 	CEPH_OSD_OP_OMAPRMKEYS    = CEPH_OSD_OP_MODE_WR | CEPH_OSD_OP_TYPE_DATA | 24,
 
+	/* digest of a range, without the data */
+	CEPH_OSD_OP_CHECKSUM      = CEPH_OSD_OP_MODE_RD | CEPH_OSD_OP_TYPE_DATA | 25,
+
+	/* clones of an object, with their snaps, sizes and overlap */
+	CEPH_OSD_OP_LIST_SNAPS    = CEPH_OSD_OP_MODE_RD | CEPH_OSD_OP_TYPE_DATA | 26,
+
 	/** multi **/
 	CEPH_OSD_OP_CLONERANGE = CEPH_OSD_OP_MODE_WR | CEPH_OSD_OP_TYPE_MULTI | 1,
 	CEPH_OSD_OP_ASSERT_SRC_VERSION = CEPH_OSD_OP_MODE_RD | CEPH_OSD_OP_TYPE_MULTI | 2,
@@ -344,6 +350,16 @@ enum {
 	CEPH_OSD_CMPXATTR_MODE_U64    = 2
 };
 
+/*
+ * CHECKSUM digests.  crc32c is seeded with -1 and returned as a __le32;
+ * the others are returned as the raw digest bytes.
+ */
+enum {
+	CEPH_OSD_CHECKSUM_CRC32C = 1,
+	CEPH_OSD_CHECKSUM_SHA1   = 2,
+	CEPH_OSD_CHECKSUM_SHA256 = 3,
+};
+
 /*
  * an individual object operation.  each may be accompanied by some data
  * payload
@@ -385,6 +401,11 @@ struct ceph_osd_op {
 			__le64 offset, length;
 			__le64 src_offset;
 		} __attribute__ ((packed)) clonerange;
+		struct {
+			__le64 offset, length;
+			__u8 type;          /* CEPH_OSD_CHECKSUM_* */
+			__le32 chunk_size;  /* 0 = one digest for the range */
+		} __attribute__ ((packed)) checksum;
 	};
 	__le32 payload_len;
 } __attribute__ ((packed));
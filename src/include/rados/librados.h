@@ -32,6 +32,32 @@ extern "C" {
 
 #define LIBRADOS_SUPPORTS_WATCH 1
 
+/**
+ * @defgroup librados_h_read_policy read policies
+ * Where reads on an io context are sent; see rados_ioctx_set_read_policy()
+ * @{
+ */
+/** always read from the primary */
+#define LIBRADOS_READ_PRIMARY 0
+/** spread reads over all replicas at random */
+#define LIBRADOS_READ_RANDOM  1
+/** read from the nearest replica; see objecter_crush_location */
+#define LIBRADOS_READ_NEAREST 2
+/** @} read_policy */
+
+/**
+ * @defgroup librados_h_checksum checksum types
+ * Digests computed by the osd for ObjectReadOperation::checksum()
+ * @{
+ */
+/** crc32c seeded with -1, as a little-endian 32-bit value */
+#define LIBRADOS_CHECKSUM_CRC32C 1
+/** 20 byte SHA-1 digest */
+#define LIBRADOS_CHECKSUM_SHA1   2
+/** 32 byte SHA-256 digest */
+#define LIBRADOS_CHECKSUM_SHA256 3
+/** @} checksum */
+
 /**
  * @defgroup librados_h_xattr_comp xattr comparison operations
  * @note BUG: there's no way to use these in the C api
@@ -583,6 +609,21 @@ int rados_ioctx_get_pool_name(rados_ioctx_t io, char *buf, unsigned maxlen);
  * any previously set key
  */
 void rados_ioctx_locator_set_key(rados_ioctx_t io, const char *key);
+
+/**
+ * Choose which replica serves reads on an io context.
+ *
+ * By default all reads go to the primary.  With LIBRADOS_READ_RANDOM
+ * or LIBRADOS_READ_NEAREST they may be served by any up to date
+ * replica instead, which spreads read load over the whole pg.  Reads of
+ * an object with a write from this client in flight still go to the
+ * primary, so a client always reads its own writes.
+ *
+ * @param io the io context to change
+ * @param policy one of the LIBRADOS_READ_* policies
+ * @returns 0 on success, -EINVAL for an unknown policy
+ */
+int rados_ioctx_set_read_policy(rados_ioctx_t io, int policy);
 /** @} obj_loc */
 
 /**
@@ -12,6 +12,7 @@
 #include "buffer.h"
 
 #include "librados.h"
+#include "rados_types.hpp"
 
 namespace librados
 {
@@ -168,6 +169,15 @@ namespace librados
     void write_full(const bufferlist& bl);
     void append(const bufferlist& bl);
     void remove();
+    /**
+     * roll the object back to a self-managed snapshot
+     *
+     * The same as IoCtx::selfmanaged_snap_rollback, but usable with
+     * aio_operate.
+     *
+     * @param snapid snapshot to roll back to
+     */
+    void selfmanaged_snap_rollback(uint64_t snapid);
     void truncate(uint64_t off);
     void zero(uint64_t off, uint64_t len);
     void rmxattr(const char *name);
@@ -218,12 +228,54 @@ namespace librados
     ObjectReadOperation() {}
     ~ObjectReadOperation() {}
 
+    using ObjectOperation::exec;
+    /**
+     * exec: call a class method and get back what it returned
+     *
+     * @param obl [out] the method's output
+     * @param prval [out] place error code in prval upon completion
+     */
+    void exec(const char *cls, const char *method, bufferlist& inbl,
+	      bufferlist *obl, int *prval);
+
     void stat(uint64_t *psize, time_t *pmtime, int *prval);
     void getxattr(const char *name, bufferlist *pbl, int *prval);
     void getxattrs(std::map<std::string, bufferlist> *pattrs, int *prval);
     void read(size_t off, uint64_t len, bufferlist *pbl, int *prval);
     void tmap_get(bufferlist *pbl, int *prval);
 
+    /**
+     * checksum: digest a range of the object on the osd
+     *
+     * Only the digests come back, so comparing an object against a
+     * local copy does not move the data.  The range is clipped to the
+     * object size.
+     *
+     * @param type [in] LIBRADOS_CHECKSUM_*
+     * @param off [in] offset of the range
+     * @param len [in] length of the range; 0 means to the end of the object
+     * @param chunk_size [in] one digest per chunk_size bytes; 0 means one
+     * digest for the whole range
+     * @param pdigests [out] the digests, back to back
+     * @param prval [out] place error code in prval upon completion
+     */
+    void checksum(int type, uint64_t off, uint64_t len, uint32_t chunk_size,
+		  bufferlist *pdigests, int *prval);
+
+    /**
+     * list_snaps: the clones of the object
+     *
+     * Each clone comes with the snaps it belongs to, its size and the
+     * extents it shares with the next newer clone (or the head), so
+     * what changed between two snaps can be worked out without reading
+     * any data.  The head, if it exists, is last with cloneid
+     * SNAP_HEAD.  Must be the first op of the operation.
+     *
+     * @param out_snaps [out] the clones, oldest first
+     * @param prval [out] place error code in prval upon completion
+     */
+    void list_snaps(snap_set_t *out_snaps, int *prval);
+
     /**
      * omap_get_vals: keys and values from the object omap
      *
@@ -440,6 +492,24 @@ namespace librados
     int aio_operate(const std::string& oid, AioCompletion *c, ObjectWriteOperation *op);
     int aio_operate(const std::string& oid, AioCompletion *c, ObjectReadOperation *op,
 		    bufferlist *pbl);
+    /**
+     * Apply a compound operation to each of many objects.
+     *
+     * All items are handed to the client in one go, so they go out back
+     * to back on each OSD connection.  c is completed once every item
+     * has completed (and, for writes, is safe once every item is safe);
+     * its return value is 0 or the first error seen.
+     *
+     * @param ops objects and the operations to apply to them; each
+     *        operation is consumed as by aio_operate
+     * @param c completion for the whole batch
+     * @param prvals if non-NULL, filled with the result of each item
+     * @returns 0 on success, negative error code on failure to submit
+     */
+    int aio_operate_batch(std::vector<std::pair<std::string, ObjectWriteOperation*> >& ops,
+			  AioCompletion *c, std::vector<int> *prvals);
+    int aio_operate_batch(std::vector<std::pair<std::string, ObjectReadOperation*> >& ops,
+			  AioCompletion *c, std::vector<int> *prvals);
 
     // watch/notify
     int watch(const std::string& o, uint64_t ver, uint64_t *handle,
@@ -455,6 +525,8 @@ namespace librados
     const std::string& get_pool_name() const;
 
     void locator_set_key(const std::string& key);
+    /// see rados_ioctx_set_read_policy()
+    int set_read_policy(int policy);
 
     int64_t get_id();
 
@@ -0,0 +1,34 @@
+#ifndef CEPH_RADOS_TYPES_HPP
+#define CEPH_RADOS_TYPES_HPP
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace librados {
+
+typedef uint64_t snap_t;
+
+enum {
+  SNAP_HEAD = (uint64_t)(-2),
+  SNAP_DIR = (uint64_t)(-1)
+};
+
+/* one clone of an object, or the head (cloneid SNAP_HEAD) */
+struct clone_info_t {
+  snap_t cloneid;
+  std::vector<snap_t> snaps;          // ascending
+  std::vector< std::pair<uint64_t,uint64_t> > overlap;  // with the next newest, offset/length
+  uint64_t size;
+  clone_info_t() : cloneid(0), size(0) {}
+};
+
+/* the clones of an object, oldest first */
+struct snap_set_t {
+  std::vector<clone_info_t> clones;
+  snap_t seq;   // newest snap seen by the object
+  snap_set_t() : seq(0) {}
+};
+
+}
+#endif
@@ -30,7 +30,7 @@ extern "C" {
 
 #define LIBRBD_VER_MAJOR 0
 #define LIBRBD_VER_MINOR 1
-#define LIBRBD_VER_EXTRA 2
+#define LIBRBD_VER_EXTRA 5
 
 #define LIBRBD_VERSION(maj, min, extra) ((maj << 16) + (min << 8) + extra)
 
@@ -71,6 +71,9 @@ int rbd_remove(rados_ioctx_t io, const char *name);
 int rbd_remove_with_progress(rados_ioctx_t io, const char *name,
 			     librbd_progress_fn_t cb, void *cbdata);
 int rbd_rename(rados_ioctx_t src_io_ctx, const char *srcname, const char *destname);
+/* clone a protected snapshot; the clone is in the same pool */
+int rbd_clone(rados_ioctx_t io, const char *p_name, const char *p_snapname,
+	      const char *c_name, int *c_order);
 
 int rbd_open(rados_ioctx_t io, const char *name, rbd_image_t *image, const char *snap_name);
 int rbd_close(rbd_image_t image);
@@ -81,6 +84,9 @@ int rbd_stat(rbd_image_t image, rbd_image_info_t *info, size_t infosize);
 int rbd_copy(rbd_image_t image, rados_ioctx_t dest_io_ctx, const char *destname);
 int rbd_copy_with_progress(rbd_image_t image, rados_ioctx_t dest_p, const char *destname,
 			   librbd_progress_fn_t cb, void *cbdata);
+/* -ENOENT if the image is not a clone */
+int rbd_get_parent_info(rbd_image_t image, char *parent_name, size_t pnamelen,
+			char *parent_snapname, size_t psnapnamelen);
 
 /* snapshots */
 int rbd_snap_list(rbd_image_t image, rbd_snap_info_t *snaps, int *max_snaps);
@@ -91,6 +97,10 @@ int rbd_snap_rollback(rbd_image_t image, const char *snapname);
 int rbd_snap_rollback_with_progress(rbd_image_t image, const char *snapname,
 				    librbd_progress_fn_t cb, void *cbdata);
 int rbd_snap_set(rbd_image_t image, const char *snapname);
+int rbd_snap_protect(rbd_image_t image, const char *snapname);
+int rbd_snap_unprotect(rbd_image_t image, const char *snapname);
+int rbd_snap_is_protected(rbd_image_t image, const char *snapname,
+			  int *is_protected);
 
 /* I/O */
 typedef void *rbd_completion_t;
@@ -98,12 +108,34 @@ typedef void (*rbd_callback_t)(rbd_completion_t cb, void *arg);
 ssize_t rbd_read(rbd_image_t image, uint64_t ofs, size_t len, char *buf);
 int64_t rbd_read_iterate(rbd_image_t image, uint64_t ofs, size_t len,
 			 int (*cb)(uint64_t, size_t, const char *, void *), void *arg);
+/**
+ * get the extents that changed between a snapshot and the open image
+ *
+ * The open image may be the head or a later snapshot.  cb is called
+ * once per changed extent, in order, with exists = 0 where the extent
+ * is now a hole.  A NULL fromsnapname reports everything that has data.
+ */
+int rbd_diff_iterate(rbd_image_t image, const char *fromsnapname,
+		     uint64_t ofs, uint64_t len,
+		     int (*cb)(uint64_t, size_t, int, void *), void *arg);
 ssize_t rbd_write(rbd_image_t image, uint64_t ofs, size_t len, const char *buf);
 int rbd_discard(rbd_image_t image, uint64_t ofs, uint64_t len);
 int rbd_aio_write(rbd_image_t image, uint64_t off, size_t len, const char *buf, rbd_completion_t c);
 int rbd_aio_read(rbd_image_t image, uint64_t off, size_t len, char *buf, rbd_completion_t c);
 int rbd_aio_discard(rbd_image_t image, uint64_t off, uint64_t len, rbd_completion_t c);
 int rbd_aio_create_completion(void *cb_arg, rbd_callback_t complete_cb, rbd_completion_t *c);
+/**
+ * open an image without waiting for it
+ *
+ * *image is set right away, but can only be used once c has completed
+ * with 0.  If the open fails, the image is closed and *image set to
+ * NULL.  Neither image nor c may be released before c completes.
+ *
+ * Returns 0: every error, including failing to send the first read,
+ * is reported through c, which always completes.
+ */
+int rbd_aio_open(rados_ioctx_t io, const char *name, rbd_image_t *image,
+		 const char *snap_name, rbd_completion_t c);
 int rbd_aio_wait_for_complete(rbd_completion_t c);
 ssize_t rbd_aio_get_return_value(rbd_completion_t c);
 void rbd_aio_release(rbd_completion_t c);
@@ -66,11 +66,19 @@ public:
 
   int open(IoCtx& io_ctx, Image& image, const char *name);
   int open(IoCtx& io_ctx, Image& image, const char *name, const char *snapname);
+  /**
+   * open without waiting; image can be used once c completes with 0.
+   * returns 0, with any error reported through c.  see rbd_aio_open.
+   */
+  int aio_open(IoCtx& io_ctx, Image& image, const char *name,
+	       const char *snapname, AioCompletion *c);
   int list(IoCtx& io_ctx, std::vector<std::string>& names);
   int create(IoCtx& io_ctx, const char *name, uint64_t size, int *order);
   int remove(IoCtx& io_ctx, const char *name);
   int remove_with_progress(IoCtx& io_ctx, const char *name, ProgressContext& pctx);
   int rename(IoCtx& src_io_ctx, const char *srcname, const char *destname);
+  int clone(IoCtx& io_ctx, const char *p_name, const char *p_snapname,
+	    const char *c_name, int *c_order);
 
 private:
   /* We don't allow assignment or copying */
@@ -90,6 +98,7 @@ public:
   int copy(IoCtx& dest_io_ctx, const char *destname);
   int copy_with_progress(IoCtx& dest_io_ctx, const char *destname,
 			 ProgressContext &prog_ctx);
+  int parent_info(std::string *parent_name, std::string *parent_snapname);
 
   /* snapshots */
   int snap_list(std::vector<snap_info_t>& snaps);
@@ -98,11 +107,16 @@ public:
   int snap_rollback(const char *snap_name);
   int snap_rollback_with_progress(const char *snap_name, ProgressContext& pctx);
   int snap_set(const char *snap_name);
+  int snap_protect(const char *snap_name);
+  int snap_unprotect(const char *snap_name);
+  int snap_is_protected(const char *snap_name, bool *is_protected);
 
   /* I/O */
   ssize_t read(uint64_t ofs, size_t len, ceph::bufferlist& bl);
   int64_t read_iterate(uint64_t ofs, size_t len,
 		       int (*cb)(uint64_t, size_t, const char *, void *), void *arg);
+  int diff_iterate(const char *fromsnapname, uint64_t ofs, uint64_t len,
+		   int (*cb)(uint64_t, size_t, int, void *), void *arg);
   ssize_t write(uint64_t ofs, size_t len, ceph::bufferlist& bl);
   int discard(uint64_t ofs, uint64_t len);
 
@@ -25,6 +25,7 @@
  *   foo.00000000
  *   foo.00000001
  *   ...          - data
+ *   foo.object_map - which data objects exist, if RBD_FEATURE_OBJECT_MAP
  */
 
 #define RBD_SUFFIX	 	".rbd"
@@ -39,7 +40,40 @@
 #define RBD_COMP_NONE		0
 #define RBD_CRYPT_NONE		0
 
+#define RBD_FEATURE_OBJECT_MAP	(1<<0)
+#define RBD_FEATURE_LAYERING	(1<<1)
+
+/* the features this client understands; it won't open anything else */
+#define RBD_FEATURES_ALL	(RBD_FEATURE_OBJECT_MAP | RBD_FEATURE_LAYERING)
+
+/*
+ * layering keeps its state in the header object's omap.  a clone
+ * records its parent under RBD_PARENT_KEY, and how much of the parent
+ * each of its own snapshots sees under RBD_SNAP_OVERLAP_KEY_PREFIX.
+ * a parent marks protected snapshots and lists the clones of each.
+ * snapids are printed as %016llx.
+ */
+#define RBD_PARENT_KEY			"parent"
+#define RBD_SNAP_OVERLAP_KEY_PREFIX	"parent_overlap_"  /* snapid */
+#define RBD_PROTECTED_KEY_PREFIX	"snap_protected_"  /* snapid */
+#define RBD_CHILD_KEY_PREFIX		"child_"           /* snapid _ name */
+
+/*
+ * the object map keeps two bits per data object, four objects to a
+ * byte starting from the low bits.  bytes past the end of the map
+ * read as RBD_OBJECT_NONEXISTENT.
+ */
+#define RBD_OBJECT_MAP_SUFFIX	".object_map"
+#define RBD_OBJECT_NONEXISTENT	0
+#define RBD_OBJECT_EXISTS	1
+
 #define RBD_HEADER_TEXT		"<<< Rados Block Device Image >>>\n"
+/*
+ * an image using any feature gets this text instead.  older librbd and
+ * the kernel client only check the text, not the features byte, so
+ * they refuse it rather than quietly ignoring the features.
+ */
+#define RBD_HEADER_TEXT_FEATURES "<<< Rados Block Device Image v2 >>>\n"
 #define RBD_HEADER_SIGNATURE	"RBD"
 #define RBD_HEADER_VERSION	"001.005"
 
@@ -61,7 +95,7 @@ struct rbd_obj_header_ondisk {
 		__u8 order;
 		__u8 crypt_type;
 		__u8 comp_type;
-		__u8 unused;
+		__u8 features;
 	} __attribute__((packed)) options;
 	__le64 image_size;
 	__le64 snap_seq;
@@ -24,7 +24,8 @@
 #define dout_prefix *_dout << "librados: "
 
 librados::IoCtxImpl::IoCtxImpl()
-  : aio_write_list_lock("librados::IoCtxImpl::aio_write_list_lock")
+  : read_flags(0),
+    aio_write_list_lock("librados::IoCtxImpl::aio_write_list_lock")
 {
 }
 
@@ -33,7 +34,7 @@ librados::IoCtxImpl::IoCtxImpl(RadosClient *c, Objecter *objecter,
 			       const char *pool_name, snapid_t s)
   : ref_cnt(0), client(c), poolid(poolid), pool_name(pool_name), snap_seq(s),
     assert_ver(0), notify_timeout(c->cct->_conf->client_notify_timeout),
-    oloc(poolid),
+    oloc(poolid), read_flags(0),
     aio_write_list_lock("librados::IoCtxImpl::aio_write_list_lock"),
     aio_write_seq(0), lock(client_lock), objecter(objecter)
 {
@@ -47,6 +48,25 @@ void librados::IoCtxImpl::set_snap_read(snapid_t s)
   snap_seq = s;
 }
 
+int librados::IoCtxImpl::set_read_policy(int policy)
+{
+  switch (policy) {
+  case LIBRADOS_READ_PRIMARY:
+    read_flags = 0;
+    break;
+  case LIBRADOS_READ_RANDOM:
+    read_flags = CEPH_OSD_FLAG_BALANCE_READS;
+    break;
+  case LIBRADOS_READ_NEAREST:
+    read_flags = CEPH_OSD_FLAG_LOCALIZE_READS;
+    break;
+  default:
+    return -EINVAL;
+  }
+  ldout(client->cct, 10) << "set read policy " << policy << dendl;
+  return 0;
+}
+
 int librados::IoCtxImpl::set_snap_write_context(snapid_t seq, vector<snapid_t>& snaps)
 {
   ::SnapContext n;
@@ -56,10 +76,21 @@ int librados::IoCtxImpl::set_snap_write_context(snapid_t seq, vector<snapid_t>&
   n.snaps = snaps;
   if (!n.is_valid())
     return -EINVAL;
+  Mutex::Locker l(*lock);
   snapc = n;
   return 0;
 }
 
+/*
+ * the queued aio paths build their ops outside the client lock, so
+ * they take a copy of snapc under it first
+ */
+::SnapContext librados::IoCtxImpl::get_snap_write_context()
+{
+  Mutex::Locker l(*lock);
+  return snapc;
+}
+
 void librados::IoCtxImpl::queue_aio_write(AioCompletionImpl *c)
 {
   get();
@@ -626,7 +657,7 @@ int librados::IoCtxImpl::operate_read(const object_t& oid,
 
   lock->Lock();
   objecter->read(oid, oloc,
-	           *o, snap_seq, pbl, 0,
+	           *o, snap_seq, pbl, read_flags,
 	           onack, &ver);
   lock->Unlock();
 
@@ -650,10 +681,9 @@ int librados::IoCtxImpl::aio_operate_read(const object_t &oid,
   c->io = this;
   c->pbl = pbl;
 
-  Mutex::Locker l(*lock);
-  objecter->read(oid, oloc,
-		 *o, snap_seq, pbl, 0,
-		 onack, 0);
+  objecter->op_submit_queued(objecter->prepare_read_op(oid, oloc,
+						      *o, snap_seq, pbl, read_flags,
+						      onack, 0));
   return 0;
 }
 
@@ -668,15 +698,90 @@ int librados::IoCtxImpl::aio_operate(const object_t& oid,
   Context *onack = new C_aio_Ack(c);
   Context *oncommit = new C_aio_Safe(c);
 
+  ::SnapContext wsnapc = get_snap_write_context();
+
   c->io = this;
   queue_aio_write(c);
 
-  Mutex::Locker l(*lock);
-  objecter->mutate(oid, oloc, *o, snapc, ut, 0, onack, oncommit, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_mutate_op(oid, oloc, *o, wsnapc, ut, 0,
+							onack, oncommit, &c->objver));
 
   return 0;
 }
 
+/*
+ * a batch is one C_Gather for the acks (and one for the commits, for
+ * writes) in front of the usual completion callbacks; each item reports
+ * its own result on the way through.  the ops are queued together and
+ * sent back to back, in as few client_lock holds as the objecter's
+ * in-flight budget allows.
+ */
+int librados::IoCtxImpl::aio_operate_batch(vector<pair<object_t, ::ObjectOperation*> >& ops,
+					   AioCompletionImpl *c, vector<int> *prvals)
+{
+  utime_t ut = ceph_clock_now(client->cct);
+  /* can't write to a snapshot */
+  if (snap_seq != CEPH_NOSNAP)
+    return -EROFS;
+
+  if (prvals)
+    prvals->assign(ops.size(), 0);
+
+  c->io = this;
+  queue_aio_write(c);
+
+  if (ops.empty()) {
+    (new C_aio_Ack(c))->complete(0);
+    (new C_aio_Safe(c))->complete(0);
+    return 0;
+  }
+
+  C_GatherBuilder ack(client->cct, new C_aio_Ack(c));
+  C_GatherBuilder safe(client->cct, new C_aio_Safe(c));
+  ::SnapContext wsnapc = get_snap_write_context();
+  std::list<Objecter::Op*> batch;
+  for (unsigned i = 0; i < ops.size(); i++) {
+    int *prval = prvals ? &(*prvals)[i] : NULL;
+    Context *onack = new C_aio_batch_item(prval, ack.new_sub());
+    Context *oncommit = new C_aio_batch_item(prval, safe.new_sub());
+    batch.push_back(objecter->prepare_mutate_op(ops[i].first, oloc, *ops[i].second,
+						wsnapc, ut, 0, onack, oncommit, NULL));
+  }
+  ack.activate();
+  safe.activate();
+
+  objecter->op_submit_queued(batch);
+  return 0;
+}
+
+int librados::IoCtxImpl::aio_operate_read_batch(vector<pair<object_t, ::ObjectOperation*> >& ops,
+						AioCompletionImpl *c, vector<int> *prvals)
+{
+  if (prvals)
+    prvals->assign(ops.size(), 0);
+
+  c->is_read = true;
+  c->io = this;
+
+  if (ops.empty()) {
+    (new C_aio_Ack(c))->complete(0);
+    return 0;
+  }
+
+  C_GatherBuilder ack(client->cct, new C_aio_Ack(c));
+  std::list<Objecter::Op*> batch;
+  for (unsigned i = 0; i < ops.size(); i++) {
+    int *prval = prvals ? &(*prvals)[i] : NULL;
+    Context *onack = new C_aio_batch_item(prval, ack.new_sub());
+    batch.push_back(objecter->prepare_read_op(ops[i].first, oloc, *ops[i].second,
+					      snap_seq, NULL, read_flags, onack, NULL));
+  }
+  ack.activate();
+
+  objecter->op_submit_queued(batch);
+  return 0;
+}
+
 int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
 				  bufferlist *pbl, size_t len, uint64_t off)
 {
@@ -688,10 +793,9 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
   c->io = this;
   c->pbl = pbl;
 
-  Mutex::Locker l(*lock);
-  objecter->read(oid, oloc,
-		 off, len, snap_seq, &c->bl, 0,
-		 onack, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_read_op(oid, oloc,
+						      off, len, snap_seq, &c->bl, read_flags,
+						      onack, &c->objver));
   return 0;
 }
 
@@ -705,10 +809,9 @@ int librados::IoCtxImpl::aio_read(const object_t oid, AioCompletionImpl *c,
   c->buf = buf;
   c->maxlen = len;
 
-  Mutex::Locker l(*lock);
-  objecter->read(oid, oloc,
-		 off, len, snap_seq, &c->bl, 0,
-		 onack, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_read_op(oid, oloc,
+						      off, len, snap_seq, &c->bl, read_flags,
+						      onack, &c->objver));
 
   return 0;
 }
@@ -728,10 +831,9 @@ int librados::IoCtxImpl::aio_sparse_read(const object_t oid,
   c->io = this;
   c->pbl = NULL;
 
-  Mutex::Locker l(*lock);
-  objecter->sparse_read(oid, oloc,
-		 off, len, snap_seq, &c->bl, 0,
-		 onack);
+  objecter->op_submit_queued(objecter->prepare_sparse_read_op(oid, oloc,
+							     off, len, snap_seq, &c->bl, read_flags,
+							     onack));
   return 0;
 }
 
@@ -740,7 +842,8 @@ int librados::IoCtxImpl::aio_write(const object_t &oid, AioCompletionImpl *c,
 				   uint64_t off)
 {
   utime_t ut = ceph_clock_now(client->cct);
-  ldout(client->cct, 20) << "aio_write " << oid << " " << off << "~" << len << " snapc=" << snapc << " snap_seq=" << snap_seq << dendl;
+  ::SnapContext wsnapc = get_snap_write_context();
+  ldout(client->cct, 20) << "aio_write " << oid << " " << off << "~" << len << " snapc=" << wsnapc << " snap_seq=" << snap_seq << dendl;
 
   /* can't write to a snapshot */
   if (snap_seq != CEPH_NOSNAP)
@@ -752,10 +855,9 @@ int librados::IoCtxImpl::aio_write(const object_t &oid, AioCompletionImpl *c,
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
-  objecter->write(oid, oloc,
-		  off, len, snapc, bl, ut, 0,
-		  onack, onsafe, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_write_op(oid, oloc,
+						       off, len, wsnapc, bl, ut, 0,
+						       onack, onsafe, &c->objver));
 
   return 0;
 }
@@ -769,16 +871,17 @@ int librados::IoCtxImpl::aio_append(const object_t &oid, AioCompletionImpl *c,
   if (snap_seq != CEPH_NOSNAP)
     return -EROFS;
 
+  ::SnapContext wsnapc = get_snap_write_context();
+
   c->io = this;
   queue_aio_write(c);
 
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
-  objecter->append(oid, oloc,
-		   len, snapc, bl, ut, 0,
-		   onack, onsafe, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_append_op(oid, oloc,
+							len, wsnapc, bl, ut, 0,
+							onack, onsafe, &c->objver));
 
   return 0;
 }
@@ -793,16 +896,17 @@ int librados::IoCtxImpl::aio_write_full(const object_t &oid,
   if (snap_seq != CEPH_NOSNAP)
     return -EROFS;
 
+  ::SnapContext wsnapc = get_snap_write_context();
+
   c->io = this;
   queue_aio_write(c);
 
   Context *onack = new C_aio_Ack(c);
   Context *onsafe = new C_aio_Safe(c);
 
-  Mutex::Locker l(*lock);
-  objecter->write_full(oid, oloc,
-		       snapc, bl, ut, 0,
-		       onack, onsafe, &c->objver);
+  objecter->op_submit_queued(objecter->prepare_write_full_op(oid, oloc,
+							    wsnapc, bl, ut, 0,
+							    onack, onsafe, &c->objver));
 
   return 0;
 }
@@ -964,7 +1068,7 @@ int librados::IoCtxImpl::tmap_get(const object_t& oid, bufferlist& bl)
   ::ObjectOperation rd;
   prepare_assert_ops(&rd);
   rd.tmap_get(&bl, NULL);
-  objecter->read(oid, oloc, rd, snap_seq, 0, 0, onack, &ver);
+  objecter->read(oid, oloc, rd, snap_seq, 0, read_flags, onack, &ver);
   lock->Unlock();
 
   mylock.Lock();
@@ -1040,7 +1144,7 @@ int librados::IoCtxImpl::read(const object_t& oid,
 
   lock->Lock();
   objecter->read(oid, oloc,
-		 off, len, snap_seq, &bl, 0,
+		 off, len, snap_seq, &bl, read_flags,
 		 onack, &ver, pop);
   lock->Unlock();
 
@@ -1111,7 +1215,7 @@ int librados::IoCtxImpl::sparse_read(const object_t& oid,
 
   lock->Lock();
   objecter->sparse_read(oid, oloc,
-			off, len, snap_seq, &bl, 0,
+			off, len, snap_seq, &bl, read_flags,
 			onack);
   lock->Unlock();
 
@@ -1150,7 +1254,7 @@ int librados::IoCtxImpl::stat(const object_t& oid, uint64_t *psize, time_t *pmti
 
   lock->Lock();
   objecter->stat(oid, oloc,
-		 snap_seq, psize, &mtime, 0,
+		 snap_seq, psize, &mtime, read_flags,
 		 onack, &ver, pop);
   lock->Unlock();
 
@@ -1184,7 +1288,7 @@ int librados::IoCtxImpl::getxattr(const object_t& oid,
 
   lock->Lock();
   objecter->getxattr(oid, oloc,
-		     name, snap_seq, &bl, 0,
+		     name, snap_seq, &bl, read_flags,
 		     onack, &ver, pop);
   lock->Unlock();
 
@@ -1297,7 +1401,7 @@ int librados::IoCtxImpl::getxattrs(const object_t& oid,
   map<string, bufferlist> aset;
   objecter->getxattrs(oid, oloc, snap_seq,
 		      aset,
-		      0, onack, &ver, pop);
+		      read_flags, onack, &ver, pop);
   lock->Unlock();
 
   attrset.clear();
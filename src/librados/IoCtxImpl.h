@@ -41,6 +41,7 @@ struct librados::IoCtxImpl {
   eversion_t last_objver;
   uint32_t notify_timeout;
   object_locator_t oloc;
+  int read_flags;   ///< extra op flags for reads, from the read policy
 
   Mutex aio_write_list_lock;
   tid_t aio_write_seq;
@@ -66,12 +67,15 @@ struct librados::IoCtxImpl {
     last_objver = rhs.last_objver;
     notify_timeout = rhs.notify_timeout;
     oloc = rhs.oloc;
+    read_flags = rhs.read_flags;
     lock = rhs.lock;
     objecter = rhs.objecter;
   }
 
   void set_snap_read(snapid_t s);
+  int set_read_policy(int policy);
   int set_snap_write_context(snapid_t seq, vector<snapid_t>& snaps);
+  ::SnapContext get_snap_write_context();
 
   void get() {
     ref_cnt.inc();
@@ -138,6 +142,10 @@ struct librados::IoCtxImpl {
   int operate_read(const object_t& oid, ::ObjectOperation *o, bufferlist *pbl);
   int aio_operate(const object_t& oid, ::ObjectOperation *o, AioCompletionImpl *c);
   int aio_operate_read(const object_t& oid, ::ObjectOperation *o, AioCompletionImpl *c, bufferlist *pbl);
+  int aio_operate_batch(std::vector<std::pair<object_t, ::ObjectOperation*> >& ops,
+			AioCompletionImpl *c, std::vector<int> *prvals);
+  int aio_operate_read_batch(std::vector<std::pair<object_t, ::ObjectOperation*> >& ops,
+			     AioCompletionImpl *c, std::vector<int> *prvals);
 
   struct C_aio_Ack : public Context {
     librados::AioCompletionImpl *c;
@@ -159,6 +167,18 @@ struct librados::IoCtxImpl {
     void finish(int r);
   };
 
+  /// record one batch item's result, then pass it on to the batch gather
+  struct C_aio_batch_item : public Context {
+    int *prval;
+    Context *sub;
+    C_aio_batch_item(int *p, Context *s) : prval(p), sub(s) {}
+    void finish(int r) {
+      if (prval)
+	*prval = r;
+      sub->complete(r);
+    }
+  };
+
   int aio_read(const object_t oid, AioCompletionImpl *c,
 			  bufferlist *pbl, size_t len, uint64_t off);
   int aio_read(object_t oid, AioCompletionImpl *c,
@@ -109,6 +109,13 @@ void librados::ObjectOperation::exec(const char *cls, const char *method, buffer
   o->call(cls, method, inbl);
 }
 
+void librados::ObjectReadOperation::exec(const char *cls, const char *method,
+					 bufferlist& inbl, bufferlist *obl, int *prval)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  o->call(cls, method, inbl, obl, prval);
+}
+
 void librados::ObjectReadOperation::stat(uint64_t *psize, time_t *pmtime, int *prval)
 {
   ::ObjectOperation *o = (::ObjectOperation *)impl;
@@ -127,6 +134,20 @@ void librados::ObjectReadOperation::tmap_get(bufferlist *pbl, int *prval)
   o->tmap_get(pbl, prval);
 }
 
+void librados::ObjectReadOperation::checksum(int type, uint64_t off, uint64_t len,
+					     uint32_t chunk_size,
+					     bufferlist *pdigests, int *prval)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  o->checksum(type, off, len, chunk_size, pdigests, prval);
+}
+
+void librados::ObjectReadOperation::list_snaps(snap_set_t *out_snaps, int *prval)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  o->list_snaps(out_snaps, prval);
+}
+
 void librados::ObjectReadOperation::getxattr(const char *name, bufferlist *pbl, int *prval)
 {
   ::ObjectOperation *o = (::ObjectOperation *)impl;
@@ -241,6 +262,12 @@ void librados::ObjectWriteOperation::remove()
   o->remove();
 }
 
+void librados::ObjectWriteOperation::selfmanaged_snap_rollback(uint64_t snapid)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  o->rollback(snapid);
+}
+
 void librados::ObjectWriteOperation::truncate(uint64_t off)
 {
   ::ObjectOperation *o = (::ObjectOperation *)impl;
@@ -819,6 +846,28 @@ int librados::IoCtx::aio_operate(const std::string& oid, AioCompletion *c, libra
   return io_ctx_impl->aio_operate_read(obj, (::ObjectOperation*)o->impl, c->pc, pbl);
 }
 
+int librados::IoCtx::aio_operate_batch(std::vector<std::pair<std::string, librados::ObjectWriteOperation*> >& ops,
+				       AioCompletion *c, std::vector<int> *prvals)
+{
+  std::vector<std::pair<object_t, ::ObjectOperation*> > v;
+  v.reserve(ops.size());
+  for (unsigned i = 0; i < ops.size(); i++)
+    v.push_back(std::make_pair(object_t(ops[i].first),
+			       (::ObjectOperation*)ops[i].second->impl));
+  return io_ctx_impl->aio_operate_batch(v, c->pc, prvals);
+}
+
+int librados::IoCtx::aio_operate_batch(std::vector<std::pair<std::string, librados::ObjectReadOperation*> >& ops,
+				       AioCompletion *c, std::vector<int> *prvals)
+{
+  std::vector<std::pair<object_t, ::ObjectOperation*> > v;
+  v.reserve(ops.size());
+  for (unsigned i = 0; i < ops.size(); i++)
+    v.push_back(std::make_pair(object_t(ops[i].first),
+			       (::ObjectOperation*)ops[i].second->impl));
+  return io_ctx_impl->aio_operate_read_batch(v, c->pc, prvals);
+}
+
 void librados::IoCtx::snap_set_read(snap_t seq)
 {
   io_ctx_impl->set_snap_read(seq);
@@ -999,6 +1048,11 @@ void librados::IoCtx::locator_set_key(const string& key)
   io_ctx_impl->oloc.key = key;
 }
 
+int librados::IoCtx::set_read_policy(int policy)
+{
+  return io_ctx_impl->set_read_policy(policy);
+}
+
 int64_t librados::IoCtx::get_id()
 {
   return io_ctx_impl->get_id();
@@ -1647,6 +1701,12 @@ extern "C" void rados_ioctx_locator_set_key(rados_ioctx_t io, const char *key)
     ctx->oloc.key = "";
 }
 
+extern "C" int rados_ioctx_set_read_policy(rados_ioctx_t io, int policy)
+{
+  librados::IoCtxImpl *ctx = (librados::IoCtxImpl *)io;
+  return ctx->set_read_policy(policy);
+}
+
 extern "C" int64_t rados_ioctx_get_id(rados_ioctx_t io)
 {
   librados::IoCtxImpl *ctx = (librados::IoCtxImpl *)io;
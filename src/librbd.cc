@@ -14,10 +14,12 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <deque>
 
 #include "common/Cond.h"
 #include "common/dout.h"
 #include "common/errno.h"
+#include "common/Finisher.h"
 #include "common/snap_types.h"
 #include "common/perf_counters.h"
 #include "include/Context.h"
@@ -42,6 +44,7 @@ namespace librbd {
     l_librbd_discard,
     l_librbd_discard_bytes,
     l_librbd_flush,
+    l_librbd_wr_around_bytes,  // bytes written past the cache
 
     l_librbd_aio_rd,               // read ops
     l_librbd_aio_rd_bytes,         // bytes read
@@ -65,9 +68,17 @@ namespace librbd {
   using librados::IoCtx;
   using librados::Rados;
 
+  /*
+   * what a notify on the header is about.  an empty payload means the
+   * header changed and everyone should refresh.
+   */
+  enum {
+    NOTIFY_OBJECT_EXISTS = 1,  // vector<objno>: now marked in the object map
+  };
+
   // raw callbacks
   void rados_cb(rados_completion_t cb, void *arg);
-  void rados_aio_sparse_read_cb(rados_completion_t cb, void *arg);
+  void rados_ctx_cb(rados_completion_t cb, void *arg);
 
   class WatchCtx;
 
@@ -77,7 +88,96 @@ namespace librbd {
     SnapInfo(snap_t _id, uint64_t _size) : id(_id), size(_size) {};
   };
 
+  /*
+   * in-memory copy of an image's object map; see rbd_types.h for the
+   * on-disk layout.  objects past the end of the map don't exist.
+   */
+  class ObjectMap {
+    std::vector<uint8_t> bytes;
+  public:
+    void decode(bufferlist& bl) {
+      bytes.resize(bl.length());
+      if (bl.length())
+	bl.copy(0, bl.length(), (char *)&bytes[0]);
+    }
+    void resize(uint64_t num_objs) {
+      // trailing bits in the last byte are cleared, as on disk
+      for (uint64_t i = num_objs; i < bytes.size() * 4 && i % 4; i++)
+	set(i, RBD_OBJECT_NONEXISTENT);
+      bytes.resize((num_objs + 3) / 4);
+    }
+    uint8_t get(uint64_t objno) const {
+      if (objno / 4 >= bytes.size())
+	return RBD_OBJECT_NONEXISTENT;
+      return (bytes[objno / 4] >> ((objno % 4) * 2)) & 3;
+    }
+    void set(uint64_t objno, uint8_t state) {
+      if (objno / 4 >= bytes.size())
+	bytes.resize(objno / 4 + 1);
+      int shift = (objno % 4) * 2;
+      bytes[objno / 4] = (bytes[objno / 4] & ~(3 << shift)) | (state << shift);
+    }
+  };
+
+  /*
+   * a clone's parent, stored under RBD_PARENT_KEY in the clone's
+   * header omap.  the parent is in the same pool.
+   */
+  struct ParentInfo {
+    int64_t pool;
+    std::string name;
+    std::string snapname;
+    snap_t snapid;
+    uint64_t overlap;   ///< bytes of the parent the clone still sees
+
+    ParentInfo() : pool(-1), snapid(CEPH_NOSNAP), overlap(0) {}
+
+    void encode(bufferlist& bl) const {
+      __u8 struct_v = 1;
+      ::encode(struct_v, bl);
+      ::encode(pool, bl);
+      ::encode(name, bl);
+      ::encode(snapname, bl);
+      ::encode(snapid, bl);
+      ::encode(overlap, bl);
+    }
+    void decode(bufferlist::iterator& p) {
+      __u8 struct_v;
+      ::decode(struct_v, p);
+      ::decode(pool, p);
+      ::decode(name, p);
+      ::decode(snapname, p);
+      ::decode(snapid, p);
+      ::decode(overlap, p);
+    }
+  };
+
   struct AioCompletion;
+  struct ImageCtx;
+
+  Finisher *get_open_finisher(CephContext *cct);
+  void put_open_finisher(CephContext *cct);
+
+  /*
+   * the header and snapshot list of an image, fetched in one compound
+   * read so that a refresh costs a single round trip
+   */
+  struct HeaderRead {
+    ImageCtx *ictx;
+    uint64_t seq;  // ictx->refresh_seq when issued
+    bool done;
+    int r;
+    bufferlist header_bl, snap_bl;
+    int header_r, snap_r;
+    librados::ObjectReadOperation op;
+
+    HeaderRead(ImageCtx *i, uint64_t s)
+      : ictx(i), seq(s), done(false), r(0), header_r(0), snap_r(0) {
+      op.read(0, 0, &header_bl, &header_r);  // the whole object
+      bufferlist inbl;
+      op.exec("rbd", "snap_list", inbl, &snap_bl, &snap_r);
+    }
+  };
 
   struct AioBlockCompletion : Context {
     CephContext *cct;
@@ -97,6 +197,26 @@ namespace librbd {
     virtual void finish(int r);
   };
 
+  /* drop an extent from the cache, then complete onfinish */
+  struct C_DiscardCacheExtent : public Context {
+    ObjectCacher *object_cacher;
+    ObjectCacher::ObjectSet *object_set;
+    Mutex *cache_lock;
+    vector<ObjectExtent> extents;
+    Context *onfinish;
+
+    C_DiscardCacheExtent(ObjectCacher *oc, ObjectCacher::ObjectSet *os, Mutex *l,
+			 const vector<ObjectExtent>& v, Context *c)
+      : object_cacher(oc), object_set(os), cache_lock(l), extents(v),
+	onfinish(c) {}
+    void finish(int r) {
+      cache_lock->Lock();
+      object_cacher->discard_set(object_set, extents);
+      cache_lock->Unlock();
+      onfinish->complete(r);
+    }
+  };
+
   struct ImageCtx {
     CephContext *cct;
     PerfCounters *perfcounter;
@@ -111,13 +231,39 @@ namespace librbd {
     IoCtx data_ctx, md_ctx;
     WatchCtx *wctx;
     bool needs_refresh;
-    Mutex refresh_lock;
+    Mutex refresh_lock; // protects needs_refresh and the refresh_* fields
+    uint64_t refresh_seq;  // bumped each time the header may have changed
+    HeaderRead *refresh_read;  // started by a notify, not yet applied
+    Cond refresh_cond;
     Mutex lock; // protects access to snapshot and header information
     Mutex cache_lock; // used as client_lock for the ObjectCacher
+    Mutex object_map_lock; // protects the object_map* fields
+    ObjectMap object_map;
+    std::string object_map_oid;
+    bool object_map_enabled;
+    bool object_map_head;  // the image's map, not a snapshot's
+    // objects being marked as existing, and the writes waiting on each
+    std::map<uint64_t, std::list<Context*> > object_map_waiters;
+    // newly marked objects the other clients haven't been told about yet
+    std::set<uint64_t> object_map_notify;
+    bool object_map_notify_queued;
+    Finisher op_finisher;  // for steps of an aio that may block
+    Finisher notify_finisher;  // notifies to other clients; these block
+
+    mutable Mutex parent_lock; // protects parent, parent_info and parent_overlap
+    ImageCtx *parent;
+    ParentInfo parent_info;
+    uint64_t parent_overlap; // of the parent, as seen from snapid
+    Mutex copyup_lock; // protects copied_up and copyup_waiters
+    ObjectMap copied_up; // objects of a clone known to exist
+    // objects being copied up, and the writes waiting on each
+    std::map<uint64_t, std::list<Context*> > copyup_waiters;
 
     ObjectCacher *object_cacher;
     LibrbdWriteback *writeback_handler;
     ObjectCacher::ObjectSet *object_set;
+    bool writethrough;  // until the user first flushes; protected by cache_lock
+    bool open_finisher_ref;  // opened by aio_open, which holds one for us
 
     ImageCtx(std::string imgname, const char *snap, IoCtx& p)
       : cct((CephContext*)p.cct()),
@@ -125,14 +271,26 @@ namespace librbd {
 	snapid(CEPH_NOSNAP),
 	snap_exists(true),
 	name(imgname),
+	wctx(NULL),
 	needs_refresh(true),
 	refresh_lock("librbd::ImageCtx::refresh_lock"),
+	refresh_seq(0), refresh_read(NULL),
 	lock("librbd::ImageCtx::lock"),
 	cache_lock("librbd::ImageCtx::cache_lock"),
-	object_cacher(NULL), writeback_handler(NULL), object_set(NULL)
+	object_map_lock("librbd::ImageCtx::object_map_lock"),
+	object_map_enabled(false), object_map_head(true),
+	object_map_notify_queued(false),
+	op_finisher(cct), notify_finisher(cct),
+	parent_lock("librbd::ImageCtx::parent_lock"),
+	parent(NULL), parent_overlap(0),
+	copyup_lock("librbd::ImageCtx::copyup_lock"),
+	object_cacher(NULL), writeback_handler(NULL), object_set(NULL),
+	writethrough(false), open_finisher_ref(false)
     {
       md_ctx.dup(p);
       data_ctx.dup(p);
+      op_finisher.start();
+      notify_finisher.start();
 
       string pname = string("librbd-") + data_ctx.get_pool_name() + string("/") + name;
       if (snap) {
@@ -152,12 +310,25 @@ namespace librbd {
 					 cct->_conf->rbd_cache_max_dirty,
 					 cct->_conf->rbd_cache_target_dirty,
 					 cct->_conf->rbd_cache_max_dirty_age);
+	object_cacher->set_readahead(cct->_conf->rbd_readahead_max_bytes,
+				     cct->_conf->rbd_readahead_trigger_requests);
+	if (cct->_conf->rbd_cache_writethrough_until_flush) {
+	  // a guest that never flushes can't cope with losing writes
+	  // it has seen complete, so don't hold any dirty data for it
+	  writethrough = true;
+	  object_cacher->set_max_dirty(0);
+	}
 	object_set = new ObjectCacher::ObjectSet(NULL, data_ctx.get_id(), 0);
 	object_cacher->start();
       }
     }
 
     ~ImageCtx() {
+      op_finisher.stop();
+      notify_finisher.wait_for_empty();
+      notify_finisher.stop();
+      if (open_finisher_ref)
+	put_open_finisher(cct);
       perf_stop();
       if (object_cacher) {
 	delete object_cacher;
@@ -183,6 +354,7 @@ namespace librbd {
       plb.add_u64_counter(l_librbd_discard, "discard");
       plb.add_u64_counter(l_librbd_discard_bytes, "discard_bytes");
       plb.add_u64_counter(l_librbd_flush, "flush");
+      plb.add_u64_counter(l_librbd_wr_around_bytes, "wr_around_bytes");
       plb.add_u64_counter(l_librbd_aio_rd, "aio_rd");
       plb.add_u64_counter(l_librbd_aio_rd_bytes, "aio_rd_bytes");
       plb.add_u64_counter(l_librbd_aio_wr, "aio_wr");
@@ -281,6 +453,17 @@ namespace librbd {
 	onfinish->complete(r);
     }
 
+    /**
+     * large writes go straight to the OSDs instead of through the
+     * cache, so they don't push out everything else
+     */
+    bool should_write_around(size_t len) const {
+      if (!object_cacher)
+	return false;
+      uint64_t around = cct->_conf->rbd_cache_write_around_bytes;
+      return around && len >= around;
+    }
+
     void write_to_cache(object_t o, bufferlist& bl, size_t len, uint64_t off) {
       lock.Lock();
       ObjectCacher::OSDWrite *wr = object_cacher->prepare_write(snapc, bl,
@@ -296,6 +479,49 @@ namespace librbd {
       }
     }
 
+    /**
+     * send op, a write that bypasses the cache.  first wait for any
+     * cached writes to the extent to commit, so they can't land on top
+     * of it.  then drop whatever the cache holds there and send op
+     * without letting go of cache_lock in between.  a read sent before
+     * op may still bring the old data back, so drop the extent again
+     * when op commits, before onfinish gets its result.  onfinish is
+     * left to the caller if op can't be sent.
+     */
+    int write_around(const string& oid, size_t len, uint64_t off,
+		     librados::ObjectWriteOperation *op, Context *onfinish) {
+      vector<ObjectExtent> v;
+      v.push_back(ObjectExtent(oid, off, len));
+      v.back().oloc.pool = data_ctx.get_id();
+
+      int r;
+      Mutex mylock("librbd::ImageCtx::write_around");
+      Cond cond;
+      bool done;
+      Context *onflush = new C_SafeCond(&mylock, &cond, &done, &r);
+      cache_lock.Lock();
+      bool already_flushed = object_cacher->flush_set(object_set, v, onflush);
+      cache_lock.Unlock();
+      if (!already_flushed) {
+	mylock.Lock();
+	while (!done)
+	  cond.Wait(mylock);
+	mylock.Unlock();
+      }
+
+      C_DiscardCacheExtent *ctx = new C_DiscardCacheExtent(object_cacher, object_set,
+							   &cache_lock, v, onfinish);
+      librados::AioCompletion *rados_completion =
+	Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+      Mutex::Locker l(cache_lock);
+      object_cacher->discard_set(object_set, v);
+      r = data_ctx.aio_operate(oid, rados_completion, op);
+      rados_completion->release();
+      if (r < 0)
+	delete ctx;
+      return r;
+    }
+
     int read_from_cache(object_t o, bufferlist *bl, size_t len, uint64_t off) {
       int r;
       Mutex mylock("librbd::ImageCtx::read_from_cache");
@@ -402,12 +628,13 @@ namespace librbd {
 
     void finish_adding_completions() {
       lock.Lock();
+      ref++;  // complete_cb may release us
       assert(pending_count);
       int count = --pending_count;
       if (!count) {
 	complete();
       }
-      lock.Unlock();
+      put_unlock();
     }
 
     void complete() {
@@ -461,6 +688,10 @@ namespace librbd {
   int snap_set(ImageCtx *ictx, const char *snap_name);
   int list(IoCtx& io_ctx, std::vector<string>& names);
   int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order);
+  int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order,
+	     const ParentInfo *parent);
+  int clone(IoCtx& io_ctx, const char *p_name, const char *p_snapname,
+	    const char *c_name, int *c_order);
   int rename(IoCtx& io_ctx, const char *srcname, const char *dstname);
   int info(ImageCtx *ictx, image_info_t& info, size_t image_size);
   int remove(IoCtx& io_ctx, const char *imgname, ProgressContext& prog_ctx);
@@ -470,21 +701,32 @@ namespace librbd {
   int snap_list(ImageCtx *ictx, std::vector<snap_info_t>& snaps);
   int snap_rollback(ImageCtx *ictx, const char *snap_name, ProgressContext& prog_ctx);
   int snap_remove(ImageCtx *ictx, const char *snap_name);
+  int snap_protect(ImageCtx *ictx, const char *snap_name);
+  int snap_unprotect(ImageCtx *ictx, const char *snap_name);
+  int snap_is_protected(ImageCtx *ictx, const char *snap_name, bool *is_protected);
+  int parent_info(ImageCtx *ictx, string *parent_name, string *parent_snapname);
   int add_snap(ImageCtx *ictx, const char *snap_name);
   int rm_snap(ImageCtx *ictx, const char *snap_name);
-  int ictx_check(ImageCtx *ictx);
+  int ictx_check(ImageCtx *ictx, bool wait=true);
   int ictx_refresh(ImageCtx *ictx);
+  int ictx_apply_header(ImageCtx *ictx, HeaderRead *hr);
+  void start_refresh_read(ImageCtx *ictx);
+  void refresh_read_cb(rados_completion_t c, void *arg);
   int copy(ImageCtx& srci, IoCtx& dest_md_ctx, const char *destname);
 
-  int open_image(ImageCtx *ictx);
+  int open_image(ImageCtx *ictx, bool watch);
+  int open_image_finish(ImageCtx *ictx, bool watch);
+  int aio_open(ImageCtx *ictx, AioCompletion *c, void **ictxp);
+  void aio_open_cb(rados_completion_t rc, void *arg);
   void close_image(ImageCtx *ictx);
 
   void trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, uint64_t newsize,
-		  ProgressContext& prog_ctx);
+		  const ObjectMap *object_map, ProgressContext& prog_ctx);
   int read_rbd_info(IoCtx& io_ctx, const string& info_oid, struct rbd_info *info);
 
   int touch_rbd_info(IoCtx& io_ctx, const string& info_oid);
   int rbd_assign_bid(IoCtx& io_ctx, const string& info_oid, uint64_t *id);
+  int check_header(CephContext *cct, bufferlist& header);
   int read_header_bl(IoCtx& io_ctx, const string& md_oid, bufferlist& header, uint64_t *ver);
   int notify_change(IoCtx& io_ctx, const string& oid, uint64_t *pver, ImageCtx *ictx);
   int read_header(IoCtx& io_ctx, const string& md_oid, struct rbd_obj_header_ondisk *header, uint64_t *ver);
@@ -494,6 +736,27 @@ namespace librbd {
   int rollback_image(ImageCtx *ictx, uint64_t snapid, ProgressContext& prog_ctx);
   void image_info(const ImageCtx& ictx, image_info_t& info, size_t info_size);
   string get_block_oid(const rbd_obj_header_ondisk &header, uint64_t num);
+  string get_object_map_oid(const rbd_obj_header_ondisk &header);
+  int read_object_map(IoCtx& io_ctx, const rbd_obj_header_ondisk &header,
+		      ObjectMap *object_map);
+  int update_object_map(IoCtx& io_ctx, const string& oid,
+			uint64_t start, uint64_t end, uint8_t state);
+  int refresh_object_map(ImageCtx *ictx);
+  int resize_object_map(ImageCtx *ictx, uint64_t old_size, uint64_t new_size);
+  bool object_may_exist(ImageCtx *ictx, uint64_t objno);
+  int object_map_mark_exists(ImageCtx *ictx, uint64_t objno);
+  void aio_object_map_mark_exists(ImageCtx *ictx, uint64_t objno, Context *onready);
+  string snap_key(const char *prefix, uint64_t snapid);
+  int refresh_parent(ImageCtx *ictx);
+  void close_parent(ImageCtx *ictx);
+  uint64_t parent_extent(ImageCtx *ictx, uint64_t objno, uint64_t block_ofs,
+			 uint64_t len);
+  int copyup_block(ImageCtx *ictx, uint64_t objno);
+  void aio_copyup_block(ImageCtx *ictx, uint64_t objno, Context *onready);
+  int prepare_write(ImageCtx *ictx, uint64_t objno);
+  void aio_prepare_write(ImageCtx *ictx, uint64_t objno, Context *onready);
+  void read_block(ImageCtx *ictx, uint64_t objno, uint64_t block_ofs, size_t len,
+		  map<uint64_t,uint64_t> *m, bufferlist *bl, Context *onfinish);
   uint64_t get_max_block(uint64_t size, int obj_order);
   uint64_t get_max_block(const rbd_obj_header_ondisk &header);
   uint64_t get_block_size(const rbd_obj_header_ondisk &header);
@@ -508,6 +771,9 @@ namespace librbd {
 		       int (*cb)(uint64_t, size_t, const char *, void *),
 		       void *arg);
   ssize_t read(ImageCtx *ictx, uint64_t off, size_t len, char *buf);
+  int diff_iterate(ImageCtx *ictx, const char *fromsnapname,
+		   uint64_t off, uint64_t len,
+		   int (*cb)(uint64_t, size_t, int, void *), void *arg);
   ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf);
   int discard(ImageCtx *ictx, uint64_t off, uint64_t len);
   int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
@@ -547,9 +813,36 @@ void WatchCtx::notify(uint8_t opcode, uint64_t ver, bufferlist& bl)
 {
   Mutex::Locker l(lock);
   ldout(ictx->cct, 1) <<  " got notification opcode=" << (int)opcode << " ver=" << ver << " cookie=" << cookie << dendl;
+  if (valid && bl.length()) {
+    __u8 op;
+    vector<uint64_t> objnos;
+    try {
+      bufferlist::iterator p = bl.begin();
+      ::decode(op, p);
+      ::decode(objnos, p);
+    } catch (const buffer::error &err) {
+      op = 0;
+    }
+    if (op == NOTIFY_OBJECT_EXISTS) {
+      // no need to reread everything for a few new objects
+      Mutex::Locker lmap(ictx->object_map_lock);
+      if (ictx->object_map_enabled && ictx->object_map_head)
+	for (vector<uint64_t>::iterator p = objnos.begin(); p != objnos.end(); ++p)
+	  ictx->object_map.set(*p, RBD_OBJECT_EXISTS);
+      return;
+    }
+  }
   if (valid) {
     Mutex::Locker lictx(ictx->refresh_lock);
     ictx->needs_refresh = true;
+    ictx->refresh_seq++;
+    if (ictx->refresh_read && ictx->refresh_read->done) {
+      delete ictx->refresh_read;  // stale now
+      ictx->refresh_read = NULL;
+    }
+    // one still in flight is restarted when it completes
+    if (!ictx->refresh_read)
+      start_refresh_read(ictx);
     ictx->perfcounter->inc(l_librbd_notify);
   }
 }
@@ -590,6 +883,12 @@ void image_info(const ImageCtx& ictx, image_info_t& info, size_t infosize)
   memcpy(&info.block_name_prefix, &ictx.header.block_name, RBD_MAX_BLOCK_NAME_SIZE);
   info.parent_pool = -1;
   bzero(&info.parent_name, RBD_MAX_IMAGE_NAME_SIZE);
+  Mutex::Locker l(ictx.parent_lock);
+  if (ictx.parent) {
+    info.parent_pool = ictx.parent_info.pool;
+    strncpy(info.parent_name, ictx.parent_info.name.c_str(),
+	    RBD_MAX_IMAGE_NAME_SIZE - 1);
+  }
 }
 
 string get_block_oid(const rbd_obj_header_ondisk &header, uint64_t num)
@@ -632,201 +931,1013 @@ uint64_t get_block_num(const rbd_obj_header_ondisk &header, uint64_t ofs)
   return num;
 }
 
-int init_rbd_info(struct rbd_info *info)
-{
-  memset(info, 0, sizeof(*info));
-  return 0;
-}
-
-void trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, uint64_t newsize,
-		ProgressContext& prog_ctx)
+string get_object_map_oid(const rbd_obj_header_ondisk &header)
 {
-  CephContext *cct = (CephContext *)io_ctx.cct();
-  uint64_t bsize = get_block_size(header);
-  uint64_t numseg = get_max_block(header);
-  uint64_t start = get_block_num(header, newsize);
-
-  uint64_t block_ofs = get_block_ofs(header, newsize);
-  if (block_ofs) {
-    ldout(cct, 2) << "trim_image object " << numseg << " truncate to " << block_ofs << dendl;
-    string oid = get_block_oid(header, start);
-    librados::ObjectWriteOperation write_op;
-    write_op.truncate(block_ofs);
-    io_ctx.operate(oid, &write_op);
-    start++;
-  }
-  if (start < numseg) {
-    ldout(cct, 2) << "trim_image objects " << start << " to " << (numseg-1) << dendl;
-    for (uint64_t i=start; i<numseg; i++) {
-      string oid = get_block_oid(header, i);
-      io_ctx.remove(oid);
-      prog_ctx.update_progress(i * bsize, (numseg - start) * bsize);
-    }
-  }
+  return string(header.block_name) + RBD_OBJECT_MAP_SUFFIX;
 }
 
-int read_rbd_info(IoCtx& io_ctx, const string& info_oid, struct rbd_info *info)
+int read_object_map(IoCtx& io_ctx, const rbd_obj_header_ondisk &header,
+		    ObjectMap *object_map)
 {
-  int r;
   bufferlist bl;
-  r = io_ctx.read(info_oid, bl, sizeof(*info), 0);
+  int r = io_ctx.read(get_object_map_oid(header), bl, 0, 0);
   if (r < 0)
     return r;
-  if (r == 0) {
-    return init_rbd_info(info);
-  }
-
-  if (r < (int)sizeof(*info))
-    return -EIO;
-
-  memcpy(info, bl.c_str(), r);
+  object_map->decode(bl);
   return 0;
 }
 
-int touch_rbd_info(IoCtx& io_ctx, const string& info_oid)
+/*
+ * the map lives in the data pool and is written with the image's snap
+ * context, so rados keeps a copy of it for each snapshot.
+ */
+int update_object_map(IoCtx& io_ctx, const string& oid,
+		      uint64_t start, uint64_t end, uint8_t state)
 {
   bufferlist bl;
-  int r = io_ctx.write(info_oid, bl, 0, 0);
-  if (r < 0)
+  ::encode(start, bl);
+  ::encode(end, bl);
+  ::encode(state, bl);
+  librados::ObjectWriteOperation op;
+  op.exec("rbd", "object_map_update", bl);
+  return io_ctx.operate(oid, &op);
+}
+
+int refresh_object_map(ImageCtx *ictx)
+{
+  assert(ictx->lock.is_locked());
+  Mutex::Locker l(ictx->object_map_lock);
+  ictx->object_map_enabled = false;
+  if (!(ictx->header.options.features & RBD_FEATURE_OBJECT_MAP))
+    return 0;
+  ictx->object_map_oid = get_object_map_oid(ictx->header);
+  ictx->object_map_head = ictx->snapid == CEPH_NOSNAP;
+
+  int r = read_object_map(ictx->data_ctx, ictx->header, &ictx->object_map);
+  if (r == -ENOENT) {
+    // treat every object as possibly existing, and leave the map alone
+    lderr(ictx->cct) << "object map " << ictx->object_map_oid
+		     << " is missing, not using it" << dendl;
+    return 0;
+  }
+  if (r < 0) {
+    lderr(ictx->cct) << "error reading object map: " << cpp_strerror(-r) << dendl;
     return r;
+  }
+  ictx->object_map_enabled = true;
   return 0;
 }
 
-int rbd_assign_bid(IoCtx& io_ctx, const string& info_oid, uint64_t *id)
+/*
+ * called after the objects past the new end are gone when shrinking,
+ * and before the header is updated when growing.
+ */
+int resize_object_map(ImageCtx *ictx, uint64_t old_size, uint64_t new_size)
 {
-  bufferlist bl, out;
-  *id = 0;
-
-  int r = touch_rbd_info(io_ctx, info_oid);
-  if (r < 0)
-    return r;
+  assert(ictx->lock.is_locked());
+  Mutex::Locker l(ictx->object_map_lock);
+  if (!ictx->object_map_enabled)
+    return 0;
 
-  r = io_ctx.exec(info_oid, "rbd", "assign_bid", bl, out);
+  int order = ictx->header.options.order;
+  uint64_t old_objs = get_max_block(old_size, order);
+  uint64_t new_objs = get_max_block(new_size, order);
+  int r;
+  if (new_objs < old_objs) {
+    r = update_object_map(ictx->data_ctx, ictx->object_map_oid, new_objs, old_objs,
+			  RBD_OBJECT_NONEXISTENT);
+    if (r < 0)
+      return r;
+  }
+  r = ictx->data_ctx.trunc(ictx->object_map_oid, (new_objs + 3) / 4);
   if (r < 0)
     return r;
-
-  bufferlist::iterator iter = out.begin();
-  ::decode(*id, iter);
-
+  ictx->object_map.resize(new_objs);
   return 0;
 }
 
-
-int read_header_bl(IoCtx& io_ctx, const string& md_oid, bufferlist& header, uint64_t *ver)
+bool object_may_exist(ImageCtx *ictx, uint64_t objno)
 {
-  int r;
-  uint64_t off = 0;
-#define READ_SIZE 4096
-  do {
+  Mutex::Locker l(ictx->object_map_lock);
+  if (!ictx->object_map_enabled)
+    return true;
+  return ictx->object_map.get(objno) != RBD_OBJECT_NONEXISTENT;
+}
+
+struct C_ObjectMapUpdated : public Context {
+  ImageCtx *ictx;
+  uint64_t objno;
+  C_ObjectMapUpdated(ImageCtx *i, uint64_t o) : ictx(i), objno(o) {}
+  void finish(int r);
+};
+
+/*
+ * tell the other clients with the image open about the objects marked
+ * since the last notify, all at once.  notify waits on every watcher,
+ * so this runs in notify_finisher, away from any write.
+ */
+struct C_NotifyObjectsExist : public Context {
+  ImageCtx *ictx;
+  C_NotifyObjectsExist(ImageCtx *i) : ictx(i) {}
+  void finish(int r) {
+    vector<uint64_t> objnos;
+    ictx->object_map_lock.Lock();
+    objnos.assign(ictx->object_map_notify.begin(),
+		  ictx->object_map_notify.end());
+    ictx->object_map_notify.clear();
+    ictx->object_map_notify_queued = false;
+    ictx->object_map_lock.Unlock();
+
     bufferlist bl;
-    r = io_ctx.read(md_oid, bl, READ_SIZE, off);
+    ::encode((__u8)NOTIFY_OBJECT_EXISTS, bl);
+    ::encode(objnos, bl);
+    r = ictx->md_ctx.notify(ictx->md_oid(), 0, bl);
     if (r < 0)
-      return r;
-    header.claim_append(bl);
-    off += r;
-   } while (r == READ_SIZE);
-
-  if (memcmp(RBD_HEADER_TEXT, header.c_str(), sizeof(RBD_HEADER_TEXT))) {
-    CephContext *cct = (CephContext *)io_ctx.cct();
-    lderr(cct) << "unrecognized header format" << dendl;
-    return -ENXIO;
+      lderr(ictx->cct) << "error notifying of new objects: "
+		       << cpp_strerror(-r) << dendl;
   }
+};
 
-  if (ver)
-    *ver = io_ctx.get_last_version();
+/*
+ * the map must say an object exists before anything is written to it.
+ * the update goes out asynchronously, and onready completes once it is
+ * on disk.  the other clients with the image open are told afterwards,
+ * in the background; until then they may still read the object as
+ * missing, as they would a write that hasn't finished.  writes to an
+ * object that is already being marked queue up behind the first one.
+ */
+void aio_object_map_mark_exists(ImageCtx *ictx, uint64_t objno, Context *onready)
+{
+  ictx->object_map_lock.Lock();
+  bool busy = ictx->object_map_waiters.count(objno);
+  if (!busy && (!ictx->object_map_enabled ||
+		ictx->object_map.get(objno) == RBD_OBJECT_EXISTS)) {
+    ictx->object_map_lock.Unlock();
+    onready->complete(0);
+    return;
+  }
+  ictx->object_map_waiters[objno].push_back(onready);
+  string oid = ictx->object_map_oid;
+  ictx->object_map_lock.Unlock();
+  if (busy)
+    return;
 
-  return 0;
+  ldout(ictx->cct, 20) << "object_map_mark_exists " << objno << dendl;
+  bufferlist bl;
+  ::encode(objno, bl);
+  ::encode(objno + 1, bl);
+  ::encode((uint8_t)RBD_OBJECT_EXISTS, bl);
+  librados::ObjectWriteOperation op;
+  op.exec("rbd", "object_map_update", bl);
+  // the waiters may block, so release them in our own thread
+  Context *ctx = new C_OnFinisher(new C_ObjectMapUpdated(ictx, objno),
+				  &ictx->op_finisher);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+  int r = ictx->data_ctx.aio_operate(oid, rados_completion, &op);
+  rados_completion->release();
+  if (r < 0)
+    ctx->complete(r);
 }
 
-int notify_change(IoCtx& io_ctx, const string& oid, uint64_t *pver, ImageCtx *ictx)
+void C_ObjectMapUpdated::finish(int r)
 {
-  uint64_t ver;
+  if (r < 0) {
+    lderr(ictx->cct) << "error updating object map: " << cpp_strerror(-r) << dendl;
+  } else {
+    Mutex::Locker l(ictx->object_map_lock);
+    ictx->object_map.set(objno, RBD_OBJECT_EXISTS);
+    ictx->object_map_notify.insert(objno);
+    if (!ictx->object_map_notify_queued) {
+      ictx->object_map_notify_queued = true;
+      ictx->notify_finisher.queue(new C_NotifyObjectsExist(ictx));
+    }
+  }
 
-  if (ictx) {
-    assert(ictx->lock.is_locked());
-    ictx->refresh_lock.Lock();
-    ictx->needs_refresh = true;
-    ictx->refresh_lock.Unlock();
+  // release the waiters in order; later writers queue until we are done
+  while (true) {
+    ictx->object_map_lock.Lock();
+    std::list<Context*>& ls = ictx->object_map_waiters[objno];
+    if (ls.empty()) {
+      ictx->object_map_waiters.erase(objno);
+      ictx->object_map_lock.Unlock();
+      break;
+    }
+    Context *onready = ls.front();
+    ls.pop_front();
+    ictx->object_map_lock.Unlock();
+    onready->complete(r);
   }
+}
 
-  if (pver)
-    ver = *pver;
-  else
-    ver = io_ctx.get_last_version();
-  bufferlist bl;
-  io_ctx.notify(oid, ver, bl);
-  return 0;
+int object_map_mark_exists(ImageCtx *ictx, uint64_t objno)
+{
+  Mutex mylock("librbd::object_map_mark_exists");
+  Cond cond;
+  bool done;
+  int r;
+  aio_object_map_mark_exists(ictx, objno, new C_SafeCond(&mylock, &cond, &done, &r));
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  return r;
 }
 
-int read_header(IoCtx& io_ctx, const string& md_oid, struct rbd_obj_header_ondisk *header, uint64_t *ver)
+string snap_key(const char *prefix, uint64_t snapid)
 {
-  bufferlist header_bl;
-  int r = read_header_bl(io_ctx, md_oid, header_bl, ver);
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)snapid);
+  return string(prefix) + buf;
+}
+
+int read_parent_info(IoCtx& md_ctx, const string& md_oid, ParentInfo *info)
+{
+  std::set<string> keys;
+  keys.insert(RBD_PARENT_KEY);
+  std::map<string, bufferlist> vals;
+  int r = md_ctx.omap_get_vals_by_keys(md_oid, keys, &vals);
   if (r < 0)
     return r;
-  if (header_bl.length() < (int)sizeof(*header))
+  if (vals.empty())
+    return -ENOENT;
+  bufferlist::iterator p = vals.begin()->second.begin();
+  try {
+    info->decode(p);
+  } catch (const buffer::error &err) {
     return -EIO;
-  memcpy(header, header_bl.c_str(), sizeof(*header));
-
+  }
   return 0;
 }
 
-int write_header(IoCtx& io_ctx, const string& md_oid, bufferlist& header)
-{
-  bufferlist bl;
-  int r = io_ctx.write(md_oid, header, header.length(), 0);
-
-  notify_change(io_ctx, md_oid, NULL, NULL);
-
-  return r;
-}
-
-int tmap_set(IoCtx& io_ctx, const string& imgname)
+int write_parent_info(IoCtx& md_ctx, const string& md_oid, const ParentInfo& info)
 {
-  bufferlist cmdbl, emptybl;
-  __u8 c = CEPH_OSD_TMAP_SET;
-  ::encode(c, cmdbl);
-  ::encode(imgname, cmdbl);
-  ::encode(emptybl, cmdbl);
-  return io_ctx.tmap_update(RBD_DIRECTORY, cmdbl);
+  std::map<string, bufferlist> vals;
+  info.encode(vals[RBD_PARENT_KEY]);
+  return md_ctx.omap_set(md_oid, vals);
 }
 
-int tmap_rm(IoCtx& io_ctx, const string& imgname)
+void close_parent(ImageCtx *ictx)
 {
-  bufferlist cmdbl;
-  __u8 c = CEPH_OSD_TMAP_RM;
-  ::encode(c, cmdbl);
-  ::encode(imgname, cmdbl);
-  return io_ctx.tmap_update(RBD_DIRECTORY, cmdbl);
+  ImageCtx *parent;
+  {
+    Mutex::Locker l(ictx->parent_lock);
+    parent = ictx->parent;
+    ictx->parent = NULL;
+    ictx->parent_overlap = 0;
+  }
+  if (parent)
+    close_image(parent);
 }
 
-int rollback_image(ImageCtx *ictx, uint64_t snapid, ProgressContext& prog_ctx)
+/*
+ * open the parent snapshot of a clone, or just pick up a new overlap
+ * if it is already open.  the parent is opened without a watch: a
+ * protected snapshot doesn't change under us.
+ */
+int refresh_parent(ImageCtx *ictx)
 {
   assert(ictx->lock.is_locked());
-  uint64_t numseg = get_max_block(ictx->header);
-  uint64_t bsize = get_block_size(ictx->header);
+  CephContext *cct = ictx->cct;
+  if (!(ictx->header.options.features & RBD_FEATURE_LAYERING)) {
+    close_parent(ictx);
+    return 0;
+  }
 
-  for (uint64_t i = 0; i < numseg; i++) {
-    int r;
-    string oid = get_block_oid(ictx->header, i);
-    r = ictx->data_ctx.selfmanaged_snap_rollback(oid, snapid);
-    ldout(ictx->cct, 10) << "selfmanaged_snap_rollback on " << oid << " to " << snapid << " returned " << r << dendl;
-    prog_ctx.update_progress(i * bsize, numseg * bsize);
-    if (r < 0 && r != -ENOENT)
-      return r;
+  ParentInfo info;
+  int r = read_parent_info(ictx->md_ctx, ictx->md_oid(), &info);
+  if (r < 0) {
+    lderr(cct) << "error reading parent of " << ictx->name << ": "
+	       << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  // a snapshot of the clone sees what the clone saw when it was taken
+  uint64_t overlap = info.overlap;
+  if (ictx->snapid != CEPH_NOSNAP) {
+    std::set<string> keys;
+    keys.insert(snap_key(RBD_SNAP_OVERLAP_KEY_PREFIX, ictx->snapid));
+    std::map<string, bufferlist> vals;
+    r = ictx->md_ctx.omap_get_vals_by_keys(ictx->md_oid(), keys, &vals);
+    if (r == 0 && !vals.empty()) {
+      bufferlist::iterator p = vals.begin()->second.begin();
+      try {
+	::decode(overlap, p);
+      } catch (const buffer::error &err) {
+	return -EIO;
+      }
+    }
+  }
+  overlap = MIN(overlap, ictx->get_image_size());
+
+  {
+    Mutex::Locker l(ictx->parent_lock);
+    if (ictx->parent && ictx->parent_info.name == info.name &&
+	ictx->parent_info.snapid == info.snapid) {
+      ictx->parent_info = info;
+      ictx->parent_overlap = overlap;
+      return 0;
+    }
+  }
+  close_parent(ictx);
+
+  ldout(cct, 10) << "opening parent " << info.name << "@" << info.snapname
+		 << " overlap " << overlap << dendl;
+  ImageCtx *parent = new ImageCtx(info.name, info.snapname.c_str(), ictx->md_ctx);
+  r = open_image(parent, false);
+  if (r == 0 && parent->snapid != info.snapid)
+    r = -ENOENT;
+  if (r < 0) {
+    lderr(cct) << "error opening parent " << info.name << "@" << info.snapname
+	       << ": " << cpp_strerror(-r) << dendl;
+    close_image(parent);
+    return r;
   }
+
+  Mutex::Locker l(ictx->parent_lock);
+  ictx->parent = parent;
+  ictx->parent_info = info;
+  ictx->parent_overlap = overlap;
   return 0;
 }
 
-int list(IoCtx& io_ctx, std::vector<std::string>& names)
+/* how much of len bytes at block_ofs in objno comes from the parent */
+uint64_t parent_extent(ImageCtx *ictx, uint64_t objno, uint64_t block_ofs,
+		       uint64_t len)
 {
-  CephContext *cct = (CephContext *)io_ctx.cct();
-  ldout(cct, 20) << "list " << &io_ctx << dendl;
-
-  bufferlist bl;
-  int r = io_ctx.read(RBD_DIRECTORY, bl, 0, 0);
-  if (r < 0)
-    return r;
+  Mutex::Locker l(ictx->parent_lock);
+  if (!ictx->parent)
+    return 0;
+  uint64_t ofs = (objno << ictx->header.options.order) + block_ofs;
+  if (ofs >= ictx->parent_overlap)
+    return 0;
+  return MIN(len, ictx->parent_overlap - ofs);
+}
+
+/*
+ * copying up one object: stat it, and if it is missing read the
+ * parent's data for it and write that with the copyup class method.
+ * each step runs in the op_finisher, with the I/O in between
+ * asynchronous.
+ */
+struct CopyupRequest {
+  ImageCtx *ictx;
+  uint64_t objno;
+  string oid;
+  uint64_t plen;
+  librados::ObjectReadOperation stat_op;
+  int stat_r;
+  bufferptr bp;
+  AioCompletion *parent_c;
+
+  CopyupRequest(ImageCtx *i, uint64_t o, const string& oi, uint64_t l)
+    : ictx(i), objno(o), oid(oi), plen(l), stat_r(0), parent_c(NULL) {
+    stat_op.stat(NULL, NULL, &stat_r);
+  }
+
+  void send_stat();
+  void send_parent_read();
+  void send_copyup();
+  void finish(int r);
+};
+
+struct C_CopyupStep : public Context {
+  CopyupRequest *req;
+  int step;
+  C_CopyupStep(CopyupRequest *rq, int s) : req(rq), step(s) {}
+  void finish(int r) {
+    switch (step) {
+    case 0:  // stat
+      if (r == -ENOENT) {
+	req->send_parent_read();
+	return;
+      }
+      break;
+    case 1:  // parent read
+      if (r >= 0) {
+	req->send_copyup();
+	return;
+      }
+      break;
+    case 2:  // copyup
+      if (r == 0 && req->ictx->object_cacher) {
+	// drop anything cached from before the object existed
+	ImageCtx *ictx = req->ictx;
+	vector<ObjectExtent> v;
+	v.push_back(ObjectExtent(req->oid, 0, get_block_size(ictx->header)));
+	v.back().oloc.pool = ictx->data_ctx.get_id();
+	Mutex::Locker cl(ictx->cache_lock);
+	ictx->object_cacher->discard_set(ictx->object_set, v);
+      }
+      break;
+    }
+    req->finish(r);
+  }
+};
+
+void CopyupRequest::send_stat()
+{
+  Context *ctx = new C_OnFinisher(new C_CopyupStep(this, 0), &ictx->op_finisher);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+  int r = ictx->data_ctx.aio_operate(oid, rados_completion, &stat_op, NULL);
+  rados_completion->release();
+  if (r < 0)
+    ctx->complete(r);
+}
+
+void copyup_parent_read_cb(completion_t cb, void *arg)
+{
+  CopyupRequest *req = (CopyupRequest *)arg;
+  ssize_t r = req->parent_c->get_return_value();
+  req->parent_c->release();
+  req->ictx->op_finisher.queue(new C_CopyupStep(req, 1), r < 0 ? r : 0);
+}
+
+void CopyupRequest::send_parent_read()
+{
+  ImageCtx *parent;
+  {
+    Mutex::Locker pl(ictx->parent_lock);
+    parent = ictx->parent;
+  }
+  ldout(ictx->cct, 20) << "copyup " << oid << " " << plen << " bytes" << dendl;
+  bp = buffer::create(plen);
+  parent_c = aio_create_completion(this, copyup_parent_read_cb);
+  int r = aio_read(parent, objno << ictx->header.options.order, plen, bp.c_str(),
+		   parent_c);
+  if (r < 0) {
+    parent_c->release();
+    finish(r);
+  }
+}
+
+void CopyupRequest::send_copyup()
+{
+  bufferlist data;
+  data.push_back(bp);
+  librados::ObjectWriteOperation op;
+  op.exec("rbd", "copyup", data);
+  Context *ctx = new C_OnFinisher(new C_CopyupStep(this, 2), &ictx->op_finisher);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+  int r = ictx->data_ctx.aio_operate(oid, rados_completion, &op);
+  rados_completion->release();
+  if (r < 0)
+    ctx->complete(r);
+}
+
+/* in the op_finisher: release the waiters in order, as for the object map */
+void CopyupRequest::finish(int r)
+{
+  if (r < 0) {
+    lderr(ictx->cct) << "error copying up " << oid << ": " << cpp_strerror(-r) << dendl;
+  } else {
+    r = 0;
+    Mutex::Locker l(ictx->copyup_lock);
+    ictx->copied_up.set(objno, RBD_OBJECT_EXISTS);
+  }
+  while (true) {
+    ictx->copyup_lock.Lock();
+    std::list<Context*>& ls = ictx->copyup_waiters[objno];
+    if (ls.empty()) {
+      ictx->copyup_waiters.erase(objno);
+      ictx->copyup_lock.Unlock();
+      break;
+    }
+    Context *onready = ls.front();
+    ls.pop_front();
+    ictx->copyup_lock.Unlock();
+    onready->complete(r);
+  }
+  delete this;
+}
+
+/*
+ * before a clone object is first written, copy the parent's data for
+ * it in, then complete onready.  the copyup class method only writes if
+ * the object is still missing, so whoever gets there first wins.  only
+ * writers to the same object wait for each other.
+ */
+void aio_copyup_block(ImageCtx *ictx, uint64_t objno, Context *onready)
+{
+  uint64_t plen = parent_extent(ictx, objno, 0, get_block_size(ictx->header));
+  if (!plen) {
+    onready->complete(0);
+    return;
+  }
+
+  ictx->copyup_lock.Lock();
+  bool busy = ictx->copyup_waiters.count(objno);
+  if (!busy && ictx->copied_up.get(objno) == RBD_OBJECT_EXISTS) {
+    ictx->copyup_lock.Unlock();
+    onready->complete(0);
+    return;
+  }
+  ictx->copyup_waiters[objno].push_back(onready);
+  ictx->copyup_lock.Unlock();
+  if (busy)
+    return;
+
+  ictx->lock.Lock();
+  string oid = get_block_oid(ictx->header, objno);
+  ictx->lock.Unlock();
+  CopyupRequest *req = new CopyupRequest(ictx, objno, oid, plen);
+  req->send_stat();
+}
+
+int copyup_block(ImageCtx *ictx, uint64_t objno)
+{
+  Mutex mylock("librbd::copyup_block");
+  Cond cond;
+  bool done;
+  int r;
+  aio_copyup_block(ictx, objno, new C_SafeCond(&mylock, &cond, &done, &r));
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  return r;
+}
+
+/* everything that has to happen before data goes to an object */
+int prepare_write(ImageCtx *ictx, uint64_t objno)
+{
+  int r = object_map_mark_exists(ictx, objno);
+  if (r < 0)
+    return r;
+  return copyup_block(ictx, objno);
+}
+
+struct C_PrepareCopyup : public Context {
+  ImageCtx *ictx;
+  uint64_t objno;
+  Context *onready;
+  C_PrepareCopyup(ImageCtx *i, uint64_t o, Context *c)
+    : ictx(i), objno(o), onready(c) {}
+  void finish(int r) {
+    if (r < 0)
+      onready->complete(r);
+    else
+      aio_copyup_block(ictx, objno, onready);
+  }
+};
+
+/* prepare_write without waiting: onready completes when it is done */
+void aio_prepare_write(ImageCtx *ictx, uint64_t objno, Context *onready)
+{
+  aio_object_map_mark_exists(ictx, objno, new C_PrepareCopyup(ictx, objno, onready));
+}
+
+/*
+ * reading a clone object that doesn't exist: fill in from the parent,
+ * in the form aio_sparse_read would have returned.
+ */
+struct ParentRead {
+  AioCompletion *c;
+  uint64_t block_ofs;
+  map<uint64_t,uint64_t> *m;
+  bufferlist *bl;
+  bufferptr bp;
+  Context *onfinish;
+};
+
+void parent_read_cb(completion_t cb, void *arg)
+{
+  ParentRead *pr = (ParentRead *)arg;
+  ssize_t r = pr->c->get_return_value();
+  pr->c->release();
+  if (r >= 0) {
+    pr->bl->clear();
+    pr->bl->push_back(pr->bp);
+    pr->m->clear();
+    (*pr->m)[pr->block_ofs] = pr->bp.length();
+  }
+  pr->onfinish->complete(r);
+  delete pr;
+}
+
+struct C_ReadBlock : public Context {
+  ImageCtx *ictx;
+  uint64_t objno, block_ofs;
+  size_t len;
+  map<uint64_t,uint64_t> *m;
+  bufferlist *bl;
+  bool from_cache;
+  bool clone_read;  // may be a clone object that isn't there yet
+  Context *onfinish;
+
+  C_ReadBlock(ImageCtx *i, uint64_t o, uint64_t bo, size_t l,
+	      map<uint64_t,uint64_t> *m_, bufferlist *b, Context *f)
+    : ictx(i), objno(o), block_ofs(bo), len(l), m(m_), bl(b),
+      from_cache(false), clone_read(false), onfinish(f) {}
+
+  void finish(int r) {
+    if (r >= 0 && from_cache) {
+      m->clear();
+      (*m)[block_ofs] = bl->length();
+    }
+    if (r >= 0 && clone_read) {
+      // it's there, so the cache can have it from now on
+      Mutex::Locker l(ictx->copyup_lock);
+      ictx->copied_up.set(objno, RBD_OBJECT_EXISTS);
+    }
+    if (r == -ENOENT) {
+      uint64_t plen = parent_extent(ictx, objno, block_ofs, len);
+      if (plen) {
+	ImageCtx *parent;
+	{
+	  Mutex::Locker l(ictx->parent_lock);
+	  parent = ictx->parent;
+	}
+	ParentRead *pr = new ParentRead;
+	pr->block_ofs = block_ofs;
+	pr->m = m;
+	pr->bl = bl;
+	pr->bp = buffer::create(plen);
+	pr->onfinish = onfinish;
+	pr->c = aio_create_completion(pr, parent_read_cb);
+	uint64_t ofs = (objno << ictx->header.options.order) + block_ofs;
+	r = aio_read(parent, ofs, plen, pr->bp.c_str(), pr->c);
+	if (r >= 0)
+	  return;
+	pr->c->release();
+	delete pr;
+      }
+    }
+    onfinish->complete(r);
+  }
+};
+
+/*
+ * read part of one object into m and bl, as aio_sparse_read does,
+ * going to the cache, the object map and the parent as needed.
+ */
+void read_block(ImageCtx *ictx, uint64_t objno, uint64_t block_ofs, size_t len,
+		map<uint64_t,uint64_t> *m, bufferlist *bl, Context *onfinish)
+{
+  C_ReadBlock *ctx = new C_ReadBlock(ictx, objno, block_ofs, len, m, bl, onfinish);
+  if (!object_may_exist(ictx, objno)) {
+    ctx->complete(-ENOENT);
+    return;
+  }
+
+  ictx->lock.Lock();
+  string oid = get_block_oid(ictx->header, objno);
+  ictx->lock.Unlock();
+
+  // the cache reads a missing object as zeros, where a clone wants its
+  // parent's data, so go around it until the object is known to exist
+  if (parent_extent(ictx, objno, block_ofs, len)) {
+    Mutex::Locker l(ictx->copyup_lock);
+    ctx->clone_read = ictx->copied_up.get(objno) != RBD_OBJECT_EXISTS;
+  }
+  if (ictx->object_cacher && !ctx->clone_read) {
+    ctx->from_cache = true;
+    ictx->aio_read_from_cache(oid, bl, len, block_ofs, ctx);
+  } else {
+    librados::AioCompletion *rados_completion =
+      Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+    int r = ictx->data_ctx.aio_sparse_read(oid, rados_completion, m, bl,
+					   len, block_ofs);
+    rados_completion->release();
+    if (r < 0)
+      ctx->complete(r);
+  }
+}
+
+int init_rbd_info(struct rbd_info *info)
+{
+  memset(info, 0, sizeof(*info));
+  return 0;
+}
+
+/*
+ * keep up to rbd_concurrent_management_ops whole-object operations in
+ * flight, reaping them oldest first so progress is reported from the
+ * caller's thread.  objects that do not exist are not an error.
+ */
+struct ObjectOpWindow {
+  IoCtx& io_ctx;
+  ProgressContext& prog_ctx;
+  uint64_t bsize, total;
+  uint64_t done;
+  unsigned max_in_flight;
+  std::deque<librados::AioCompletion*> in_flight;
+  int ret;
+
+  ObjectOpWindow(IoCtx& io, ProgressContext& p, uint64_t bs, uint64_t n)
+    : io_ctx(io), prog_ctx(p), bsize(bs), total(n), done(0), ret(0) {
+    CephContext *cct = (CephContext *)io_ctx.cct();
+    max_in_flight = MAX(1, cct->_conf->rbd_concurrent_management_ops);
+  }
+  void wait_front() {
+    librados::AioCompletion *c = in_flight.front();
+    in_flight.pop_front();
+    c->wait_for_safe();
+    int r = c->get_return_value();
+    if (r < 0 && r != -ENOENT && ret == 0)
+      ret = r;
+    c->release();
+    prog_ctx.update_progress(++done * bsize, total * bsize);
+  }
+  // count an object there was no need to touch
+  void skip() {
+    prog_ctx.update_progress(++done * bsize, total * bsize);
+  }
+  int submit(const string& oid, librados::ObjectWriteOperation *op) {
+    while (in_flight.size() >= max_in_flight)
+      wait_front();
+    if (ret < 0)
+      return ret;
+    librados::AioCompletion *c = librados::Rados::aio_create_completion();
+    int r = io_ctx.aio_operate(oid, c, op);
+    if (r < 0) {
+      c->release();
+      return r;
+    }
+    in_flight.push_back(c);
+    return 0;
+  }
+  int drain() {
+    while (!in_flight.empty())
+      wait_front();
+    return ret;
+  }
+};
+
+void trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, uint64_t newsize,
+		const ObjectMap *object_map, ProgressContext& prog_ctx)
+{
+  CephContext *cct = (CephContext *)io_ctx.cct();
+  uint64_t bsize = get_block_size(header);
+  uint64_t numseg = get_max_block(header);
+  uint64_t start = get_block_num(header, newsize);
+
+  uint64_t block_ofs = get_block_ofs(header, newsize);
+  if (block_ofs) {
+    // truncate would create the object if it isn't there
+    if (!object_map || object_map->get(start) != RBD_OBJECT_NONEXISTENT) {
+      ldout(cct, 2) << "trim_image object " << numseg << " truncate to " << block_ofs << dendl;
+      string oid = get_block_oid(header, start);
+      librados::ObjectWriteOperation write_op;
+      write_op.truncate(block_ofs);
+      io_ctx.operate(oid, &write_op);
+    }
+    start++;
+  }
+  if (start < numseg) {
+    ldout(cct, 2) << "trim_image objects " << start << " to " << (numseg-1) << dendl;
+    ObjectOpWindow window(io_ctx, prog_ctx, bsize, numseg - start);
+    for (uint64_t i=start; i<numseg; i++) {
+      if (object_map && object_map->get(i) == RBD_OBJECT_NONEXISTENT) {
+	window.skip();
+	continue;
+      }
+      string oid = get_block_oid(header, i);
+      librados::ObjectWriteOperation op;
+      op.remove();
+      int r = window.submit(oid, &op);
+      if (r < 0) {
+	lderr(cct) << "trim_image error removing " << oid << ": " << cpp_strerror(-r) << dendl;
+	break;
+      }
+    }
+    window.drain();
+  }
+}
+
+int read_rbd_info(IoCtx& io_ctx, const string& info_oid, struct rbd_info *info)
+{
+  int r;
+  bufferlist bl;
+  r = io_ctx.read(info_oid, bl, sizeof(*info), 0);
+  if (r < 0)
+    return r;
+  if (r == 0) {
+    return init_rbd_info(info);
+  }
+
+  if (r < (int)sizeof(*info))
+    return -EIO;
+
+  memcpy(info, bl.c_str(), r);
+  return 0;
+}
+
+int touch_rbd_info(IoCtx& io_ctx, const string& info_oid)
+{
+  bufferlist bl;
+  int r = io_ctx.write(info_oid, bl, 0, 0);
+  if (r < 0)
+    return r;
+  return 0;
+}
+
+int rbd_assign_bid(IoCtx& io_ctx, const string& info_oid, uint64_t *id)
+{
+  bufferlist bl, out;
+  *id = 0;
+
+  int r = touch_rbd_info(io_ctx, info_oid);
+  if (r < 0)
+    return r;
+
+  r = io_ctx.exec(info_oid, "rbd", "assign_bid", bl, out);
+  if (r < 0)
+    return r;
+
+  bufferlist::iterator iter = out.begin();
+  ::decode(*id, iter);
+
+  return 0;
+}
+
+
+/*
+ * a header we can use: the right text, and no features we don't know
+ * about.  images with features carry RBD_HEADER_TEXT_FEATURES.
+ */
+int check_header(CephContext *cct, bufferlist& header)
+{
+  if (header.length() < sizeof(struct rbd_obj_header_ondisk) ||
+      (memcmp(RBD_HEADER_TEXT, header.c_str(), sizeof(RBD_HEADER_TEXT)) &&
+       memcmp(RBD_HEADER_TEXT_FEATURES, header.c_str(),
+	      sizeof(RBD_HEADER_TEXT_FEATURES)))) {
+    lderr(cct) << "unrecognized header format" << dendl;
+    return -ENXIO;
+  }
+  const struct rbd_obj_header_ondisk *ondisk =
+    (const struct rbd_obj_header_ondisk *)header.c_str();
+  uint8_t unknown = ondisk->options.features & ~RBD_FEATURES_ALL;
+  if (unknown) {
+    lderr(cct) << "image uses unsupported features 0x" << hex << (int)unknown
+	       << dec << dendl;
+    return -ENOSYS;
+  }
+  return 0;
+}
+
+int read_header_bl(IoCtx& io_ctx, const string& md_oid, bufferlist& header, uint64_t *ver)
+{
+  int r;
+  uint64_t off = 0;
+#define READ_SIZE 4096
+  do {
+    bufferlist bl;
+    r = io_ctx.read(md_oid, bl, READ_SIZE, off);
+    if (r < 0)
+      return r;
+    header.claim_append(bl);
+    off += r;
+   } while (r == READ_SIZE);
+
+  r = check_header((CephContext *)io_ctx.cct(), header);
+  if (r < 0)
+    return r;
+
+  if (ver)
+    *ver = io_ctx.get_last_version();
+
+  return 0;
+}
+
+int notify_change(IoCtx& io_ctx, const string& oid, uint64_t *pver, ImageCtx *ictx)
+{
+  uint64_t ver;
+
+  if (ictx) {
+    assert(ictx->lock.is_locked());
+    ictx->refresh_lock.Lock();
+    ictx->needs_refresh = true;
+    ictx->refresh_seq++;
+    ictx->refresh_lock.Unlock();
+  }
+
+  if (pver)
+    ver = *pver;
+  else
+    ver = io_ctx.get_last_version();
+  bufferlist bl;
+  io_ctx.notify(oid, ver, bl);
+  return 0;
+}
+
+int read_header(IoCtx& io_ctx, const string& md_oid, struct rbd_obj_header_ondisk *header, uint64_t *ver)
+{
+  bufferlist header_bl;
+  int r = read_header_bl(io_ctx, md_oid, header_bl, ver);
+  if (r < 0)
+    return r;
+  memcpy(header, header_bl.c_str(), sizeof(*header));
+
+  return 0;
+}
+
+int write_header(IoCtx& io_ctx, const string& md_oid, bufferlist& header)
+{
+  bufferlist bl;
+  int r = io_ctx.write(md_oid, header, header.length(), 0);
+
+  notify_change(io_ctx, md_oid, NULL, NULL);
+
+  return r;
+}
+
+int tmap_set(IoCtx& io_ctx, const string& imgname)
+{
+  bufferlist cmdbl, emptybl;
+  __u8 c = CEPH_OSD_TMAP_SET;
+  ::encode(c, cmdbl);
+  ::encode(imgname, cmdbl);
+  ::encode(emptybl, cmdbl);
+  return io_ctx.tmap_update(RBD_DIRECTORY, cmdbl);
+}
+
+int tmap_rm(IoCtx& io_ctx, const string& imgname)
+{
+  bufferlist cmdbl;
+  __u8 c = CEPH_OSD_TMAP_RM;
+  ::encode(c, cmdbl);
+  ::encode(imgname, cmdbl);
+  return io_ctx.tmap_update(RBD_DIRECTORY, cmdbl);
+}
+
+int rollback_image(ImageCtx *ictx, uint64_t snapid, ProgressContext& prog_ctx)
+{
+  assert(ictx->lock.is_locked());
+  uint64_t numseg = get_max_block(ictx->header);
+  uint64_t bsize = get_block_size(ictx->header);
+
+  // an object absent both now and in the snapshot has nothing to roll back
+  ObjectMap head_map, snap_map;
+  bool have_maps;
+  {
+    Mutex::Locker l(ictx->object_map_lock);
+    have_maps = ictx->object_map_enabled;
+    if (have_maps)
+      head_map = ictx->object_map;
+  }
+  if (have_maps) {
+    IoCtx snap_ctx;
+    snap_ctx.dup(ictx->data_ctx);
+    snap_ctx.snap_set_read(snapid);
+    int r = read_object_map(snap_ctx, ictx->header, &snap_map);
+    if (r < 0) {
+      ldout(ictx->cct, 2) << "error reading snapshot object map: "
+			  << cpp_strerror(-r) << dendl;
+      have_maps = false;
+    }
+  }
+  if (ictx->header.options.features & RBD_FEATURE_OBJECT_MAP && numseg) {
+    // until the map itself is rolled back, everything may exist
+    int r = update_object_map(ictx->data_ctx, get_object_map_oid(ictx->header),
+			      0, numseg, RBD_OBJECT_EXISTS);
+    if (r < 0 && r != -ENOENT)
+      return r;
+  }
+
+  ObjectOpWindow window(ictx->data_ctx, prog_ctx, bsize, numseg);
+  for (uint64_t i = 0; i < numseg; i++) {
+    if (have_maps &&
+	head_map.get(i) == RBD_OBJECT_NONEXISTENT &&
+	snap_map.get(i) == RBD_OBJECT_NONEXISTENT) {
+      window.skip();
+      continue;
+    }
+    string oid = get_block_oid(ictx->header, i);
+    ldout(ictx->cct, 10) << "selfmanaged_snap_rollback on " << oid << " to " << snapid << dendl;
+    librados::ObjectWriteOperation op;
+    op.selfmanaged_snap_rollback(snapid);
+    int r = window.submit(oid, &op);
+    if (r < 0) {
+      window.drain();
+      return r;
+    }
+  }
+  int r = window.drain();
+  if (r < 0)
+    return r;
+
+  if (ictx->header.options.features & RBD_FEATURE_OBJECT_MAP) {
+    // the map goes back with the data; ictx_refresh reloads it
+    r = ictx->data_ctx.selfmanaged_snap_rollback(get_object_map_oid(ictx->header),
+						 snapid);
+    if (r < 0 && r != -ENOENT)
+      return r;
+  }
+  return 0;
+}
+
+int list(IoCtx& io_ctx, std::vector<std::string>& names)
+{
+  CephContext *cct = (CephContext *)io_ctx.cct();
+  ldout(cct, 20) << "list " << &io_ctx << dendl;
+
+  bufferlist bl;
+  int r = io_ctx.read(RBD_DIRECTORY, bl, 0, 0);
+  if (r < 0)
+    return r;
 
   bufferlist::iterator p = bl.begin();
   bufferlist header;
@@ -858,10 +1969,178 @@ int snap_create(ImageCtx *ictx, const char *snap_name)
   return 0;
 }
 
-int snap_remove(ImageCtx *ictx, const char *snap_name)
+int snap_remove(ImageCtx *ictx, const char *snap_name)
+{
+  ldout(ictx->cct, 20) << "snap_remove " << ictx << " " << snap_name << dendl;
+
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  Mutex::Locker l(ictx->lock);
+  snap_t snapid = ictx->get_snapid(snap_name);
+  if (snapid == CEPH_NOSNAP)
+    return -ENOENT;
+
+  r = rm_snap(ictx, snap_name);
+  if (r < 0)
+    return r;
+
+  r = ictx->data_ctx.selfmanaged_snap_remove(snapid);
+
+  if (r < 0)
+    return r;
+
+  notify_change(ictx->md_ctx, ictx->md_oid(), NULL, ictx);
+
+  ictx->perfcounter->inc(l_librbd_snap_remove);
+  return 0;
+}
+
+int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
+{
+  return create(io_ctx, imgname, size, order, NULL);
+}
+
+int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order,
+	   const ParentInfo *parent)
+{
+  CephContext *cct = (CephContext *)io_ctx.cct();
+  ldout(cct, 20) << "create " << &io_ctx << " name = " << imgname << " size = " << size << dendl;
+
+  string md_oid = imgname;
+  md_oid += RBD_SUFFIX;
+
+  // make sure it doesn't already exist
+  int r = io_ctx.stat(md_oid, NULL, NULL);
+  if (r == 0) {
+    lderr(cct) << "rbd image header " << md_oid << " already exists" << dendl;
+    return -EEXIST;
+  }
+
+  uint64_t bid;
+  string dir_info = RBD_INFO;
+  r = rbd_assign_bid(io_ctx, dir_info, &bid);
+  if (r < 0) {
+    lderr(cct) << "failed to assign a block name for image" << dendl;
+    return r;
+  }
+
+  struct rbd_obj_header_ondisk header;
+  init_rbd_header(header, size, order, bid);
+  if (parent)
+    header.options.features |= RBD_FEATURE_LAYERING;
+
+  if (cct->_conf->rbd_object_map) {
+    // the map has to be there before any header that refers to it
+    ldout(cct, 2) << "creating object map..." << dendl;
+    header.options.features |= RBD_FEATURE_OBJECT_MAP;
+    librados::ObjectWriteOperation op;
+    op.create(true);
+    op.truncate((get_max_block(header) + 3) / 4);
+    r = io_ctx.operate(get_object_map_oid(header), &op);
+    if (r < 0) {
+      lderr(cct) << "error creating object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
+  if (header.options.features)
+    memcpy(&header.text, RBD_HEADER_TEXT_FEATURES, sizeof(RBD_HEADER_TEXT_FEATURES));
+
+  bufferlist bl;
+  bl.append((const char *)&header, sizeof(header));
+
+  ldout(cct, 2) << "adding rbd image to directory..." << dendl;
+  r = tmap_set(io_ctx, imgname);
+  if (r < 0) {
+    lderr(cct) << "error adding img to directory: " << cpp_strerror(-r)<< dendl;
+    return r;
+  }
+
+  ldout(cct, 2) << "creating rbd image..." << dendl;
+  librados::ObjectWriteOperation op;
+  op.write(0, bl);
+  if (parent) {
+    // a header with the layering feature is never without its parent
+    std::map<string, bufferlist> vals;
+    parent->encode(vals[RBD_PARENT_KEY]);
+    op.omap_set(vals);
+  }
+  r = io_ctx.operate(md_oid, &op);
+  if (r < 0) {
+    lderr(cct) << "error writing header: " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  ldout(cct, 2) << "done." << dendl;
+  return 0;
+}
+
+int update_child(IoCtx& io_ctx, const ParentInfo& info, const char *c_name,
+		 const char *method)
+{
+  bufferlist bl, bl2;
+  ::encode(info.snapid, bl);
+  ::encode(string(c_name), bl);
+  return io_ctx.exec(info.name + RBD_SUFFIX, "rbd", method, bl, bl2);
+}
+
+int clone(IoCtx& io_ctx, const char *p_name, const char *p_snapname,
+	  const char *c_name, int *c_order)
+{
+  CephContext *cct = (CephContext *)io_ctx.cct();
+  ldout(cct, 20) << "clone " << &io_ctx << " " << p_name << "@"
+		 << (p_snapname ? p_snapname : "NULL") << " -> " << c_name << dendl;
+
+  if (!p_snapname || !*p_snapname) {
+    lderr(cct) << "clone: a parent snapshot is required" << dendl;
+    return -EINVAL;
+  }
+
+  ImageCtx *p_ictx = new ImageCtx(p_name, p_snapname, io_ctx);
+  int r = open_image(p_ictx, false);
+  if (r < 0) {
+    lderr(cct) << "error opening parent image: " << cpp_strerror(-r) << dendl;
+    close_image(p_ictx);
+    return r;
+  }
+
+  ParentInfo info;
+  p_ictx->lock.Lock();
+  info.pool = io_ctx.get_id();
+  info.name = p_name;
+  info.snapname = p_snapname;
+  info.snapid = p_ictx->snapid;
+  info.overlap = p_ictx->get_image_size();
+  int order = *c_order ? *c_order : p_ictx->header.options.order;
+  p_ictx->lock.Unlock();
+  close_image(p_ictx);
+
+  if (info.snapid == CEPH_NOSNAP) {
+    lderr(cct) << "parent snapshot " << p_snapname << " not found" << dendl;
+    return -ENOENT;
+  }
+
+  // fails unless the snapshot is protected, and keeps it that way
+  r = update_child(io_ctx, info, c_name, "add_child");
+  if (r < 0) {
+    lderr(cct) << "error adding child to parent (is " << p_name << "@"
+	       << p_snapname << " protected?): " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  r = create(io_ctx, c_name, info.overlap, &order, &info);
+  if (r < 0) {
+    lderr(cct) << "error creating child: " << cpp_strerror(-r) << dendl;
+    update_child(io_ctx, info, c_name, "remove_child");
+    return r;
+  }
+  *c_order = order;
+  return 0;
+}
+
+int snap_protect_op(ImageCtx *ictx, const char *snap_name, const char *method)
 {
-  ldout(ictx->cct, 20) << "snap_remove " << ictx << " " << snap_name << dendl;
-
   int r = ictx_check(ictx);
   if (r < 0)
     return r;
@@ -871,68 +2150,73 @@ int snap_remove(ImageCtx *ictx, const char *snap_name)
   if (snapid == CEPH_NOSNAP)
     return -ENOENT;
 
-  r = rm_snap(ictx, snap_name);
-  if (r < 0)
-    return r;
-
-  r = ictx->data_ctx.selfmanaged_snap_remove(snapid);
-
-  if (r < 0)
+  bufferlist bl, bl2;
+  ::encode(snapid, bl);
+  r = ictx->md_ctx.exec(ictx->md_oid(), "rbd", method, bl, bl2);
+  if (r < 0) {
+    lderr(ictx->cct) << "rbd." << method << " failed: " << cpp_strerror(-r) << dendl;
     return r;
-
+  }
   notify_change(ictx->md_ctx, ictx->md_oid(), NULL, ictx);
-
-  ictx->perfcounter->inc(l_librbd_snap_remove);
   return 0;
 }
 
-int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
+int snap_protect(ImageCtx *ictx, const char *snap_name)
 {
-  CephContext *cct = (CephContext *)io_ctx.cct();
-  ldout(cct, 20) << "create " << &io_ctx << " name = " << imgname << " size = " << size << dendl;
+  ldout(ictx->cct, 20) << "snap_protect " << ictx << " " << snap_name << dendl;
+  return snap_protect_op(ictx, snap_name, "snap_protect");
+}
 
-  string md_oid = imgname;
-  md_oid += RBD_SUFFIX;
+int snap_unprotect(ImageCtx *ictx, const char *snap_name)
+{
+  ldout(ictx->cct, 20) << "snap_unprotect " << ictx << " " << snap_name << dendl;
+  return snap_protect_op(ictx, snap_name, "snap_unprotect");
+}
 
-  // make sure it doesn't already exist
-  int r = io_ctx.stat(md_oid, NULL, NULL);
-  if (r == 0) {
-    lderr(cct) << "rbd image header " << md_oid << " already exists" << dendl;
-    return -EEXIST;
-  }
+int snap_is_protected(ImageCtx *ictx, const char *snap_name, bool *is_protected)
+{
+  ldout(ictx->cct, 20) << "snap_is_protected " << ictx << " " << snap_name << dendl;
 
-  uint64_t bid;
-  string dir_info = RBD_INFO;
-  r = rbd_assign_bid(io_ctx, dir_info, &bid);
-  if (r < 0) {
-    lderr(cct) << "failed to assign a block name for image" << dendl;
+  int r = ictx_check(ictx);
+  if (r < 0)
     return r;
-  }
-
-  struct rbd_obj_header_ondisk header;
-  init_rbd_header(header, size, order, bid);
 
-  bufferlist bl;
-  bl.append((const char *)&header, sizeof(header));
+  Mutex::Locker l(ictx->lock);
+  snap_t snapid = ictx->get_snapid(snap_name);
+  if (snapid == CEPH_NOSNAP)
+    return -ENOENT;
 
-  ldout(cct, 2) << "adding rbd image to directory..." << dendl;
-  r = tmap_set(io_ctx, imgname);
-  if (r < 0) {
-    lderr(cct) << "error adding img to directory: " << cpp_strerror(-r)<< dendl;
+  std::set<string> keys;
+  keys.insert(snap_key(RBD_PROTECTED_KEY_PREFIX, snapid));
+  std::map<string, bufferlist> vals;
+  r = ictx->md_ctx.omap_get_vals_by_keys(ictx->md_oid(), keys, &vals);
+  if (r < 0)
     return r;
-  }
+  *is_protected = !vals.empty();
+  return 0;
+}
 
-  ldout(cct, 2) << "creating rbd image..." << dendl;
-  r = io_ctx.write(md_oid, bl, bl.length(), 0);
-  if (r < 0) {
-    lderr(cct) << "error writing header: " << cpp_strerror(-r) << dendl;
+int parent_info(ImageCtx *ictx, string *parent_name, string *parent_snapname)
+{
+  int r = ictx_check(ictx);
+  if (r < 0)
     return r;
-  }
 
-  ldout(cct, 2) << "done." << dendl;
+  Mutex::Locker l(ictx->parent_lock);
+  if (!ictx->parent)
+    return -ENOENT;
+  *parent_name = ictx->parent_info.name;
+  *parent_snapname = ictx->parent_info.snapname;
   return 0;
 }
 
+bool has_children(IoCtx& io_ctx, const string& md_oid)
+{
+  std::map<string, bufferlist> vals;
+  int r = io_ctx.omap_get_vals(md_oid, "", RBD_CHILD_KEY_PREFIX, 1, &vals);
+  return r < 0 || !vals.empty();
+}
+
 int rename(IoCtx& io_ctx, const char *srcname, const char *dstname)
 {
   CephContext *cct = (CephContext *)io_ctx.cct();
@@ -956,11 +2240,48 @@ int rename(IoCtx& io_ctx, const char *srcname, const char *dstname)
     lderr(cct) << "rbd image header " << dst_md_oid << " already exists" << dendl;
     return -EEXIST;
   }
-  r = write_header(io_ctx, dst_md_oid, header);
+  // clones find their parent by name
+  if (has_children(io_ctx, md_oid)) {
+    lderr(cct) << "image has clones - not renaming" << dendl;
+    return -EBUSY;
+  }
+  std::map<string, bufferlist> omap;
+  r = io_ctx.omap_get_vals(md_oid, "", (uint64_t)-1, &omap);
+  if (r < 0) {
+    lderr(cct) << "error reading header omap: " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+  ParentInfo pi;
+  bool is_clone = omap.count(RBD_PARENT_KEY);
+  if (is_clone) {
+    bufferlist::iterator p = omap[RBD_PARENT_KEY].begin();
+    try {
+      pi.decode(p);
+    } catch (const buffer::error &err) {
+      return -EIO;
+    }
+    r = update_child(io_ctx, pi, dstname, "add_child");
+    if (r < 0) {
+      lderr(cct) << "error adding child to parent: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
+  librados::ObjectWriteOperation op;
+  op.write_full(header);
+  if (!omap.empty())
+    op.omap_set(omap);
+  r = io_ctx.operate(dst_md_oid, &op);
   if (r < 0) {
     lderr(cct) << "error writing header: " << dst_md_oid << ": " << cpp_strerror(-r) << dendl;
+    if (is_clone)
+      update_child(io_ctx, pi, dstname, "remove_child");
     return r;
   }
+  if (is_clone) {
+    r = update_child(io_ctx, pi, srcname, "remove_child");
+    if (r < 0)
+      lderr(cct) << "warning: couldn't remove old name from parent" << dendl;
+  }
   r = tmap_set(io_ctx, dstname_str);
   if (r < 0) {
     io_ctx.remove(dst_md_oid);
@@ -1030,13 +2351,47 @@ int remove(IoCtx& io_ctx, const char *imgname, ProgressContext& prog_ctx)
       lderr(cct) << "image has snapshots - not removing" << dendl;
       return -ENOTEMPTY;
     }
-    trim_image(io_ctx, header, 0, prog_ctx);
+    ParentInfo pi;
+    bool is_clone = false;
+    if (header.options.features & RBD_FEATURE_LAYERING) {
+      r = read_parent_info(io_ctx, md_oid, &pi);
+      if (r < 0)
+	ldout(cct, 2) << "error reading parent: " << cpp_strerror(-r) << dendl;
+      else
+	is_clone = true;
+    }
+    ObjectMap object_map;
+    bool have_map = false;
+    if (header.options.features & RBD_FEATURE_OBJECT_MAP) {
+      r = read_object_map(io_ctx, header, &object_map);
+      if (r < 0)
+	ldout(cct, 2) << "error reading object map: " << cpp_strerror(-r) << dendl;
+      else
+	have_map = true;
+    }
+    trim_image(io_ctx, header, 0, have_map ? &object_map : NULL, prog_ctx);
+    if (header.options.features & RBD_FEATURE_OBJECT_MAP) {
+      ldout(cct, 2) << "removing object map..." << dendl;
+      r = io_ctx.remove(get_object_map_oid(header));
+      if (r < 0 && r != -ENOENT) {
+	lderr(cct) << "error removing object map: " << cpp_strerror(-r) << dendl;
+	return r;
+      }
+    }
     ldout(cct, 2) << "removing header..." << dendl;
     r = io_ctx.remove(md_oid);
     if (r < 0 && r != -ENOENT) {
       lderr(cct) << "error removing header: " << cpp_strerror(-r) << dendl;
       return r;
     }
+    if (is_clone) {
+      ldout(cct, 2) << "removing child from parent..." << dendl;
+      r = update_child(io_ctx, pi, imgname, "remove_child");
+      if (r < 0 && r != -ENOENT) {
+	lderr(cct) << "error removing child from parent: " << cpp_strerror(-r) << dendl;
+	return r;
+      }
+    }
   }
 
   ldout(cct, 2) << "removing rbd image from directory..." << dendl;
@@ -1050,6 +2405,26 @@ int remove(IoCtx& io_ctx, const char *imgname, ProgressContext& prog_ctx)
   return 0;
 }
 
+int shrink_parent_overlap(ImageCtx *ictx, uint64_t size)
+{
+  ParentInfo info;
+  {
+    Mutex::Locker l(ictx->parent_lock);
+    if (!ictx->parent || ictx->parent_info.overlap <= size)
+      return 0;
+    info = ictx->parent_info;
+  }
+  info.overlap = size;
+  int r = write_parent_info(ictx->md_ctx, ictx->md_oid(), info);
+  if (r < 0)
+    return r;
+
+  Mutex::Locker l(ictx->parent_lock);
+  ictx->parent_info = info;
+  ictx->parent_overlap = MIN(ictx->parent_overlap, size);
+  return 0;
+}
+
 int resize_helper(ImageCtx *ictx, uint64_t size, ProgressContext& prog_ctx)
 {
   CephContext *cct = ictx->cct;
@@ -1058,19 +2433,52 @@ int resize_helper(ImageCtx *ictx, uint64_t size, ProgressContext& prog_ctx)
     return 0;
   }
 
+  int r;
   if (size > ictx->header.image_size) {
     ldout(cct, 2) << "expanding image " << ictx->header.image_size << " -> " << size << dendl;
+    r = resize_object_map(ictx, ictx->header.image_size, size);
+    if (r < 0) {
+      lderr(cct) << "error resizing object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
     ictx->header.image_size = size;
   } else {
     ldout(cct, 2) << "shrinking image " << ictx->header.image_size << " -> " << size << dendl;
-    trim_image(ictx->data_ctx, ictx->header, size, prog_ctx);
+    // the new last object is truncated, so it must have its parent's data
+    if (get_block_ofs(ictx->header, size)) {
+      r = prepare_write(ictx, get_block_num(ictx->header, size));
+      if (r < 0)
+	return r;
+    }
+    ObjectMap object_map;
+    bool have_map;
+    {
+      Mutex::Locker l(ictx->object_map_lock);
+      have_map = ictx->object_map_enabled;
+      if (have_map)
+	object_map = ictx->object_map;
+    }
+    trim_image(ictx->data_ctx, ictx->header, size, have_map ? &object_map : NULL,
+	       prog_ctx);
+    r = resize_object_map(ictx, ictx->header.image_size, size);
+    if (r < 0) {
+      lderr(cct) << "error resizing object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
     ictx->header.image_size = size;
+
+    // growing again later must not uncover the parent
+    r = shrink_parent_overlap(ictx, size);
+    if (r < 0) {
+      lderr(cct) << "error updating parent overlap: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
   }
 
   // rewrite header
   bufferlist bl;
   bl.append((const char *)&(ictx->header), sizeof(ictx->header));
-  int r = ictx->md_ctx.write(ictx->md_oid(), bl, bl.length(), 0);
+  r = ictx->md_ctx.write(ictx->md_oid(), bl, bl.length(), 0);
 
   if (r == -ERANGE)
     lderr(cct) << "operation might have conflicted with another client!" << dendl;
@@ -1150,6 +2558,24 @@ int add_snap(ImageCtx *ictx, const char *snap_name)
     lderr(ictx->cct) << "rbd.snap_add execution failed failed: " << cpp_strerror(-r) << dendl;
     return r;
   }
+
+  uint64_t overlap = 0;
+  bool is_clone;
+  {
+    Mutex::Locker l(ictx->parent_lock);
+    is_clone = ictx->parent;
+    if (is_clone)
+      overlap = ictx->parent_info.overlap;
+  }
+  if (is_clone) {
+    std::map<string, bufferlist> vals;
+    ::encode(overlap, vals[snap_key(RBD_SNAP_OVERLAP_KEY_PREFIX, snap_id)]);
+    r = ictx->md_ctx.omap_set(ictx->md_oid(), vals);
+    if (r < 0) {
+      lderr(ictx->cct) << "error recording parent overlap: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
   notify_change(ictx->md_ctx, ictx->md_oid(), NULL, ictx);
 
   return 0;
@@ -1171,14 +2597,25 @@ int rm_snap(ImageCtx *ictx, const char *snap_name)
   return 0;
 }
 
-int ictx_check(ImageCtx *ictx)
+/*
+ * refresh the header if it has changed.  with wait false, an IO that
+ * can't be affected by a header change (reads) carries on with the
+ * old header while a read of the new one is still in flight.
+ */
+int ictx_check(ImageCtx *ictx, bool wait)
 {
   CephContext *cct = ictx->cct;
   ldout(cct, 20) << "ictx_check " << ictx << dendl;
   ictx->refresh_lock.Lock();
   bool needs_refresh = ictx->needs_refresh;
+  bool in_flight = ictx->refresh_read && !ictx->refresh_read->done;
   ictx->refresh_lock.Unlock();
 
+  if (needs_refresh && in_flight && !wait) {
+    ldout(cct, 20) << "ictx_check " << ictx << " refresh in flight, not waiting" << dendl;
+    return 0;
+  }
+
   if (needs_refresh) {
     Mutex::Locker l(ictx->lock);
 
@@ -1195,24 +2632,103 @@ int ictx_refresh(ImageCtx *ictx)
 {
   CephContext *cct = ictx->cct;
   assert(ictx->lock.is_locked());
-  bufferlist bl, bl2;
 
   ldout(cct, 20) << "ictx_refresh " << ictx << dendl;
 
+  // a notify may already have started reading the new header
   ictx->refresh_lock.Lock();
+  while (ictx->refresh_read && !ictx->refresh_read->done)
+    ictx->refresh_cond.Wait(ictx->refresh_lock);
+  HeaderRead *hr = ictx->refresh_read;
+  ictx->refresh_read = NULL;
+  if (hr && hr->seq != ictx->refresh_seq) {
+    delete hr;  // something changed after it was read
+    hr = NULL;
+  }
   ictx->needs_refresh = false;
+  uint64_t seq = ictx->refresh_seq;
   ictx->refresh_lock.Unlock();
 
-  int r = read_header(ictx->md_ctx, ictx->md_oid(), &(ictx->header), NULL);
-  if (r < 0) {
+  int r;
+  if (hr) {
+    ldout(cct, 20) << "ictx_refresh using prefetched header" << dendl;
+    r = hr->r;
+  } else {
+    hr = new HeaderRead(ictx, seq);
+    r = ictx->md_ctx.operate(ictx->md_oid(), &hr->op, NULL);
+  }
+  if (r >= 0)
+    r = ictx_apply_header(ictx, hr);
+  else
     lderr(cct) << "Error reading header: " << cpp_strerror(-r) << dendl;
-    return r;
+  delete hr;
+  return r;
+}
+
+void refresh_read_cb(rados_completion_t c, void *arg)
+{
+  HeaderRead *hr = (HeaderRead *)arg;
+  ImageCtx *ictx = hr->ictx;
+  Mutex::Locker l(ictx->refresh_lock);
+  assert(ictx->refresh_read == hr);
+  hr->r = rados_aio_get_return_value(c);
+  hr->done = true;
+  if (hr->seq != ictx->refresh_seq) {
+    // changed again while we were reading
+    ictx->refresh_read = NULL;
+    delete hr;
+    start_refresh_read(ictx);
   }
-  r = ictx->md_ctx.exec(ictx->md_oid(), "rbd", "snap_list", bl, bl2);
+  ictx->refresh_cond.Signal();
+}
+
+/*
+ * start reading the header in the background, so it is likely to be
+ * there by the time the next IO needs it.  if it can't be started,
+ * the next IO reads it synchronously as before.
+ */
+void start_refresh_read(ImageCtx *ictx)
+{
+  assert(ictx->refresh_lock.is_locked());
+  assert(!ictx->refresh_read);
+  ldout(ictx->cct, 20) << "start_refresh_read " << ictx
+		       << " seq " << ictx->refresh_seq << dendl;
+  HeaderRead *hr = new HeaderRead(ictx, ictx->refresh_seq);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(hr, refresh_read_cb, NULL);
+  ictx->refresh_read = hr;
+  int r = ictx->md_ctx.aio_operate(ictx->md_oid(), rados_completion,
+				   &hr->op, NULL);
+  rados_completion->release();
   if (r < 0) {
-    lderr(cct) << "Error listing snapshots: " << cpp_strerror(-r) << dendl;
+    ictx->refresh_read = NULL;
+    delete hr;
+  }
+}
+
+/*
+ * update ictx from a header and snapshot list read off the header
+ * object
+ */
+int ictx_apply_header(ImageCtx *ictx, HeaderRead *hr)
+{
+  CephContext *cct = ictx->cct;
+  assert(ictx->lock.is_locked());
+
+  int r = check_header(cct, hr->header_bl);
+  if (r < 0)
     return r;
+  memcpy(&ictx->header, hr->header_bl.c_str(), sizeof(ictx->header));
+  if (ictx->object_cacher) {
+    // readahead never crosses an object boundary
+    Mutex::Locker l(ictx->cache_lock);
+    ictx->object_set->object_size = get_block_size(ictx->header);
   }
+  if (hr->snap_r < 0) {
+    lderr(cct) << "Error listing snapshots: " << cpp_strerror(-hr->snap_r) << dendl;
+    return hr->snap_r;
+  }
+  bufferlist& bl2 = hr->snap_bl;
   r = 0;
 
   std::map<snap_t, std::string> old_snap_ids;
@@ -1252,6 +2768,7 @@ int ictx_refresh(ImageCtx *ictx)
     lderr(cct) << "image snap context is invalid!" << dendl;
     ictx->refresh_lock.Lock();
     ictx->needs_refresh = true;
+    ictx->refresh_seq++;
     ictx->refresh_lock.Unlock();
     return -EIO;
   }
@@ -1265,7 +2782,10 @@ int ictx_refresh(ImageCtx *ictx)
 
   ictx->data_ctx.selfmanaged_snap_set_write_ctx(ictx->snapc.seq, ictx->snaps);
 
-  return 0;
+  r = refresh_object_map(ictx);
+  if (r < 0)
+    return r;
+  return refresh_parent(ictx);
 }
 
 ProgressContext::~ProgressContext()
@@ -1344,6 +2864,30 @@ int snap_rollback(ImageCtx *ictx, const char *snap_name, ProgressContext& prog_c
     return r;
   }
 
+  // rolled back objects may be gone again; see the snapshot's overlap
+  {
+    Mutex::Locker l(ictx->copyup_lock);
+    ictx->copied_up = ObjectMap();
+  }
+  if (ictx->header.options.features & RBD_FEATURE_LAYERING) {
+    ParentInfo info;
+    r = read_parent_info(ictx->md_ctx, ictx->md_oid(), &info);
+    std::set<string> keys;
+    keys.insert(snap_key(RBD_SNAP_OVERLAP_KEY_PREFIX, snapid));
+    std::map<string, bufferlist> vals;
+    if (r == 0)
+      r = ictx->md_ctx.omap_get_vals_by_keys(ictx->md_oid(), keys, &vals);
+    if (r == 0 && !vals.empty()) {
+      bufferlist::iterator p = vals.begin()->second.begin();
+      ::decode(info.overlap, p);
+      r = write_parent_info(ictx->md_ctx, ictx->md_oid(), info);
+    }
+    if (r < 0) {
+      lderr(cct) << "Error restoring parent overlap: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
+
   ictx_refresh(ictx);
   snap_t new_snapid = ictx->get_snapid(snap_name);
   ldout(cct, 20) << "snapid is " << ictx->snapid << " new snapid is " << new_snapid << dendl;
@@ -1356,23 +2900,53 @@ int snap_rollback(ImageCtx *ictx, const char *snap_name, ProgressContext& prog_c
 
 struct CopyProgressCtx {
   CopyProgressCtx(ProgressContext &p)
-	: prog_ctx(p)
+	: prog_ctx(p), max_in_flight(1), ret(0)
   {
   }
   ImageCtx *destictx;
   uint64_t src_size;
   ProgressContext &prog_ctx;
+  std::deque<AioCompletion*> in_flight;  ///< writes to destictx, oldest first
+  unsigned max_in_flight;
+  int ret;
+
+  // wait for the oldest write and note any error
+  void wait_front() {
+    AioCompletion *c = in_flight.front();
+    in_flight.pop_front();
+    c->wait_for_complete();
+    ssize_t r = c->get_return_value();
+    if (r < 0 && ret == 0)
+      ret = r;
+    c->release();
+  }
+  int drain() {
+    while (!in_flight.empty())
+      wait_front();
+    return ret;
+  }
 };
 
 int do_copy_extent(uint64_t offset, size_t len, const char *buf, void *data)
 {
   CopyProgressCtx *cp = reinterpret_cast<CopyProgressCtx*>(data);
   cp->prog_ctx.update_progress(offset, cp->src_size);
-  int ret = 0;
-  if (buf) {
-    ret = write(cp->destictx, offset, len, buf);
+  if (!buf)
+    return cp->ret;
+  while (cp->in_flight.size() >= cp->max_in_flight)
+    cp->wait_front();
+  if (cp->ret < 0)
+    return cp->ret;
+
+  // aio_write copies buf, so it need not outlive us
+  AioCompletion *c = aio_create_completion();
+  int r = aio_write(cp->destictx, offset, len, buf, c);
+  if (r < 0) {
+    c->release();
+    return r;
   }
-  return ret;
+  cp->in_flight.push_back(c);
+  return 0;
 }
 
 int copy(ImageCtx& ictx, IoCtx& dest_md_ctx, const char *destname,
@@ -1392,13 +2966,17 @@ int copy(ImageCtx& ictx, IoCtx& dest_md_ctx, const char *destname,
 
   cp.destictx = new librbd::ImageCtx(destname, NULL, dest_md_ctx);
   cp.src_size = src_size;
-  r = open_image(cp.destictx);
+  cp.max_in_flight = MAX(1, cct->_conf->rbd_concurrent_management_ops);
+  r = open_image(cp.destictx, true);
   if (r < 0) {
     lderr(cct) << "failed to read newly created header" << dendl;
     return r;
   }
 
   r = read_iterate(&ictx, 0, src_size, do_copy_extent, &cp);
+  int wr = cp.drain();
+  if (r >= 0 && wr < 0)
+    r = wr;
 
   if (r >= 0) {
     // don't return total bytes read, which may not fit in an int
@@ -1427,10 +3005,14 @@ int snap_set(ImageCtx *ictx, const char *snap_name)
   ictx->snap_exists = true;
   ictx->data_ctx.snap_set_read(ictx->snapid);
 
-  return 0;
+  // the map and parent overlap as of the snapshot we now read from
+  int r = refresh_object_map(ictx);
+  if (r < 0)
+    return r;
+  return refresh_parent(ictx);
 }
 
-int open_image(ImageCtx *ictx)
+int open_image(ImageCtx *ictx, bool watch)
 {
   ldout(ictx->cct, 20) << "open_image: ictx =  " << ictx
 		       << " name =  '" << ictx->name << "' snap_name = '"
@@ -1442,8 +3024,27 @@ int open_image(ImageCtx *ictx)
   if (r < 0)
     return r;
 
+  return open_image_finish(ictx, watch);
+}
+
+// the rest of opening an image, once the header has been read
+int open_image_finish(ImageCtx *ictx, bool watch)
+{
+  int r;
   ictx->snap_set(ictx->snapname);
   ictx->data_ctx.snap_set_read(ictx->snapid);
+  if (ictx->snapid != CEPH_NOSNAP) {
+    ictx->lock.Lock();
+    r = refresh_object_map(ictx);
+    if (r == 0)
+      r = refresh_parent(ictx);
+    ictx->lock.Unlock();
+    if (r < 0)
+      return r;
+  }
+
+  if (!watch)
+    return 0;
 
   WatchCtx *wctx = new WatchCtx(ictx);
   if (!wctx)
@@ -1454,6 +3055,144 @@ int open_image(ImageCtx *ictx)
   return r;
 }
 
+/*
+ * the rest of an aio_open (applying the header, the object map and
+ * parent reads, the watch) is synchronous, so it runs in a Finisher
+ * shared by all the images of a CephContext rather than in the
+ * librados callback thread.  it can't be the image's op_finisher: a
+ * failed open closes the image, which stops that finisher.  the
+ * shared one is stopped along with the last image opened through it;
+ * if that happens in the finisher itself (a failed open, or a close
+ * from a completion callback) it is left idle for the next aio_open
+ * instead.
+ */
+struct OpenFinisher {
+  Finisher finisher;
+  int users;
+  OpenFinisher(CephContext *cct) : finisher(cct), users(0) {}
+};
+
+static Mutex open_finishers_lock("librbd::open_finishers_lock");
+static map<CephContext*, OpenFinisher*> open_finishers;
+
+Finisher *get_open_finisher(CephContext *cct)
+{
+  Mutex::Locker l(open_finishers_lock);
+  OpenFinisher *&of = open_finishers[cct];
+  if (!of) {
+    of = new OpenFinisher(cct);
+    of->finisher.start();
+  }
+  of->users++;
+  return &of->finisher;
+}
+
+void put_open_finisher(CephContext *cct)
+{
+  open_finishers_lock.Lock();
+  map<CephContext*, OpenFinisher*>::iterator p = open_finishers.find(cct);
+  assert(p != open_finishers.end());
+  OpenFinisher *of = p->second;
+  assert(of->users > 0);
+  if (--of->users > 0 || of->finisher.am_self()) {
+    open_finishers_lock.Unlock();
+    return;
+  }
+  open_finishers.erase(p);
+  open_finishers_lock.Unlock();
+  of->finisher.stop();
+  delete of;
+}
+
+struct OpenRequest {
+  HeaderRead hr;
+  AioCompletion *c;
+  void **ictxp;  // the caller's handle, cleared if the open fails
+  Finisher *fin;  // we hold a ref on it
+  OpenRequest(ImageCtx *ictx, AioCompletion *c_, void **p, Finisher *f)
+    : hr(ictx, 0), c(c_), ictxp(p), fin(f) {}
+};
+
+/*
+ * in the open finisher, with the result of the header read (or of
+ * submitting it).  the request's ref on the finisher passes to the
+ * image if it opens.
+ */
+struct C_OpenFinish : public Context {
+  OpenRequest *req;
+  C_OpenFinish(OpenRequest *r) : req(r) {}
+  void finish(int r) {
+    ImageCtx *ictx = req->hr.ictx;
+    CephContext *cct = ictx->cct;
+    AioCompletion *c = req->c;
+    if (r >= 0) {
+      ictx->lock.Lock();
+      r = ictx_apply_header(ictx, &req->hr);
+      ictx->lock.Unlock();
+    } else {
+      lderr(cct) << "Error reading header: " << cpp_strerror(-r) << dendl;
+    }
+    if (r >= 0)
+      r = open_image_finish(ictx, true);
+    ldout(cct, 20) << "aio_open " << ictx << " r = " << r << dendl;
+    if (r < 0) {
+      close_image(ictx);
+      *req->ictxp = NULL;
+      put_open_finisher(cct);
+    } else {
+      ictx->open_finisher_ref = true;
+    }
+    delete req;
+
+    c->lock.Lock();
+    c->rval = r;
+    c->lock.Unlock();
+    c->finish_adding_completions();
+    c->put();
+  }
+};
+
+void aio_open_cb(rados_completion_t rc, void *arg)
+{
+  OpenRequest *req = (OpenRequest *)arg;
+  int r = rados_aio_get_return_value(rc);
+  ldout(req->hr.ictx->cct, 20) << "aio_open_cb " << req->hr.ictx
+			       << " r = " << r << dendl;
+  req->fin->queue(new C_OpenFinish(req), r);
+}
+
+/*
+ * open_image without waiting: the header and snapshot list come back
+ * from one compound read, and c completes once the image is usable.
+ * every error, including failing to send the read, is reported
+ * through c, never returned; ictxp is set to NULL (and the image
+ * closed) if it can't be opened.
+ */
+int aio_open(ImageCtx *ictx, AioCompletion *c, void **ictxp)
+{
+  ldout(ictx->cct, 20) << "aio_open: ictx = " << ictx
+		       << " name = '" << ictx->name << "' snap_name = '"
+		       << ictx->snapname << "'" << dendl;
+
+  ictx->refresh_lock.Lock();
+  ictx->needs_refresh = false;
+  ictx->refresh_lock.Unlock();
+
+  c->get();
+  OpenRequest *req = new OpenRequest(ictx, c, ictxp,
+				     get_open_finisher(ictx->cct));
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(req, aio_open_cb, NULL);
+  int r = ictx->md_ctx.aio_operate(ictx->md_oid(), rados_completion,
+				   &req->hr.op, NULL);
+  rados_completion->release();
+  if (r < 0) {
+    // not in the caller's thread, which may hold locks c's callback takes
+    req->fin->queue(new C_OpenFinish(req), r);
+  }
+  return 0;
+}
+
 void close_image(ImageCtx *ictx)
 {
   ldout(ictx->cct, 20) << "close_image " << ictx << dendl;
@@ -1462,20 +3201,73 @@ void close_image(ImageCtx *ictx)
   else
     flush(ictx);
   ictx->lock.Lock();
-  ictx->wctx->invalidate();
-  ictx->md_ctx.unwatch(ictx->md_oid(), ictx->wctx->cookie);
-  delete ictx->wctx;
+  if (ictx->wctx) {
+    ictx->wctx->invalidate();
+    ictx->md_ctx.unwatch(ictx->md_oid(), ictx->wctx->cookie);
+    delete ictx->wctx;
+  }
   ictx->lock.Unlock();
+
+  // a header read started by a notify still refers to us
+  ictx->refresh_lock.Lock();
+  while (ictx->refresh_read && !ictx->refresh_read->done)
+    ictx->refresh_cond.Wait(ictx->refresh_lock);
+  delete ictx->refresh_read;
+  ictx->refresh_read = NULL;
+  ictx->refresh_lock.Unlock();
+
+  close_parent(ictx);
   delete ictx;
 }
 
+/*
+ * read_iterate keeps up to rbd_concurrent_management_ops block reads
+ * in flight, but hands them to the callback strictly in offset order:
+ * a block that completes early waits until everything before it has
+ * been delivered.
+ */
+struct ReadIterateWindow {
+  Mutex lock;
+  Cond cond;
+  ReadIterateWindow() : lock("librbd::ReadIterateWindow::lock") {}
+};
+
+struct ReadIterateBlock {
+  ReadIterateWindow *window;
+  uint64_t block_ofs;
+  uint64_t buf_ofs;
+  size_t len;
+  map<uint64_t, uint64_t> m;
+  bufferlist bl;
+  int r;
+  bool done;
+
+  ReadIterateBlock(ReadIterateWindow *w, uint64_t bo, uint64_t o, size_t l)
+    : window(w), block_ofs(bo), buf_ofs(o), len(l), r(0), done(false) {}
+
+  void complete(int ret) {
+    Mutex::Locker l(window->lock);
+    r = ret;
+    done = true;
+    window->cond.Signal();
+  }
+};
+
+struct C_ReadIterateBlock : public Context {
+  ReadIterateBlock *block;
+  C_ReadIterateBlock(ReadIterateBlock *b) : block(b) {}
+  void finish(int r) {
+    block->complete(r);
+  }
+};
+
 int64_t read_iterate(ImageCtx *ictx, uint64_t off, size_t len,
 		     int (*cb)(uint64_t, size_t, const char *, void *),
 		     void *arg)
 {
   ldout(ictx->cct, 20) << "read_iterate " << ictx << " off = " << off << " len = " << len << dendl;
 
-  int r = ictx_check(ictx);
+  int r = ictx_check(ictx, false);
   if (r < 0)
     return r;
 
@@ -1483,59 +3275,69 @@ int64_t read_iterate(ImageCtx *ictx, uint64_t off, size_t len,
   if (r < 0)
     return r;
 
-  int64_t ret;
+  if (!len)
+    return 0;
+
   int64_t total_read = 0;
+  uint64_t total_issued = 0;
   ictx->lock.Lock();
   uint64_t start_block = get_block_num(ictx->header, off);
   uint64_t end_block = get_block_num(ictx->header, off + len - 1);
   uint64_t block_size = get_block_size(ictx->header);
   ictx->lock.Unlock();
-  uint64_t left = len;
-
-  for (uint64_t i = start_block; i <= end_block; i++) {
-    bufferlist bl;
-    ictx->lock.Lock();
-    string oid = get_block_oid(ictx->header, i);
-    uint64_t block_ofs = get_block_ofs(ictx->header, off + total_read);
-    ictx->lock.Unlock();
-    uint64_t read_len = min(block_size - block_ofs, left);
-    uint64_t bytes_read;
-
-    if (ictx->object_cacher) {
-      r = ictx->read_from_cache(oid, &bl, read_len, block_ofs);
-      if (r < 0 && r != -ENOENT)
-	return r;
+  unsigned max = MAX(1, ictx->cct->_conf->rbd_concurrent_management_ops);
 
-      if (r == -ENOENT)
-	r = cb(total_read, read_len, NULL, arg);
-      else
-	r = cb(total_read, read_len, bl.c_str(), arg);
-
-      bytes_read = read_len; // ObjectCacher pads with zeroes at end of object
-    } else {
-      map<uint64_t, uint64_t> m;
-      r = ictx->data_ctx.sparse_read(oid, m, bl, read_len, block_ofs);
-      if (r < 0 && r == -ENOENT)
-	r = 0;
-      if (r < 0) {
-	return r;
-      }
-
-      r = handle_sparse_read(ictx->cct, bl, block_ofs, m, total_read, read_len, cb, arg);
-      bytes_read = r;
+  ReadIterateWindow window;
+  std::deque<ReadIterateBlock*> in_flight;
+  uint64_t i = start_block;
+  r = 0;
+  while (true) {
+    // top up the window
+    while (r == 0 && i <= end_block && in_flight.size() < max) {
+      ictx->lock.Lock();
+      uint64_t block_ofs = get_block_ofs(ictx->header, off + total_issued);
+      ictx->lock.Unlock();
+      uint64_t read_len = min(block_size - block_ofs, len - total_issued);
+
+      ReadIterateBlock *block = new ReadIterateBlock(&window, block_ofs,
+						     total_issued, read_len);
+      in_flight.push_back(block);
+      read_block(ictx, i, block_ofs, read_len, &block->m, &block->bl,
+		 new C_ReadIterateBlock(block));
+      total_issued += read_len;
+      i++;
     }
-    if (r < 0) {
-      return r;
+    if (in_flight.empty())
+      break;
+
+    // deliver the oldest, in order
+    ReadIterateBlock *block = in_flight.front();
+    window.lock.Lock();
+    while (!block->done)
+      window.cond.Wait(window.lock);
+    window.lock.Unlock();
+    in_flight.pop_front();
+
+    if (r == 0) {
+      int ret = block->r;
+      if (ret == -ENOENT)
+	ret = 0;
+      if (ret >= 0)
+	ret = handle_sparse_read(ictx->cct, block->bl, block->block_ofs, block->m,
+				 block->buf_ofs, block->len, cb, arg);
+      if (ret < 0)
+	r = ret;   // stop issuing, drain what is in flight
+      else
+	total_read += ret;
     }
-
-    total_read += bytes_read;
-    left -= bytes_read;
+    delete block;
   }
-  ret = total_read;
+  if (r < 0)
+    return r;
 
   ictx->perfcounter->inc(l_librbd_rd);
   ictx->perfcounter->inc(l_librbd_rd_bytes, len);
-  return ret;
+  return total_read;
 }
 
 static int simple_read_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
@@ -1555,6 +3357,244 @@ ssize_t read(ImageCtx *ictx, uint64_t ofs, size_t len, char *buf)
   return read_iterate(ictx, ofs, len, simple_read_cb, buf);
 }
 
+/*
+ * which version of an object a snap sees: its index in the clone list
+ * (head last), or -1 if the object did not exist then.
+ */
+static int snap_set_find(const librados::snap_set_t& ss, snap_t snap)
+{
+  int n = ss.clones.size();
+  bool has_head = n && ss.clones[n - 1].cloneid == librados::SNAP_HEAD;
+  if (snap == CEPH_NOSNAP || snap > ss.seq)
+    return has_head ? n - 1 : -1;
+  for (int i = 0; i < n; i++) {
+    const librados::clone_info_t& c = ss.clones[i];
+    if (c.cloneid == librados::SNAP_HEAD)
+      break;
+    if (c.cloneid >= snap) {
+      if (!c.snaps.empty() && c.snaps.front() <= snap)
+	return i;
+      break;
+    }
+  }
+  return -1;
+}
+
+struct DiffIterateBlock {
+  ReadIterateWindow *window;
+  uint64_t objno;
+  uint64_t block_ofs;
+  uint64_t ofs;   // in the image
+  uint64_t len;
+  librados::snap_set_t snaps;
+  int rval;
+  int r;
+  bool done;
+
+  DiffIterateBlock(ReadIterateWindow *w, uint64_t n, uint64_t bo, uint64_t o,
+		   uint64_t l)
+    : window(w), objno(n), block_ofs(bo), ofs(o), len(l), rval(0), r(0),
+      done(false) {}
+
+  void complete(int ret) {
+    Mutex::Locker l(window->lock);
+    r = ret;
+    done = true;
+    window->cond.Signal();
+  }
+};
+
+struct C_DiffIterateBlock : public Context {
+  DiffIterateBlock *block;
+  C_DiffIterateBlock(DiffIterateBlock *b) : block(b) {}
+  void finish(int r) {
+    block->complete(r);
+  }
+};
+
+/*
+ * work out what changed in one object from the clone sizes and the
+ * overlap of each clone with the next newer one, and hand it to cb.
+ */
+static int diff_block(ImageCtx *ictx, DiffIterateBlock *block,
+		      snap_t from_id, snap_t end_id,
+		      int (*cb)(uint64_t, size_t, int, void *), void *arg)
+{
+  int r = block->r;
+  if (r == 0)
+    r = block->rval;
+  if (r == -ENOENT) {
+    // never written; a clone still shows its parent there
+    if (from_id == CEPH_NOSNAP) {
+      uint64_t plen = parent_extent(ictx, block->objno, block->block_ofs,
+				    block->len);
+      if (plen)
+	return cb(block->ofs, plen, 1, arg);
+    }
+    return 0;
+  }
+  if (r < 0)
+    return r;
+
+  const librados::snap_set_t& ss = block->snaps;
+  int from = from_id == CEPH_NOSNAP ? -1 : snap_set_find(ss, from_id);
+  int end = snap_set_find(ss, end_id);
+  ldout(ictx->cct, 20) << "diff_block " << block->objno << " from " << from
+		       << " end " << end << " of " << ss.clones.size()
+		       << " seq " << ss.seq << dendl;
+
+  if (end < 0 && from < 0) {
+    if (from_id == CEPH_NOSNAP) {
+      uint64_t plen = parent_extent(ictx, block->objno, block->block_ofs,
+				    block->len);
+      if (plen)
+	return cb(block->ofs, plen, 1, arg);
+    }
+    return 0;
+  }
+
+  uint64_t end_size = end >= 0 ? ss.clones[end].size : 0;
+  interval_set<uint64_t> diff;
+  if (from < 0) {
+    if (end_size)
+      diff.insert(0, end_size);
+  } else if (end < 0) {
+    if (ss.clones[from].size)
+      diff.insert(0, ss.clones[from].size);
+  } else {
+    for (int k = from; k < end; k++) {
+      const librados::clone_info_t& c = ss.clones[k];
+      uint64_t l = MAX(c.size, ss.clones[k + 1].size);
+      if (!l)
+	continue;
+      interval_set<uint64_t> changed, overlap, same;
+      changed.insert(0, l);
+      for (vector<pair<uint64_t,uint64_t> >::const_iterator p = c.overlap.begin();
+	   p != c.overlap.end();
+	   ++p)
+	overlap.insert(p->first, p->second);
+      same.intersection_of(changed, overlap);
+      changed.subtract(same);
+      diff.union_of(changed);
+    }
+  }
+
+  interval_set<uint64_t> want;
+  want.insert(block->block_ofs, block->len);
+  diff.intersection_of(want);
+
+  for (interval_set<uint64_t>::iterator p = diff.begin(); p != diff.end(); ++p) {
+    uint64_t ofs = p.get_start();
+    uint64_t len = p.get_len();
+    uint64_t img_ofs = block->ofs + ofs - block->block_ofs;
+    // past the end of the new version reads back as zeros
+    uint64_t data = ofs < end_size ? MIN(len, end_size - ofs) : 0;
+    if (data) {
+      r = cb(img_ofs, data, 1, arg);
+      if (r < 0)
+	return r;
+    }
+    if (len > data) {
+      r = cb(img_ofs + data, len - data, 0, arg);
+      if (r < 0)
+	return r;
+    }
+  }
+  return 0;
+}
+
+int diff_iterate(ImageCtx *ictx, const char *fromsnapname,
+		 uint64_t off, uint64_t len,
+		 int (*cb)(uint64_t, size_t, int, void *), void *arg)
+{
+  ldout(ictx->cct, 20) << "diff_iterate " << ictx << " from "
+		       << (fromsnapname ? fromsnapname : "(none)")
+		       << " off = " << off << " len = " << len << dendl;
+
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  r = check_io(ictx, off, len);
+  if (r < 0)
+    return r;
+
+  ictx->lock.Lock();
+  snap_t end_id = ictx->snapid;
+  snap_t from_id = CEPH_NOSNAP;
+  if (fromsnapname) {
+    from_id = ictx->get_snapid(fromsnapname);
+    if (from_id == CEPH_NOSNAP) {
+      ictx->lock.Unlock();
+      return -ENOENT;
+    }
+    if (end_id != CEPH_NOSNAP && from_id >= end_id) {
+      ictx->lock.Unlock();
+      return -EINVAL;
+    }
+  }
+  uint64_t start_block = get_block_num(ictx->header, off);
+  uint64_t end_block = len ? get_block_num(ictx->header, off + len - 1) : 0;
+  uint64_t block_size = get_block_size(ictx->header);
+  ictx->lock.Unlock();
+
+  if (!len)
+    return 0;
+
+  // the osd has to have seen our writes
+  if (end_id == CEPH_NOSNAP) {
+    r = _flush(ictx);
+    if (r < 0)
+      return r;
+  }
+
+  unsigned max = MAX(1, ictx->cct->_conf->rbd_concurrent_management_ops);
+  ReadIterateWindow window;
+  std::deque<DiffIterateBlock*> in_flight;
+  uint64_t issued = 0;
+  uint64_t i = start_block;
+  r = 0;
+  while (true) {
+    while (r == 0 && i <= end_block && in_flight.size() < max) {
+      ictx->lock.Lock();
+      uint64_t block_ofs = get_block_ofs(ictx->header, off + issued);
+      string oid = get_block_oid(ictx->header, i);
+      ictx->lock.Unlock();
+      uint64_t block_len = min(block_size - block_ofs, len - issued);
+
+      DiffIterateBlock *block = new DiffIterateBlock(&window, i, block_ofs,
+						     off + issued, block_len);
+      in_flight.push_back(block);
+      librados::ObjectReadOperation op;
+      op.list_snaps(&block->snaps, &block->rval);
+      Context *ctx = new C_DiffIterateBlock(block);
+      librados::AioCompletion *rados_completion =
+	Rados::aio_create_completion(ctx, rados_ctx_cb, NULL);
+      int ret = ictx->data_ctx.aio_operate(oid, rados_completion, &op, NULL);
+      rados_completion->release();
+      if (ret < 0)
+	ctx->complete(ret);
+      issued += block_len;
+      i++;
+    }
+    if (in_flight.empty())
+      break;
+
+    // report the oldest, in order
+    DiffIterateBlock *block = in_flight.front();
+    window.lock.Lock();
+    while (!block->done)
+      window.cond.Wait(window.lock);
+    window.lock.Unlock();
+    in_flight.pop_front();
+
+    if (r == 0)
+      r = diff_block(ictx, block, from_id, end_id, cb, arg);
+    delete block;
+  }
+  return r;
+}
+
 ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
 {
   ldout(ictx->cct, 20) << "write " << ictx << " off = " << off << " len = " << len << dendl;
@@ -1582,6 +3622,7 @@ ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
   if (snap != CEPH_NOSNAP)
     return -EROFS;
 
+  bool around = ictx->should_write_around(len);
   for (uint64_t i = start_block; i <= end_block; i++) {
     bufferlist bl;
     ictx->lock.Lock();
@@ -1590,8 +3631,29 @@ ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
     ictx->lock.Unlock();
     uint64_t write_len = min(block_size - block_ofs, left);
     bl.append(buf + total_write, write_len);
-    if (ictx->object_cacher) {
+    r = prepare_write(ictx, i);
+    if (r < 0)
+      return r;
+    if (ictx->object_cacher && !around) {
       ictx->write_to_cache(oid, bl, write_len, block_ofs);
+    } else if (around) {
+      librados::ObjectWriteOperation op;
+      op.write(block_ofs, bl);
+      Mutex mylock("librbd::write");
+      Cond cond;
+      bool done;
+      Context *onfinish = new C_SafeCond(&mylock, &cond, &done, &r);
+      int sr = ictx->write_around(oid, write_len, block_ofs, &op, onfinish);
+      if (sr < 0) {
+	delete onfinish;
+	return sr;
+      }
+      mylock.Lock();
+      while (!done)
+	cond.Wait(mylock);
+      mylock.Unlock();
+      if (r < 0)
+	return r;
     } else {
       r = ictx->data_ctx.write(oid, bl, write_len, block_ofs);
       if (r < 0)
@@ -1605,6 +3667,8 @@ ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
 
   ictx->perfcounter->inc(l_librbd_wr);
   ictx->perfcounter->inc(l_librbd_wr_bytes, total_write);
+  if (around)
+    ictx->perfcounter->inc(l_librbd_wr_around_bytes, total_write);
   return total_write;
 }
 
@@ -1647,8 +3711,24 @@ int discard(ImageCtx *ictx, uint64_t off, uint64_t len)
       v.back().oloc.pool = ictx->data_ctx.get_id();
     }
 
+    bool whole = block_ofs == 0 && write_len == block_size;
+    bool covered = parent_extent(ictx, i, 0, block_size) > 0;
+    if (!covered && !object_may_exist(ictx, i)) {
+      total_write += write_len;
+      left -= write_len;
+      continue;
+    }
+    if (covered) {
+      // a clone keeps an empty object to hide the parent's data
+      r = whole ? object_map_mark_exists(ictx, i) : prepare_write(ictx, i);
+      if (r < 0)
+	return r;
+    }
+
     librados::ObjectWriteOperation write_op;
-    if (block_ofs == 0 && write_len == block_size)
+    if (whole && covered)
+      write_op.truncate(0);
+    else if (whole)
       write_op.remove();
     else if (write_len + block_ofs == block_size)
       write_op.truncate(block_ofs);
@@ -1800,7 +3880,17 @@ int flush(ImageCtx *ictx)
   if (r < 0)
     return r;
 
-  return _flush(ictx);
+  r = _flush(ictx);
+  if (ictx->object_cacher) {
+    // the user flushes, so writeback is safe from here on
+    Mutex::Locker l(ictx->cache_lock);
+    if (ictx->writethrough) {
+      ldout(cct, 10) << "flush " << ictx << " switching to writeback" << dendl;
+      ictx->writethrough = false;
+      ictx->object_cacher->set_max_dirty(cct->_conf->rbd_cache_max_dirty);
+    }
+  }
+  return r;
 }
 
 int _flush(ImageCtx *ictx)
@@ -1821,6 +3911,50 @@ int _flush(ImageCtx *ictx)
   return r;
 }
 
+/*
+ * the rest of an aio write or discard to one object, once it is ready
+ * for data: either hand bl to the cache, or send the block's write_op.
+ * this may run in the op_finisher, so it is free to block.
+ */
+struct C_AioBlockReady : public Context {
+  ImageCtx *ictx;
+  string oid;
+  AioBlockCompletion *block_completion;
+  bool to_cache, around;
+  bufferlist bl;  // to_cache only
+  size_t len;
+  uint64_t block_ofs;
+
+  C_AioBlockReady(ImageCtx *i, const string& o, AioBlockCompletion *bc)
+    : ictx(i), oid(o), block_completion(bc), to_cache(false), around(false),
+      len(0), block_ofs(0) {}
+
+  void finish(int r) {
+    if (r < 0) {
+      block_completion->complete(r);
+      return;
+    }
+    if (to_cache) {
+      ictx->write_to_cache(oid, bl, len, block_ofs);  // may block
+      block_completion->complete(0);
+      return;
+    }
+    if (around) {
+      r = ictx->write_around(oid, len, block_ofs, &block_completion->write_op,
+			     block_completion);  // may block
+      if (r < 0)
+	block_completion->complete(r);
+      return;
+    }
+    librados::AioCompletion *rados_completion =
+      Rados::aio_create_completion(block_completion, NULL, rados_cb);
+    r = ictx->data_ctx.aio_operate(oid, rados_completion, &block_completion->write_op);
+    rados_completion->release();
+    if (r < 0)
+      block_completion->complete(r);
+  }
+};
+
 int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
 			         AioCompletion *c)
 {
@@ -1850,6 +3984,7 @@ int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
   if (snap != CEPH_NOSNAP)
     return -EROFS;
 
+  bool around = ictx->should_write_around(len);
   c->get();
   for (uint64_t i = start_block; i <= end_block; i++) {
     ictx->lock.Lock();
@@ -1860,28 +3995,30 @@ int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
     uint64_t write_len = min(block_size - block_ofs, left);
     bufferlist bl;
     bl.append(buf + total_write, write_len);
-    if (ictx->object_cacher) {
-      // may block
-      ictx->write_to_cache(oid, bl, write_len, block_ofs);
+    AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, len, NULL);
+    c->add_block_completion(block_completion);
+    C_AioBlockReady *ready = new C_AioBlockReady(ictx, oid, block_completion);
+    ready->len = write_len;
+    ready->block_ofs = block_ofs;
+    if (ictx->object_cacher && !around) {
+      ready->to_cache = true;
+      ready->bl = bl;
     } else {
-      AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, len, NULL);
-      c->add_block_completion(block_completion);
-      librados::AioCompletion *rados_completion =
-	Rados::aio_create_completion(block_completion, NULL, rados_cb);
-      r = ictx->data_ctx.aio_write(oid, rados_completion, bl, write_len, block_ofs);
-      rados_completion->release();
-      if (r < 0)
-	goto done;
+      ready->around = around;
+      block_completion->write_op.write(block_ofs, bl);
     }
+    aio_prepare_write(ictx, i, ready);
     total_write += write_len;
     left -= write_len;
   }
-done:
+  r = 0;
   c->finish_adding_completions();
   c->put();
 
   ictx->perfcounter->inc(l_librbd_aio_wr);
   ictx->perfcounter->inc(l_librbd_aio_wr_bytes, len);
+  if (around)
+    ictx->perfcounter->inc(l_librbd_wr_around_bytes, total_write);
 
   /* FIXME: cleanup all the allocated stuff */
   return r;
@@ -1922,8 +4059,6 @@ int aio_discard(ImageCtx *ictx, uint64_t off, uint64_t len, AioCompletion *c)
     uint64_t block_ofs = get_block_ofs(ictx->header, off + total_write);
     ictx->lock.Unlock();
 
-    AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, len, NULL);
-
     uint64_t write_len = min(block_size - block_ofs, left);
 
     if (ictx->object_cacher) {
@@ -1931,7 +4066,19 @@ int aio_discard(ImageCtx *ictx, uint64_t off, uint64_t len, AioCompletion *c)
       v.back().oloc.pool = ictx->data_ctx.get_id();
     }
 
-    if (block_ofs == 0 && write_len == block_size)
+    // truncate and zero would create the object
+    bool whole = block_ofs == 0 && write_len == block_size;
+    bool covered = parent_extent(ictx, i, 0, block_size) > 0;
+    if (!covered && !object_may_exist(ictx, i)) {
+      total_write += write_len;
+      left -= write_len;
+      continue;
+    }
+    AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, len, NULL);
+
+    if (whole && covered)
+      block_completion->write_op.truncate(0);
+    else if (whole)
       block_completion->write_op.remove();
     else if (block_ofs + write_len == block_size)
       block_completion->write_op.truncate(block_ofs);
@@ -1939,18 +4086,17 @@ int aio_discard(ImageCtx *ictx, uint64_t off, uint64_t len, AioCompletion *c)
       block_completion->write_op.zero(block_ofs, write_len);
 
     c->add_block_completion(block_completion);
-    librados::AioCompletion *rados_completion =
-      Rados::aio_create_completion(block_completion, NULL, rados_cb);
-
-    r = ictx->data_ctx.aio_operate(oid, rados_completion, &block_completion->write_op);
-    rados_completion->release();
-    if (r < 0)
-      goto done;
+    C_AioBlockReady *ready = new C_AioBlockReady(ictx, oid, block_completion);
+    if (!covered)
+      ready->complete(0);
+    else if (whole)
+      aio_object_map_mark_exists(ictx, i, ready);  // keep an empty object
+    else
+      aio_prepare_write(ictx, i, ready);  // a clone hides the parent's data
     total_write += write_len;
     left -= write_len;
   }
   r = 0;
-done:
   if (ictx->object_cacher)
     ictx->object_cacher->discard_set(ictx->object_set, v);
 
@@ -1964,11 +4110,10 @@ done:
   return r;
 }
 
-void rados_aio_sparse_read_cb(rados_completion_t c, void *arg)
+void rados_ctx_cb(rados_completion_t c, void *arg)
 {
-  AioBlockCompletion *block_completion = (AioBlockCompletion *)arg;
-  block_completion->finish(rados_aio_get_return_value(c));
-  delete block_completion;
+  Context *ctx = (Context *)arg;
+  ctx->complete(rados_aio_get_return_value(c));
 }
 
 int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
@@ -1977,7 +4122,7 @@ int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
 {
   ldout(ictx->cct, 20) << "aio_read " << ictx << " off = " << off << " len = " << len << dendl;
 
-  int r = ictx_check(ictx);
+  int r = ictx_check(ictx, false);
   if (r < 0)
     return r;
 
@@ -1996,44 +4141,21 @@ int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
 
   c->get();
   for (uint64_t i = start_block; i <= end_block; i++) {
-    bufferlist bl;
     ictx->lock.Lock();
-    string oid = get_block_oid(ictx->header, i);
     uint64_t block_ofs = get_block_ofs(ictx->header, off + total_read);
     ictx->lock.Unlock();
     uint64_t read_len = min(block_size - block_ofs, left);
 
-    map<uint64_t,uint64_t> m;
-    map<uint64_t,uint64_t>::iterator iter;
-
     AioBlockCompletion *block_completion =
 	new AioBlockCompletion(ictx->cct, c, block_ofs, read_len, buf + total_read);
     c->add_block_completion(block_completion);
-
-    if (ictx->object_cacher) {
-      block_completion->m[block_ofs] = read_len;
-      ictx->aio_read_from_cache(oid, &block_completion->data_bl,
-				read_len, block_ofs, block_completion);
-    } else {
-      librados::AioCompletion *rados_completion =
-	Rados::aio_create_completion(block_completion, rados_aio_sparse_read_cb, NULL);
-      r = ictx->data_ctx.aio_sparse_read(oid, rados_completion,
-					 &block_completion->m, &block_completion->data_bl,
-					 read_len, block_ofs);
-      rados_completion->release();
-      if (r < 0 && r == -ENOENT)
-	r = 0;
-      if (r < 0) {
-	ret = r;
-	goto done;
-      }
-    }
+    read_block(ictx, i, block_ofs, read_len, &block_completion->m,
+	       &block_completion->data_bl, block_completion);
 
     total_read += read_len;
     left -= read_len;
   }
   ret = total_read;
-done:
   c->finish_adding_completions();
   c->put();
 
@@ -2070,7 +4192,7 @@ int RBD::open(IoCtx& io_ctx, Image& image, const char *name, const char *snapnam
   if (!ictx)
     return -ENOMEM;
 
-  int r = librbd::open_image(ictx);
+  int r = librbd::open_image(ictx, true);
   if (r < 0)
     return r;
 
@@ -2078,6 +4200,17 @@ int RBD::open(IoCtx& io_ctx, Image& image, const char *name, const char *snapnam
   return 0;
 }
 
+int RBD::aio_open(IoCtx& io_ctx, Image& image, const char *name,
+		  const char *snapname, RBD::AioCompletion *c)
+{
+  ImageCtx *ictx = new ImageCtx(name, snapname, io_ctx);
+  if (!ictx)
+    return -ENOMEM;
+
+  image.ctx = (image_ctx_t) ictx;
+  return librbd::aio_open(ictx, (librbd::AioCompletion *)c->pc, &image.ctx);
+}
+
 int RBD::create(IoCtx& io_ctx, const char *name, uint64_t size, int *order)
 {
   int r = librbd::create(io_ctx, name, size, order);
@@ -2109,6 +4242,13 @@ int RBD::rename(IoCtx& src_io_ctx, const char *srcname, const char *destname)
   return r;
 }
 
+int RBD::clone(IoCtx& io_ctx, const char *p_name, const char *p_snapname,
+	       const char *c_name, int *c_order)
+{
+  int r = librbd::clone(io_ctx, p_name, p_snapname, c_name, c_order);
+  return r;
+}
+
 RBD::AioCompletion::AioCompletion(void *cb_arg, callback_t complete_cb)
 {
   librbd::AioCompletion *c = librbd::aio_create_completion(cb_arg, complete_cb);
@@ -2189,6 +4329,13 @@ int Image::copy_with_progress(IoCtx& dest_io_ctx, const char *destname,
   return r;
 }
 
+int Image::parent_info(string *parent_name, string *parent_snapname)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::parent_info(ictx, parent_name, parent_snapname);
+  return r;
+}
+
 int Image::snap_create(const char *snap_name)
 {
   ImageCtx *ictx = (ImageCtx *)ctx;
@@ -2230,6 +4377,27 @@ int Image::snap_set(const char *snap_name)
   return librbd::snap_set(ictx, snap_name);
 }
 
+int Image::snap_protect(const char *snap_name)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::snap_protect(ictx, snap_name);
+  return r;
+}
+
+int Image::snap_unprotect(const char *snap_name)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::snap_unprotect(ictx, snap_name);
+  return r;
+}
+
+int Image::snap_is_protected(const char *snap_name, bool *is_protected)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::snap_is_protected(ictx, snap_name, is_protected);
+  return r;
+}
+
 ssize_t Image::read(uint64_t ofs, size_t len, bufferlist& bl)
 {
   ImageCtx *ictx = (ImageCtx *)ctx;
@@ -2238,6 +4406,13 @@ ssize_t Image::read(uint64_t ofs, size_t len, bufferlist& bl)
   return librbd::read(ictx, ofs, len, bl.c_str());
 }
 
+int Image::diff_iterate(const char *fromsnapname, uint64_t ofs, uint64_t len,
+			int (*cb)(uint64_t, size_t, int, void *), void *arg)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  return librbd::diff_iterate(ictx, fromsnapname, ofs, len, cb, arg);
+}
+
 int64_t Image::read_iterate(uint64_t ofs, size_t len,
 			    int (*cb)(uint64_t, size_t, const char *, void *), void *arg)
 {
@@ -2381,6 +4556,29 @@ extern "C" int rbd_rename(rados_ioctx_t src_p, const char *srcname, const char *
   return librbd::rename(src_io_ctx, srcname, destname);
 }
 
+extern "C" int rbd_clone(rados_ioctx_t p, const char *p_name, const char *p_snapname,
+			 const char *c_name, int *c_order)
+{
+  librados::IoCtx io_ctx;
+  librados::IoCtx::from_rados_ioctx_t(p, io_ctx);
+  return librbd::clone(io_ctx, p_name, p_snapname, c_name, c_order);
+}
+
+extern "C" int rbd_get_parent_info(rbd_image_t image, char *parent_name, size_t pnamelen,
+				   char *parent_snapname, size_t psnapnamelen)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  string p_name, p_snapname;
+  int r = librbd::parent_info(ictx, &p_name, &p_snapname);
+  if (r < 0)
+    return r;
+  if (p_name.length() >= pnamelen || p_snapname.length() >= psnapnamelen)
+    return -ERANGE;
+  strcpy(parent_name, p_name.c_str());
+  strcpy(parent_snapname, p_snapname.c_str());
+  return 0;
+}
+
 extern "C" int rbd_open(rados_ioctx_t p, const char *name, rbd_image_t *image, const char *snap_name)
 {
   librados::IoCtx io_ctx;
@@ -2388,11 +4586,24 @@ extern "C" int rbd_open(rados_ioctx_t p, const char *name, rbd_image_t *image, c
   librbd::ImageCtx *ictx = new librbd::ImageCtx(name, snap_name, io_ctx);
   if (!ictx)
     return -ENOMEM;
-  int r = librbd::open_image(ictx);
+  int r = librbd::open_image(ictx, true);
   *image = (rbd_image_t)ictx;
   return r;
 }
 
+extern "C" int rbd_aio_open(rados_ioctx_t p, const char *name, rbd_image_t *image,
+			    const char *snap_name, rbd_completion_t c)
+{
+  librados::IoCtx io_ctx;
+  librados::IoCtx::from_rados_ioctx_t(p, io_ctx);
+  librbd::ImageCtx *ictx = new librbd::ImageCtx(name, snap_name, io_ctx);
+  if (!ictx)
+    return -ENOMEM;
+  librbd::RBD::AioCompletion *comp = (librbd::RBD::AioCompletion *)c;
+  *image = (rbd_image_t)ictx;
+  return librbd::aio_open(ictx, (librbd::AioCompletion *)comp->pc, image);
+}
+
 extern "C" int rbd_close(rbd_image_t image)
 {
   librbd::ImageCtx *ctx = (librbd::ImageCtx *)image;
@@ -2498,6 +4709,30 @@ extern "C" int rbd_snap_set(rbd_image_t image, const char *snapname)
   return librbd::snap_set(ictx, snapname);
 }
 
+extern "C" int rbd_snap_protect(rbd_image_t image, const char *snap_name)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::snap_protect(ictx, snap_name);
+}
+
+extern "C" int rbd_snap_unprotect(rbd_image_t image, const char *snap_name)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::snap_unprotect(ictx, snap_name);
+}
+
+extern "C" int rbd_snap_is_protected(rbd_image_t image, const char *snap_name,
+				     int *is_protected)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  bool protected_snap;
+  int r = librbd::snap_is_protected(ictx, snap_name, &protected_snap);
+  if (r < 0)
+    return r;
+  *is_protected = protected_snap ? 1 : 0;
+  return 0;
+}
+
 /* I/O */
 extern "C" ssize_t rbd_read(rbd_image_t image, uint64_t ofs, size_t len, char *buf)
 {
@@ -2505,6 +4740,14 @@ extern "C" ssize_t rbd_read(rbd_image_t image, uint64_t ofs, size_t len, char *b
   return librbd::read(ictx, ofs, len, buf);
 }
 
+extern "C" int rbd_diff_iterate(rbd_image_t image, const char *fromsnapname,
+				uint64_t ofs, uint64_t len,
+				int (*cb)(uint64_t, size_t, int, void *), void *arg)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::diff_iterate(ictx, fromsnapname, ofs, len, cb, arg);
+}
+
 extern "C" int64_t rbd_read_iterate(rbd_image_t image, uint64_t ofs, size_t len,
 				    int (*cb)(uint64_t, size_t, const char *, void *), void *arg)
 {
@@ -69,6 +69,33 @@ tid_t LibrbdWriteback::write(const object_t& oid,
 					oncommit, &m_lock);
   librados::AioCompletion *rados_cb =
     librados::Rados::aio_create_completion(args, NULL, librbd_writeback_librados_aio_cb);
+  set_write_snapc(snapc);
+  m_ioctx.aio_write(oid.name, rados_cb, bl, len, off);
+  return ++m_tid;
+}
+
+tid_t LibrbdWriteback::write_extents(const object_t& oid,
+				     const object_locator_t& oloc,
+				     const map<uint64_t, bufferlist>& extents,
+				     const SnapContext& snapc, utime_t mtime,
+				     uint64_t trunc_size, __u32 trunc_seq,
+				     Context *oncommit)
+{
+  CallbackArgs *args = new CallbackArgs((CephContext *)m_ioctx.cct(),
+					oncommit, &m_lock);
+  librados::AioCompletion *rados_cb =
+    librados::Rados::aio_create_completion(args, NULL, librbd_writeback_librados_aio_cb);
+  librados::ObjectWriteOperation op;
+  for (map<uint64_t, bufferlist>::const_iterator p = extents.begin();
+       p != extents.end(); ++p)
+    op.write(p->first, p->second);
+  set_write_snapc(snapc);
+  m_ioctx.aio_operate(oid.name, rados_cb, &op);
+  return ++m_tid;
+}
+
+void LibrbdWriteback::set_write_snapc(const SnapContext& snapc)
+{
   // TODO: find a way to make this less stupid
   vector<librados::snap_t> snaps;
   for (vector<snapid_t>::const_iterator it = snapc.snaps.begin();
@@ -78,6 +105,4 @@ tid_t LibrbdWriteback::write(const object_t& oid,
 
   m_ioctx.snap_set_read(CEPH_NOSNAP);
   m_ioctx.selfmanaged_snap_set_write_ctx(snapc.seq.val, snaps);
-  m_ioctx.aio_write(oid.name, rados_cb, bl, len, off);
-  return ++m_tid;
 }
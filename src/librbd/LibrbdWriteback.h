@@ -26,7 +26,16 @@ class LibrbdWriteback : public WritebackHandler {
 		      const bufferlist &bl, utime_t mtime, uint64_t trunc_size,
 		      __u32 trunc_seq, Context *oncommit);
 
+  // Note that oloc, mtime, trunc_size, and trunc_seq are ignored
+  virtual tid_t write_extents(const object_t& oid, const object_locator_t& oloc,
+			      const map<uint64_t, bufferlist>& extents,
+			      const SnapContext& snapc, utime_t mtime,
+			      uint64_t trunc_size, __u32 trunc_seq,
+			      Context *oncommit);
+
  private:
+  void set_write_snapc(const SnapContext& snapc);
+
   int m_tid;
   Mutex& m_lock;
   librados::IoCtx m_ioctx;
@@ -19,6 +19,10 @@
 #include "osd/osd_types.h"
 
 class MOSDPGScan : public Message {
+
+  static const int HEAD_VERSION = 2;
+  static const int COMPAT_VERSION = 1;
+
 public:
   enum {
     OP_SCAN_GET_DIGEST = 1,      // just objects and versions
@@ -36,6 +40,14 @@ public:
   epoch_t map_epoch, query_epoch;
   pg_t pgid;
   hobject_t begin, end;
+  __u32 max;   ///< objects wanted per interval; 0 == receiver's default
+
+  /// the interval size to scan for a sender's hint, never over our limit
+  unsigned get_max(unsigned limit) const {
+    if (max && max < limit)
+      return max;
+    return limit;
+  }
 
   virtual void decode_payload() {
     bufferlist::iterator p = payload.begin();
@@ -45,6 +57,10 @@ public:
     ::decode(pgid, p);
     ::decode(begin, p);
     ::decode(end, p);
+    if (header.version >= 2)
+      ::decode(max, p);
+    else
+      max = 0;
   }
 
   virtual void encode_payload(uint64_t features) {
@@ -54,15 +70,17 @@ public:
     ::encode(pgid, payload);
     ::encode(begin, payload);
     ::encode(end, payload);
+    ::encode(max, payload);
   }
 
-  MOSDPGScan() : Message(MSG_OSD_PG_SCAN) {}
-  MOSDPGScan(__u32 o, epoch_t e, epoch_t qe, pg_t p, hobject_t be, hobject_t en)
-    : Message(MSG_OSD_PG_SCAN),
+  MOSDPGScan() : Message(MSG_OSD_PG_SCAN, HEAD_VERSION, COMPAT_VERSION), max(0) {}
+  MOSDPGScan(__u32 o, epoch_t e, epoch_t qe, pg_t p, hobject_t be, hobject_t en,
+	     __u32 m = 0)
+    : Message(MSG_OSD_PG_SCAN, HEAD_VERSION, COMPAT_VERSION),
       op(o),
       map_epoch(e), query_epoch(e),
       pgid(p),
-      begin(be), end(en) {
+      begin(be), end(en), max(m) {
   }
 private:
   ~MOSDPGScan() {}
@@ -72,8 +90,10 @@ public:
   void print(ostream& out) const {
     out << "pg_scan(" << get_op_name(op)
 	<< " " << pgid
-	<< " " << begin << "-" << end
-	<< " e " << map_epoch << "/" << query_epoch
+	<< " " << begin << "-" << end;
+    if (max)
+      out << " max " << max;
+    out << " e " << map_epoch << "/" << query_epoch
 	<< ")";
   }
 };
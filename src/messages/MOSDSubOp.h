@@ -25,7 +25,7 @@
 
 class MOSDSubOp : public Message {
 
-  static const int HEAD_VERSION = 6;
+  static const int HEAD_VERSION = 7;
   static const int COMPAT_VERSION = 1;
 
 public:
@@ -83,6 +83,9 @@ public:
   map<string,bufferlist> omap_entries;
   bufferlist omap_header;
 
+  // additional whole-object pushes batched with this one
+  vector<PushOp> pushes;
+
   virtual void decode_payload() {
     bufferlist::iterator p = payload.begin();
     ::decode(map_epoch, p);
@@ -133,6 +136,8 @@ public:
       ::decode(omap_entries, p);
     if (header.version >= 6)
       ::decode(omap_header, p);
+    if (header.version >= 7)
+      ::decode(pushes, p);
   }
 
   virtual void encode_payload(uint64_t features) {
@@ -177,6 +182,7 @@ public:
     ::encode(current_progress, payload);
     ::encode(omap_entries, payload);
     ::encode(omap_header, payload);
+    ::encode(pushes, payload);
   }
 
   MOSDSubOp()
@@ -215,6 +221,7 @@ public:
     out << " v " << version
 	<< " snapset=" << snapset << " snapc=" << snapc;    
     if (!data_subset.empty()) out << " subset " << data_subset;
+    if (!pushes.empty()) out << " +" << pushes.size() << " pushes";
     out << ")";
   }
 };
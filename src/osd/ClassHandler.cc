@@ -13,11 +13,55 @@
 #endif
 
 #include "common/config.h"
+#include "common/perf_counters.h"
+#include "include/str_list.h"
 
 #define dout_subsys ceph_subsys_osd
 #undef dout_prefix
 #define dout_prefix *_dout
 
+enum {
+  l_cls_first = 96000,
+  l_cls_calls,
+  l_cls_errors,
+  l_cls_lat,
+  l_cls_rd_bytes,
+  l_cls_wr_bytes,
+  l_cls_last,
+};
+
+static PerfCounters *create_logger(const string& name)
+{
+  PerfCountersBuilder b(g_ceph_context, name, l_cls_first, l_cls_last);
+  b.add_u64_counter(l_cls_calls, "calls");
+  b.add_u64_counter(l_cls_errors, "errors");
+  b.add_fl_avg(l_cls_lat, "lat");
+  b.add_u64_counter(l_cls_rd_bytes, "rd_bytes");
+  b.add_u64_counter(l_cls_wr_bytes, "wr_bytes");
+  PerfCounters *l = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(l);
+  return l;
+}
+
+static void destroy_logger(PerfCounters *l)
+{
+  if (!l)
+    return;
+  g_ceph_context->get_perfcounters_collection()->remove(l);
+  delete l;
+}
+
+ClassHandler::~ClassHandler()
+{
+  for (map<string, ClassData>::iterator p = classes.begin(); p != classes.end(); ++p) {
+    for (map<string, ClassMethod>::iterator q = p->second.methods_map.begin();
+	 q != p->second.methods_map.end();
+	 ++q)
+      destroy_logger(q->second.logger);
+    destroy_logger(p->second.logger);
+  }
+}
+
 int ClassHandler::open_class(const string& cname, ClassData **pcls)
 {
   Mutex::Locker lock(mutex);
@@ -31,6 +75,20 @@ int ClassHandler::open_class(const string& cname, ClassData **pcls)
   return 0;
 }
 
+void ClassHandler::preload_classes(const string& names)
+{
+  list<string> ls;
+  get_str_list(names, ls);
+  for (list<string>::iterator p = ls.begin(); p != ls.end(); ++p) {
+    ClassData *cls;
+    int r = open_class(*p, &cls);
+    if (r < 0)
+      dout(0) << "preload_classes failed to load " << *p << dendl;
+    else
+      dout(10) << "preload_classes loaded " << *p << dendl;
+  }
+}
+
 ClassHandler::ClassData *ClassHandler::_get_class(const string& cname)
 {
   ClassData *cls;
@@ -108,9 +166,84 @@ int ClassHandler::_load_class(ClassData *cls)
   
   dout(10) << "_load_class " << cls->name << " success" << dendl;
   cls->status = ClassData::CLASS_OPEN;
+  _create_loggers(cls);
   return 0;
 }
 
+void ClassHandler::_create_loggers(ClassData *cls)
+{
+  if (!cls->logger)
+    cls->logger = create_logger("cls_" + cls->name);
+  for (map<string, ClassMethod>::iterator p = cls->methods_map.begin();
+       p != cls->methods_map.end();
+       ++p)
+    if (!p->second.logger)
+      p->second.logger = create_logger("cls_" + cls->name + "." + p->first);
+}
+
+struct ClassMethodStats {
+  string name;
+  uint64_t calls, errors, rd_bytes, wr_bytes;
+  utime_t total_lat, max_lat;
+  uint64_t lat_hist[ClassHandler::LAT_BUCKETS];
+};
+
+void ClassHandler::dump_stats(Formatter *f, unsigned max)
+{
+  Mutex::Locker l(mutex);
+
+  vector<pair<utime_t, ClassMethod*> > by_time;
+  simple_spin_lock(&stats_lock);
+  for (map<string, ClassData>::iterator p = classes.begin(); p != classes.end(); ++p)
+    for (map<string, ClassMethod>::iterator q = p->second.methods_map.begin();
+	 q != p->second.methods_map.end();
+	 ++q)
+      if (q->second.calls)
+	by_time.push_back(make_pair(q->second.total_lat, &q->second));
+  simple_spin_unlock(&stats_lock);
+  sort(by_time.begin(), by_time.end());
+
+  f->open_array_section("cls_methods");
+  for (vector<pair<utime_t, ClassMethod*> >::reverse_iterator p = by_time.rbegin();
+       p != by_time.rend() && max > 0;
+       ++p, --max) {
+    ClassMethod *m = p->second;
+    ClassMethodStats s;
+    s.name = m->cls->name + "." + m->name;
+    simple_spin_lock(&stats_lock);
+    s.calls = m->calls;
+    s.errors = m->errors;
+    s.rd_bytes = m->rd_bytes;
+    s.wr_bytes = m->wr_bytes;
+    s.total_lat = m->total_lat;
+    s.max_lat = m->max_lat;
+    memcpy(s.lat_hist, m->lat_hist, sizeof(s.lat_hist));
+    simple_spin_unlock(&stats_lock);
+
+    f->open_object_section("method");
+    f->dump_string("name", s.name);
+    f->dump_unsigned("calls", s.calls);
+    f->dump_unsigned("errors", s.errors);
+    f->dump_unsigned("rd_bytes", s.rd_bytes);
+    f->dump_unsigned("wr_bytes", s.wr_bytes);
+    f->dump_float("total_lat", (double)s.total_lat);
+    f->dump_float("avg_lat", (double)s.total_lat / (double)s.calls);
+    f->dump_float("max_lat", (double)s.max_lat);
+    f->open_array_section("lat_hist");
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+      if (!s.lat_hist[i])
+	continue;
+      f->open_object_section("bucket");
+      f->dump_unsigned("lt_usec", 2ull << i);
+      f->dump_unsigned("count", s.lat_hist[i]);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
 
 
 ClassHandler::ClassData *ClassHandler::register_class(const char *cname)
@@ -183,6 +316,7 @@ void ClassHandler::ClassData::unregister_method(ClassHandler::ClassMethod *metho
    map<string, ClassMethod>::iterator iter = methods_map.find(method->name);
    if (iter == methods_map.end())
      return;
+   destroy_logger(iter->second.logger);
    methods_map.erase(iter);
 }
 
@@ -211,3 +345,36 @@ int ClassHandler::ClassMethod::exec(cls_method_context_t ctx, bufferlist& indata
   return ret;
 }
 
+void ClassHandler::ClassMethod::account(utime_t lat, int r, uint64_t rd, uint64_t wr)
+{
+  PerfCounters *loggers[2] = { logger, cls->logger };
+  for (int i = 0; i < 2; i++) {
+    if (!loggers[i])
+      continue;
+    loggers[i]->inc(l_cls_calls);
+    if (r < 0)
+      loggers[i]->inc(l_cls_errors);
+    loggers[i]->finc(l_cls_lat, (double)lat);
+    loggers[i]->inc(l_cls_rd_bytes, rd);
+    loggers[i]->inc(l_cls_wr_bytes, wr);
+  }
+
+  uint64_t us = (uint64_t)lat.sec() * 1000000 + lat.usec();
+  int b = 0;
+  while (us > 1 && b < LAT_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+
+  simple_spin_lock(&cls->handler->stats_lock);
+  calls++;
+  if (r < 0)
+    errors++;
+  rd_bytes += rd;
+  wr_bytes += wr;
+  total_lat += lat;
+  if (lat > max_lat)
+    max_lat = lat;
+  lat_hist[b]++;
+  simple_spin_unlock(&cls->handler->stats_lock);
+}
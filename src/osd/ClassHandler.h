@@ -6,7 +6,12 @@
 #include "objclass/objclass.h"
 
 #include "common/Cond.h"
+#include "common/Formatter.h"
 #include "common/Mutex.h"
+#include "common/simple_spin.h"
+#include "include/utime.h"
+
+class PerfCounters;
 
 
 class ClassHandler
@@ -14,6 +19,9 @@ class ClassHandler
 public:
   class ClassData;
 
+  /// latency histogram buckets, by log2 of the call time in usec
+  static const int LAT_BUCKETS = 24;
+
   struct ClassMethod {
     struct ClassHandler::ClassData *cls;
     string name;
@@ -21,7 +29,16 @@ public:
     cls_method_call_t func;
     cls_method_cxx_call_t cxx_func;
 
+    PerfCounters *logger;
+
+    // guarded by handler->stats_lock
+    uint64_t calls, errors;
+    uint64_t rd_bytes, wr_bytes;   ///< through the cls_cxx_* calls
+    utime_t total_lat, max_lat;
+    uint64_t lat_hist[LAT_BUCKETS];
+
     int exec(cls_method_context_t ctx, bufferlist& indata, bufferlist& outdata);
+    void account(utime_t lat, int r, uint64_t rd, uint64_t wr);
     void unregister();
 
     int get_flags() {
@@ -29,7 +46,10 @@ public:
       return flags;
     }
 
-    ClassMethod() : cls(0), func(0), cxx_func(0) {}
+    ClassMethod() : cls(0), func(0), cxx_func(0), logger(0),
+		    calls(0), errors(0), rd_bytes(0), wr_bytes(0) {
+      memset(lat_hist, 0, sizeof(lat_hist));
+    }
   };
 
   struct ClassData {
@@ -44,6 +64,7 @@ public:
     string name;
     ClassHandler *handler;
     void *handle;
+    PerfCounters *logger;   ///< sums over all methods
 
     map<string, ClassMethod> methods_map;
 
@@ -53,7 +74,7 @@ public:
     ClassMethod *_get_method(const char *mname);
 
     ClassData() : status(CLASS_UNKNOWN), 
-		  handle(NULL) {}
+		  handle(NULL), logger(NULL) {}
     ~ClassData() { }
 
     ClassMethod *register_method(const char *mname, int flags, cls_method_call_t func);
@@ -70,14 +91,21 @@ public:
 private:
   Mutex mutex;
   map<string, ClassData> classes;
+  simple_spinlock_t stats_lock;
 
   ClassData *_get_class(const string& cname);
   int _load_class(ClassData *cls);
+  void _create_loggers(ClassData *cls);
 
 public:
-  ClassHandler() : mutex("ClassHandler") {}
+  ClassHandler() : mutex("ClassHandler"), stats_lock(SIMPLE_SPINLOCK_INITIALIZER) {}
+  ~ClassHandler();
   
   int open_class(const string& cname, ClassData **pcls);
+  /// load classes up front so the first call doesn't pay for dlopen
+  void preload_classes(const string& names);
+  /// per-method stats, the most expensive (by total time) first
+  void dump_stats(Formatter *f, unsigned max);
   
   ClassData *register_class(const char *cname);
   void unregister_class(ClassData *cls);
@@ -40,6 +40,7 @@
 #include "ReplicatedPG.h"
 
 #include "Ager.h"
+#include "PGLoader.h"
 
 
 #include "msg/Messenger.h"
@@ -587,8 +588,10 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   stat_lock("OSD::stat_lock"),
   finished_lock("OSD::finished_lock"),
   admin_ops_hook(NULL),
+  op_sched(NULL),
   op_queue_len(0),
   op_wq(this, g_conf->osd_op_thread_timeout, &op_tp),
+  op_qos_lock("OSD::op_qos_lock"),
   map_lock("OSD::map_lock"),
   peer_map_epoch_lock("OSD::peer_map_epoch_lock"),
   map_cache_lock("OSD::map_cache_lock"),
@@ -605,9 +608,13 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   command_wq(this, g_conf->osd_command_thread_timeout, &command_tp),
   recovery_ops_active(0),
   recovery_wq(this, g_conf->osd_recovery_thread_timeout, &recovery_tp),
+  recovery_rate_lock("OSD::recovery_rate_lock"),
+  recovery_rate(0),
+  client_op_lat_sum(0), client_op_lat_num(0),
   remove_list_lock("OSD::remove_list_lock"),
   replay_queue_lock("OSD::replay_queue_lock"),
   snap_trim_wq(this, g_conf->osd_snap_trim_thread_timeout, &disk_tp),
+  snap_trim_rate_lock("OSD::snap_trim_rate_lock"),
   sched_scrub_lock("OSD::sched_scrub_lock"),
   scrubs_pending(0),
   scrubs_active(0),
@@ -616,12 +623,16 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   rep_scrub_wq(this, g_conf->osd_scrub_thread_timeout, &disk_tp),
   remove_wq(this, g_conf->osd_remove_thread_timeout, &disk_tp),
   watch_lock("OSD::watch_lock"),
-  watch_timer(external_messenger->cct, watch_lock)
+  watch_timer(external_messenger->cct, watch_lock, g_conf->osd_watch_timer_tick)
 {
   monc->set_messenger(client_messenger);
 
   map_in_progress_cond = new Cond();
-  
+
+  if (g_conf->osd_op_queue == "mclock")
+    op_sched = new mClockScheduler<OpQueueItem*, op_qos_key_t>(this);
+  else
+    op_sched = new FifoScheduler<OpQueueItem*, op_qos_key_t>(this);
 }
 
 OSD::~OSD()
@@ -629,6 +640,7 @@ OSD::~OSD()
   delete authorize_handler_registry;
   delete map_in_progress_cond;
   delete class_handler;
+  delete op_sched;
   g_ceph_context->get_perfcounters_collection()->remove(logger);
   delete logger;
   delete store;
@@ -669,7 +681,13 @@ public:
   OpsFlightSocketHook(OSD *o) : osd(o) {}
   bool call(std::string command, bufferlist& out) {
     stringstream ss;
-    osd->dump_ops_in_flight(ss);
+    if (command == "dump_cls_stats") {
+      JSONFormatter f(true);
+      osd->class_handler->dump_stats(&f, g_conf->osd_class_stats_dump_max);
+      f.flush(ss);
+    } else {
+      osd->dump_ops_in_flight(ss);
+    }
     out.append(ss);
     return true;
   }
@@ -707,6 +725,7 @@ int OSD::init()
 
   class_handler = new ClassHandler();
   cls_initialize(class_handler);
+  class_handler->preload_classes(g_conf->osd_class_preload);
 
   // load up "current" osdmap
   assert_warn(!osdmap);
@@ -718,6 +737,8 @@ int OSD::init()
 
   bind_epoch = osdmap->get_epoch();
 
+  create_logger();
+
   // load up pgs (as they previously existed)
   load_pgs();
 
@@ -729,8 +750,6 @@ int OSD::init()
     return -EINVAL;
   }
 
-  create_logger();
-    
   // i'm ready!
   client_messenger->add_dispatcher_head(this);
   client_messenger->add_dispatcher_head(&clog);
@@ -786,6 +805,9 @@ int OSD::init()
   r = admin_socket->register_command("dump_ops_in_flight", admin_ops_hook,
                                          "show the ops currently in flight");
   assert(r == 0);
+  r = admin_socket->register_command("dump_cls_stats", admin_ops_hook,
+				     "show the object class methods using the most time");
+  assert(r == 0);
 
   return 0;
 }
@@ -807,6 +829,7 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_op_r,      "op_r");        // client reads
   osd_plb.add_u64_counter(l_osd_op_r_outb, "op_r_out_bytes");   // client read out bytes
   osd_plb.add_fl_avg(l_osd_op_r_lat,  "op_r_latency");    // client read latency
+  osd_plb.add_u64_counter(l_osd_op_r_unlocked, "op_r_unlocked");   // client reads done without the pg lock
   osd_plb.add_u64_counter(l_osd_op_w,      "op_w");        // client writes
   osd_plb.add_u64_counter(l_osd_op_w_inb,  "op_w_in_bytes");    // client write in bytes
   osd_plb.add_fl_avg(l_osd_op_w_rlat, "op_w_rlat");   // client write readable/applied latency
@@ -833,6 +856,11 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_pull,      "pull");       // pull requests sent
   osd_plb.add_u64_counter(l_osd_push,      "push");       // push messages
   osd_plb.add_u64_counter(l_osd_push_outb, "push_out_bytes");  // pushed bytes
+  osd_plb.add_u64_counter(l_osd_push_batched, "push_batched");  // objects batched into another push
+  osd_plb.add_u64_counter(l_osd_push_throttled, "push_throttled");  // pushes stalled on recovery budget
+  osd_plb.add_u64(l_osd_recovery_rate, "recovery_rate");  // current recovery budget (bytes/sec)
+  osd_plb.add_u64_counter(l_osd_snap_trim, "snap_trim");  // clone trims started
+  osd_plb.add_u64_counter(l_osd_snap_trim_throttled, "snap_trim_throttled");  // pgs stalled on snap trim budget
 
   osd_plb.add_u64_counter(l_osd_rop, "recovery_ops");       // recovery ops (started)
 
@@ -848,6 +876,12 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_map, "map_messages");           // osdmap messages
   osd_plb.add_u64_counter(l_osd_mape, "map_message_epochs");         // osdmap epochs
   osd_plb.add_u64_counter(l_osd_mape_dup, "map_message_epoch_dups"); // dup osdmap epochs
+  osd_plb.add_u64_counter(l_osd_pg_advmap_skip, "pg_advance_map_skipped"); // pg epochs skipped during catch-up
+
+  osd_plb.add_fl_avg(l_osd_load_list, "load_list");   // startup: listing collections
+  osd_plb.add_fl_avg(l_osd_load_read_info, "load_read_info");   // startup: reading a pg's info
+  osd_plb.add_fl_avg(l_osd_load_read_log, "load_read_log");   // startup: reading a pg's log
+  osd_plb.add_fl_avg(l_osd_load_build_prior, "load_build_prior");   // startup: generating a pg's past intervals
 
   logger = osd_plb.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
@@ -907,6 +941,7 @@ int OSD::shutdown()
   dout(10) << "no ops" << dendl;
 
   cct->get_admin_socket()->unregister_command("dump_ops_in_flight");
+  cct->get_admin_socket()->unregister_command("dump_cls_stats");
   delete admin_ops_hook;
   admin_ops_hook = NULL;
 
@@ -1214,18 +1249,52 @@ PG *OSD::lookup_lock_raw_pg(pg_t pgid)
 }
 
 
+/*
+ * read a pg off disk, on one of load_pgs' PGLoader threads.  the pgs
+ * are already open and locked by load_pgs; this only reads their
+ * on-disk state and fills in past intervals, which needs nothing but
+ * old maps.
+ */
+struct OSDPGLoader {
+  OSD *osd;
+  OSDPGLoader(OSD *o) : osd(o) {}
+  void operator()(PG *pg) {
+    osd->load_pg_state(pg);
+  }
+};
+
+void OSD::load_pg_state(PG *pg)
+{
+  utime_t start = ceph_clock_now(g_ceph_context);
+  pg->read_info(store);
+  utime_t now = ceph_clock_now(g_ceph_context);
+  logger->finc(l_osd_load_read_info, (double)(now - start));
+
+  start = now;
+  pg->read_log_or_reset(store);
+  now = ceph_clock_now(g_ceph_context);
+  logger->finc(l_osd_load_read_log, (double)(now - start));
+
+  start = now;
+  pg->generate_past_intervals();
+  now = ceph_clock_now(g_ceph_context);
+  logger->finc(l_osd_load_build_prior, (double)(now - start));
+}
+
 void OSD::load_pgs()
 {
   assert(osd_lock.is_locked());
   dout(10) << "load_pgs" << dendl;
   assert(pg_map.empty());
 
+  utime_t start = ceph_clock_now(g_ceph_context);
   vector<coll_t> ls;
   int r = store->list_collections(ls);
   if (r < 0) {
     derr << "failed to list pgs: " << cpp_strerror(-r) << dendl;
   }
 
+  vector<PG*> pgs;
   for (vector<coll_t>::iterator it = ls.begin();
        it != ls.end();
        it++) {
@@ -1255,10 +1324,24 @@ void OSD::load_pgs()
       continue;
     }
 
-    PG *pg = _open_lock_pg(pgid);
+    pgs.push_back(_open_lock_pg(pgid));
+  }
+  logger->finc(l_osd_load_list, (double)(ceph_clock_now(g_ceph_context) - start));
+
+  // read pg state, log
+  unsigned nthreads = MIN((size_t)MAX(1, g_conf->osd_pg_load_threads), pgs.size());
+  dout(10) << "load_pgs reading " << pgs.size() << " pgs with "
+	   << nthreads << " threads" << dendl;
+  OSDPGLoader load(this);
+  PGLoader<PG*, OSDPGLoader>(pgs, load).run(nthreads);
 
-    // read pg state, log
-    pg->read_state(store);
+  ObjectStore::Transaction t;
+  for (vector<PG*>::iterator p = pgs.begin(); p != pgs.end(); ++p) {
+    PG *pg = *p;
+    pg_t pgid = pg->info.pgid;
+
+    // keep any past intervals we just generated
+    pg->write_if_dirty(t);
 
     reg_last_pg_scrub(pg->info.pgid, pg->info.history.last_scrub_stamp);
 
@@ -1273,6 +1356,8 @@ void OSD::load_pgs()
     dout(10) << "load_pgs loaded " << *pg << " " << pg->log << dendl;
     pg->unlock();
   }
+  if (!t.empty())
+    store->apply_transaction(t);
   dout(10) << "load_pgs done" << dendl;
 }
  
@@ -1761,7 +1846,15 @@ void OSD::tick()
   logger->set(l_osd_buf, buffer::get_total_alloc());
 
   // periodically kick recovery work queue
+  adjust_recovery_rate();
+  resume_throttled_recovery();
   recovery_tp.kick();
+
+  resume_throttled_snap_trim();
+
+  // pick up qos changes, and wake op threads waiting out a limit
+  refresh_op_qos();
+  op_tp.kick();
   
   if (scrub_should_schedule()) {
     sched_scrub();
@@ -2460,6 +2553,10 @@ void OSD::do_command(Connection *con, tid_t tid, vector<string>& cmd, bufferlist
     cpu_profiler_handle_command(cmd, clog);
   }
 
+  else if (cmd[0] == "qos") {
+    r = do_qos_command(cmd, ss);
+  }
+
   else if (cmd[0] == "dump_pg_recovery_stats") {
     stringstream s;
     pg_recovery_stats.dump(s);
@@ -2997,14 +3094,22 @@ void OSD::sched_scrub()
 
     dout(10) << " on " << t << " " << pgid << dendl;
     sched_scrub_lock.Unlock();
+    if (!op_qos_admit(scrub_qos_bucket, op_qos_key_t(op_qos_key_t::SCRUB))) {
+      dout(10) << "sched_scrub over scrub qos limit" << dendl;
+      sched_scrub_lock.Lock();
+      break;
+    }
     PG *pg = _lookup_lock_pg(pgid);
     if (pg) {
-      if (pg->is_active() && !pg->sched_scrub()) {
-	pg->unlock();
+      bool was_scrubbing = pg->is_scrubbing();
+      bool keep_going = !pg->is_active() || pg->sched_scrub();
+      if (!was_scrubbing && pg->is_scrubbing())
+	op_qos_charge(scrub_qos_bucket, 1);
+      pg->unlock();
+      if (!keep_going) {
 	sched_scrub_lock.Lock();
 	break;
       }
-      pg->unlock();
     }
     sched_scrub_lock.Lock();
 
@@ -3097,6 +3202,101 @@ void OSD::note_up_osd(int peer)
   forget_peer_epoch(peer, osdmap->get_epoch() - 1);
 }
 
+/*
+ * decode incremental maps on a helper thread, ahead of the thread that
+ * applies them.
+ */
+struct OSDMapIncDecoder : public Thread {
+  Mutex lock;
+  Cond cond;
+  vector<bufferlist*> in;
+  vector<OSDMap::Incremental*> out;
+
+  OSDMapIncDecoder() : lock("OSDMapIncDecoder::lock") {}
+  ~OSDMapIncDecoder() {
+    for (unsigned i = 0; i < out.size(); i++)
+      delete out[i];
+  }
+
+  void add(bufferlist *bl) {
+    in.push_back(bl);
+    out.push_back(NULL);
+  }
+  void *entry() {
+    for (unsigned i = 0; i < in.size(); i++) {
+      OSDMap::Incremental *inc = new OSDMap::Incremental;
+      bufferlist::iterator p = in[i]->begin();
+      inc->decode(p);
+      Mutex::Locker l(lock);
+      out[i] = inc;
+      cond.Signal();
+    }
+    return 0;
+  }
+  OSDMap::Incremental *get(unsigned i) {
+    Mutex::Locker l(lock);
+    while (!out[i])
+      cond.Wait(lock);
+    return out[i];
+  }
+};
+
+/*
+ * for a set of pgs, find the epochs in [maps] at which each pg's up or
+ * acting set changes.  read-only; the caller holds the pg locks.
+ */
+struct OSDMapChangeScanner : public Thread {
+  const vector<OSDMapRef>& maps;
+  vector<PG*> pgs;
+  vector<set<epoch_t> > changes;
+
+  OSDMapChangeScanner(const vector<OSDMapRef>& m) : maps(m) {}
+  void *entry() {
+    changes.resize(pgs.size());
+    for (unsigned i = 0; i < pgs.size(); i++) {
+      vector<int> up = pgs[i]->up, acting = pgs[i]->acting;
+      for (unsigned j = 0; j < maps.size(); j++) {
+	vector<int> newup, newacting;
+	maps[j]->pg_to_up_acting_osds(pgs[i]->info.pgid, newup, newacting);
+	if (newup != up || newacting != acting) {
+	  changes[i].insert(maps[j]->get_epoch());
+	  up.swap(newup);
+	  acting.swap(newacting);
+	}
+      }
+    }
+    return 0;
+  }
+};
+
+void OSD::plan_advance_map(epoch_t first, epoch_t last,
+			   hash_map<pg_t, set<epoch_t> >& changes)
+{
+  vector<OSDMapRef> maps;
+  for (epoch_t e = first; e <= last; e++) {
+    OSDMapRef m = get_map(e);
+    // fill every pool's table up front so the scanners only read them
+    m->build_pg_mappings(g_conf->osd_pg_mapping_threads);
+    maps.push_back(m);
+  }
+
+  unsigned nthreads = MAX(1, g_conf->osd_pg_mapping_threads);
+  vector<OSDMapChangeScanner*> scanners;
+  for (unsigned i = 0; i < nthreads; i++)
+    scanners.push_back(new OSDMapChangeScanner(maps));
+  unsigned n = 0;
+  for (hash_map<pg_t,PG*>::iterator i = pg_map.begin(); i != pg_map.end(); i++)
+    scanners[n++ % nthreads]->pgs.push_back(i->second);
+  for (unsigned i = 0; i < nthreads; i++)
+    scanners[i]->create();
+  for (unsigned i = 0; i < nthreads; i++) {
+    scanners[i]->join();
+    for (unsigned j = 0; j < scanners[i]->pgs.size(); j++)
+      changes[scanners[i]->pgs[j]->info.pgid].swap(scanners[i]->changes[j]);
+    delete scanners[i];
+  }
+}
+
 void OSD::handle_osd_map(MOSDMap *m)
 {
   assert(osd_lock.is_locked());
@@ -3176,9 +3376,11 @@ void OSD::handle_osd_map(MOSDMap *m)
 
   list<OpRequestRef> rq;
   while (true) {
-    PG *pg = op_wq._dequeue();
-    if (!pg)
+    // drain everything, even keys that are over their qos limit
+    OpQueueItem *i = op_wq._dequeue(true);
+    if (!i)
       break;
+    PG *pg = i->pg;
 
     // op_wq is inside pg->lock
     op_wq.unlock();
@@ -3189,8 +3391,8 @@ void OSD::handle_osd_map(MOSDMap *m)
     // thread did something very strange :/
     assert(!pg->op_queue.empty());
 
-    OpRequestRef op = pg->op_queue.front();
-    pg->op_queue.pop_front();
+    OpRequestRef op = take_queued_op(pg, i->key);
+    delete i;
     pg->unlock();
     pg->put();
     dout(15) << " will requeue " << *op->request << dendl;
@@ -3205,6 +3407,19 @@ void OSD::handle_osd_map(MOSDMap *m)
 
   // store new maps: queue for disk and put in the osdmap cache
   epoch_t start = MAX(osdmap->get_epoch() + 1, first);
+
+  // decode the incrementals ahead of applying them
+  OSDMapIncDecoder decoder;
+  map<epoch_t,unsigned> inc_slot;
+  for (epoch_t e = start; e <= last; e++) {
+    if (m->maps.count(e) || !m->incremental_maps.count(e))
+      continue;
+    inc_slot[e] = decoder.in.size();
+    decoder.add(&m->incremental_maps[e]);
+  }
+  if (!inc_slot.empty())
+    decoder.create();
+
   for (epoch_t e = start; e <= last; e++) {
     map<epoch_t,bufferlist>::iterator p;
     p = m->maps.find(e);
@@ -3232,15 +3447,11 @@ void OSD::handle_osd_map(MOSDMap *m)
 
       OSDMap *o = new OSDMap;
       if (e > 1) {
-	bufferlist obl;
 	OSDMapRef prev = get_map(e - 1);
-	prev->encode(obl);
-	o->decode(obl);
+	o->deepish_copy_from(*prev);
       }
 
-      OSDMap::Incremental inc;
-      bufferlist::iterator p = bl.begin();
-      inc.decode(p);
+      OSDMap::Incremental& inc = *decoder.get(inc_slot[e]);
       if (o->apply_incremental(inc) < 0) {
 	derr << "ERROR: bad fsid?  i have " << osdmap->get_fsid() << " and inc has " << inc.fsid << dendl;
 	assert(0 == "bad fsid");
@@ -3259,6 +3470,8 @@ void OSD::handle_osd_map(MOSDMap *m)
 
     assert(0 == "MOSDMap lied about what maps it had?");
   }
+  if (!inc_slot.empty())
+    decoder.join();
 
   // check for cluster snapshot
   string cluster_snap;
@@ -3310,6 +3523,11 @@ void OSD::handle_osd_map(MOSDMap *m)
     pg->lock_with_map_lock_held(true);
   }
 
+  // figure out which epochs each pg actually needs to see
+  hash_map<pg_t, set<epoch_t> > mapping_changes;
+  if (!pg_map.empty())
+    plan_advance_map(start, superblock.newest_map, mapping_changes);
+
   // advance through the new maps
   for (epoch_t cur = start; cur <= superblock.newest_map; cur++) {
     dout(10) << " advance to epoch " << cur << " (<= newest " << superblock.newest_map << ")" << dendl;
@@ -3329,7 +3547,7 @@ void OSD::handle_osd_map(MOSDMap *m)
     osdmap = newmap;
 
     superblock.current_epoch = cur;
-    advance_map(t, fin);
+    advance_map(t, fin, cur < superblock.newest_map ? &mapping_changes : NULL);
     had_map_since = ceph_clock_now(g_ceph_context);
   }
 
@@ -3484,7 +3702,13 @@ void OSD::handle_osd_map(MOSDMap *m)
  * scan placement groups, initiate any replication
  * activities.
  */
-void OSD::advance_map(ObjectStore::Transaction& t, C_Contexts *tfin)
+/*
+ * if mapping_changes is given, pgs that are idle (neither active nor
+ * peering) and whose mapping does not change in this epoch are not
+ * shown it; they will see a later one.
+ */
+void OSD::advance_map(ObjectStore::Transaction& t, C_Contexts *tfin,
+		      hash_map<pg_t, set<epoch_t> > *mapping_changes)
 {
   assert(osd_lock.is_locked());
 
@@ -3597,14 +3821,21 @@ void OSD::advance_map(ObjectStore::Transaction& t, C_Contexts *tfin)
        it++) {
     PG *pg = it->second;
 
-    vector<int> newup, newacting;
-    osdmap->pg_to_up_acting_osds(pg->info.pgid, newup, newacting);
-
     //pg->lock_with_map_lock_held();
 
     // update pg's osdmap ref, assert lock is held
     pg->reassert_lock_with_map_lock_held();
 
+    if (mapping_changes && pg->can_skip_advance_map() &&
+	!(*mapping_changes)[pg->info.pgid].count(osdmap->get_epoch())) {
+      dout(20) << "Skipping pg " << *pg << ", mapping unchanged" << dendl;
+      logger->inc(l_osd_pg_advmap_skip);
+      continue;
+    }
+
+    vector<int> newup, newacting;
+    osdmap->pg_to_up_acting_osds(pg->info.pgid, newup, newacting);
+
     dout(10) << "Scanning pg " << *pg << dendl;
     pg->handle_advance_map(osdmap, lastmap, newup, newacting, 0);
     //pg->unlock();
@@ -5015,6 +5246,14 @@ bool OSD::_recover_now()
     dout(15) << "_recover_now defer until " << defer_recovery_until << dendl;
     return false;
   }
+  if (!recovery_bytes_available()) {
+    dout(15) << "_recover_now out of recovery bandwidth" << dendl;
+    return false;
+  }
+  if (!op_qos_admit(recovery_qos_bucket, op_qos_key_t(op_qos_key_t::RECOVERY))) {
+    dout(15) << "_recover_now over recovery qos limit" << dendl;
+    return false;
+  }
 
   return true;
 }
@@ -5047,6 +5286,7 @@ void OSD::do_recovery(PG *pg)
     PG::RecoveryCtx rctx(&query_map, &info_map, 0, &fin->contexts, t);
 
     int started = pg->start_recovery_ops(max, &rctx);
+    op_qos_charge(recovery_qos_bucket, started);
     
     dout(10) << "do_recovery started " << started
 	     << " (" << recovery_ops_active << "/" << g_conf->osd_recovery_max_active << " rops) on "
@@ -5145,6 +5385,146 @@ void OSD::defer_recovery(PG *pg)
   recovery_wq.unlock();
 }
 
+/*
+ * Recovery pushes draw from a bytes/sec token bucket.  The budget
+ * starts at osd_recovery_max_bytes_per_sec and, if a client op latency
+ * target is set, backs off multiplicatively while client ops are slow
+ * and creeps back up additively when they are not.
+ */
+bool OSD::recovery_bytes_available()
+{
+  Mutex::Locker l(recovery_rate_lock);
+  return recovery_bucket.may_start(ceph_clock_now(g_ceph_context));
+}
+
+void OSD::take_recovery_bytes(uint64_t bytes)
+{
+  Mutex::Locker l(recovery_rate_lock);
+  recovery_bucket.take(ceph_clock_now(g_ceph_context), bytes);
+}
+
+void OSD::queue_for_recovery_bandwidth(PG *pg)
+{
+  dout(15) << "queue_for_recovery_bandwidth " << *pg << dendl;
+  logger->inc(l_osd_push_throttled);
+  Mutex::Locker l(recovery_rate_lock);
+  recovery_throttled_pgs.insert(pg->info.pgid);
+}
+
+void OSD::note_client_op_latency(utime_t lat)
+{
+  Mutex::Locker l(recovery_rate_lock);
+  client_op_lat_sum += (double)lat;
+  client_op_lat_num++;
+}
+
+void OSD::adjust_recovery_rate()
+{
+  Mutex::Locker l(recovery_rate_lock);
+  double max = g_conf->osd_recovery_max_bytes_per_sec;
+  double min = MIN((double)g_conf->osd_recovery_min_bytes_per_sec, max);
+  double target = g_conf->osd_recovery_client_latency_target;
+
+  if (max <= 0) {
+    // unlimited
+    recovery_rate = 0;
+  } else if (target <= 0 || recovery_rate <= 0) {
+    recovery_rate = max;
+  } else if (client_op_lat_num) {
+    double avg = client_op_lat_sum / (double)client_op_lat_num;
+    if (avg > target)
+      recovery_rate = MAX(min, recovery_rate / 2);
+    else
+      recovery_rate = MIN(max, recovery_rate + max / 10);
+    dout(20) << "adjust_recovery_rate avg client op latency " << avg
+	     << " target " << target << dendl;
+  } else {
+    // idle clients; open up
+    recovery_rate = max;
+  }
+  client_op_lat_sum = 0;
+  client_op_lat_num = 0;
+
+  if (recovery_rate != recovery_bucket.get_rate()) {
+    dout(10) << "adjust_recovery_rate " << recovery_bucket.get_rate()
+	     << " -> " << recovery_rate << " bytes/sec" << dendl;
+    recovery_bucket.set_rate(recovery_rate);
+  }
+  logger->set(l_osd_recovery_rate, (uint64_t)recovery_rate);
+}
+
+void OSD::resume_throttled_recovery()
+{
+  assert(osd_lock.is_locked());
+  set<pg_t> pgs;
+  {
+    Mutex::Locker l(recovery_rate_lock);
+    if (recovery_throttled_pgs.empty() ||
+	!recovery_bucket.may_start(ceph_clock_now(g_ceph_context)))
+      return;
+    pgs.swap(recovery_throttled_pgs);
+  }
+  for (set<pg_t>::iterator p = pgs.begin(); p != pgs.end(); ++p) {
+    if (!_have_pg(*p))
+      continue;
+    PG *pg = _lookup_lock_pg(*p);
+    dout(10) << "resume_throttled_recovery " << *pg << dendl;
+    pg->resume_throttled_pushes();
+    pg->unlock();
+  }
+}
+
+/*
+ * Clone trims draw from an ops/sec token bucket shared by all pgs.  A
+ * pg that finds it empty is parked until the next tick refills it.
+ */
+unsigned OSD::reserve_snap_trims(PG *pg, unsigned want)
+{
+  Mutex::Locker l(snap_trim_rate_lock);
+  utime_t now = ceph_clock_now(g_ceph_context);
+  if (!snap_trim_bucket.may_start(now)) {
+    dout(15) << "reserve_snap_trims " << *pg << " throttled" << dendl;
+    logger->inc(l_osd_snap_trim_throttled);
+    snap_trim_throttled_pgs.insert(pg->info.pgid);
+    return 0;
+  }
+  if (!snap_trim_bucket.is_unlimited()) {
+    double avail = snap_trim_bucket.get_tokens(now);
+    if (avail < want)
+      want = MAX(1u, (unsigned)avail);
+  }
+  snap_trim_bucket.take(now, want);
+  logger->inc(l_osd_snap_trim, want);
+  return want;
+}
+
+void OSD::resume_throttled_snap_trim()
+{
+  assert(osd_lock.is_locked());
+  set<pg_t> pgs;
+  {
+    Mutex::Locker l(snap_trim_rate_lock);
+    double rate = g_conf->osd_snap_trim_max_ops_per_sec;
+    if (rate != snap_trim_bucket.get_rate()) {
+      dout(10) << "resume_throttled_snap_trim rate " << snap_trim_bucket.get_rate()
+	       << " -> " << rate << " trims/sec" << dendl;
+      snap_trim_bucket.set_rate(rate);
+    }
+    if (snap_trim_throttled_pgs.empty() ||
+	!snap_trim_bucket.may_start(ceph_clock_now(g_ceph_context)))
+      return;
+    pgs.swap(snap_trim_throttled_pgs);
+  }
+  for (set<pg_t>::iterator p = pgs.begin(); p != pgs.end(); ++p) {
+    if (!_have_pg(*p))
+      continue;
+    PG *pg = _lookup_lock_pg(*p);
+    dout(10) << "resume_throttled_snap_trim " << *pg << dendl;
+    pg->queue_snap_trim();
+    pg->unlock();
+  }
+}
+
 
 // =========================================================
 // OPS
@@ -5505,6 +5885,29 @@ bool OSD::subop_is_queueable(PG *pg, OpRequestRef op)
   return true;
 }
 
+op_qos_key_t OSD::get_op_qos_key(OpRequestRef op)
+{
+  entity_name_t src = op->request->get_source();
+  if (op->request->get_type() != CEPH_MSG_OSD_OP)
+    return op_qos_key_t(op_qos_key_t::OSD, src.num());
+
+  if (g_conf->osd_op_qos_key == "pool") {
+    MOSDOp *m = (MOSDOp*)op->request;
+    return op_qos_key_t(op_qos_key_t::POOL, m->get_pg().pool());
+  }
+  if (!src.is_client())
+    return op_qos_key_t(op_qos_key_t::CLIENT, -1);  // mds etc. share a key
+  return op_qos_key_t(op_qos_key_t::CLIENT, src.num());
+}
+
+double OSD::get_op_qos_cost(OpRequestRef op)
+{
+  uint64_t unit = g_conf->osd_op_qos_cost_bytes;
+  if (!unit)
+    return 1;
+  return 1 + (double)op->request->get_data_len() / (double)unit;
+}
+
 /*
  * enqueue called with osd_lock held
  */
@@ -5546,29 +5949,30 @@ void OSD::enqueue_op(PG *pg, OpRequestRef op)
   // add to pg's op_queue
   pg->op_queue.push_back(op);
   
-  op_wq.queue(pg);
+  op_wq.queue(new OpQueueItem(pg, get_op_qos_key(op), get_op_qos_cost(op)));
 
   op->mark_queued_for_pg();
 }
 
-bool OSD::OpWQ::_enqueue(PG *pg)
+bool OSD::OpWQ::_enqueue(OpQueueItem *i)
 {
-  pg->get();
-  osd->op_queue.push_back(pg);
+  i->pg->get();
+  osd->op_sched->enqueue(i->key, i->cost, i,
+			 (double)ceph_clock_now(g_ceph_context));
   osd->op_queue_len++;
   osd->logger->set(l_osd_opq, osd->op_queue_len);
   return true;
 }
 
-PG *OSD::OpWQ::_dequeue()
+OSD::OpQueueItem *OSD::OpWQ::_dequeue(bool ignore_limit)
 {
-  if (osd->op_queue.empty())
-    return NULL;
-  PG *pg = osd->op_queue.front();
-  osd->op_queue.pop_front();
+  OpQueueItem *i;
+  if (!osd->op_sched->dequeue((double)ceph_clock_now(g_ceph_context), &i,
+			      ignore_limit))
+    return NULL;  // empty, or everyone is over their limit
   osd->op_queue_len--;
   osd->logger->set(l_osd_opq, osd->op_queue_len);
-  return pg;
+  return i;
 }
 
 /*
@@ -5605,10 +6009,30 @@ void OSD::requeue_ops(PG *pg, list<OpRequestRef>& ls)
   pg->op_queue.splice(pg->op_queue.end(), orig_queue);
 }
 
+/*
+ * pull the oldest op queued on pg under key.  if the pg's queue was
+ * reshuffled underneath us (requeue_ops)
+ * or osd_op_qos_key changed and nothing matches, fall back to the
+ * front; the token counts still line up.
+ */
+OpRequestRef OSD::take_queued_op(PG *pg, op_qos_key_t key)
+{
+  assert(pg->is_locked());
+  assert(!pg->op_queue.empty());
+  list<OpRequestRef>::iterator p = pg->op_queue.begin();
+  while (p != pg->op_queue.end() && get_op_qos_key(*p) != key)
+    ++p;
+  if (p == pg->op_queue.end())
+    p = pg->op_queue.begin();
+  OpRequestRef op = *p;
+  pg->op_queue.erase(p);
+  return op;
+}
+
 /*
  * NOTE: dequeue called in worker thread, without osd_lock
  */
-void OSD::dequeue_op(PG *pg)
+void OSD::dequeue_op(PG *pg, op_qos_key_t key)
 {
   OpRequestRef op;
 
@@ -5618,8 +6042,7 @@ void OSD::dequeue_op(PG *pg)
     pg->lock();
 
     assert(!pg->op_queue.empty());
-    op = pg->op_queue.front();
-    pg->op_queue.pop_front();
+    op = take_queued_op(pg, key);
     
     dout(10) << "dequeue_op " << *op->request << " pg " << *pg << dendl;
 
@@ -5647,6 +6070,170 @@ void OSD::dequeue_op(PG *pg)
 }
 
 
+
+// --------------------------------
+// op qos
+
+ostream& operator<<(ostream& out, const op_qos_key_t& k)
+{
+  switch (k.klass) {
+  case op_qos_key_t::CLIENT: return out << "client." << k.id;
+  case op_qos_key_t::POOL: return out << "pool." << k.id;
+  case op_qos_key_t::OSD: return out << "osd." << k.id;
+  case op_qos_key_t::RECOVERY: return out << "recovery";
+  case op_qos_key_t::SCRUB: return out << "scrub";
+  }
+  return out << "???." << k.id;
+}
+
+bool op_qos_key_t::parse(const string& s)
+{
+  if (s == "recovery") {
+    *this = op_qos_key_t(RECOVERY);
+    return true;
+  }
+  if (s == "scrub") {
+    *this = op_qos_key_t(SCRUB);
+    return true;
+  }
+  size_t dot = s.find('.');
+  if (dot == string::npos)
+    return false;
+  string type = s.substr(0, dot);
+  const char *start = s.c_str() + dot + 1;
+  char *end;
+  long long i = strtoll(start, &end, 10);
+  if (end == start || *end)
+    return false;
+  if (type == "client")
+    *this = op_qos_key_t(CLIENT, i);
+  else if (type == "pool")
+    *this = op_qos_key_t(POOL, i);
+  else if (type == "osd")
+    *this = op_qos_key_t(OSD, i);
+  else
+    return false;
+  return true;
+}
+
+OpQoS OSD::get_qos(const op_qos_key_t& k)
+{
+  {
+    Mutex::Locker l(op_qos_lock);
+    map<op_qos_key_t, OpQoS>::iterator p = op_qos_overrides.find(k);
+    if (p != op_qos_overrides.end())
+      return p->second;
+  }
+  switch (k.klass) {
+  case op_qos_key_t::OSD:
+    return OpQoS(g_conf->osd_op_qos_osd_reservation,
+		 g_conf->osd_op_qos_osd_weight,
+		 g_conf->osd_op_qos_osd_limit);
+  case op_qos_key_t::RECOVERY:
+    return OpQoS(0, 1, g_conf->osd_op_qos_recovery_limit);
+  case op_qos_key_t::SCRUB:
+    return OpQoS(0, 1, g_conf->osd_op_qos_scrub_limit);
+  default:
+    return OpQoS(g_conf->osd_op_qos_client_reservation,
+		 g_conf->osd_op_qos_client_weight,
+		 g_conf->osd_op_qos_client_limit);
+  }
+}
+
+void OSD::refresh_op_qos()
+{
+  op_wq.lock();
+  op_sched->refresh_qos();
+  op_wq.unlock();
+}
+
+/*
+ * recovery and scrub run in their own thread pools, so their qos
+ * classes are enforced as admission limits rather than by op_sched.
+ */
+bool OSD::op_qos_admit(TokenBucket& b, const op_qos_key_t& k)
+{
+  double limit = get_qos(k).limit;
+  utime_t now = ceph_clock_now(g_ceph_context);
+  Mutex::Locker l(op_qos_lock);
+  if (b.get_rate() != limit)
+    b.set_rate(limit, MAX(limit, 1.0));
+  return b.may_start(now);
+}
+
+void OSD::op_qos_charge(TokenBucket& b, double cost)
+{
+  Mutex::Locker l(op_qos_lock);
+  b.take(ceph_clock_now(g_ceph_context), cost);
+}
+
+/*
+ * qos dump
+ * qos set <key> <reservation> <weight> <limit>
+ * qos rm <key>
+ *
+ * key is client.N, pool.N, osd.N, recovery or scrub.
+ */
+int OSD::do_qos_command(vector<string>& cmd, ostream& ss)
+{
+  if (cmd.size() >= 2 && cmd[1] == "dump") {
+    JSONFormatter f(true);
+    f.open_object_section("op_qos");
+    f.dump_string("queue", g_conf->osd_op_queue);
+    f.dump_string("key", g_conf->osd_op_qos_key);
+    f.open_array_section("overrides");
+    op_qos_lock.Lock();
+    for (map<op_qos_key_t, OpQoS>::iterator p = op_qos_overrides.begin();
+	 p != op_qos_overrides.end();
+	 ++p) {
+      f.open_object_section("override");
+      f.dump_stream("key") << p->first;
+      f.dump_float("reservation", p->second.reservation);
+      f.dump_float("weight", p->second.weight);
+      f.dump_float("limit", p->second.limit);
+      f.close_section();
+    }
+    op_qos_lock.Unlock();
+    f.close_section();
+    f.open_object_section("scheduler");
+    op_wq.lock();
+    op_sched->dump(&f);
+    op_wq.unlock();
+    f.close_section();
+    f.close_section();
+    f.flush(ss);
+    return 0;
+  }
+
+  op_qos_key_t key;
+  if (cmd.size() < 3 || !key.parse(cmd[2])) {
+    ss << "usage: qos dump | qos set <key> <res> <weight> <limit> | qos rm <key>";
+    return -EINVAL;
+  }
+  if (cmd[1] == "set" && cmd.size() == 6) {
+    OpQoS q(atof(cmd[3].c_str()), atof(cmd[4].c_str()), atof(cmd[5].c_str()));
+    if (q.reservation < 0 || q.weight <= 0 || q.limit < 0) {
+      ss << "reservation and limit must be >= 0, weight > 0";
+      return -EINVAL;
+    }
+    op_qos_lock.Lock();
+    op_qos_overrides[key] = q;
+    op_qos_lock.Unlock();
+    ss << "set " << key << " " << q;
+  } else if (cmd[1] == "rm") {
+    op_qos_lock.Lock();
+    op_qos_overrides.erase(key);
+    op_qos_lock.Unlock();
+    ss << "cleared " << key;
+  } else {
+    ss << "unrecognized qos command";
+    return -EINVAL;
+  }
+  refresh_op_qos();
+  op_tp.kick();
+  return 0;
+}
+
 // --------------------------------
 
 int OSD::init_op_flags(MOSDOp *op)
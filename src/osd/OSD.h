@@ -22,6 +22,7 @@
 #include "common/Mutex.h"
 #include "common/RWLock.h"
 #include "common/Timer.h"
+#include "common/TimerWheel.h"
 #include "common/WorkQueue.h"
 #include "common/LogClient.h"
 
@@ -29,7 +30,9 @@
 #include "OSDCaps.h"
 
 #include "common/DecayCounter.h"
+#include "common/TokenBucket.h"
 #include "osd/ClassHandler.h"
+#include "osd/OpScheduler.h"
 
 #include "include/CompatSet.h"
 
@@ -64,6 +67,7 @@ enum {
   l_osd_op_r,
   l_osd_op_r_outb,
   l_osd_op_r_lat,
+  l_osd_op_r_unlocked,
   l_osd_op_w,
   l_osd_op_w_inb,
   l_osd_op_w_rlat,
@@ -89,6 +93,11 @@ enum {
   l_osd_pull,
   l_osd_push,
   l_osd_push_outb,
+  l_osd_push_batched,
+  l_osd_push_throttled,
+  l_osd_recovery_rate,
+  l_osd_snap_trim,
+  l_osd_snap_trim_throttled,
 
   l_osd_rop,
 
@@ -104,6 +113,11 @@ enum {
   l_osd_map,
   l_osd_mape,
   l_osd_mape_dup,
+  l_osd_pg_advmap_skip,
+  l_osd_load_list,
+  l_osd_load_read_info,
+  l_osd_load_read_log,
+  l_osd_load_build_prior,
 
   l_osd_last,
 };
@@ -128,7 +142,40 @@ class OpsFlightSocketHook;
 
 extern const coll_t meta_coll;
 
-class OSD : public Dispatcher {
+/*
+ * op scheduling key.  client ops are keyed by client or by pool
+ * (osd_op_qos_key); everything from a peer osd shares one key so that
+ * replication traffic stays ordered.  recovery and scrub are not queued,
+ * but they are rate limited under their own keys.
+ */
+struct op_qos_key_t {
+  enum {
+    CLIENT,
+    POOL,
+    OSD,
+    RECOVERY,
+    SCRUB,
+  };
+  int klass;
+  int64_t id;
+
+  op_qos_key_t(int k = CLIENT, int64_t i = 0) : klass(k), id(i) {}
+
+  bool parse(const string& s);
+};
+inline bool operator==(const op_qos_key_t& l, const op_qos_key_t& r) {
+  return l.klass == r.klass && l.id == r.id;
+}
+inline bool operator!=(const op_qos_key_t& l, const op_qos_key_t& r) {
+  return !(l == r);
+}
+inline bool operator<(const op_qos_key_t& l, const op_qos_key_t& r) {
+  return l.klass < r.klass || (l.klass == r.klass && l.id < r.id);
+}
+ostream& operator<<(ostream& out, const op_qos_key_t& k);
+
+class OSD : public Dispatcher,
+	    public OpQoSPolicy<op_qos_key_t> {
   /** OSD **/
 protected:
   Mutex osd_lock;			// global lock
@@ -347,36 +394,63 @@ private:
   OpsFlightSocketHook *admin_ops_hook;
 
   // -- op queue --
-  deque<PG*> op_queue;
+  /*
+   * one entry per op in some pg->op_queue.  the scheduler picks the
+   * next entry; dequeue_op then runs the oldest op in that pg with the
+   * same key, so per-key (per-client) order within a pg is preserved.
+   */
+  struct OpQueueItem {
+    PG *pg;
+    op_qos_key_t key;
+    double cost;
+    OpQueueItem(PG *p, op_qos_key_t k, double c) : pg(p), key(k), cost(c) {}
+  };
+  OpScheduler<OpQueueItem*, op_qos_key_t> *op_sched;  // protected by op_wq lock
   int op_queue_len;
 
-  struct OpWQ : public ThreadPool::WorkQueue<PG> {
+  struct OpWQ : public ThreadPool::WorkQueue<OpQueueItem> {
     OSD *osd;
     OpWQ(OSD *o, time_t ti, ThreadPool *tp)
-      : ThreadPool::WorkQueue<PG>("OSD::OpWQ", ti, ti*10, tp), osd(o) {}
+      : ThreadPool::WorkQueue<OpQueueItem>("OSD::OpWQ", ti, ti*10, tp), osd(o) {}
 
-    bool _enqueue(PG *pg);
-    void _dequeue(PG *pg) {
+    bool _enqueue(OpQueueItem *i);
+    void _dequeue(OpQueueItem *i) {
       assert(0);
     }
     bool _empty() {
-      return osd->op_queue.empty();
+      return osd->op_sched->empty();
     }
-    PG *_dequeue();
-    void _process(PG *pg) {
-      osd->dequeue_op(pg);
+    OpQueueItem *_dequeue() {
+      return _dequeue(false);
+    }
+    OpQueueItem *_dequeue(bool ignore_limit);
+    void _process(OpQueueItem *i) {
+      osd->dequeue_op(i->pg, i->key);
+      delete i;
     }
     void _clear() {
-      assert(osd->op_queue.empty());
+      assert(osd->op_sched->empty());
     }
   } op_wq;
 
+  op_qos_key_t get_op_qos_key(OpRequestRef op);
+  double get_op_qos_cost(OpRequestRef op);
   void enqueue_op(PG *pg, OpRequestRef op);
   void requeue_ops(PG *pg, list<OpRequestRef>& ls);
-  void dequeue_op(PG *pg);
-  static void static_dequeueop(OSD *o, PG *pg) {
-    o->dequeue_op(pg);
-  };
+  void dequeue_op(PG *pg, op_qos_key_t key);
+  OpRequestRef take_queued_op(PG *pg, op_qos_key_t key);
+
+  // -- op qos --
+  Mutex op_qos_lock;  // leaf; protects the fields below
+  map<op_qos_key_t, OpQoS> op_qos_overrides;   ///< set via 'qos set'
+  TokenBucket recovery_qos_bucket, scrub_qos_bucket;
+public:
+  OpQoS get_qos(const op_qos_key_t& k);
+private:
+  void refresh_op_qos();
+  bool op_qos_admit(TokenBucket& b, const op_qos_key_t& k);
+  void op_qos_charge(TokenBucket& b, double cost);
+  int do_qos_command(vector<string>& cmd, ostream& ss);
 
 
   friend class PG;
@@ -407,7 +481,10 @@ private:
   void note_down_osd(int osd);
   void note_up_osd(int osd);
   
-  void advance_map(ObjectStore::Transaction& t, C_Contexts *tfin);
+  void plan_advance_map(epoch_t first, epoch_t last,
+			hash_map<pg_t, set<epoch_t> >& mapping_changes);
+  void advance_map(ObjectStore::Transaction& t, C_Contexts *tfin,
+		   hash_map<pg_t, set<epoch_t> > *mapping_changes = NULL);
   void activate_map(ObjectStore::Transaction& t, list<Context*>& tfin);
 
   // osd map cache (past osd maps)
@@ -481,6 +558,8 @@ protected:
 		       C_Contexts **pfin);
   
   void load_pgs();
+  void load_pg_state(PG *pg);
+  friend struct OSDPGLoader;
   void calc_priors_during(pg_t pgid, epoch_t start, epoch_t end, set<int>& pset);
   void project_pg_history(pg_t pgid, pg_history_t& h, epoch_t from,
 			  vector<int>& lastup, vector<int>& lastacting);
@@ -768,6 +847,21 @@ protected:
   void do_recovery(PG *pg);
   bool _recover_now();
 
+  // -- recovery bandwidth --
+  Mutex recovery_rate_lock;
+  TokenBucket recovery_bucket;     ///< push bytes/sec budget
+  double recovery_rate;            ///< current (adaptive) budget, bytes/sec
+  double client_op_lat_sum;        ///< client op latency since last tick
+  uint64_t client_op_lat_num;
+  set<pg_t> recovery_throttled_pgs;  ///< pgs with pushes stalled on budget
+
+  bool recovery_bytes_available();
+  void take_recovery_bytes(uint64_t bytes);
+  void queue_for_recovery_bandwidth(PG *pg);
+  void note_client_op_latency(utime_t lat);
+  void adjust_recovery_rate();
+  void resume_throttled_recovery();
+
   Mutex remove_list_lock;
   map<epoch_t, map<int, vector<pg_t> > > remove_list;
 
@@ -821,6 +915,13 @@ protected:
     }
   } snap_trim_wq;
 
+  Mutex snap_trim_rate_lock;
+  TokenBucket snap_trim_bucket;    ///< clone trims/sec budget
+  set<pg_t> snap_trim_throttled_pgs;  ///< pgs with trimming stalled on budget
+
+  unsigned reserve_snap_trims(PG *pg, unsigned want);
+  void resume_throttled_snap_trim();
+
   // -- scrub scheduling --
   Mutex sched_scrub_lock;
   int scrubs_pending;
@@ -1114,7 +1215,7 @@ public:
   void ack_notification(entity_name_t& peer_addr, void *notif, void *obc,
 			ReplicatedPG *pg);
   Mutex watch_lock;
-  SafeTimer watch_timer;
+  TimerWheel watch_timer;   ///< watch and notify timeouts
   void handle_notify_timeout(void *notif);
   void disconnect_session_watches(Session *session);
   void handle_watch_timeout(void *obc,
@@ -19,6 +19,7 @@
 #include "include/ceph_features.h"
 
 #include "common/code_environment.h"
+#include "common/Thread.h"
 
 #define dout_subsys ceph_subsys_osd
 
@@ -507,6 +508,7 @@ void OSDMap::set_max_osd(int m)
   osd_uuid->resize(m);
 
   calc_num_osds();
+  invalidate_pg_mapping();
 }
 
 int OSDMap::calc_num_osds()
@@ -643,6 +645,32 @@ void OSDMap::dedup(const OSDMap *o, OSDMap *n)
   if (o->osd_uuid->size() == n->osd_uuid->size() &&
       *o->osd_uuid == *n->osd_uuid)
     n->osd_uuid = o->osd_uuid;
+
+  // if crush, weights and osd existence/up state are the same, any pool
+  // with the same placement parameters maps the same way.
+  bool same_inputs = (n->crush == o->crush &&
+		      n->max_osd == o->max_osd &&
+		      n->osd_weight == o->osd_weight);
+  for (int i = 0; same_inputs && i < n->max_osd; i++)
+    if ((n->osd_state[i] ^ o->osd_state[i]) & (CEPH_OSD_EXISTS|CEPH_OSD_UP))
+      same_inputs = false;
+  if (same_inputs) {
+    bool all_pools = (n->pools.size() == o->pools.size());
+    Mutex::Locker l(o->pg_mapping->lock);
+    for (map<int64_t,pg_pool_t>::const_iterator p = n->pools.begin(); p != n->pools.end(); ++p) {
+      map<int64_t,pg_pool_t>::const_iterator q = o->pools.find(p->first);
+      if (q == o->pools.end() ||
+	  !pool_mapping_t(q->second).matches(p->second)) {
+	all_pools = false;
+	continue;
+      }
+      map<int64_t,pool_mapping_ref>::iterator r = o->pg_mapping->pools.find(p->first);
+      if (r != o->pg_mapping->pools.end() && r->second->matches(p->second))
+	n->pg_mapping->pools[p->first] = r->second;
+    }
+    if (all_pools)
+      n->pg_mapping = o->pg_mapping;   // share whatever gets built later, too
+  }
 }
 
 int OSDMap::apply_incremental(Incremental &inc)
@@ -785,6 +813,7 @@ int OSDMap::apply_incremental(Incremental &inc)
   }
 
   calc_num_osds();
+  invalidate_pg_mapping();
   return 0;
 }
 
@@ -832,22 +861,194 @@ void OSDMap::_remove_nonexistent_osds(vector<int>& osds) const
     osds.resize(osds.size() - removed);
 }
 
-int OSDMap::_pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) const
+int OSDMap::_calc_pg_to_osds(const CrushWrapper& c, const pg_pool_t& pool, pg_t pg,
+			     vector<int>& osds) const
 {
   // map to osds[]
   ps_t pps = pool.raw_pg_to_pps(pg);  // placement ps
   unsigned size = pool.get_size();
 
   // what crush rule?
-  int ruleno = crush->find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
+  int ruleno = c.find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
   if (ruleno >= 0)
-    crush->do_rule(ruleno, pps, osds, size, osd_weight);
+    c.do_rule(ruleno, pps, osds, size, osd_weight);
+  else
+    osds.clear();
 
   _remove_nonexistent_osds(osds);
 
   return osds.size();
 }
 
+void OSDMap::_build_pool_mapping(const CrushWrapper& c, const pg_pool_t& pool,
+				 int64_t poolid, pool_mapping_t *m) const
+{
+  unsigned stride = m->stride();
+  m->table.resize(m->pgp_num * stride);
+  vector<int> raw, up;
+  for (unsigned ps = 0; ps < m->pgp_num; ps++) {
+    pg_t pg(ps, poolid, -1);
+    _calc_pg_to_osds(c, pool, pg, raw);
+    _raw_to_up_osds(pg, raw, up);
+    int32_t *row = &m->table[ps * stride];
+    row[0] = raw.size();
+    row[1] = up.size();
+    for (unsigned i = 0; i < raw.size() && i < m->size; i++)
+      row[2 + i] = raw[i];
+    for (unsigned i = 0; i < up.size() && i < m->size; i++)
+      row[2 + m->size + i] = up[i];
+  }
+}
+
+OSDMap::pool_mapping_ref OSDMap::_get_pool_mapping(const pg_pool_t& pool,
+						   int64_t poolid) const
+{
+  std::tr1::shared_ptr<mapping_cache_t> cache = pg_mapping;
+  Mutex::Locker l(cache->lock);
+  map<int64_t, pool_mapping_ref>::iterator p = cache->pools.find(poolid);
+  if (p != cache->pools.end() && p->second->matches(pool))
+    return p->second;
+
+  // build under the lock so concurrent lookups don't each build the
+  // table.  crush_do_rule writes to the uniform buckets' permutation
+  // cache, and crush may be shared with other maps, so run a copy.
+  CrushWrapper c;
+  _copy_crush(c);
+  pool_mapping_t *m = new pool_mapping_t(pool);
+  _build_pool_mapping(c, pool, poolid, m);
+  pool_mapping_ref r(m);
+  cache->pools[poolid] = r;
+  return r;
+}
+
+int OSDMap::_pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) const
+{
+  vector<int> up;
+  _pg_to_raw_up(pool, pg, osds, up);
+  return osds.size();
+}
+
+void OSDMap::_pg_to_raw_up(const pg_pool_t& pool, pg_t pg,
+			   vector<int>& raw, vector<int>& up) const
+{
+  if (!pool.get_pgp_num()) {
+    CrushWrapper c;
+    _copy_crush(c);
+    _calc_pg_to_osds(c, pool, pg, raw);
+    _raw_to_up_osds(pg, raw, up);
+    return;
+  }
+  pool_mapping_ref m = _get_pool_mapping(pool, pg.pool());
+  unsigned seed = ceph_stable_mod(pg.ps(), pool.get_pgp_num(),
+				  pool.get_pgp_num_mask());
+  const int32_t *row = &m->table[seed * m->stride()];
+  raw.assign(row + 2, row + 2 + row[0]);
+  up.assign(row + 2 + m->size, row + 2 + m->size + row[1]);
+}
+
+struct OSDMapMappingThread : public Thread {
+  const OSDMap *osdmap;
+  bufferlist crushbl;
+  list<int64_t> *todo;    // shared; protected by lock
+  Mutex *lock;
+  OSDMapMappingThread(const OSDMap *o, bufferlist& bl, list<int64_t> *t, Mutex *l)
+    : osdmap(o), crushbl(bl), todo(t), lock(l) {}
+  void *entry() {
+    // crush_do_rule is not safe to run concurrently on one map (uniform
+    // buckets cache a permutation), so each thread gets its own copy.
+    CrushWrapper c;
+    bufferlist::iterator p = crushbl.begin();
+    c.decode(p);
+    while (true) {
+      lock->Lock();
+      if (todo->empty()) {
+	lock->Unlock();
+	break;
+      }
+      int64_t pool = todo->front();
+      todo->pop_front();
+      lock->Unlock();
+      osdmap->_build_and_add_pool_mapping(c, pool);
+    }
+    return 0;
+  }
+};
+
+void OSDMap::_copy_crush(CrushWrapper& c) const
+{
+  bufferlist bl;
+  crush->encode(bl);
+  bufferlist::iterator p = bl.begin();
+  c.decode(p);
+}
+
+void OSDMap::_build_and_add_pool_mapping(const CrushWrapper& c, int64_t poolid) const
+{
+  const pg_pool_t *pool = get_pg_pool(poolid);
+  pool_mapping_t *m = new pool_mapping_t(*pool);
+  _build_pool_mapping(c, *pool, poolid, m);
+  pool_mapping_ref r(m);
+  Mutex::Locker l(pg_mapping->lock);
+  pg_mapping->pools[poolid] = r;
+}
+
+bool OSDMap::shares_pool_mapping(const OSDMap& o, int64_t poolid) const
+{
+  pool_mapping_ref a, b;
+  {
+    Mutex::Locker l(pg_mapping->lock);
+    map<int64_t, pool_mapping_ref>::iterator p = pg_mapping->pools.find(poolid);
+    if (p != pg_mapping->pools.end())
+      a = p->second;
+  }
+  {
+    Mutex::Locker l(o.pg_mapping->lock);
+    map<int64_t, pool_mapping_ref>::iterator p = o.pg_mapping->pools.find(poolid);
+    if (p != o.pg_mapping->pools.end())
+      b = p->second;
+  }
+  return a && a == b;
+}
+
+void OSDMap::build_pg_mappings(unsigned nthreads) const
+{
+  list<int64_t> todo;
+  {
+    Mutex::Locker l(pg_mapping->lock);
+    for (map<int64_t,pg_pool_t>::const_iterator p = pools.begin(); p != pools.end(); ++p) {
+      map<int64_t, pool_mapping_ref>::iterator q = pg_mapping->pools.find(p->first);
+      if (p->second.get_pgp_num() &&
+	  (q == pg_mapping->pools.end() || !q->second->matches(p->second)))
+	todo.push_back(p->first);
+    }
+  }
+  if (todo.empty())
+    return;
+
+  if (nthreads <= 1 || todo.size() == 1) {
+    CrushWrapper c;
+    _copy_crush(c);
+    for (list<int64_t>::iterator p = todo.begin(); p != todo.end(); ++p)
+      _build_and_add_pool_mapping(c, *p);
+    return;
+  }
+
+  if (nthreads > todo.size())
+    nthreads = todo.size();
+  bufferlist crushbl;
+  crush->encode(crushbl);
+  Mutex lock("OSDMap::build_pg_mappings::lock");
+  vector<OSDMapMappingThread*> threads;
+  for (unsigned i = 0; i < nthreads; i++) {
+    threads.push_back(new OSDMapMappingThread(this, crushbl, &todo, &lock));
+    threads.back()->create();
+  }
+  for (unsigned i = 0; i < nthreads; i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+}
+
 // pg -> (up osd list)
 void OSDMap::_raw_to_up_osds(pg_t pg, vector<int>& raw, vector<int>& up) const
 {
@@ -888,10 +1089,10 @@ int OSDMap::pg_to_acting_osds(pg_t pg, vector<int>& acting) const
   const pg_pool_t *pool = get_pg_pool(pg.pool());
   if (!pool)
     return 0;
-  vector<int> raw;
-  _pg_to_osds(*pool, pg, raw);
+  vector<int> raw, up;
+  _pg_to_raw_up(*pool, pg, raw, up);
   if (!_raw_to_temp_osds(*pool, pg, raw, acting))
-    _raw_to_up_osds(pg, raw, acting);
+    acting.swap(up);
   return acting.size();
 }
 
@@ -901,8 +1102,7 @@ void OSDMap::pg_to_raw_up(pg_t pg, vector<int>& up)
   if (!pool)
     return;
   vector<int> raw;
-  _pg_to_osds(*pool, pg, raw);
-  _raw_to_up_osds(pg, raw, up);
+  _pg_to_raw_up(*pool, pg, raw, up);
 }
   
 void OSDMap::pg_to_up_acting_osds(pg_t pg, vector<int>& up, vector<int>& acting) const
@@ -911,8 +1111,7 @@ void OSDMap::pg_to_up_acting_osds(pg_t pg, vector<int>& up, vector<int>& acting)
   if (!pool)
     return;
   vector<int> raw;
-  _pg_to_osds(*pool, pg, raw);
-  _raw_to_up_osds(pg, raw, up);
+  _pg_to_raw_up(*pool, pg, raw, up);
   if (!_raw_to_temp_osds(*pool, pg, raw, acting))
     acting = up;
 }
@@ -1150,6 +1349,7 @@ void OSDMap::decode(bufferlist::iterator& p)
     name_pool[i->second] = i->first;
 
   calc_num_osds();
+  invalidate_pg_mapping();
 }
 
 
@@ -1465,6 +1665,7 @@ void OSDMap::build_simple(CephContext *cct, epoch_t e, uuid_d &fsid,
     set_state(i, 0);
     set_weight(i, CEPH_OSD_OUT);
   }
+  invalidate_pg_mapping();
 }
 
 
@@ -1579,6 +1780,7 @@ void OSDMap::build_simple_from_conf(CephContext *cct, epoch_t e, uuid_d &fsid,
     set_state(i, 0);
     set_weight(i, CEPH_OSD_OUT);
   }
+  invalidate_pg_mapping();
 }
 
 void OSDMap::build_simple_crush_map_from_conf(CephContext *cct, CrushWrapper& crush,
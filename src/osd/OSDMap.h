@@ -181,6 +181,38 @@ private:
   epoch_t cluster_snapshot_epoch;
   string cluster_snapshot;
 
+  /*
+   * precomputed raw and up osds for every placement seed in a pool.
+   * built lazily on first use and thrown away whenever the map is
+   * modified.  copies of a map (and deduped maps whose placement inputs
+   * are identical) share the cache.
+   */
+  struct pool_mapping_t {
+    unsigned pgp_num, pgp_num_mask, size;
+    int crush_ruleset;
+    unsigned type;
+    vector<int32_t> table;  // per seed: nraw, nup, raw[size], up[size]
+
+    pool_mapping_t(const pg_pool_t& p)
+      : pgp_num(p.get_pgp_num()), pgp_num_mask(p.get_pgp_num_mask()),
+	size(p.get_size()),
+	crush_ruleset(p.get_crush_ruleset()), type(p.get_type()) {}
+    bool matches(const pg_pool_t& p) const {
+      return pgp_num == p.get_pgp_num() && pgp_num_mask == p.get_pgp_num_mask() &&
+	size == p.get_size() &&
+	crush_ruleset == p.get_crush_ruleset() && type == p.get_type();
+    }
+    unsigned stride() const { return 2 + 2 * size; }
+  };
+  typedef std::tr1::shared_ptr<const pool_mapping_t> pool_mapping_ref;
+
+  struct mapping_cache_t {
+    Mutex lock;
+    map<int64_t, pool_mapping_ref> pools;
+    mapping_cache_t() : lock("OSDMap::mapping_cache_t::lock") {}
+  };
+  mutable std::tr1::shared_ptr<mapping_cache_t> pg_mapping;
+
  public:
   std::tr1::shared_ptr<CrushWrapper> crush;       // hierarchical map
 
@@ -197,6 +229,7 @@ private:
 	     pg_temp(new map<pg_t,vector<int> >),
 	     osd_uuid(new vector<uuid_d>),
 	     cluster_snapshot_epoch(0),
+	     pg_mapping(new mapping_cache_t),
 	     crush(new CrushWrapper) {
     memset(&fsid, 0, sizeof(fsid));
   }
@@ -256,6 +289,7 @@ private:
   void set_state(int o, unsigned s) {
     assert(o < max_osd);
     osd_state[o] = s;
+    invalidate_pg_mapping();
   }
   void set_weightf(int o, float w) {
     set_weight(o, (int)((float)CEPH_OSD_IN * w));
@@ -265,6 +299,7 @@ private:
     osd_weight[o] = w;
     if (w)
       osd_state[o] |= CEPH_OSD_EXISTS;
+    invalidate_pg_mapping();
   }
   unsigned get_weight(int o) const {
     assert(o < max_osd);
@@ -364,6 +399,14 @@ private:
 
   int apply_incremental(Incremental &inc);
 
+  /// copy o, duplicating anything apply_incremental modifies in place
+  void deepish_copy_from(const OSDMap& o) {
+    *this = o;
+    osd_addrs.reset(new addrs_s(*o.osd_addrs));
+    pg_temp.reset(new map<pg_t,vector<int> >(*o.pg_temp));
+    osd_uuid.reset(new vector<uuid_d>(*o.osd_uuid));
+  }
+
   /// try to re-use/reference addrs in oldmap from newmap
   static void dedup(const OSDMap *oldmap, OSDMap *newmap);
 
@@ -403,10 +446,25 @@ public:
   }
 
 private:
-  /// pg -> (raw osd list)
-  int _pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) const;
+  /// pg -> (raw osd list), straight from crush
+  int _calc_pg_to_osds(const CrushWrapper& c, const pg_pool_t& pool, pg_t pg,
+		       vector<int>& osds) const;
   void _remove_nonexistent_osds(vector<int>& osds) const;
 
+  /// pg -> (raw osd list), via the mapping cache
+  int _pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) const;
+  /// pg -> (raw, up osd lists), via the mapping cache
+  void _pg_to_raw_up(const pg_pool_t& pool, pg_t pg,
+		     vector<int>& raw, vector<int>& up) const;
+
+  pool_mapping_ref _get_pool_mapping(const pg_pool_t& pool, int64_t poolid) const;
+  void _build_pool_mapping(const CrushWrapper& c, const pg_pool_t& pool,
+			   int64_t poolid, pool_mapping_t *m) const;
+  void _build_and_add_pool_mapping(const CrushWrapper& c, int64_t poolid) const;
+  /// a private copy of crush, safe to run beside other users of the map
+  void _copy_crush(CrushWrapper& c) const;
+  friend struct OSDMapMappingThread;
+
   /// pg -> (up osd list)
   void _raw_to_up_osds(pg_t pg, vector<int>& raw, vector<int>& up) const;
 
@@ -418,6 +476,15 @@ public:
   void pg_to_raw_up(pg_t pg, vector<int>& up);  
   void pg_to_up_acting_osds(pg_t pg, vector<int>& up, vector<int>& acting) const;
 
+  /// drop precomputed mappings; call after changing the map in place
+  void invalidate_pg_mapping() {
+    pg_mapping.reset(new mapping_cache_t);
+  }
+  /// precompute mappings for all pools, spread over up to nthreads threads
+  void build_pg_mappings(unsigned nthreads) const;
+  /// true if we and o hold the same precomputed table for a pool
+  bool shares_pool_mapping(const OSDMap& o, int64_t poolid) const;
+
   int64_t lookup_pg_pool_name(const char *name) {
     if (name_pool.count(name))
       return name_pool[name];
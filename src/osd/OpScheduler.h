@@ -0,0 +1,334 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSD_OPSCHEDULER_H
+#define CEPH_OSD_OPSCHEDULER_H
+
+#include <deque>
+#include <map>
+#include <ostream>
+
+#include "common/Formatter.h"
+
+/**
+ * QoS parameters for one scheduling key, in cost units (ops) per second.
+ *
+ *  reservation - minimum rate we try to guarantee; 0 == none
+ *  weight      - share of whatever is left over
+ *  limit       - maximum rate; 0 == unlimited
+ */
+struct OpQoS {
+  double reservation;
+  double weight;
+  double limit;
+
+  OpQoS(double r = 0, double w = 1, double l = 0)
+    : reservation(r), weight(w), limit(l) {}
+
+  bool operator==(const OpQoS &o) const {
+    return reservation == o.reservation && weight == o.weight &&
+      limit == o.limit;
+  }
+  bool operator!=(const OpQoS &o) const {
+    return !(*this == o);
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const OpQoS &q)
+{
+  return out << "qos(r " << q.reservation << " w " << q.weight
+	     << " l " << q.limit << ")";
+}
+
+/// where a scheduler finds the QoS parameters for a key
+template <typename K>
+class OpQoSPolicy {
+public:
+  virtual ~OpQoSPolicy() {}
+  virtual OpQoS get_qos(const K &k) = 0;
+};
+
+/**
+ * OpScheduler - decides which queued item runs next
+ *
+ * Items are kept FIFO per key, so anything that needs to stay ordered
+ * must share a key.  The scheduler only chooses between keys.
+ *
+ * Not thread safe; callers provide their own locking.
+ */
+template <typename T, typename K>
+class OpScheduler {
+protected:
+  OpQoSPolicy<K> *policy;
+
+public:
+  OpScheduler(OpQoSPolicy<K> *p) : policy(p) {}
+  virtual ~OpScheduler() {}
+
+  virtual void enqueue(const K &k, double cost, T item, double now) = 0;
+  /// requeue ahead of anything else for the same key
+  virtual void enqueue_front(const K &k, double cost, T item, double now) = 0;
+  /**
+   * pick the next item to run
+   *
+   * @param ignore_limit dequeue even if every key is over its limit
+   * @return false if nothing may run now
+   */
+  virtual bool dequeue(double now, T *out, bool ignore_limit = false) = 0;
+  virtual bool empty() const = 0;
+  virtual unsigned length() const = 0;
+  /// re-read QoS parameters from the policy
+  virtual void refresh_qos() {}
+  virtual void dump(ceph::Formatter *f) const = 0;
+};
+
+/**
+ * FifoScheduler - one queue, strict arrival order
+ */
+template <typename T, typename K>
+class FifoScheduler : public OpScheduler<T, K> {
+  std::deque<T> q;
+
+public:
+  FifoScheduler(OpQoSPolicy<K> *p) : OpScheduler<T, K>(p) {}
+
+  void enqueue(const K &k, double cost, T item, double now) {
+    q.push_back(item);
+  }
+  void enqueue_front(const K &k, double cost, T item, double now) {
+    q.push_front(item);
+  }
+  bool dequeue(double now, T *out, bool ignore_limit = false) {
+    if (q.empty())
+      return false;
+    *out = q.front();
+    q.pop_front();
+    return true;
+  }
+  bool empty() const {
+    return q.empty();
+  }
+  unsigned length() const {
+    return q.size();
+  }
+  void dump(ceph::Formatter *f) const {
+    f->dump_string("type", "fifo");
+    f->dump_unsigned("length", q.size());
+  }
+};
+
+/**
+ * mClockScheduler - reservation/weight/limit scheduling (Gulati et al,
+ * "mClock: Handling Throughput Variability for Hypervisor IO
+ * Scheduling", OSDI 2010)
+ *
+ * Each request is tagged on arrival with
+ *
+ *   R = max(R_prev + cost/reservation, now)
+ *   P = max(P_prev + cost/weight, now)
+ *   L = max(L_prev + cost/limit, now)
+ *
+ * Dequeue first serves the smallest R tag that is due (reservations);
+ * otherwise it serves the smallest P tag among keys whose L tag is due,
+ * and pulls that key's R tags back so weight-based service does not
+ * count against its reservation.
+ *
+ * Keys are scanned linearly, which is fine for the handful of clients
+ * and peers an OSD sees at once.  A key keeps its tags while it has
+ * nothing queued, so a client running one op at a time is still held
+ * to its limit; keys idle for longer than idle_age are swept out.
+ */
+template <typename T, typename K>
+class mClockScheduler : public OpScheduler<T, K> {
+  struct Request {
+    double cost;
+    double r, p, l;
+    T item;
+    Request(double c, double r_, double p_, double l_, T i)
+      : cost(c), r(r_), p(p_), l(l_), item(i) {}
+  };
+
+  struct Client {
+    OpQoS qos;
+    double r_prev, p_prev, l_prev;   ///< tags of the last request tagged
+    double last_active;              ///< when we last enqueued or dequeued
+    std::deque<Request> requests;
+    Client() : r_prev(0), p_prev(0), l_prev(0), last_active(0) {}
+  };
+
+  std::map<K, Client> clients;
+  unsigned total;
+  double idle_age;     ///< forget keys with nothing queued for this long
+  double next_sweep;
+
+  static double next_tag(double prev, double cost, double rate, double now) {
+    if (rate <= 0)
+      return 0;
+    double t = prev + cost / rate;
+    return t > now ? t : now;
+  }
+
+  Client &get_client(const K &k) {
+    typename std::map<K, Client>::iterator p = clients.find(k);
+    if (p != clients.end())
+      return p->second;
+    Client &c = clients[k];
+    c.qos = this->policy->get_qos(k);
+    return c;
+  }
+
+  void retire(typename std::map<K, Client>::iterator p, T *out, bool by_weight) {
+    Client &c = p->second;
+    Request &req = c.requests.front();
+    *out = req.item;
+    if (by_weight && c.qos.reservation > 0) {
+      double adj = req.cost / c.qos.reservation;
+      for (typename std::deque<Request>::iterator q = c.requests.begin();
+	   q != c.requests.end();
+	   ++q)
+	q->r -= adj;
+      c.r_prev -= adj;
+    }
+    c.requests.pop_front();
+    total--;
+  }
+
+  void sweep(double now) {
+    if (now < next_sweep)
+      return;
+    next_sweep = now + idle_age;
+    typename std::map<K, Client>::iterator p = clients.begin();
+    while (p != clients.end()) {
+      if (p->second.requests.empty() &&
+	  p->second.last_active + idle_age < now)
+	clients.erase(p++);
+      else
+	++p;
+    }
+  }
+
+public:
+  mClockScheduler(OpQoSPolicy<K> *p, double idle = 300)
+    : OpScheduler<T, K>(p), total(0), idle_age(idle), next_sweep(0) {}
+
+  void enqueue(const K &k, double cost, T item, double now) {
+    sweep(now);
+    Client &c = get_client(k);
+    c.last_active = now;
+    double w = c.qos.weight > 0 ? c.qos.weight : 1;
+    c.r_prev = next_tag(c.r_prev, cost, c.qos.reservation, now);
+    c.p_prev = next_tag(c.p_prev, cost, w, now);
+    c.l_prev = next_tag(c.l_prev, cost, c.qos.limit, now);
+    c.requests.push_back(Request(cost, c.r_prev, c.p_prev, c.l_prev, item));
+    total++;
+  }
+
+  void enqueue_front(const K &k, double cost, T item, double now) {
+    Client &c = get_client(k);
+    if (c.requests.empty()) {
+      enqueue(k, cost, item, now);
+      return;
+    }
+    // jump the line with the tags of the current head
+    Request &h = c.requests.front();
+    c.requests.push_front(Request(cost, h.r, h.p, h.l, item));
+    total++;
+  }
+
+  bool dequeue(double now, T *out, bool ignore_limit = false) {
+    sweep(now);
+    if (total == 0)
+      return false;
+
+    typename std::map<K, Client>::iterator best = clients.end();
+
+    // constraint phase: reservations that are due
+    for (typename std::map<K, Client>::iterator p = clients.begin();
+	 p != clients.end();
+	 ++p) {
+      if (p->second.requests.empty())
+	continue;
+      const Request &h = p->second.requests.front();
+      if (p->second.qos.reservation <= 0 || h.r > now)
+	continue;
+      if (best == clients.end() || h.r < best->second.requests.front().r)
+	best = p;
+    }
+    if (best != clients.end()) {
+      best->second.last_active = now;
+      retire(best, out, false);
+      return true;
+    }
+
+    // weight phase: proportional share among keys under their limit
+    for (typename std::map<K, Client>::iterator p = clients.begin();
+	 p != clients.end();
+	 ++p) {
+      if (p->second.requests.empty())
+	continue;
+      const Request &h = p->second.requests.front();
+      if (!ignore_limit && p->second.qos.limit > 0 && h.l > now)
+	continue;
+      if (best == clients.end() || h.p < best->second.requests.front().p)
+	best = p;
+    }
+    if (best == clients.end())
+      return false;
+    best->second.last_active = now;
+    retire(best, out, true);
+    return true;
+  }
+
+  bool empty() const {
+    return total == 0;
+  }
+  unsigned length() const {
+    return total;
+  }
+
+  void refresh_qos() {
+    for (typename std::map<K, Client>::iterator p = clients.begin();
+	 p != clients.end();
+	 ++p)
+      p->second.qos = this->policy->get_qos(p->first);
+  }
+
+  void dump(ceph::Formatter *f) const {
+    f->dump_string("type", "mclock");
+    f->dump_unsigned("length", total);
+    f->open_array_section("clients");
+    for (typename std::map<K, Client>::const_iterator p = clients.begin();
+	 p != clients.end();
+	 ++p) {
+      const Client &c = p->second;
+      f->open_object_section("client");
+      f->dump_stream("key") << p->first;
+      f->dump_stream("qos") << c.qos;
+      f->dump_unsigned("queued", c.requests.size());
+      if (c.requests.empty()) {
+	f->dump_float("r_tag", c.r_prev);
+	f->dump_float("p_tag", c.p_prev);
+	f->dump_float("l_tag", c.l_prev);
+      } else {
+	f->dump_float("r_tag", c.requests.front().r);
+	f->dump_float("p_tag", c.requests.front().p);
+	f->dump_float("l_tag", c.requests.front().l);
+      }
+      f->close_section();
+    }
+    f->close_section();
+  }
+};
+
+#endif
@@ -1791,6 +1791,7 @@ void PG::update_stats()
     info.stats.ondisk_log_size = ondisklog.length();
     info.stats.log_start = log.tail;
     info.stats.ondisk_log_start = log.tail;
+    info.stats.snaptrimq_len = snap_trimq.size();
 
     pg_stats_valid = true;
     pg_stats_stable = info.stats;
@@ -2318,6 +2319,12 @@ std::string PG::get_corrupt_pg_log_name() const
 }
 
 void PG::read_state(ObjectStore *store)
+{
+  read_info(store);
+  read_log_or_reset(store);
+}
+
+void PG::read_info(ObjectStore *store)
 {
   bufferlist bl;
   bufferlist::iterator p;
@@ -2355,7 +2362,10 @@ void PG::read_state(ObjectStore *store)
   } else {
     ::decode(snap_collections, p);
   }
+}
 
+void PG::read_log_or_reset(ObjectStore *store)
+{
   try {
     read_log(store);
   }
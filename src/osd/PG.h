@@ -708,6 +708,7 @@ public:
   virtual void clean_up_local(ObjectStore::Transaction& t) = 0;
 
   virtual int start_recovery_ops(int max, RecoveryCtx *prctx) = 0;
+  virtual void resume_throttled_pushes() = 0;
 
   void purge_strays();
 
@@ -1282,6 +1283,8 @@ public:
   int get_state() const { return state; }
   bool       is_active() const { return state_test(PG_STATE_ACTIVE); }
   bool       is_peering() const { return state_test(PG_STATE_PEERING); }
+  /// idle pgs only care about maps that change their mapping
+  bool       can_skip_advance_map() const { return !is_active() && !is_peering(); }
   bool       is_down() const { return state_test(PG_STATE_DOWN); }
   bool       is_replay() const { return state_test(PG_STATE_REPLAY); }
   bool       is_clean() const { return state_test(PG_STATE_CLEAN); }
@@ -1314,6 +1317,9 @@ public:
 
   std::string get_corrupt_pg_log_name() const;
   void read_state(ObjectStore *store);
+  void read_info(ObjectStore *store);
+  /// read the log; if it is corrupt, set it aside and start a fresh one
+  void read_log_or_reset(ObjectStore *store);
   coll_t make_snap_collection(ObjectStore::Transaction& t, snapid_t sn);
   void update_snap_collections(vector<pg_log_entry_t> &log_entries,
 			       ObjectStore::Transaction& t);
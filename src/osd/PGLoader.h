@@ -0,0 +1,77 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSD_PGLOADER_H
+#define CEPH_OSD_PGLOADER_H
+
+#include <vector>
+
+#include "common/Mutex.h"
+#include "common/Thread.h"
+
+/*
+ * calls load(pg) for each of pgs, on up to nthreads threads at once.
+ * the threads take pgs off the list in order, so with one thread this
+ * is the plain serial loop.  load must be safe to run for different
+ * pgs concurrently.
+ */
+template <typename T, typename L>
+class PGLoader {
+  std::vector<T>& pgs;
+  L& load;
+  Mutex lock;
+  unsigned next;  // protected by lock
+
+  struct LoaderThread : public Thread {
+    PGLoader *pl;
+    LoaderThread(PGLoader *p) : pl(p) {}
+    void *entry() {
+      pl->loop();
+      return 0;
+    }
+  };
+
+  void loop() {
+    while (true) {
+      T pg;
+      {
+	Mutex::Locker l(lock);
+	if (next == pgs.size())
+	  break;
+	pg = pgs[next++];
+      }
+      load(pg);
+    }
+  }
+
+public:
+  PGLoader(std::vector<T>& p, L& l)
+    : pgs(p), load(l), lock("PGLoader::lock"), next(0) {}
+
+  void run(unsigned nthreads) {
+    if (nthreads > pgs.size())
+      nthreads = pgs.size();
+    std::vector<LoaderThread*> threads;
+    for (unsigned i = 0; i < nthreads; i++) {
+      threads.push_back(new LoaderThread(this));
+      threads.back()->create();
+    }
+    for (unsigned i = 0; i < nthreads; i++) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+};
+
+#endif
@@ -39,6 +39,7 @@
 #include "mds/inode_backtrace.h" // Ugh
 
 #include "common/config.h"
+#include "common/ceph_crypto.h"
 #include "include/compat.h"
 
 #include "json_spirit/json_spirit_value.h"
@@ -101,6 +102,23 @@ bool ReplicatedPG::is_missing_object(const hobject_t& soid)
   return missing.missing.count(soid);
 }
 
+/*
+ * a replica may serve a read only if it holds the current version of
+ * the object: we must not be missing it (or its snapdir), and if we are
+ * being backfilled, it must be on the side of last_backfill we have.
+ */
+bool ReplicatedPG::replica_can_read(const hobject_t& head)
+{
+  assert(!is_primary());
+  hobject_t snapdir = head;
+  snapdir.snap = CEPH_SNAPDIR;
+  if (is_missing_object(head) || is_missing_object(snapdir))
+    return false;
+  if (head > info.last_backfill)
+    return false;
+  return true;
+}
+
 void ReplicatedPG::wait_for_missing_object(const hobject_t& soid, OpRequestRef op)
 {
   assert(is_missing_object(soid));
@@ -277,6 +295,14 @@ int ReplicatedPG::do_command(vector<string>& cmd, ostream& ss,
     recovery_state.handle_query_state(&jsf);
     jsf.close_section();
 
+    if (is_primary() && backfill_target >= 0) {
+      jsf.open_object_section("backfill");
+      jsf.dump_int("target", backfill_target);
+      jsf.dump_stream("pos") << backfill_pos;
+      backfill_stats.dump(&jsf, ceph_clock_now(g_ceph_context));
+      jsf.close_section();
+    }
+
     jsf.close_section();
     stringstream dss;
     jsf.flush(dss);
@@ -574,7 +600,9 @@ void ReplicatedPG::calc_trim_to()
 }
 
 ReplicatedPG::ReplicatedPG(OSD *o, PGPool *_pool, pg_t p, const hobject_t& oid, const hobject_t& ioid) : 
-  PG(o, _pool, p, oid, ioid), temp_created(false),
+  PG(o, _pool, p, oid, ioid), batch_pushes(false),
+  peer_backfill_next_valid(false), peer_backfill_scanning(false),
+  temp_created(false),
   temp_coll(coll_t::make_temp_coll(p)), snap_trimmer_machine(this)
 { 
   snap_trimmer_machine.initiate();
@@ -615,6 +643,15 @@ void ReplicatedPG::do_op(OpRequestRef op)
   // missing object?
   hobject_t head(m->get_oid(), m->get_object_locator().key,
 		 CEPH_NOSNAP, m->get_pg().ps());
+
+  // balanced/localized read on a replica?  send the client to the
+  // primary rather than waiting for recovery here.
+  if (!is_primary() && !replica_can_read(head)) {
+    dout(10) << "do_op replica can't serve " << head << ", -EAGAIN" << dendl;
+    osd->reply_op_error(op, -EAGAIN);
+    return;
+  }
+
   if (is_missing_object(head)) {
     wait_for_missing_object(head, op);
     return;
@@ -645,17 +682,21 @@ void ReplicatedPG::do_op(OpRequestRef op)
   ObjectContext *obc;
   bool can_create = m->may_write();
   snapid_t snapid;
+  snapid_t want = m->get_snapid();
+  bool list_snaps = !m->ops.empty() && m->ops[0].op.op == CEPH_OSD_OP_LIST_SNAPS;
+  if (list_snaps)
+    want = CEPH_SNAPDIR;   // whatever carries the snapset
   int r = find_object_context(hobject_t(m->get_oid(), 
 					m->get_object_locator().key,
-					m->get_snapid(), m->get_pg().ps()),
+					want, m->get_pg().ps()),
 			      m->get_object_locator(),
 			      &obc, can_create, &snapid);
   if (r) {
     if (r == -EAGAIN) {
-      // If we're not the primary of this OSD, and we have
-      // CEPH_OSD_FLAG_LOCALIZE_READS set, we just return -EAGAIN. Otherwise,
-      // we have to wait for the object.
-      if (is_primary() || (!(m->get_rmw_flags() & CEPH_OSD_FLAG_LOCALIZE_READS))) {
+      // If we're not the primary of this PG, we just return -EAGAIN and
+      // the client retries at the primary.  Otherwise, we have to wait
+      // for the object.
+      if (is_primary()) {
 	// missing the specific snap we need; requeue and wait.
 	assert(!can_create); // only happens on a read
 	hobject_t soid(m->get_oid(), m->get_object_locator().key,
@@ -667,6 +708,25 @@ void ReplicatedPG::do_op(OpRequestRef op)
     osd->reply_op_error(op, r);
     return;
   }
+
+  // list-snaps reads each clone's object_info for its snaps
+  if (list_snaps) {
+    const SnapSet& snapset = obc->ssc->snapset;
+    for (vector<snapid_t>::const_iterator p = snapset.clones.begin();
+	 p != snapset.clones.end();
+	 ++p) {
+      hobject_t clone_oid(m->get_oid(), m->get_object_locator().key,
+			  *p, m->get_pg().ps());
+      if (is_missing_object(clone_oid)) {
+	put_object_context(obc);
+	if (is_primary())
+	  wait_for_missing_object(clone_oid, op);
+	else
+	  osd->reply_op_error(op, -EAGAIN);
+	return;
+      }
+    }
+  }
   
   // make sure locator is consistent
   if (m->get_object_locator() != obc->obs.oi.oloc) {
@@ -690,6 +750,7 @@ void ReplicatedPG::do_op(OpRequestRef op)
 	   << " has oi of " << obc->obs.oi << dendl;
   
   bool ok;
+  AccessMode& mode = obc->mode;
   dout(10) << "do_op mode is " << mode << dendl;
   assert(!mode.wake);   // we should never have woken waiters here.
   if ((m->may_read() && m->may_write()) ||
@@ -703,7 +764,7 @@ void ReplicatedPG::do_op(OpRequestRef op)
     assert(0);
   if (!ok) {
     dout(10) << "do_op waiting on mode " << mode << dendl;
-    mode.waiting.push_back(op);
+    mode.waiting.push_back(op);   // keeps our obc ref
     op->mark_delayed();
     return;
   }
@@ -871,24 +932,29 @@ void ReplicatedPG::do_op(OpRequestRef op)
   uint64_t old_size = obc->obs.oi.size;
   eversion_t old_version = obc->obs.oi.version;
 
-  if (m->may_read()) {
-    dout(10) << " taking ondisk_read_lock" << dendl;
-    obc->ondisk_read_lock();
-  }
-  for (map<hobject_t,ObjectContext*>::iterator p = src_obc.begin(); p != src_obc.end(); ++p) {
-    dout(10) << " taking ondisk_read_lock for src " << p->first << dendl;
-    p->second->ondisk_read_lock();
-  }
+  int result;
+  if (can_read_unlocked(ctx)) {
+    result = do_unlocked_read(ctx);
+  } else {
+    if (m->may_read()) {
+      dout(10) << " taking ondisk_read_lock" << dendl;
+      obc->ondisk_read_lock();
+    }
+    for (map<hobject_t,ObjectContext*>::iterator p = src_obc.begin(); p != src_obc.end(); ++p) {
+      dout(10) << " taking ondisk_read_lock for src " << p->first << dendl;
+      p->second->ondisk_read_lock();
+    }
 
-  int result = prepare_transaction(ctx);
+    result = prepare_transaction(ctx);
 
-  if (m->may_read()) {
-    dout(10) << " dropping ondisk_read_lock" << dendl;
-    obc->ondisk_read_unlock();
-  }
-  for (map<hobject_t,ObjectContext*>::iterator p = src_obc.begin(); p != src_obc.end(); ++p) {
-    dout(10) << " dropping ondisk_read_lock for src " << p->first << dendl;
-    p->second->ondisk_read_unlock();
+    if (m->may_read()) {
+      dout(10) << " dropping ondisk_read_lock" << dendl;
+      obc->ondisk_read_unlock();
+    }
+    for (map<hobject_t,ObjectContext*>::iterator p = src_obc.begin(); p != src_obc.end(); ++p) {
+      dout(10) << " dropping ondisk_read_lock for src " << p->first << dendl;
+      p->second->ondisk_read_unlock();
+    }
   }
 
   if (result == -EAGAIN) {
@@ -987,6 +1053,7 @@ void ReplicatedPG::log_op_stats(OpContext *ctx)
   osd->logger->inc(l_osd_op_outb, outb);
   osd->logger->inc(l_osd_op_inb, inb);
   osd->logger->finc(l_osd_op_lat, latency);
+  osd->note_client_op_latency(latency);
 
   if (m->may_read() && m->may_write()) {
     osd->logger->inc(l_osd_op_rw);
@@ -1104,8 +1171,12 @@ void ReplicatedPG::do_scan(OpRequestRef op)
   case MOSDPGScan::OP_SCAN_GET_DIGEST:
     {
       BackfillInterval bi;
+      // the scan runs under the pg lock: take the primary's hint, but
+      // never scan more than our own osd_backfill_scan_max
+      int max = m->get_max(MAX(1, g_conf->osd_backfill_scan_max));
+      int min = MIN(g_conf->osd_backfill_scan_min, max);
       osr.flush();
-      scan_range(m->begin, g_conf->osd_backfill_scan_min, g_conf->osd_backfill_scan_max, &bi);
+      scan_range(m->begin, min, max, &bi);
       MOSDPGScan *reply = new MOSDPGScan(MOSDPGScan::OP_SCAN_DIGEST,
 					 get_osdmap()->get_epoch(), m->query_epoch,
 					 info.pgid, bi.begin, bi.end);
@@ -1118,6 +1189,23 @@ void ReplicatedPG::do_scan(OpRequestRef op)
     {
       int from = m->get_source().num();
       assert(from == backfill_target);
+      if (!peer_backfill_scanning || m->begin != peer_backfill_scan_begin) {
+	dout(10) << " ignoring stale scan from " << m->begin << dendl;
+	break;
+      }
+      peer_backfill_scanning = false;
+
+      if (!waiting_on_backfill) {
+	// a prefetch; keep it until the current interval runs out
+	BackfillInterval& bi = peer_backfill_next;
+	bi.begin = m->begin;
+	bi.end = m->end;
+	bufferlist::iterator p = m->get_data().begin();
+	::decode(bi.objects, p);
+	peer_backfill_next_valid = true;
+	break;
+      }
+
       BackfillInterval& bi = peer_backfill_info;
       bi.begin = m->begin;
       bi.end = m->end;
@@ -1128,7 +1216,9 @@ void ReplicatedPG::do_scan(OpRequestRef op)
 	peer_backfill_info.begin : backfill_info.begin;
       dout(10) << " backfill_pos now " << backfill_pos << dendl;
 
-      assert(waiting_on_backfill);
+      if (!bi.extends_to_end())
+	send_backfill_scan(bi.end);
+
       waiting_on_backfill = false;
       finish_recovery_op(bi.begin);
     }
@@ -1182,14 +1272,16 @@ void ReplicatedPG::do_backfill(OpRequestRef op)
   }
 }
 
-/* Returns head of snap_trimq as snap_to_trim and the relevant objects as 
- * obs_to_trim */
+/* Returns head of snap_trimq as snap_to_trim and the first page of the
+ * relevant objects as obs_to_trim */
 bool ReplicatedPG::get_obs_to_trim(snapid_t &snap_to_trim,
 				   coll_t &col_to_trim,
-				   vector<hobject_t> &obs_to_trim)
+				   vector<hobject_t> &obs_to_trim,
+				   hobject_t *next)
 {
   assert_locked();
   obs_to_trim.clear();
+  *next = hobject_t::get_max();
 
   interval_set<snapid_t> s;
   s.intersection_of(snap_trimq, info.purged_snaps);
@@ -1214,11 +1306,29 @@ bool ReplicatedPG::get_obs_to_trim(snapid_t &snap_to_trim,
   // flush pg ops to fs so we can rely on collection_list()
   osr.flush();
 
-  osd->store->collection_list(col_to_trim, obs_to_trim);
+  list_obs_to_trim(col_to_trim, hobject_t(), obs_to_trim, next);
 
   return true;
 }
 
+/* Lists the snap collection a page at a time, so a big one is never
+ * held in memory all at once.  Trimmed clones drop out of the
+ * collection, so a trim that is interrupted picks up where it left off
+ * rather than rescanning. */
+void ReplicatedPG::list_obs_to_trim(coll_t col_to_trim, hobject_t start,
+				    vector<hobject_t> &obs_to_trim,
+				    hobject_t *next)
+{
+  obs_to_trim.clear();
+  int r = osd->store->collection_list_partial(col_to_trim, start,
+					      osd->store->get_ideal_list_min(),
+					      osd->store->get_ideal_list_max(),
+					      0, &obs_to_trim, next);
+  assert(r == 0);
+  dout(10) << "list_obs_to_trim " << col_to_trim << " from " << start
+	   << " got " << obs_to_trim.size() << ", next " << *next << dendl;
+}
+
 ReplicatedPG::RepGather *ReplicatedPG::trim_object(const hobject_t &coid,
 						   const snapid_t &sn)
 {
@@ -1246,6 +1356,11 @@ ReplicatedPG::RepGather *ReplicatedPG::trim_object(const hobject_t &coid,
   dout(10) << coid << " snaps " << snaps << " old snapset " << snapset << dendl;
   assert(snapset.seq);
 
+  /* Currently, mode.try_write always returns true.  If this changes, we will
+   * need to delay the trim accordingly */
+  entity_inst_t nobody;
+  assert(obc->mode.try_write(nobody));
+
   vector<OSDOp> ops;
   tid_t rep_tid = osd->get_tid();
   osd_reqid_t reqid(osd->cluster_messenger->get_myname(), 0, rep_tid);
@@ -1369,14 +1484,6 @@ bool ReplicatedPG::snap_trimmer()
   lock();
   dout(10) << "snap_trimmer entry" << dendl;
   if (is_primary()) {
-    entity_inst_t nobody;
-    if (!mode.try_write(nobody)) {
-      dout(10) << " can't write, requeueing" << dendl;
-      queue_snap_trim();
-      unlock();
-      put();
-      return true;
-    }
     if (!finalizing_scrub) {
       dout(10) << "snap_trimmer posting" << dendl;
       snap_trimmer_machine.process_event(SnapTrim());
@@ -1557,8 +1664,6 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
   object_info_t& oi = obs.oi;
   const hobject_t& soid = oi.soid;
 
-  bool first_read = false;
-
   ObjectStore::Transaction& t = ctx->op_t;
 
   dout(10) << "do_osd_op " << soid << " " << ops << dendl;
@@ -1612,44 +1717,73 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 
     case CEPH_OSD_OP_READ:
       {
-	// read into a buffer
-	bufferlist bl;
-	int r = osd->store->read(coll, soid, op.extent.offset, op.extent.length, bl);
-	if (first_read) {
-	  first_read = false;
-	  ctx->data_off = op.extent.offset;
-	}
-	osd_op.outdata.claim_append(bl);
-	if (r >= 0) 
-	  op.extent.length = r;
-	else {
+	int r = _do_read_op(ctx, osd_op);
+	if (r < 0)
 	  result = r;
-	  op.extent.length = 0;
-	}
-	ctx->delta_stats.num_rd_kb += SHIFT_ROUND_UP(op.extent.length, 10);
-	ctx->delta_stats.num_rd++;
-	dout(10) << " read got " << r << " / " << op.extent.length << " bytes from obj " << soid << dendl;
-
-	__u32 seq = oi.truncate_seq;
-	// are we beyond truncate_size?
-	if ( (seq < op.extent.truncate_seq) &&
-	     (op.extent.offset + op.extent.length > op.extent.truncate_size) ) {
-
-	  // truncated portion of the read
-	  unsigned from = MAX(op.extent.offset, op.extent.truncate_size);  // also end of data
-	  unsigned to = op.extent.offset + op.extent.length;
-	  unsigned trim = to-from;
+	dout(10) << " read got " << r << " / " << op.extent.length
+		 << " bytes from obj " << soid << dendl;
+      }
+      break;
 
-	  op.extent.length = op.extent.length - trim;
+    case CEPH_OSD_OP_CHECKSUM:
+      result = _do_read_op(ctx, osd_op);
+      dout(10) << " checksum " << op.checksum.offset << "~" << op.checksum.length
+	       << " type " << (int)op.checksum.type << " = " << result << dendl;
+      break;
 
-	  bufferlist keep;
+    case CEPH_OSD_OP_LIST_SNAPS:
+      {
+	if (!ssc) {
+	  result = -ENOENT;
+	  break;
+	}
+	const SnapSet& snapset = ssc->snapset;
+	obj_list_snap_response_t resp;
+	resp.seq = snapset.seq;
+	for (vector<snapid_t>::const_iterator q = snapset.clones.begin();
+	     q != snapset.clones.end();
+	     ++q) {
+	  clone_info ci;
+	  ci.cloneid = *q;
+
+	  hobject_t clone_oid(soid.oid, soid.get_key(), *q, soid.hash);
+	  ObjectContext *cobc = get_object_context(clone_oid, oi.oloc, false);
+	  if (!cobc) {
+	    osd->clog.error() << info.pgid << " " << soid << " clone " << *q
+			      << " in snapset but missing\n";
+	    result = -EIO;
+	    break;
+	  }
+	  // the clone's snaps are kept newest first
+	  ci.snaps.assign(cobc->obs.oi.snaps.rbegin(), cobc->obs.oi.snaps.rend());
+	  put_object_context(cobc);
+
+	  map<snapid_t, interval_set<uint64_t> >::const_iterator o =
+	    snapset.clone_overlap.find(*q);
+	  if (o != snapset.clone_overlap.end())
+	    for (interval_set<uint64_t>::const_iterator i = o->second.begin();
+		 i != o->second.end();
+		 ++i)
+	      ci.overlap.push_back(pair<uint64_t,uint64_t>(i.get_start(), i.get_len()));
+
+	  map<snapid_t, uint64_t>::const_iterator s = snapset.clone_size.find(*q);
+	  if (s != snapset.clone_size.end())
+	    ci.size = s->second;
+	  resp.clones.push_back(ci);
+	}
+	if (result < 0)
+	  break;
 
-	  // keep first part of osd_op.outdata; trim at truncation point
-	  dout(10) << " obj " << soid << " seq " << seq
-	           << ": trimming overlap " << from << "~" << trim << dendl;
-	  keep.substr_of(osd_op.outdata, 0, osd_op.outdata.length() - trim);
-          osd_op.outdata.claim(keep);
+	if (soid.snap == CEPH_NOSNAP && obs.exists) {
+	  clone_info ci;
+	  ci.cloneid = CEPH_NOSNAP;
+	  ci.size = oi.size;
+	  resp.clones.push_back(ci);
 	}
+	::encode(resp, osd_op.outdata);
+	ctx->delta_stats.num_rd++;
+	dout(10) << " list_snaps " << resp.clones.size() << " clones seq "
+		 << resp.seq << dendl;
       }
       break;
 
@@ -1745,7 +1879,12 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 
 	bufferlist outdata;
 	dout(10) << "call method " << cname << "." << mname << dendl;
+	utime_t start = ceph_clock_now(g_ceph_context);
+	uint64_t rd = ctx->bytes_read;
+	uint64_t wr = ctx->op_t.get_encoded_bytes();
 	result = method->exec((cls_method_context_t)&ctx, indata, outdata);
+	method->account(ceph_clock_now(g_ceph_context) - start, result,
+			ctx->bytes_read - rd, ctx->op_t.get_encoded_bytes() - wr);
 	dout(10) << "method called response length=" << outdata.length() << dendl;
 	op.extent.length = outdata.length();
 	osd_op.outdata.claim_append(outdata);
@@ -1754,50 +1893,17 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 
     case CEPH_OSD_OP_STAT:
       {
-	if (obs.exists) {
-	  ::encode(oi.size, osd_op.outdata);
-	  ::encode(oi.mtime, osd_op.outdata);
-	  dout(10) << "stat oi has " << oi.size << " " << oi.mtime << dendl;
-	} else {
-	  result = -ENOENT;
-	  dout(10) << "stat oi object does not exist" << dendl;
-	}
-
-	ctx->delta_stats.num_rd++;
-      }
-      break;
-
-    case CEPH_OSD_OP_GETXATTR:
-      {
-	string aname;
-	bp.copy(op.xattr.name_len, aname);
-	string name = "_" + aname;
-	int r = osd->store->getattr(coll, soid, name.c_str(), osd_op.outdata);
-	if (r >= 0) {
-	  op.xattr.value_len = r;
-	  result = 0;
-	} else
+	int r = _do_read_op(ctx, osd_op);
+	if (r < 0)
 	  result = r;
-	ctx->delta_stats.num_rd++;
+	dout(10) << "stat oi " << oi.size << " " << oi.mtime << " = " << r << dendl;
       }
       break;
 
-   case CEPH_OSD_OP_GETXATTRS:
-      {
-	map<string,bufferptr> attrset;
-        result = osd->store->getattrs(coll, soid, attrset, true);
-        map<string, bufferptr>::iterator iter;
-        map<string, bufferlist> newattrs;
-        for (iter = attrset.begin(); iter != attrset.end(); ++iter) {
-           bufferlist bl;
-           bl.append(iter->second);
-           newattrs[iter->first] = bl;
-        }
-        
-        bufferlist bl;
-        ::encode(newattrs, bl);
-        osd_op.outdata.claim_append(bl);
-      }
+    case CEPH_OSD_OP_GETXATTR:
+    case CEPH_OSD_OP_GETXATTRS:
+      result = _do_read_op(ctx, osd_op);
+      dout(10) << " " << ceph_osd_op_name(op.op) << " = " << result << dendl;
       break;
       
     case CEPH_OSD_OP_CMPXATTR:
@@ -2678,6 +2784,124 @@ int ReplicatedPG::_copy_up_tmap(OpContext *ctx)
   return 0;
 }
 
+// CHECKSUM reads at most this much at a time, however big the chunk
+static const uint64_t CHECKSUM_READ_MAX = 4 << 20;
+
+struct ChecksumCrc32c {
+  __u32 crc;
+  ChecksumCrc32c() : crc(-1) {}
+  void update(bufferlist& bl) {
+    crc = bl.crc32c(crc);
+  }
+  void final(bufferlist& out) {
+    ::encode(crc, out);
+    crc = -1;
+  }
+};
+
+template <typename D, int size>
+struct ChecksumCrypto {
+  D d;
+  void update(bufferlist& bl) {
+    for (list<bufferptr>::const_iterator p = bl.buffers().begin();
+	 p != bl.buffers().end();
+	 ++p)
+      d.Update((const byte*)p->c_str(), p->length());
+  }
+  void final(bufferlist& out) {
+    byte buf[size];
+    d.Final(buf);   // also restarts d
+    out.append((const char*)buf, size);
+  }
+};
+
+/*
+ * read off~end in pieces of up to CHECKSUM_READ_MAX, and digest each
+ * chunk out of those buffers, so small chunks don't mean small reads.
+ */
+template <typename D>
+static int checksum_range(ObjectStore *store, coll_t coll, const hobject_t& soid,
+			  uint64_t off, uint64_t end, uint64_t chunk,
+			  bufferlist& out)
+{
+  D d;
+  if (off == end) {
+    d.final(out);
+    return 0;
+  }
+  uint64_t left = chunk;   // of the current chunk
+  for (uint64_t pos = off; pos < end; ) {
+    bufferlist bl;
+    uint64_t len = MIN(end - pos, CHECKSUM_READ_MAX);
+    int r = store->read(coll, soid, pos, len, bl);
+    if (r < 0)
+      return r;
+    if (bl.length() < len)
+      bl.append_zero(len - bl.length());
+    for (uint64_t boff = 0; boff < len; ) {
+      uint64_t n = MIN(left, len - boff);
+      bufferlist piece;
+      piece.substr_of(bl, boff, n);
+      d.update(piece);
+      boff += n;
+      left -= n;
+      if (!left) {
+	d.final(out);
+	left = chunk;
+      }
+    }
+    pos += len;
+  }
+  if (left != chunk)
+    d.final(out);
+  return 0;
+}
+
+/*
+ * digest op.checksum.offset~length (0 == to the end) of the object, one
+ * digest per chunk_size bytes or one for the whole range.  the range is
+ * clipped to the object size and op.checksum.length set to what was
+ * covered.  this runs without the pg lock from do_unlocked_read, so it
+ * must not touch pg state (or dout).  offset and length come from the
+ * client, so compare them without adding them up.
+ */
+int ReplicatedPG::_checksum(const hobject_t& soid, uint64_t size, OSDOp& osd_op)
+{
+  ceph_osd_op& op = osd_op.op;
+  uint64_t end = size;
+  uint64_t off = MIN(op.checksum.offset, end);
+  if (op.checksum.length && op.checksum.length < end - off)
+    end = off + op.checksum.length;
+  uint64_t chunk = op.checksum.chunk_size;
+  if (!chunk || chunk > end - off)
+    chunk = MAX(end - off, 1);
+
+  int r;
+  switch (op.checksum.type) {
+  case CEPH_OSD_CHECKSUM_CRC32C:
+    r = checksum_range<ChecksumCrc32c>(osd->store, coll, soid, off, end, chunk,
+				       osd_op.outdata);
+    break;
+  case CEPH_OSD_CHECKSUM_SHA1:
+    r = checksum_range<ChecksumCrypto<ceph::crypto::SHA1,
+				      CEPH_CRYPTO_SHA1_DIGESTSIZE> >(
+      osd->store, coll, soid, off, end, chunk, osd_op.outdata);
+    break;
+  case CEPH_OSD_CHECKSUM_SHA256:
+    r = checksum_range<ChecksumCrypto<ceph::crypto::SHA256,
+				      CEPH_CRYPTO_SHA256_DIGESTSIZE> >(
+      osd->store, coll, soid, off, end, chunk, osd_op.outdata);
+    break;
+  default:
+    return -EINVAL;
+  }
+  if (r < 0)
+    return r;
+  op.checksum.offset = off;
+  op.checksum.length = end - off;
+  return 0;
+}
+
 inline int ReplicatedPG::_delete_head(OpContext *ctx)
 {
   SnapSet& snapset = ctx->new_snapset;
@@ -2947,6 +3171,21 @@ void ReplicatedPG::add_interval_usage(interval_set<uint64_t>& s, object_stat_sum
   }
 }
 
+typedef map<Connection*, list<Message*> > watch_outgoing_t;
+
+static void queue_watch_message(watch_outgoing_t& out, Connection *con, Message *m)
+{
+  list<Message*>& l = out[con];
+  if (l.empty())
+    con->get();
+  l.push_back(m);
+}
+
+/*
+ * notifies are queued per connection while we hold watch_lock and sent
+ * once it is dropped, so fanning out to many watchers doesn't hold
+ * every other watch op up behind the messenger.
+ */
 void ReplicatedPG::do_osd_op_effects(OpContext *ctx)
 {
   if (ctx->watch_connect || ctx->watch_disconnect ||
@@ -2959,6 +3198,7 @@ void ReplicatedPG::do_osd_op_effects(OpContext *ctx)
 
     dout(10) << "do_osd_op_effects applying watch/notify effects on session " << session << dendl;
 
+    watch_outgoing_t outgoing;
     osd->watch_lock.Lock();
     dump_watchers(obc);
     
@@ -3000,7 +3240,7 @@ void ReplicatedPG::do_osd_op_effects(OpContext *ctx)
 	  /* there is a pending notification for this watcher, we should resend it anyway
 	     even if we already sent it as it might not have received it */
 	  MWatchNotify *notify_msg = new MWatchNotify(w.cookie, oi.user_version.version, notif->id, WATCH_NOTIFY, notif->bl);
-	  osd->client_messenger->send_message(notify_msg, session->con);
+	  queue_watch_message(outgoing, session->con, notify_msg);
 	}
       }
     }
@@ -3041,7 +3281,7 @@ void ReplicatedPG::do_osd_op_effects(OpContext *ctx)
 	  s->add_notif(notif, name);
 
 	  MWatchNotify *notify_msg = new MWatchNotify(w.cookie, oi.user_version.version, notif->id, WATCH_NOTIFY, notif->bl);
-	  osd->client_messenger->send_message(notify_msg, s->con);
+	  queue_watch_message(outgoing, s->con, notify_msg);
 	} else {
 	  // unconnected
 	  entity_name_t name = i->first;
@@ -3076,6 +3316,12 @@ void ReplicatedPG::do_osd_op_effects(OpContext *ctx)
     }
 
     osd->watch_lock.Unlock();
+
+    for (watch_outgoing_t::iterator p = outgoing.begin(); p != outgoing.end(); ++p) {
+      for (list<Message*>::iterator q = p->second.begin(); q != p->second.end(); ++q)
+	osd->client_messenger->send_message(*q, p->first);
+      p->first->put();
+    }
     session->put();
   }
 }
@@ -3090,6 +3336,196 @@ coll_t ReplicatedPG::get_temp_coll(ObjectStore::Transaction *t)
   return temp_coll;
 }
 
+/*
+ * The plain reads do_osd_ops and do_unlocked_read share.  These may run
+ * without the pg lock, so they only look at ctx and the object store,
+ * and leave the logging to the caller.
+ */
+int ReplicatedPG::_do_read_op(OpContext *ctx, OSDOp& osd_op)
+{
+  ceph_osd_op& op = osd_op.op;
+  const ObjectState& obs = ctx->new_obs;
+  const object_info_t& oi = obs.oi;
+  const hobject_t& soid = oi.soid;
+  bufferlist::iterator bp = osd_op.indata.begin();
+  int result = 0;
+
+  switch (op.op) {
+  case CEPH_OSD_OP_READ:
+    {
+      bufferlist bl;
+      int r = osd->store->read(coll, soid, op.extent.offset, op.extent.length, bl);
+      osd_op.outdata.claim_append(bl);
+      if (r >= 0) 
+	op.extent.length = r;
+      else {
+	result = r;
+	op.extent.length = 0;
+      }
+      ctx->delta_stats.num_rd_kb += SHIFT_ROUND_UP(op.extent.length, 10);
+      ctx->delta_stats.num_rd++;
+
+      // are we beyond truncate_size?
+      if ( (oi.truncate_seq < op.extent.truncate_seq) &&
+	   (op.extent.offset + op.extent.length > op.extent.truncate_size) ) {
+	// truncated portion of the read
+	unsigned from = MAX(op.extent.offset, op.extent.truncate_size);  // also end of data
+	unsigned to = op.extent.offset + op.extent.length;
+	unsigned trim = to-from;
+
+	op.extent.length = op.extent.length - trim;
+
+	// keep first part of osd_op.outdata; trim at truncation point
+	bufferlist keep;
+	keep.substr_of(osd_op.outdata, 0, osd_op.outdata.length() - trim);
+	osd_op.outdata.claim(keep);
+      }
+    }
+    break;
+
+  case CEPH_OSD_OP_CHECKSUM:
+    result = _checksum(soid, oi.size, osd_op);
+    if (result >= 0) {
+      ctx->delta_stats.num_rd_kb += SHIFT_ROUND_UP(op.checksum.length, 10);
+      ctx->delta_stats.num_rd++;
+    }
+    break;
+
+  case CEPH_OSD_OP_STAT:
+    if (obs.exists) {
+      ::encode(oi.size, osd_op.outdata);
+      ::encode(oi.mtime, osd_op.outdata);
+    } else {
+      result = -ENOENT;
+    }
+    ctx->delta_stats.num_rd++;
+    break;
+
+  case CEPH_OSD_OP_GETXATTR:
+    {
+      string aname;
+      bp.copy(op.xattr.name_len, aname);
+      string name = "_" + aname;
+      int r = osd->store->getattr(coll, soid, name.c_str(), osd_op.outdata);
+      if (r >= 0) {
+	op.xattr.value_len = r;
+	result = 0;
+      } else
+	result = r;
+      ctx->delta_stats.num_rd++;
+    }
+    break;
+
+  case CEPH_OSD_OP_GETXATTRS:
+    {
+      map<string,bufferptr> attrset;
+      result = osd->store->getattrs(coll, soid, attrset, true);
+      map<string, bufferlist> newattrs;
+      for (map<string,bufferptr>::iterator i = attrset.begin(); i != attrset.end(); ++i)
+	newattrs[i->first].append(i->second);
+      ::encode(newattrs, osd_op.outdata);
+    }
+    break;
+
+  default:
+    assert(0 == "not a plain read");
+  }
+  return result;
+}
+
+/*
+ * Plain reads of a head object can run without the pg lock, so that ops
+ * on other objects in the pg can proceed while we wait on the disk.
+ * They read against the object state as of when the op started
+ * (ctx->new_obs) and do not touch the snapset, so only the ops
+ * _do_read_op handles qualify.
+ */
+bool ReplicatedPG::can_read_unlocked(OpContext *ctx)
+{
+  if (!g_conf->osd_op_unlocked_reads)
+    return false;
+  MOSDOp *m = (MOSDOp*)ctx->op->request;
+  if (m->may_write() || (m->get_flags() & CEPH_OSD_FLAG_RWORDERED))
+    return false;
+  if (!ctx->src_obc.empty() ||
+      !ctx->new_obs.exists ||
+      ctx->new_obs.oi.soid.snap != CEPH_NOSNAP)
+    return false;
+  for (vector<OSDOp>::iterator p = ctx->ops.begin(); p != ctx->ops.end(); ++p) {
+    switch (p->op.op) {
+    case CEPH_OSD_OP_READ:
+    case CEPH_OSD_OP_STAT:
+    case CEPH_OSD_OP_GETXATTR:
+    case CEPH_OSD_OP_GETXATTRS:
+    case CEPH_OSD_OP_CHECKSUM:
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Drops and retakes the pg lock.  Nothing between unlock() and lock()
+ * may look at pg state, including the dout prefix.
+ *
+ * Our caller's queue ref keeps the pg itself around.  While we are
+ * unlocked the obc is marked with unlocked_readers, so that an interval
+ * change cuts it loose from object_contexts instead of tripping over it
+ * (see context_registry_on_change).  If peering was reset or the pg
+ * started deleting in the meantime, the result is thrown away and the
+ * op requeued, and we return -EAGAIN.
+ */
+int ReplicatedPG::do_unlocked_read(OpContext *ctx)
+{
+  dout(10) << "do_unlocked_read " << ctx->new_obs.oi.soid << " " << ctx->ops << dendl;
+  ObjectContext *obc = ctx->obc;
+  int result = 0;
+  epoch_t reset_epoch = get_last_peering_reset();
+
+  obc->unlocked_readers++;
+  obc->ondisk_read_lock();
+  unlock();
+
+  for (vector<OSDOp>::iterator p = ctx->ops.begin(); p != ctx->ops.end(); ++p) {
+    OSDOp& osd_op = *p;
+    ceph_osd_op& op = osd_op.op;
+
+    // munge -1 truncate to 0 truncate, as do_osd_ops does
+    if (op.extent.truncate_seq == 1 && op.extent.truncate_size == (-1ULL)) {
+      op.extent.truncate_size = 0;
+      op.extent.truncate_seq = 0;
+    }
+
+    result = _do_read_op(ctx, osd_op);
+    ctx->bytes_read += osd_op.outdata.length();
+
+    if (result < 0 && (op.flags & CEPH_OSD_OP_FLAG_FAILOK))
+      result = 0;
+    if (result < 0)
+      break;
+  }
+
+  obc->ondisk_read_unlock();
+  lock();
+  obc->unlocked_readers--;
+
+  if (deleting || get_last_peering_reset() != reset_epoch) {
+    dout(10) << "do_unlocked_read " << ctx->new_obs.oi.soid
+	     << " pg changed while unlocked, requeueing" << dendl;
+    list<OpRequestRef> ls;
+    ls.push_back(ctx->op);
+    osd->requeue_ops(this, ls);
+    return -EAGAIN;
+  }
+
+  osd->logger->inc(l_osd_op_r_unlocked);
+  ctx->reply_version = ctx->new_obs.oi.user_version;
+  dout(10) << "do_unlocked_read " << ctx->new_obs.oi.soid << " = " << result << dendl;
+  return result;
+}
+
 int ReplicatedPG::prepare_transaction(OpContext *ctx)
 {
   assert(!ctx->ops.empty());
@@ -3318,9 +3754,9 @@ void ReplicatedPG::op_applied(RepGather *repop)
     repop->ctx->snapset_obc = 0;
   }
 
-  dout(10) << "op_applied mode was " << mode << dendl;
-  mode.write_applied();
-  dout(10) << "op_applied mode now " << mode << " (finish_write)" << dendl;
+  dout(10) << "op_applied mode was " << repop->obc->mode << dendl;
+  repop->obc->mode.write_applied();
+  dout(10) << "op_applied mode now " << repop->obc->mode << " (finish_write)" << dendl;
 
   put_object_context(repop->obc);
   put_object_contexts(repop->src_obc);
@@ -3337,6 +3773,10 @@ void ReplicatedPG::op_applied(RepGather *repop)
   if (!repop->aborted)
     eval_repop(repop);
 
+  // the trimmer waits for applied, which may come after commit
+  if (repop->queue_snap_trimmer && repop->done)
+    queue_snap_trim();
+
   repop->put();
   unlock();
 }
@@ -3399,9 +3839,9 @@ void ReplicatedPG::eval_repop(RepGather *repop)
 
   // apply?
   if (!repop->applied && !repop->applying &&
-      ((mode.is_delayed_mode() &&
+      ((repop->obc->mode.is_delayed_mode() &&
 	repop->waitfor_ack.size() == 1) ||  // all other replicas have acked
-       mode.is_rmw_mode()))
+       repop->obc->mode.is_rmw_mode()))
     apply_repop(repop);
   
   if (m) {
@@ -3562,9 +4002,9 @@ ReplicatedPG::RepGather *ReplicatedPG::new_repop(OpContext *ctx, ObjectContext *
 
   RepGather *repop = new RepGather(ctx, obc, rep_tid, info.last_complete);
 
-  dout(10) << "new_repop mode was " << mode << dendl;
-  mode.write_start();
-  dout(10) << "new_repop mode now " << mode << " (start_write)" << dendl;
+  dout(10) << "new_repop mode was " << obc->mode << dendl;
+  obc->mode.write_start();
+  dout(10) << "new_repop mode now " << obc->mode << " (start_write)" << dendl;
 
   repop->start = ceph_clock_now(g_ceph_context);
 
@@ -3720,7 +4160,7 @@ void ReplicatedPG::handle_watch_timeout(void *_obc,
 
   /* Currently, mode.try_write always returns true.  If this changes, we will
    * need to delay the repop accordingly */
-  assert(mode.try_write(nobody));
+  assert(obc->mode.try_write(nobody));
   RepGather *repop = new_repop(ctx, obc, rep_tid);
 
   ObjectStore::Transaction *t = &ctx->op_t;
@@ -3821,6 +4261,26 @@ ReplicatedPG::ObjectContext *ReplicatedPG::get_object_context(const hobject_t& s
 void ReplicatedPG::context_registry_on_change()
 {
   remove_watchers_and_notifies();
+
+  // reads running without the pg lock still hold their obc.  forget
+  // those contexts; the readers drop them when they retake the lock.
+  for (map<hobject_t, ObjectContext *>::iterator p = object_contexts.begin();
+       p != object_contexts.end(); ) {
+    if (p->second->unlocked_readers) {
+      dout(10) << "context_registry_on_change forgetting " << p->first
+	       << " with unlocked readers" << dendl;
+      SnapSetContext *ssc = p->second->ssc;
+      if (ssc && ssc->registered) {
+	snapset_contexts.erase(ssc->oid);
+	ssc->registered = false;
+      }
+      p->second->registered = false;
+      object_contexts.erase(p++);
+    } else {
+      ++p;
+    }
+  }
+
   if (object_contexts.size()) {
     for (map<hobject_t, ObjectContext *>::iterator p = object_contexts.begin();
 	 p != object_contexts.end();
@@ -3854,6 +4314,33 @@ int ReplicatedPG::find_object_context(const hobject_t& oid,
     return 0;
   }
 
+  // want the snapset?  that comes with the head if it exists, otherwise
+  // with the snapdir.
+  if (oid.snap == CEPH_SNAPDIR) {
+    ObjectContext *obc = get_object_context(head, oloc, false);
+    if (obc && !obc->obs.exists) {
+      put_object_context(obc);
+      obc = NULL;
+    }
+    if (!obc) {
+      hobject_t snapdir(oid.oid, oid.get_key(), CEPH_SNAPDIR, oid.hash);
+      obc = get_object_context(snapdir, oloc, false);
+      if (!obc)
+	return -ENOENT;
+    }
+    if (!obc->ssc) {
+      obc->ssc = get_snapset_context(oid.oid, oid.get_key(), oid.hash, false);
+      if (!obc->ssc) {
+	put_object_context(obc);
+	return -ENOENT;
+      }
+    }
+    dout(10) << "find_object_context " << oid << " @" << oid.snap
+	     << " -> " << obc->obs.oi.soid << " snapset " << obc->ssc->snapset << dendl;
+    *pobc = obc;
+    return 0;
+  }
+
   // we want a snap
   SnapSetContext *ssc = get_snapset_context(oid.oid, oid.get_key(), oid.hash, can_create);
   if (!ssc)
@@ -3933,11 +4420,14 @@ void ReplicatedPG::put_object_context(ObjectContext *obc)
   dout(10) << "put_object_context " << obc << " " << obc->obs.oi.soid << " "
 	   << obc->ref << " -> " << (obc->ref-1) << dendl;
 
-  if (mode.wake) {
-    osd->requeue_ops(this, mode.waiting);
-    for (list<Cond*>::iterator p = mode.waiting_cond.begin(); p != mode.waiting_cond.end(); p++)
+  if (obc->mode.wake) {
+    // drop the refs the waiters held
+    obc->ref -= obc->mode.waiting.size();
+    osd->requeue_ops(this, obc->mode.waiting);
+    for (list<Cond*>::iterator p = obc->mode.waiting_cond.begin(); p != obc->mode.waiting_cond.end(); p++)
       (*p)->Signal();
-    mode.wake = false;
+    obc->mode.waiting_cond.clear();
+    obc->mode.wake = false;
   }
 
   --obc->ref;
@@ -4605,10 +5095,126 @@ void ReplicatedPG::push_start(
   pi.recovery_progress.data_recovered_to = 0;
   pi.recovery_progress.data_complete = 0;
   pi.recovery_progress.omap_complete = 0;
+  pi.chunks_in_flight = 0;
+
+  if (batch_pushes &&
+      g_conf->osd_recovery_push_batch_max > 1 &&
+      obc->obs.oi.size <= g_conf->osd_recovery_max_chunk &&
+      osd->recovery_bytes_available() &&
+      peer_supports_push_batch(peer)) {
+    // small object; try to push it whole alongside others
+    PushOp pop;
+    ObjectRecoveryProgress new_progress;
+    if (build_push_op(pi.recovery_info, pi.recovery_progress,
+		      &new_progress, &pop) < 0)
+      return;
+    pi.recovery_progress = new_progress;
+    pi.chunks_in_flight++;
+    if (new_progress.data_complete) {
+      queue_push(peer, pop);
+    } else {
+      // more omap than fits in a chunk; push it the usual way
+      MOSDSubOp *subop = new_push_subop(pop);
+      osd->cluster_messenger->
+	send_message(subop, get_osdmap()->get_cluster_inst(peer));
+      continue_push(soid, peer);
+    }
+    return;
+  }
+
+  continue_push(soid, peer);
+}
+
+/*
+ * keep up to osd_recovery_max_push_chunks chunks of an object push in
+ * flight to a peer.  the replica applies them in order, so there is no
+ * need to wait for each ack before reading and sending the next chunk.
+ */
+void ReplicatedPG::continue_push(const hobject_t &soid, int peer)
+{
+  PushInfo &pi = pushing[soid][peer];
+  int window = MAX(1, g_conf->osd_recovery_max_push_chunks);
+  while (!pi.recovery_progress.data_complete &&
+	 pi.chunks_in_flight < window) {
+    if (!osd->recovery_bytes_available()) {
+      if (pi.chunks_in_flight == 0) {
+	// nothing will ack and wake us up; let the osd resume us later
+	dout(10) << "continue_push " << soid << " to osd." << peer
+		 << " waiting for recovery bandwidth" << dendl;
+	throttled_pushes.insert(make_pair(soid, peer));
+	osd->queue_for_recovery_bandwidth(this);
+      }
+      break;
+    }
+    ObjectRecoveryProgress new_progress;
+    if (send_push(peer, pi.recovery_info, pi.recovery_progress,
+		  &new_progress) < 0)
+      break;
+    pi.recovery_progress = new_progress;
+    pi.chunks_in_flight++;
+  }
+}
+
+void ReplicatedPG::resume_throttled_pushes()
+{
+  set<pair<hobject_t, int> > ls;
+  ls.swap(throttled_pushes);
+  for (set<pair<hobject_t, int> >::iterator p = ls.begin();
+       p != ls.end();
+       ++p) {
+    map<hobject_t, map<int, PushInfo> >::iterator i = pushing.find(p->first);
+    if (i == pushing.end() || !i->second.count(p->second))
+      continue;
+    dout(10) << "resume_throttled_pushes " << p->first
+	     << " to osd." << p->second << dendl;
+    continue_push(p->first, p->second);
+  }
+}
+
+bool ReplicatedPG::peer_supports_push_batch(int peer)
+{
+  Connection *con = osd->cluster_messenger->get_connection(
+    get_osdmap()->get_cluster_inst(peer));
+  bool r = con->has_feature(CEPH_FEATURE_OSD_PUSHBATCH);
+  con->put();
+  return r;
+}
+
+void ReplicatedPG::queue_push(int peer, const PushOp &pop)
+{
+  dout(15) << "queue_push " << pop.soid << " to osd." << peer << dendl;
+  vector<PushOp> &ls = pending_pushes[peer];
+  ls.push_back(pop);
 
-  ObjectRecoveryProgress new_progress;
-  send_push(peer, pi.recovery_info, pi.recovery_progress, &new_progress);
-  pi.recovery_progress = new_progress;
+  uint64_t &bytes = pending_push_bytes[peer];
+  bytes += ls.back().data.length();
+  if ((int)ls.size() >= g_conf->osd_recovery_push_batch_max ||
+      bytes >= g_conf->osd_recovery_max_chunk)
+    send_pending_pushes();
+}
+
+/*
+ * send queued whole-object pushes.  the first rides in the usual
+ * MOSDSubOp fields; the rest are appended to MOSDSubOp::pushes.  the
+ * replica acks each object individually.
+ */
+void ReplicatedPG::send_pending_pushes()
+{
+  for (map<int, vector<PushOp> >::iterator p = pending_pushes.begin();
+       p != pending_pushes.end();
+       ++p) {
+    if (p->second.empty())
+      continue;
+    MOSDSubOp *subop = new_push_subop(p->second[0]);
+    subop->pushes.assign(p->second.begin() + 1, p->second.end());
+    dout(10) << "send_pending_pushes " << p->second.size()
+	     << " objects to osd." << p->first << dendl;
+    osd->logger->inc(l_osd_push_batched, p->second.size() - 1);
+    osd->cluster_messenger->
+      send_message(subop, get_osdmap()->get_cluster_inst(p->first));
+  }
+  pending_pushes.clear();
+  pending_push_bytes.clear();
 }
 
 int ReplicatedPG::send_pull(int peer,
@@ -4881,32 +5487,55 @@ void ReplicatedPG::handle_pull_response(OpRequestRef op)
   }
 }
 
+void ReplicatedPG::submit_push_op(PushOp &pop, ObjectStore::Transaction *t)
+{
+  bool first = pop.before_progress.first;
+  bool complete = pop.after_progress.data_complete &&
+    pop.after_progress.omap_complete;
+  submit_push_data(pop.recovery_info,
+		   first,
+		   pop.data_included,
+		   pop.data,
+		   pop.omap_header,
+		   pop.attrset,
+		   pop.omap_entries,
+		   t);
+  if (complete)
+    submit_push_complete(pop.recovery_info,
+			 t);
+}
+
 void ReplicatedPG::handle_push(OpRequestRef op)
 {
   MOSDSubOp *m = (MOSDSubOp *)op->request;
   dout(10) << "handle_push "
 	   << m->recovery_info
 	   << m->recovery_progress
+	   << (m->pushes.empty() ? "" : " (batched)")
 	   << dendl;
-  bufferlist data;
-  m->claim_data(data);
-  bool first = m->current_progress.first;
-  bool complete = m->recovery_progress.data_complete &&
-    m->recovery_progress.omap_complete;
+
+  PushOp pop;
+  pop.soid = m->recovery_info.soid;
+  pop.version = m->version;
+  m->claim_data(pop.data);
+  pop.data_included = m->data_included;
+  pop.omap_header = m->omap_header;
+  pop.omap_entries = m->omap_entries;
+  pop.attrset = m->attrset;
+  pop.recovery_info = m->recovery_info;
+  pop.before_progress = m->current_progress;
+  pop.after_progress = m->recovery_progress;
+
   ObjectStore::Transaction *t = new ObjectStore::Transaction;
   Context *onreadable = new ObjectStore::C_DeleteTransaction(t);
   Context *onreadable_sync = 0;
-  submit_push_data(m->recovery_info,
-		   first,
-		   m->data_included,
-		   data,
-		   m->omap_header,
-		   m->attrset,
-		   m->omap_entries,
-		   t);
-  if (complete)
-    submit_push_complete(m->recovery_info,
-			 t);
+  submit_push_op(pop, t);
+  for (vector<PushOp>::iterator p = m->pushes.begin();
+       p != m->pushes.end();
+       ++p) {
+    dout(10) << "handle_push batched " << *p << dendl;
+    submit_push_op(*p, t);
+  }
 
   int r = osd->store->
     queue_transaction(&osr, t,
@@ -4918,51 +5547,50 @@ void ReplicatedPG::handle_push(OpRequestRef op)
 		      onreadable_sync);
   assert(r == 0);
 
+  assert(entity_name_t::TYPE_OSD == m->get_connection()->peer_type);
   MOSDSubOpReply *reply = new MOSDSubOpReply(
     m, 0, get_osdmap()->get_epoch(), CEPH_OSD_FLAG_ACK);
-  assert(entity_name_t::TYPE_OSD == m->get_connection()->peer_type);
   osd->cluster_messenger->send_message(reply, m->get_connection());
+
+  // ack each batched object so the primary can retire it
+  for (vector<PushOp>::iterator p = m->pushes.begin();
+       p != m->pushes.end();
+       ++p) {
+    reply = new MOSDSubOpReply(
+      m, 0, get_osdmap()->get_epoch(), CEPH_OSD_FLAG_ACK);
+    reply->poid = p->soid;
+    osd->cluster_messenger->send_message(reply, m->get_connection());
+  }
 }
 
-int ReplicatedPG::send_push(int peer,
-			    ObjectRecoveryInfo recovery_info,
-			    ObjectRecoveryProgress progress,
-			    ObjectRecoveryProgress *out_progress)
+int ReplicatedPG::build_push_op(const ObjectRecoveryInfo &recovery_info,
+				const ObjectRecoveryProgress &progress,
+				ObjectRecoveryProgress *out_progress,
+				PushOp *out_op)
 {
   ObjectRecoveryProgress new_progress = progress;
 
-  tid_t tid = osd->get_tid();
-  osd_reqid_t rid(osd->cluster_messenger->get_myname(), 0, tid);
-  MOSDSubOp *subop = new MOSDSubOp(rid, info.pgid, recovery_info.soid,
-				   false, 0, get_osdmap()->get_epoch(),
-				   tid, recovery_info.version);
-
-  dout(7) << "send_push_op " << recovery_info.soid
+  dout(7) << "build_push_op " << recovery_info.soid
 	  << " v " << recovery_info.version
 	  << " size " << recovery_info.size
-          << " to osd." << peer
 	  << " recovery_info: " << recovery_info
           << dendl;
 
-  subop->ops = vector<OSDOp>(1);
-  subop->ops[0].op.op = CEPH_OSD_OP_PUSH;
-
   if (progress.first) {
-    osd->store->omap_get_header(coll, recovery_info.soid, &subop->omap_header);
-    osd->store->getattrs(coll, recovery_info.soid, subop->attrset);
+    osd->store->omap_get_header(coll, recovery_info.soid, &out_op->omap_header);
+    osd->store->getattrs(coll, recovery_info.soid, out_op->attrset);
 
     // Debug
     bufferlist bv;
-    bv.push_back(subop->attrset[OI_ATTR]);
+    bv.push_back(out_op->attrset[OI_ATTR]);
     object_info_t oi(bv);
 
     if (oi.version != recovery_info.version) {
       osd->clog.error() << info.pgid << " push "
 			<< recovery_info.soid << " v "
-			<< recovery_info.version << " to osd." << peer
+			<< recovery_info.version
 			<< " failed because local copy is "
 			<< oi.version << "\n";
-      subop->put();
       return -1;
     }
 
@@ -4979,7 +5607,7 @@ int ReplicatedPG::send_push(int peer,
 	 iter->next()) {
       if (available < (iter->key().size() + iter->value().length()))
 	break;
-      subop->omap_entries.insert(make_pair(iter->key(), iter->value()));
+      out_op->omap_entries.insert(make_pair(iter->key(), iter->value()));
       available -= (iter->key().size() + iter->value().length());
     }
     if (!iter->valid())
@@ -4988,12 +5616,12 @@ int ReplicatedPG::send_push(int peer,
       new_progress.omap_recovered_to = iter->key();
   }
 
-  subop->data_included.span_of(recovery_info.copy_subset,
-			       progress.data_recovered_to,
-			       available);
+  out_op->data_included.span_of(recovery_info.copy_subset,
+				progress.data_recovered_to,
+				available);
 
-  for (interval_set<uint64_t>::iterator p = subop->data_included.begin();
-       p != subop->data_included.end();
+  for (interval_set<uint64_t>::iterator p = out_op->data_included.begin();
+       p != out_op->data_included.end();
        ++p) {
     bufferlist bit;
     osd->store->read(coll, recovery_info.soid,
@@ -5005,29 +5633,70 @@ int ReplicatedPG::send_push(int peer,
       p.set_len(bit.length());
       new_progress.data_complete = true;
     }
-    subop->ops[0].indata.claim_append(bit);
+    out_op->data.claim_append(bit);
   }
 
-  if (!subop->data_included.empty())
-    new_progress.data_recovered_to = subop->data_included.range_end();
+  if (!out_op->data_included.empty())
+    new_progress.data_recovered_to = out_op->data_included.range_end();
 
   if (new_progress.is_complete(recovery_info))
     new_progress.data_complete = true;
 
   osd->logger->inc(l_osd_push);
-  osd->logger->inc(l_osd_push_outb, subop->ops[0].indata.length());
-  
-  // send
-  subop->recovery_info = recovery_info;
-  subop->recovery_progress = new_progress;
-  subop->current_progress = progress;
-  osd->cluster_messenger->
-    send_message(subop, get_osdmap()->get_cluster_inst(peer));
+  osd->logger->inc(l_osd_push_outb, out_op->data.length());
+  osd->take_recovery_bytes(out_op->data.length());
+
+  out_op->soid = recovery_info.soid;
+  out_op->version = recovery_info.version;
+  out_op->recovery_info = recovery_info;
+  out_op->after_progress = new_progress;
+  out_op->before_progress = progress;
+
   if (out_progress)
     *out_progress = new_progress;
   return 0;
 }
 
+MOSDSubOp *ReplicatedPG::new_push_subop(PushOp &pop)
+{
+  tid_t tid = osd->get_tid();
+  osd_reqid_t rid(osd->cluster_messenger->get_myname(), 0, tid);
+  MOSDSubOp *subop = new MOSDSubOp(rid, info.pgid, pop.soid,
+				   false, 0, get_osdmap()->get_epoch(),
+				   tid, pop.version);
+  subop->ops = vector<OSDOp>(1);
+  subop->ops[0].op.op = CEPH_OSD_OP_PUSH;
+  subop->ops[0].indata.claim(pop.data);
+  subop->data_included.swap(pop.data_included);
+  subop->omap_header.claim(pop.omap_header);
+  subop->omap_entries.swap(pop.omap_entries);
+  subop->attrset.swap(pop.attrset);
+  subop->recovery_info = pop.recovery_info;
+  subop->recovery_progress = pop.after_progress;
+  subop->current_progress = pop.before_progress;
+  return subop;
+}
+
+int ReplicatedPG::send_push(int peer,
+			    ObjectRecoveryInfo recovery_info,
+			    ObjectRecoveryProgress progress,
+			    ObjectRecoveryProgress *out_progress)
+{
+  dout(7) << "send_push_op " << recovery_info.soid
+	  << " v " << recovery_info.version
+	  << " to osd." << peer << dendl;
+
+  PushOp pop;
+  int r = build_push_op(recovery_info, progress, out_progress, &pop);
+  if (r < 0)
+    return r;
+
+  MOSDSubOp *subop = new_push_subop(pop);
+  osd->cluster_messenger->
+    send_message(subop, get_osdmap()->get_cluster_inst(peer));
+  return 0;
+}
+
 void ReplicatedPG::send_push_op_blank(const hobject_t& soid, int peer)
 {
   // send a blank push back to the primary
@@ -5062,15 +5731,17 @@ void ReplicatedPG::sub_op_push_reply(OpRequestRef op)
 	     << dendl;
   } else {
     PushInfo *pi = &pushing[soid][peer];
+    if (pi->chunks_in_flight > 0)
+      pi->chunks_in_flight--;
 
     if (!pi->recovery_progress.data_complete) {
       dout(10) << " pushing more from, "
 	       << pi->recovery_progress.data_recovered_to
 	       << " of " << pi->recovery_info.copy_subset << dendl;
-      ObjectRecoveryProgress new_progress;
-      send_push(
-	peer, pi->recovery_info, pi->recovery_progress, &new_progress);
-      pi->recovery_progress = new_progress;
+      continue_push(soid, peer);
+    } else if (pi->chunks_in_flight > 0) {
+      dout(10) << " pushed all of " << soid << ", waiting for "
+	       << pi->chunks_in_flight << " more acks" << dendl;
     } else {
       // done!
       if (peer == backfill_target && backfills_in_flight.count(soid))
@@ -5571,6 +6242,8 @@ void ReplicatedPG::on_activate()
       backfill_pos = peer_info[acting[i]].last_backfill;
       dout(10) << " chose backfill target osd." << backfill_target
 	       << " from " << backfill_pos << dendl;
+      backfill_stats = backfill_stat_t();
+      backfill_stats.start = ceph_clock_now(g_ceph_context);
     }
   }
 }
@@ -5606,6 +6279,9 @@ void ReplicatedPG::on_change()
 
   // clear pushing/pulling maps
   pushing.clear();
+  throttled_pushes.clear();
+  pending_pushes.clear();
+  pending_push_bytes.clear();
   pulling.clear();
   pull_from_peer.clear();
 
@@ -5636,10 +6312,14 @@ void ReplicatedPG::_clear_recovery_state()
   recovering_oids.clear();
 #endif
   backfill_pos = hobject_t();
+  peer_backfill_next.clear();
+  peer_backfill_next_valid = false;
+  peer_backfill_scanning = false;
   backfills_in_flight.clear();
   pending_backfill_updates.clear();
   pulling.clear();
   pushing.clear();
+  throttled_pushes.clear();
   pull_from_peer.clear();
 }
 
@@ -5719,6 +6399,9 @@ int ReplicatedPG::start_recovery_ops(int max, RecoveryCtx *prctx)
     info.last_complete = info.last_update;
   }
 
+  // small whole-object pushes started below are sent in batches
+  batch_pushes = true;
+
   if (num_missing == num_unfound) {
     // All of the missing objects we have are unfound.
     // Recover the replicas.
@@ -5738,6 +6421,9 @@ int ReplicatedPG::start_recovery_ops(int max, RecoveryCtx *prctx)
     started += recover_backfill(max - started);
   }
 
+  batch_pushes = false;
+  send_pending_pushes();
+
   dout(10) << " started " << started << dendl;
   osd->logger->inc(l_osd_rop, started);
 
@@ -6044,6 +6730,9 @@ int ReplicatedPG::recover_backfill(int max)
   if (pbi.begin < pinfo.last_backfill) {
     pbi.reset(pinfo.last_backfill);
     backfill_info.reset(pinfo.last_backfill);
+    peer_backfill_next.clear();
+    peer_backfill_next_valid = false;
+    peer_backfill_scanning = false;
   }
 
   dout(10) << " peer osd." << backfill_target
@@ -6087,11 +6776,24 @@ int ReplicatedPG::recover_backfill(int max)
 
     if (pbi.begin <= backfill_info.begin &&
 	!pbi.extends_to_end() && pbi.empty()) {
-      dout(10) << " scanning peer osd." << backfill_target << " from " << pbi.end << dendl;
-      epoch_t e = get_osdmap()->get_epoch();
-      MOSDPGScan *m = new MOSDPGScan(MOSDPGScan::OP_SCAN_GET_DIGEST, e, e, info.pgid,
-				     pbi.end, hobject_t());
-      osd->cluster_messenger->send_message(m, get_osdmap()->get_cluster_inst(backfill_target));
+      if (peer_backfill_next_valid && peer_backfill_next.begin == pbi.end) {
+	dout(10) << " using prefetched peer interval " << peer_backfill_next.begin
+		 << "-" << peer_backfill_next.end << dendl;
+	pbi = peer_backfill_next;
+	pbi.trim();
+	peer_backfill_next.clear();
+	peer_backfill_next_valid = false;
+	if (!pbi.extends_to_end())
+	  send_backfill_scan(pbi.end);
+	continue;
+      }
+      peer_backfill_next.clear();
+      peer_backfill_next_valid = false;
+      if (!peer_backfill_scanning || peer_backfill_scan_begin != pbi.end)
+	send_backfill_scan(pbi.end);
+      dout(10) << " waiting on scan of peer osd." << backfill_target
+	       << " from " << pbi.end << dendl;
+      backfill_stats.scan_waits++;
       waiting_on_backfill = true;
       start_recovery_op(pbi.end);
       ops++;
@@ -6106,6 +6808,7 @@ int ReplicatedPG::recover_backfill(int max)
     if (pbi.begin < backfill_info.begin) {
       dout(20) << " removing peer " << pbi.begin << dendl;
       to_remove[pbi.begin] = pbi.objects.begin()->second;
+      backfill_stats.removes++;
       // Object was degraded, but won't be recovered
       if (waiting_for_degraded_object.count(pbi.begin)) {
 	osd->requeue_ops(
@@ -6225,12 +6928,65 @@ void ReplicatedPG::push_backfill_object(hobject_t oid, eversion_t v, eversion_t
 
   start_recovery_op(oid);
   ObjectContext *obc = get_object_context(oid, OLOC_BLANK, false);
+  backfill_stats.objects++;
+  backfill_stats.bytes += obc->obs.oi.size;
   obc->ondisk_read_lock();
   push_to_replica(obc, oid, peer);
   obc->ondisk_read_unlock();
   put_object_context(obc);
 }
 
+/*
+ * Size peer intervals to about osd_backfill_scan_bytes of data, going by
+ * the pg's average object size: many small objects get long intervals
+ * so round trips are amortized, big ones short so the interval stays
+ * current.
+ */
+unsigned ReplicatedPG::get_backfill_scan_max()
+{
+  unsigned min = g_conf->osd_backfill_scan_min;
+  unsigned max = MAX(min, (unsigned)g_conf->osd_backfill_scan_max);
+  const object_stat_sum_t& sum = info.stats.stats.sum;
+  if (g_conf->osd_backfill_scan_bytes == 0 ||
+      sum.num_objects <= 0 || sum.num_bytes <= 0)
+    return max;
+  uint64_t avg = MAX(1, sum.num_bytes / sum.num_objects);
+  uint64_t want = g_conf->osd_backfill_scan_bytes / avg;
+  if (want < min)
+    return min;
+  if (want > max)
+    return max;
+  return want;
+}
+
+void ReplicatedPG::send_backfill_scan(const hobject_t& begin)
+{
+  unsigned max = get_backfill_scan_max();
+  dout(10) << "send_backfill_scan osd." << backfill_target << " from " << begin
+	   << " max " << max << dendl;
+  epoch_t e = get_osdmap()->get_epoch();
+  MOSDPGScan *m = new MOSDPGScan(MOSDPGScan::OP_SCAN_GET_DIGEST, e, e, info.pgid,
+				 begin, hobject_t(), max);
+  osd->cluster_messenger->send_message(m, get_osdmap()->get_cluster_inst(backfill_target));
+  peer_backfill_scanning = true;
+  peer_backfill_scan_begin = begin;
+  backfill_stats.scans++;
+}
+
+void ReplicatedPG::backfill_stat_t::dump(Formatter *f, utime_t now) const
+{
+  double elapsed = start == utime_t() ? 0 : (double)(now - start);
+  f->dump_stream("start") << start;
+  f->dump_float("elapsed", elapsed);
+  f->dump_unsigned("objects", objects);
+  f->dump_unsigned("bytes", bytes);
+  f->dump_unsigned("removes", removes);
+  f->dump_unsigned("scans", scans);
+  f->dump_unsigned("scan_waits", scan_waits);
+  f->dump_float("objects_per_sec", elapsed > 0 ? (double)objects / elapsed : 0);
+  f->dump_float("bytes_per_sec", elapsed > 0 ? (double)bytes / elapsed : 0);
+}
+
 void ReplicatedPG::scan_range(hobject_t begin, int min, int max, BackfillInterval *bi)
 {
   assert(is_locked());
@@ -6546,7 +7302,8 @@ boost::statechart::result ReplicatedPG::NotTrimming::react(const SnapTrim&)
   coll_t &col_to_trim = context<SnapTrimmer>().col_to_trim;
   if (!pg->get_obs_to_trim(snap_to_trim,
 			   col_to_trim,
-			   obs_to_trim)) {
+			   obs_to_trim,
+			   &context<SnapTrimmer>().next_to_list)) {
     // Nothing to trim
     dout(10) << "NotTrimming: nothing to trim" << dendl;
     return discard_event();
@@ -6639,37 +7396,74 @@ boost::statechart::result ReplicatedPG::TrimmingObjects::react(const SnapTrim&)
   ReplicatedPG *pg = context< SnapTrimmer >().pg;
   vector<hobject_t> &obs_to_trim = context<SnapTrimmer>().obs_to_trim;
   snapid_t &snap_to_trim = context<SnapTrimmer>().snap_to_trim;
+  coll_t &col_to_trim = context<SnapTrimmer>().col_to_trim;
+  hobject_t &next_to_list = context<SnapTrimmer>().next_to_list;
   set<RepGather *> &repops = context<SnapTrimmer>().repops;
 
+  // on to the next page of the collection
+  if (position == obs_to_trim.end() && !next_to_list.is_max()) {
+    pg->list_obs_to_trim(col_to_trim, next_to_list, obs_to_trim, &next_to_list);
+    position = obs_to_trim.begin();
+  }
+
   // Done, 
   if (position == obs_to_trim.end()) {
     post_event(SnapTrim());
     return transit< WaitingOnReplicas >();
   }
 
-  dout(10) << "TrimmingObjects react trimming " << *position << dendl;
-  RepGather *repop = pg->trim_object(*position, snap_to_trim);
+  // forget trims that have been applied everywhere
+  for (set<RepGather *>::iterator i = repops.begin(); i != repops.end(); ) {
+    if ((*i)->applied && (*i)->waitfor_ack.empty()) {
+      (*i)->put();
+      repops.erase(i++);
+    } else {
+      ++i;
+    }
+  }
 
-  if (repop) {
-    repop->queue_snap_trimmer = true;
-    eversion_t old_last_update = pg->log.head;
-    bool old_exists = repop->obc->obs.exists;
-    uint64_t old_size = repop->obc->obs.oi.size;
-    eversion_t old_version = repop->obc->obs.oi.version;
-    
-    pg->append_log(repop->ctx->log, eversion_t(), repop->ctx->local_t);
-    pg->issue_repop(repop, repop->ctx->mtime, old_last_update, old_exists, old_size, old_version);
-    pg->eval_repop(repop);
-    
-    repops.insert(repop);
-    ++position;
-  } else {
-    // object has already been trimmed, this is an extra
-    coll_t col_to_trim(pg->info.pgid, snap_to_trim);
-    ObjectStore::Transaction *t = new ObjectStore::Transaction;
-    t->collection_remove(col_to_trim, *position);
-    int r = pg->osd->store->queue_transaction(NULL, t, new ObjectStore::C_DeleteTransaction(t));
-    assert(r == 0);
+  // keep up to osd_snap_trim_batch trims in flight; each one kicks us
+  // again when it completes, and the osd requeues us if we are over
+  // budget.
+  unsigned max = MAX(1, g_conf->osd_snap_trim_batch);
+  if (repops.size() >= max) {
+    dout(10) << "TrimmingObjects " << repops.size() << " trims in flight" << dendl;
+    context<SnapTrimmer>().requeue = false;
+    return discard_event();
+  }
+  unsigned want = MIN(max - repops.size(),
+		      (unsigned)(obs_to_trim.end() - position));
+  unsigned n = pg->osd->reserve_snap_trims(pg, want);
+  if (!n) {
+    dout(10) << "TrimmingObjects out of budget" << dendl;
+    context<SnapTrimmer>().requeue = false;
+    return discard_event();
+  }
+  context<SnapTrimmer>().requeue = true;
+
+  for (; n > 0; n--, ++position) {
+    dout(10) << "TrimmingObjects react trimming " << *position << dendl;
+    RepGather *repop = pg->trim_object(*position, snap_to_trim);
+
+    if (repop) {
+      repop->queue_snap_trimmer = true;
+      eversion_t old_last_update = pg->log.head;
+      bool old_exists = repop->obc->obs.exists;
+      uint64_t old_size = repop->obc->obs.oi.size;
+      eversion_t old_version = repop->obc->obs.oi.version;
+
+      pg->append_log(repop->ctx->log, eversion_t(), repop->ctx->local_t);
+      pg->issue_repop(repop, repop->ctx->mtime, old_last_update, old_exists, old_size, old_version);
+      pg->eval_repop(repop);
+
+      repops.insert(repop);
+    } else {
+      // object has already been trimmed, this is an extra
+      ObjectStore::Transaction *t = new ObjectStore::Transaction;
+      t->collection_remove(col_to_trim, *position);
+      int r = pg->osd->store->queue_transaction(NULL, t, new ObjectStore::C_DeleteTransaction(t));
+      assert(r == 0);
+    }
   }
   return discard_event();
 }
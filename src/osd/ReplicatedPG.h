@@ -273,6 +273,11 @@ public:
   public:
     Cond cond;
     int unstable_writes, readers, writers_waiting, readers_waiting;
+    int unlocked_readers;   // do_unlocked_read()s in flight; under the pg lock
+
+    // read/write ordering for ops on this object.  ops waiting here
+    // each hold a ref on us until they are requeued.
+    AccessMode mode;
 
     // set if writes for this object are blocked on another objects recovery
     ObjectContext *blocked_by;      // object blocking our writes
@@ -287,7 +292,7 @@ public:
       : ref(0), registered(false), obs(oi_, exists_), ssc(ssc_),
 	lock("ReplicatedPG::ObjectContext::lock"),
 	unstable_writes(0), readers(0), writers_waiting(0), readers_waiting(0),
-	blocked_by(0) {}
+	unlocked_readers(0), blocked_by(0) {}
     
     void get() { ++ref; }
 
@@ -465,8 +470,6 @@ public:
 
 protected:
 
-  AccessMode mode;
-
   // replica ops
   // [primary|tail]
   xlist<RepGather*> repop_queue;
@@ -551,9 +554,20 @@ protected:
   struct PushInfo {
     ObjectRecoveryProgress recovery_progress;
     ObjectRecoveryInfo recovery_info;
+    int chunks_in_flight;  ///< chunks sent but not yet acked
+
+    PushInfo() : chunks_in_flight(0) {}
   };
   map<hobject_t, map<int, PushInfo> > pushing;
 
+  /// pushes with nothing in flight, waiting on osd recovery bandwidth
+  set<pair<hobject_t, int> > throttled_pushes;
+
+  /// whole-object pushes queued for batching, by peer
+  bool batch_pushes;
+  map<int, vector<PushOp> > pending_pushes;
+  map<int, uint64_t> pending_push_bytes;
+
   // pull
   struct PullInfo {
     ObjectRecoveryProgress recovery_progress;
@@ -573,13 +587,24 @@ protected:
 			       bufferlist *data_usable);
   void handle_pull_response(OpRequestRef op);
   void handle_push(OpRequestRef op);
+  int build_push_op(const ObjectRecoveryInfo &recovery_info,
+		    const ObjectRecoveryProgress &progress,
+		    ObjectRecoveryProgress *out_progress,
+		    PushOp *out_op);
+  MOSDSubOp *new_push_subop(PushOp &pop);
   int send_push(int peer,
 		ObjectRecoveryInfo recovery_info,
 		ObjectRecoveryProgress progress,
 		ObjectRecoveryProgress *out_progress = 0);
+  bool peer_supports_push_batch(int peer);
+  void queue_push(int peer, const PushOp &pop);
+  void send_pending_pushes();
+  void continue_push(const hobject_t &soid, int peer);
+  void resume_throttled_pushes();
   int send_pull(int peer,
 		ObjectRecoveryInfo recovery_info,
 		ObjectRecoveryProgress progress);
+  void submit_push_op(PushOp &pop, ObjectStore::Transaction *t);
   void submit_push_data(const ObjectRecoveryInfo &recovery_info,
 			bool first,
 			const interval_set<uint64_t> &intervals_included,
@@ -611,6 +636,29 @@ protected:
   /// leading edge of backfill
   hobject_t backfill_pos;
 
+  /*
+   * The next interval on the backfill target is requested as soon as
+   * the current one arrives, so the scan round trip overlaps with
+   * pushing the current interval.
+   */
+  BackfillInterval peer_backfill_next;
+  bool peer_backfill_next_valid;
+  bool peer_backfill_scanning;         ///< a scan of the target is outstanding
+  hobject_t peer_backfill_scan_begin;  ///< ...starting here
+
+  struct backfill_stat_t {
+    utime_t start;
+    uint64_t objects, bytes;  ///< pushed
+    uint64_t removes;
+    uint64_t scans;           ///< peer intervals requested
+    uint64_t scan_waits;      ///< times we stalled waiting for one
+    backfill_stat_t() : objects(0), bytes(0), removes(0), scans(0), scan_waits(0) {}
+    void dump(Formatter *f, utime_t now) const;
+  } backfill_stats;
+
+  unsigned get_backfill_scan_max();
+  void send_backfill_scan(const hobject_t& begin);
+
   // Reverse mapping from osd peer to objects beging pulled from that peer
   map<int, set<hobject_t> > pull_from_peer;
 
@@ -654,6 +702,8 @@ protected:
   void add_interval_usage(interval_set<uint64_t>& s, object_stat_sum_t& st);  
 
   int prepare_transaction(OpContext *ctx);
+  bool can_read_unlocked(OpContext *ctx);
+  int do_unlocked_read(OpContext *ctx);
   
   // pg on-disk content
   void remove_object_with_snap_hardlinks(ObjectStore::Transaction& t, const hobject_t& soid);
@@ -802,7 +852,11 @@ public:
   void do_backfill(OpRequestRef op);
   bool get_obs_to_trim(snapid_t &snap_to_trim,
 		       coll_t &col_to_trim,
-		       vector<hobject_t> &obs_to_trim);
+		       vector<hobject_t> &obs_to_trim,
+		       hobject_t *next);
+  void list_obs_to_trim(coll_t col_to_trim, hobject_t start,
+			vector<hobject_t> &obs_to_trim,
+			hobject_t *next);
   RepGather *trim_object(const hobject_t &coid, const snapid_t &sn);
   bool snap_trimmer();
   int do_osd_ops(OpContext *ctx, vector<OSDOp>& ops);
@@ -821,7 +875,8 @@ private:
   struct SnapTrimmer : public boost::statechart::state_machine< SnapTrimmer, NotTrimming > {
     ReplicatedPG *pg;
     set<RepGather *> repops;
-    vector<hobject_t> obs_to_trim;
+    vector<hobject_t> obs_to_trim;   ///< current page of col_to_trim
+    hobject_t next_to_list;          ///< where the next page starts
     snapid_t snap_to_trim;
     coll_t col_to_trim;
     bool need_share_pg_info;
@@ -877,6 +932,8 @@ private:
   int _get_tmap(OpContext *ctx, map<string, bufferlist> *out,
 		bufferlist *header);
   int _copy_up_tmap(OpContext *ctx);
+  int _checksum(const hobject_t& soid, uint64_t size, OSDOp& osd_op);
+  int _do_read_op(OpContext *ctx, OSDOp& osd_op);
   int _delete_head(OpContext *ctx);
   int _rollback_to(OpContext *ctx, ceph_osd_op& op);
 public:
@@ -891,6 +948,8 @@ public:
   bool is_degraded_object(const hobject_t& oid);
   void wait_for_degraded_object(const hobject_t& oid, OpRequestRef op);
 
+  bool replica_can_read(const hobject_t& head);
+
   void mark_all_unfound_lost(int what);
   eversion_t pick_newest_available(const hobject_t& oid);
   ObjectContext *mark_object_lost(ObjectStore::Transaction *t,
@@ -957,6 +957,7 @@ void pg_stat_t::dump(Formatter *f) const
   f->dump_stream("last_scrub_stamp") << last_scrub_stamp;
   f->dump_unsigned("log_size", log_size);
   f->dump_unsigned("ondisk_log_size", ondisk_log_size);
+  f->dump_int("snaptrimq_len", snaptrimq_len);
   stats.dump(f);
   f->open_array_section("up");
   for (vector<int>::const_iterator p = up.begin(); p != up.end(); ++p)
@@ -970,7 +971,7 @@ void pg_stat_t::dump(Formatter *f) const
 
 void pg_stat_t::encode(bufferlist &bl) const
 {
-  ENCODE_START(9, 8, bl);
+  ENCODE_START(10, 8, bl);
   ::encode(version, bl);
   ::encode(reported, bl);
   ::encode(state, bl);
@@ -993,12 +994,13 @@ void pg_stat_t::encode(bufferlist &bl) const
   ::encode(last_clean, bl);
   ::encode(last_unstale, bl);
   ::encode(mapping_epoch, bl);
+  ::encode(snaptrimq_len, bl);
   ENCODE_FINISH(bl);
 }
 
 void pg_stat_t::decode(bufferlist::iterator &bl)
 {
-  DECODE_START_LEGACY_COMPAT_LEN(9, 8, 8, bl);
+  DECODE_START_LEGACY_COMPAT_LEN(10, 8, 8, bl);
   ::decode(version, bl);
   ::decode(reported, bl);
   ::decode(state, bl);
@@ -1057,6 +1059,10 @@ void pg_stat_t::decode(bufferlist::iterator &bl)
       ::decode(last_unstale, bl);
       ::decode(mapping_epoch, bl);
     }
+    if (struct_v >= 10)
+      ::decode(snaptrimq_len, bl);
+    else
+      snaptrimq_len = 0;
   }
   DECODE_FINISH(bl);
 }
@@ -1088,6 +1094,7 @@ void pg_stat_t::generate_test_instances(list<pg_stat_t*>& o)
   a.stats = *l.back();
   a.log_size = 99;
   a.ondisk_log_size = 88;
+  a.snaptrimq_len = 77;
   a.up.push_back(123);
   a.acting.push_back(456);
   o.push_back(new pg_stat_t(a));
@@ -1101,24 +1108,30 @@ void pool_stat_t::dump(Formatter *f) const
   stats.dump(f);
   f->dump_unsigned("log_size", log_size);
   f->dump_unsigned("ondisk_log_size", ondisk_log_size);
+  f->dump_int("snaptrimq_len", snaptrimq_len);
 }
 
 void pool_stat_t::encode(bufferlist &bl) const
 {
-  ENCODE_START(5, 5, bl);
+  ENCODE_START(6, 5, bl);
   ::encode(stats, bl);
   ::encode(log_size, bl);
   ::encode(ondisk_log_size, bl);
+  ::encode(snaptrimq_len, bl);
   ENCODE_FINISH(bl);
 }
 
 void pool_stat_t::decode(bufferlist::iterator &bl)
 {
-  DECODE_START_LEGACY_COMPAT_LEN(5, 5, 5, bl);
+  DECODE_START_LEGACY_COMPAT_LEN(6, 5, 5, bl);
   if (struct_v >= 4) {
     ::decode(stats, bl);
     ::decode(log_size, bl);
     ::decode(ondisk_log_size, bl);
+    if (struct_v >= 6)
+      ::decode(snaptrimq_len, bl);
+    else
+      snaptrimq_len = 0;
   } else {
     ::decode(stats.sum.num_bytes, bl);
     uint64_t num_kb;
@@ -1153,6 +1166,7 @@ void pool_stat_t::generate_test_instances(list<pool_stat_t*>& o)
   a.stats = *l.back();
   a.log_size = 123;
   a.ondisk_log_size = 456;
+  a.snaptrimq_len = 789;
   o.push_back(new pool_stat_t(a));
 }
 
@@ -2019,6 +2033,112 @@ ostream& operator<<(ostream& out, const SnapSet& cs)
 	     << (cs.head_exists ? "+head":"");
 }
 
+// -- clone_info --
+
+void clone_info::encode(bufferlist& bl) const
+{
+  ENCODE_START(1, 1, bl);
+  ::encode(cloneid, bl);
+  ::encode(snaps, bl);
+  ::encode(overlap, bl);
+  ::encode(size, bl);
+  ENCODE_FINISH(bl);
+}
+
+void clone_info::decode(bufferlist::iterator& bl)
+{
+  DECODE_START(1, bl);
+  ::decode(cloneid, bl);
+  ::decode(snaps, bl);
+  ::decode(overlap, bl);
+  ::decode(size, bl);
+  DECODE_FINISH(bl);
+}
+
+void clone_info::dump(Formatter *f) const
+{
+  if (cloneid == CEPH_NOSNAP)
+    f->dump_string("cloneid", "HEAD");
+  else
+    f->dump_unsigned("cloneid", cloneid.val);
+  f->open_array_section("snapshots");
+  for (vector<snapid_t>::const_iterator p = snaps.begin(); p != snaps.end(); ++p)
+    f->dump_unsigned("snap", *p);
+  f->close_section();
+  f->open_array_section("overlaps");
+  for (vector<pair<uint64_t, uint64_t> >::const_iterator p = overlap.begin();
+       p != overlap.end(); ++p) {
+    f->open_object_section("overlap");
+    f->dump_unsigned("offset", p->first);
+    f->dump_unsigned("length", p->second);
+    f->close_section();
+  }
+  f->close_section();
+  f->dump_unsigned("size", size);
+}
+
+void clone_info::generate_test_instances(list<clone_info*>& o)
+{
+  o.push_back(new clone_info);
+  o.push_back(new clone_info);
+  o.back()->cloneid = 1;
+  o.back()->snaps.push_back(1);
+  o.back()->overlap.push_back(pair<uint64_t,uint64_t>(0, 4096));
+  o.back()->overlap.push_back(pair<uint64_t,uint64_t>(8192, 4096));
+  o.back()->size = 16384;
+  o.push_back(new clone_info);
+  o.back()->cloneid = CEPH_NOSNAP;
+  o.back()->size = 32768;
+}
+
+// -- obj_list_snap_response_t --
+
+void obj_list_snap_response_t::encode(bufferlist& bl) const
+{
+  ENCODE_START(1, 1, bl);
+  ::encode(clones, bl);
+  ::encode(seq, bl);
+  ENCODE_FINISH(bl);
+}
+
+void obj_list_snap_response_t::decode(bufferlist::iterator& bl)
+{
+  DECODE_START(1, bl);
+  ::decode(clones, bl);
+  ::decode(seq, bl);
+  DECODE_FINISH(bl);
+}
+
+void obj_list_snap_response_t::dump(Formatter *f) const
+{
+  f->dump_unsigned("seq", seq);
+  f->open_array_section("clones");
+  for (vector<clone_info>::const_iterator p = clones.begin(); p != clones.end(); ++p) {
+    f->open_object_section("clone");
+    p->dump(f);
+    f->close_section();
+  }
+  f->close_section();
+}
+
+void obj_list_snap_response_t::generate_test_instances(list<obj_list_snap_response_t*>& o)
+{
+  o.push_back(new obj_list_snap_response_t);
+  o.push_back(new obj_list_snap_response_t);
+  clone_info cl;
+  cl.cloneid = 1;
+  cl.snaps.push_back(1);
+  cl.overlap.push_back(pair<uint64_t,uint64_t>(0, 4096));
+  cl.size = 16384;
+  o.back()->clones.push_back(cl);
+  cl.cloneid = CEPH_NOSNAP;
+  cl.snaps.clear();
+  cl.overlap.clear();
+  cl.size = 32768;
+  o.back()->clones.push_back(cl);
+  o.back()->seq = 123;
+}
+
 // -- watch_info_t --
 
 void watch_info_t::encode(bufferlist& bl) const
@@ -2342,6 +2462,97 @@ ostream &ObjectRecoveryInfo::print(ostream &out) const
 	     << ")";
 }
 
+// -- PushOp --
+
+void PushOp::encode(bufferlist &bl) const
+{
+  ENCODE_START(1, 1, bl);
+  ::encode(soid, bl);
+  ::encode(version, bl);
+  ::encode(data, bl);
+  ::encode(data_included, bl);
+  ::encode(omap_header, bl);
+  ::encode(omap_entries, bl);
+  ::encode(attrset, bl);
+  ::encode(recovery_info, bl);
+  ::encode(after_progress, bl);
+  ::encode(before_progress, bl);
+  ENCODE_FINISH(bl);
+}
+
+void PushOp::decode(bufferlist::iterator &bl)
+{
+  DECODE_START(1, bl);
+  ::decode(soid, bl);
+  ::decode(version, bl);
+  ::decode(data, bl);
+  ::decode(data_included, bl);
+  ::decode(omap_header, bl);
+  ::decode(omap_entries, bl);
+  ::decode(attrset, bl);
+  ::decode(recovery_info, bl);
+  ::decode(after_progress, bl);
+  ::decode(before_progress, bl);
+  DECODE_FINISH(bl);
+}
+
+void PushOp::generate_test_instances(list<PushOp*>& o)
+{
+  o.push_back(new PushOp);
+  o.push_back(new PushOp);
+  o.back()->soid = hobject_t(sobject_t("asdf", 2));
+  o.back()->version = eversion_t(3, 10);
+  o.back()->data.append("foo");
+  o.back()->data_included.insert(0, 3);
+  o.back()->omap_header.append("bar");
+}
+
+void PushOp::dump(Formatter *f) const
+{
+  f->dump_stream("soid") << soid;
+  f->dump_stream("version") << version;
+  f->dump_int("data_len", data.length());
+  f->dump_stream("data_included") << data_included;
+  f->dump_int("omap_header_len", omap_header.length());
+  f->dump_int("omap_entries_len", omap_entries.size());
+  f->dump_int("attrset_len", attrset.size());
+  {
+    f->open_object_section("recovery_info");
+    recovery_info.dump(f);
+    f->close_section();
+  }
+  {
+    f->open_object_section("after_progress");
+    after_progress.dump(f);
+    f->close_section();
+  }
+  {
+    f->open_object_section("before_progress");
+    before_progress.dump(f);
+    f->close_section();
+  }
+}
+
+ostream &PushOp::print(ostream &out) const
+{
+  return out << "PushOp(" << soid
+	     << ", version: " << version
+	     << ", data_included: " << data_included
+	     << ", data_size: " << data.length()
+	     << ", omap_header_size: " << omap_header.length()
+	     << ", omap_entries_size: " << omap_entries.size()
+	     << ", attrset_size: " << attrset.size()
+	     << ", recovery_info: " << recovery_info
+	     << ", after_progress: " << after_progress
+	     << ", before_progress: " << before_progress
+	     << ")";
+}
+
+ostream& operator<<(ostream& out, const PushOp &op)
+{
+  return op.print(out);
+}
+
 // -- ScrubMap --
 
 void ScrubMap::merge_incr(const ScrubMap &l)
@@ -2481,6 +2692,7 @@ ostream& operator<<(ostream& out, const OSDOp& op)
     // data extent
     switch (op.op.op) {
     case CEPH_OSD_OP_DELETE:
+    case CEPH_OSD_OP_LIST_SNAPS:
       break;
     case CEPH_OSD_OP_TRUNCATE:
       out << " " << op.op.extent.offset;
@@ -2492,6 +2704,12 @@ ostream& operator<<(ostream& out, const OSDOp& op)
     case CEPH_OSD_OP_ROLLBACK:
       out << " " << snapid_t(op.op.snap.snapid);
       break;
+    case CEPH_OSD_OP_CHECKSUM:
+      out << " " << op.op.checksum.offset << "~" << op.op.checksum.length
+	  << " type " << (int)op.op.checksum.type;
+      if (op.op.checksum.chunk_size)
+	out << " chunk " << op.op.checksum.chunk_size;
+      break;
     default:
       out << " " << op.op.extent.offset << "~" << op.op.extent.length;
       if (op.op.extent.truncate_seq)
@@ -843,23 +843,28 @@ struct pg_stat_t {
   vector<int> up, acting;
   epoch_t mapping_epoch;
 
+  int64_t snaptrimq_len;      // removed snaps not yet trimmed
+
   pg_stat_t()
     : state(0),
       created(0), last_epoch_clean(0),
       parent_split_bits(0), 
       log_size(0), ondisk_log_size(0),
-      mapping_epoch(0)
+      mapping_epoch(0),
+      snaptrimq_len(0)
   { }
 
   void add(const pg_stat_t& o) {
     stats.add(o.stats);
     log_size += o.log_size;
     ondisk_log_size += o.ondisk_log_size;
+    snaptrimq_len += o.snaptrimq_len;
   }
   void sub(const pg_stat_t& o) {
     stats.sub(o.stats);
     log_size -= o.log_size;
     ondisk_log_size -= o.ondisk_log_size;
+    snaptrimq_len -= o.snaptrimq_len;
   }
 
   void dump(Formatter *f) const;
@@ -876,25 +881,29 @@ struct pool_stat_t {
   object_stat_collection_t stats;
   uint64_t log_size;
   uint64_t ondisk_log_size;    // >= active_log_size
+  int64_t snaptrimq_len;       // snap trim backlog, summed over pgs
 
-  pool_stat_t() : log_size(0), ondisk_log_size(0)
+  pool_stat_t() : log_size(0), ondisk_log_size(0), snaptrimq_len(0)
   { }
 
   void add(const pg_stat_t& o) {
     stats.add(o.stats);
     log_size += o.log_size;
     ondisk_log_size += o.ondisk_log_size;
+    snaptrimq_len += o.snaptrimq_len;
   }
   void sub(const pg_stat_t& o) {
     stats.sub(o.stats);
     log_size -= o.log_size;
     ondisk_log_size -= o.ondisk_log_size;
+    snaptrimq_len -= o.snaptrimq_len;
   }
 
   bool is_zero() const {
     return (stats.is_zero() &&
 	    log_size == 0 &&
-	    ondisk_log_size == 0);
+	    ondisk_log_size == 0 &&
+	    snaptrimq_len == 0);
   }
 
   void dump(Formatter *f) const;
@@ -1576,6 +1585,36 @@ WRITE_CLASS_ENCODER(SnapSet)
 
 ostream& operator<<(ostream& out, const SnapSet& cs);
 
+/*
+ * reply to CEPH_OSD_OP_LIST_SNAPS: each clone, and the head (cloneid
+ * CEPH_NOSNAP) if it exists, oldest first.
+ */
+struct clone_info {
+  snapid_t cloneid;
+  vector<snapid_t> snaps;          // ascending
+  vector<pair<uint64_t, uint64_t> > overlap;  // w/ next newest
+  uint64_t size;
+
+  clone_info() : cloneid(CEPH_NOSNAP), size(0) {}
+
+  void encode(bufferlist& bl) const;
+  void decode(bufferlist::iterator& bl);
+  void dump(Formatter *f) const;
+  static void generate_test_instances(list<clone_info*>& o);
+};
+WRITE_CLASS_ENCODER(clone_info)
+
+struct obj_list_snap_response_t {
+  vector<clone_info> clones;
+  snapid_t seq;
+
+  void encode(bufferlist& bl) const;
+  void decode(bufferlist::iterator& bl);
+  void dump(Formatter *f) const;
+  static void generate_test_instances(list<obj_list_snap_response_t*>& o);
+};
+WRITE_CLASS_ENCODER(obj_list_snap_response_t)
+
 
 
 #define OI_ATTR "_"
@@ -1719,6 +1758,32 @@ struct ObjectRecoveryProgress {
 WRITE_CLASS_ENCODER(ObjectRecoveryProgress)
 ostream& operator<<(ostream& out, const ObjectRecoveryProgress &prog);
 
+/*
+ * one chunk of an object push.  small objects are pushed whole in a
+ * single PushOp, several of which may ride along in one MOSDSubOp.
+ */
+struct PushOp {
+  hobject_t soid;
+  eversion_t version;
+  bufferlist data;
+  interval_set<uint64_t> data_included;
+  bufferlist omap_header;
+  map<string, bufferlist> omap_entries;
+  map<string, bufferptr> attrset;
+
+  ObjectRecoveryInfo recovery_info;
+  ObjectRecoveryProgress before_progress;
+  ObjectRecoveryProgress after_progress;
+
+  static void generate_test_instances(list<PushOp*>& o);
+  void encode(bufferlist &bl) const;
+  void decode(bufferlist::iterator &bl);
+  ostream &print(ostream &out) const;
+  void dump(Formatter *f) const;
+};
+WRITE_CLASS_ENCODER(PushOp)
+ostream& operator<<(ostream& out, const PushOp &op);
+
 
 /*
  * summarize pg contents for purposes of a scrub
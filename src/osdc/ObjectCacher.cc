@@ -25,8 +25,10 @@ ObjectCacher::BufferHead *ObjectCacher::Object::split(BufferHead *left, loff_t o
   // split off right
   ObjectCacher::BufferHead *right = new BufferHead(this);
   right->last_write_tid = left->last_write_tid;
+  right->last_write = left->last_write;
   right->set_state(left->get_state());
   right->snapc = left->snapc;
+  right->readahead = left->readahead;
   
   loff_t newleftlen = off - left->start();
   right->set_start(off);
@@ -37,8 +39,8 @@ ObjectCacher::BufferHead *ObjectCacher::Object::split(BufferHead *left, loff_t o
   left->set_length(newleftlen);
   oc->bh_stat_add(left);
   
-  // add right
-  oc->bh_add(this, right);
+  // add right, next to left in the lru, as it's just as old
+  oc->bh_add(this, right, left);
   
   // split buffers too
   bufferlist bl;
@@ -79,6 +81,8 @@ void ObjectCacher::Object::merge_left(BufferHead *left, BufferHead *right)
   oc->bh_stat_sub(left);
   left->set_length(left->length() + right->length());
   oc->bh_stat_add(left);
+  if (left->is_dirty() && right->last_write > left->last_write)
+    oc->lru_dirty.lru_touch(left);  // keep the dirty lru in write order
 
   // data
   left->bl.claim_append(right->bl);
@@ -111,7 +115,8 @@ void ObjectCacher::Object::try_merge_bh(BufferHead *bh)
   if (p != data.begin()) {
     p--;
     if (p->second->end() == bh->start() &&
-	p->second->get_state() == bh->get_state()) {
+	p->second->get_state() == bh->get_state() &&
+	p->second->readahead == bh->readahead) {
       merge_left(p->second, bh);
       bh = p->second;
     } else 
@@ -122,7 +127,8 @@ void ObjectCacher::Object::try_merge_bh(BufferHead *bh)
   p++;
   if (p != data.end() &&
       p->second->start() == bh->end() &&
-      p->second->get_state() == bh->get_state()) 
+      p->second->get_state() == bh->get_state() &&
+      p->second->readahead == bh->readahead)
     merge_left(bh, p->second);
 }
 
@@ -374,7 +380,8 @@ void ObjectCacher::Object::truncate(loff_t s)
   }
 }
 
-void ObjectCacher::Object::discard(loff_t off, loff_t len)
+// readers waiting on discarded bhs are moved to waiters, to be retried
+void ObjectCacher::Object::discard(loff_t off, loff_t len, list<Context*>& waiters)
 {
   ldout(oc->cct, 10) << "discard " << *this << " " << off << "~" << len << dendl;
 
@@ -397,7 +404,12 @@ void ObjectCacher::Object::discard(loff_t off, loff_t len)
     }
 
     p++;
+    for (map<loff_t, list<Context*> >::iterator q = bh->waitfor_read.begin();
+	 q != bh->waitfor_read.end();
+	 q++)
+      waiters.splice(waiters.end(), q->second);
     oc->bh_remove(this, bh);
+    delete bh;
   }
 }
 
@@ -416,6 +428,7 @@ ObjectCacher::ObjectCacher(CephContext *cct_, string name, WritebackHandler& wb,
   : perfcounter(NULL),
     cct(cct_), writeback_handler(wb), name(name), lock(l),
     max_dirty(max_dirty), target_dirty(target_dirty), max_size(max_size),
+    readahead_max(0), readahead_trigger(0),
     flush_set_callback(flush_callback), flush_set_callback_arg(flush_callback_arg),
     flusher_stop(false), flusher_thread(this),
     stat_clean(0), stat_dirty(0), stat_rx(0), stat_tx(0), stat_missing(0), stat_dirty_waiting(0)
@@ -434,7 +447,6 @@ ObjectCacher::~ObjectCacher()
     assert(!i->size());
   assert(lru_rest.lru_get_size() == 0);
   assert(lru_dirty.lru_get_size() == 0);
-  assert(dirty_bh.empty());
 }
 
 void ObjectCacher::perf_start()
@@ -454,6 +466,11 @@ void ObjectCacher::perf_start()
   plb.add_u64_counter(l_objectcacher_write_ops_blocked, "write_ops_blocked");
   plb.add_u64_counter(l_objectcacher_write_bytes_blocked, "write_bytes_blocked");
   plb.add_fl(l_objectcacher_write_time_blocked, "write_time_blocked");
+  plb.add_u64_counter(l_objectcacher_readahead_bytes, "readahead_bytes");
+  plb.add_u64_counter(l_objectcacher_readahead_hit_bytes, "readahead_hit_bytes");
+  plb.add_u64_counter(l_objectcacher_readahead_wasted_bytes, "readahead_wasted_bytes");
+  plb.add_u64(l_objectcacher_dirty_bytes, "dirty_bytes");
+  plb.add_fl_avg(l_objectcacher_flush_latency, "flush_latency");
 
   perfcounter = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(perfcounter);
@@ -516,6 +533,85 @@ void ObjectCacher::bh_read(BufferHead *bh)
 			 onfinish);
 }
 
+/*
+ * a read continues a stream if it starts where the last one ended, or
+ * at the start of another object when the last one ended at an object
+ * boundary.  once a stream has gone on for long enough, prefetch a
+ * window past the end of it, up to the end of the current object, and
+ * double the window each time the stream gets within half a window of
+ * what we have prefetched.
+ */
+void ObjectCacher::readahead(OSDRead *rd, ObjectSet *oset)
+{
+  if (!readahead_max || !oset->object_size || rd->extents.empty())
+    return;
+
+  for (vector<ObjectExtent>::iterator ex_it = rd->extents.begin();
+       ex_it != rd->extents.end();
+       ex_it++) {
+    sobject_t soid(ex_it->oid, rd->snap);
+    bool seq;
+    if (soid == oset->ra_last_oid)
+      seq = (loff_t)ex_it->offset == oset->ra_last_end;
+    else
+      seq = ex_it->offset == 0 && oset->ra_last_end == (loff_t)oset->object_size;
+    if (seq) {
+      oset->ra_nr_consec++;
+    } else {
+      oset->ra_nr_consec = 0;
+      oset->ra_window = 0;
+    }
+    if (soid != oset->ra_last_oid)
+      oset->ra_end = 0;
+    oset->ra_last_oid = soid;
+    oset->ra_last_end = ex_it->offset + ex_it->length;
+  }
+
+  if (oset->ra_nr_consec < readahead_trigger)
+    return;
+
+  // don't let one stream push everything else out of the cache
+  uint64_t limit = MIN(readahead_max, (uint64_t)max_size / 4);
+  loff_t start = MAX(oset->ra_last_end, oset->ra_end);
+  if (oset->ra_window &&
+      start - oset->ra_last_end >= (loff_t)oset->ra_window / 2)
+    return;  // still well ahead of the stream
+
+  ObjectExtent& last = rd->extents.back();
+  if (oset->ra_window)
+    oset->ra_window = MIN(oset->ra_window * 2, limit);
+  else
+    oset->ra_window = MIN(last.length * 2, limit);
+  loff_t end = MIN(oset->ra_last_end + (loff_t)oset->ra_window,
+		   (loff_t)oset->object_size);
+  if (start >= end)
+    return;
+
+  ldout(cct, 10) << "readahead " << oset->ra_last_oid << " " << start << "~"
+		 << (end - start) << " window " << oset->ra_window
+		 << " after " << oset->ra_nr_consec << " sequential reads" << dendl;
+
+  OSDRead ra(rd->snap, NULL, 0);
+  ObjectExtent ex(last.oid, start, end - start);
+  ex.oloc = last.oloc;
+  ra.extents.push_back(ex);
+  Object *o = get_object(oset->ra_last_oid, oset, ex.oloc);
+  map<loff_t, BufferHead*> hits, missing, rx;
+  o->map_read(&ra, hits, missing, rx);
+  uint64_t bytes = 0;
+  for (map<loff_t, BufferHead*>::iterator bh_it = missing.begin();
+       bh_it != missing.end();
+       bh_it++) {
+    bh_it->second->readahead = true;
+    bh_read(bh_it->second);
+    bytes += bh_it->second->length();
+  }
+  oset->ra_end = end;
+
+  if (perfcounter && bytes)
+    perfcounter->inc(l_objectcacher_readahead_bytes, bytes);
+}
+
 void ObjectCacher::bh_read_finish(int64_t poolid, sobject_t oid, loff_t start,
 				  uint64_t length, bufferlist &bl, int r)
 {
@@ -603,7 +699,8 @@ void ObjectCacher::bh_write(BufferHead *bh)
   
   // finishers
   C_WriteCommit *oncommit = new C_WriteCommit(this, bh->ob->oloc.pool,
-                                              bh->ob->get_soid(), bh->start(), bh->length());
+                                              bh->ob->get_soid(), bh->start(), bh->length(),
+					      ceph_clock_now(cct));
 
   ObjectSet *oset = bh->ob->oset;
 
@@ -626,6 +723,102 @@ void ObjectCacher::bh_write(BufferHead *bh)
   mark_tx(bh);
 }
 
+/*
+ * write dirty bhs of one object, one op for each snap context among
+ * them (usually just the one)
+ */
+void ObjectCacher::bh_write_scattered(list<BufferHead*>& blist)
+{
+  while (!blist.empty()) {
+    const SnapContext& snapc = blist.front()->snapc;
+    list<BufferHead*> same;
+    list<BufferHead*>::iterator p = blist.begin();
+    while (p != blist.end()) {
+      if ((*p)->snapc.seq == snapc.seq && (*p)->snapc.snaps == snapc.snaps)
+	same.splice(same.end(), blist, p++);
+      else
+	++p;
+    }
+    if (same.size() == 1)
+      bh_write(same.front());
+    else
+      bh_write_extents(same);
+  }
+}
+
+// write bhs of one object, all with the same snap context, in one op
+void ObjectCacher::bh_write_extents(list<BufferHead*>& blist)
+{
+  BufferHead *first = blist.front();
+  Object *ob = first->ob;
+  ObjectSet *oset = ob->oset;
+  C_WriteCommit *oncommit = new C_WriteCommit(this, ob->oloc.pool,
+					      ob->get_soid(),
+					      ceph_clock_now(cct));
+  map<uint64_t, bufferlist> extents;
+  utime_t mtime;
+  for (list<BufferHead*>::iterator p = blist.begin(); p != blist.end(); ++p) {
+    BufferHead *bh = *p;
+    ldout(cct, 7) << "bh_write_extents " << *bh << dendl;
+    assert(bh->ob == ob);
+    oncommit->ranges.push_back(make_pair(bh->start(), bh->length()));
+    extents[bh->start()] = bh->bl;
+    if (bh->last_write > mtime)
+      mtime = bh->last_write;
+  }
+
+  tid_t tid = writeback_handler.write_extents(ob->get_oid(), ob->get_oloc(),
+					      extents, first->snapc, mtime,
+					      oset->truncate_size,
+					      oset->truncate_seq, oncommit);
+  oncommit->tid = tid;
+  ob->last_write_tid = tid;
+  for (list<BufferHead*>::iterator p = blist.begin(); p != blist.end(); ++p) {
+    BufferHead *bh = *p;
+    bh->last_write_tid = tid;
+    if (perfcounter)
+      perfcounter->inc(l_objectcacher_data_flushed, bh->length());
+    mark_tx(bh);
+  }
+}
+
+/*
+ * write bh, along with the other dirty bhs of its object that were
+ * last written before cutoff, in one op, so an object's writeback goes
+ * out together instead of interleaved with other objects in lru order.
+ * stops once max bytes (0 for no limit) have been gathered.
+ */
+loff_t ObjectCacher::bh_write_adjacencies(BufferHead *bh, utime_t cutoff, loff_t max)
+{
+  Object *ob = bh->ob;
+  set<BufferHead*, BufferHead::ptr_lt>& s = ob->oset->dirty_or_tx_bh;
+  set<BufferHead*, BufferHead::ptr_lt>::iterator p = s.find(bh);
+  assert(p != s.end());
+  while (p != s.begin()) {
+    --p;
+    if ((*p)->ob != ob) {
+      ++p;
+      break;
+    }
+  }
+
+  list<BufferHead*> blist;
+  blist.push_back(bh);
+  loff_t did = bh->length();
+  for (; p != s.end() && (*p)->ob == ob; ++p) {
+    if (max && did >= max)
+      break;
+    BufferHead *n = *p;
+    if (n == bh || !n->is_dirty() || n->last_write > cutoff)
+      continue;
+    ldout(cct, 10) << "bh_write_adjacencies also " << *n << dendl;
+    did += n->length();
+    blist.push_back(n);
+  }
+  bh_write_scattered(blist);
+  return did;
+}
+
 void ObjectCacher::lock_ack(int64_t poolid, list<sobject_t>& oids, tid_t tid)
 {
   for (list<sobject_t>::iterator i = oids.begin();
@@ -688,14 +881,19 @@ void ObjectCacher::lock_ack(int64_t poolid, list<sobject_t>& oids, tid_t tid)
   }
 }
 
-void ObjectCacher::bh_write_commit(int64_t poolid, sobject_t oid, loff_t start,
-				   uint64_t length, tid_t tid, int r)
+void ObjectCacher::bh_write_commit(int64_t poolid, sobject_t oid,
+				   vector<pair<loff_t, uint64_t> >& ranges,
+				   tid_t tid, int r, utime_t issued)
 {
   assert(lock.is_locked());
+  if (perfcounter && issued != utime_t()) {   // not a lock op
+    utime_t lat = ceph_clock_now(cct) - issued;
+    perfcounter->finc(l_objectcacher_flush_latency, (double)lat);
+  }
   ldout(cct, 7) << "bh_write_commit " 
 		<< oid 
 		<< " tid " << tid
-		<< " " << start << "~" << length
+		<< " " << ranges
 		<< dendl;
   if (r < 0) {
     // TODO: handle write error
@@ -707,36 +905,42 @@ void ObjectCacher::bh_write_commit(int64_t poolid, sobject_t oid, loff_t start,
     Object *ob = objects[poolid][oid];
     
     // apply to bh's!
-    for (map<loff_t, BufferHead*>::iterator p = ob->data.lower_bound(start);
-         p != ob->data.end();
-         p++) {
-      BufferHead *bh = p->second;
-      
-      if (bh->start() > start+(loff_t)length)
-	break;
-
-      if (bh->start() < start &&
-          bh->end() > start+(loff_t)length) {
-        ldout(cct, 20) << "bh_write_commit skipping " << *bh << dendl;
-        continue;
-      }
-      
-      // make sure bh is tx
-      if (!bh->is_tx()) {
-        ldout(cct, 10) << "bh_write_commit skipping non-tx " << *bh << dendl;
-        continue;
+    for (vector<pair<loff_t, uint64_t> >::iterator q = ranges.begin();
+	 q != ranges.end();
+	 ++q) {
+      loff_t start = q->first;
+      uint64_t length = q->second;
+      for (map<loff_t, BufferHead*>::iterator p = ob->data.lower_bound(start);
+	   p != ob->data.end();
+	   p++) {
+	BufferHead *bh = p->second;
+
+	if (bh->start() > start+(loff_t)length)
+	  break;
+
+	if (bh->start() < start &&
+	    bh->end() > start+(loff_t)length) {
+	  ldout(cct, 20) << "bh_write_commit skipping " << *bh << dendl;
+	  continue;
+	}
+
+	// make sure bh is tx
+	if (!bh->is_tx()) {
+	  ldout(cct, 10) << "bh_write_commit skipping non-tx " << *bh << dendl;
+	  continue;
+	}
+
+	// make sure bh tid matches
+	if (bh->last_write_tid != tid) {
+	  assert(bh->last_write_tid > tid);
+	  ldout(cct, 10) << "bh_write_commit newer tid on " << *bh << dendl;
+	  continue;
+	}
+
+	// ok!  mark bh clean.
+	mark_clean(bh);
+	ldout(cct, 10) << "bh_write_commit clean " << *bh << dendl;
       }
-      
-      // make sure bh tid matches
-      if (bh->last_write_tid != tid) {
-        assert(bh->last_write_tid > tid);
-        ldout(cct, 10) << "bh_write_commit newer tid on " << *bh << dendl;
-        continue;
-      }
-      
-      // ok!  mark bh clean.
-      mark_clean(bh);
-      ldout(cct, 10) << "bh_write_commit clean " << *bh << dendl;
     }
     
     // update last_commit.
@@ -781,8 +985,7 @@ void ObjectCacher::flush(loff_t amount)
     if (!bh) break;
     if (bh->last_write > cutoff) break;
 
-    did += bh->length();
-    bh_write(bh);
+    did += bh_write_adjacencies(bh, cutoff, amount ? amount - did : 0);
   }    
 }
 
@@ -802,6 +1005,8 @@ void ObjectCacher::trim(loff_t max)
     
     ldout(cct, 10) << "trim trimming " << *bh << dendl;
     assert(bh->is_clean());
+    if (bh->readahead && perfcounter)
+      perfcounter->inc(l_objectcacher_readahead_wasted_bytes, bh->length());
     
     Object *ob = bh->ob;
     bh_remove(ob, bh);
@@ -846,9 +1051,16 @@ bool ObjectCacher::is_cached(ObjectSet *oset, vector<ObjectExtent>& extents, sna
  * returns 0 if doing async read
  */
 int ObjectCacher::readx(OSDRead *rd, ObjectSet *oset, Context *onfinish)
+{
+  return _readx(rd, oset, onfinish, true);
+}
+
+int ObjectCacher::_readx(OSDRead *rd, ObjectSet *oset, Context *onfinish,
+			 bool external_call)
 {
   assert(lock.is_locked());
   bool success = true;
+  uint64_t readahead_hit = 0;
   list<BufferHead*> hit_ls;
   uint64_t bytes_in_cache = 0;
   uint64_t bytes_not_in_cache = 0;
@@ -937,6 +1149,11 @@ int ObjectCacher::readx(OSDRead *rd, ObjectSet *oset, Context *onfinish)
 		      opos - bh->start(),
 		      len);
         stripe_map[f_it->first].claim_append(bit);
+	if (bh->readahead) {
+	  readahead_hit += len;
+	  if (opos + (loff_t)len == bh->end())
+	    bh->readahead = false;  // the stream has read through it
+	}
 
         opos += len;
         bhoff += len;
@@ -962,6 +1179,11 @@ int ObjectCacher::readx(OSDRead *rd, ObjectSet *oset, Context *onfinish)
        bhit != hit_ls.end();
        bhit++) 
     touch_bh(*bhit);
+
+  if (external_call)
+    readahead(rd, oset);
+  if (perfcounter && readahead_hit)
+    perfcounter->inc(l_objectcacher_readahead_hit_bytes, readahead_hit);
   
   if (!success) {
     if (perfcounter) {
@@ -1026,6 +1248,7 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock)
     // map it all into a single bufferhead.
     BufferHead *bh = o->map_write(wr);
     bh->snapc = wr->snapc;
+    bh->readahead = false;
     
     bytes_written += bh->length();
     if (bh->is_tx()) {
@@ -1070,6 +1293,7 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset, Mutex& wait_on_lock)
 
   if (perfcounter) {
     perfcounter->inc(l_objectcacher_data_written, bytes_written);
+    perfcounter->set(l_objectcacher_dirty_bytes, get_stat_dirty());
     if (bytes_written_in_flush) {
       perfcounter->inc(l_objectcacher_overwritten_in_flush,
                        bytes_written_in_flush);
@@ -1145,6 +1369,8 @@ void ObjectCacher::flusher_entry()
   lock.Lock();
   while (!flusher_stop) {
     while (!flusher_stop) {
+      if (perfcounter)
+	perfcounter->set(l_objectcacher_dirty_bytes, get_stat_dirty());
       loff_t all = get_stat_tx() + get_stat_rx() + get_stat_clean() + get_stat_dirty();
       ldout(cct, 11) << "flusher "
 		     << all << " / " << max_size << ":  "
@@ -1172,7 +1398,7 @@ void ObjectCacher::flusher_entry()
         while ((bh = (BufferHead*)lru_dirty.lru_get_next_expire()) != 0 &&
                bh->last_write < cutoff) {
           ldout(cct, 10) << "flusher flushing aged dirty bh " << *bh << dendl;
-          bh_write(bh);
+          bh_write_adjacencies(bh, cutoff, 0);
         }
         break;
       }
@@ -1360,23 +1586,7 @@ bool ObjectCacher::set_is_cached(ObjectSet *oset)
 
 bool ObjectCacher::set_is_dirty_or_committing(ObjectSet *oset)
 {
-  if (oset->objects.empty())
-    return false;
-  
-  for (xlist<Object*>::iterator i = oset->objects.begin();
-       !i.end(); ++i) {
-    Object *ob = *i;
-    
-    for (map<loff_t,BufferHead*>::iterator p = ob->data.begin();
-         p != ob->data.end();
-         p++) {
-      BufferHead *bh = p->second;
-      if (bh->is_dirty() || bh->is_tx()) 
-        return true;
-    }
-  }  
-  
-  return false;
+  return !oset->dirty_or_tx_bh.empty();
 }
 
 
@@ -1402,6 +1612,7 @@ bool ObjectCacher::flush(Object *ob, loff_t offset, loff_t length)
 {
   bool clean = true;
   ldout(cct, 10) << "flush " << *ob << " " << offset << "~" << length << dendl;
+  list<BufferHead*> blist;
   for (map<loff_t,BufferHead*>::iterator p = ob->data_lower_bound(offset); p != ob->data.end(); p++) {
     BufferHead *bh = p->second;
     ldout(cct, 20) << "flush  " << *bh << dendl;
@@ -1415,9 +1626,11 @@ bool ObjectCacher::flush(Object *ob, loff_t offset, loff_t length)
     if (!bh->is_dirty()) {
       continue;
     }
-    bh_write(bh);
+    blist.push_back(bh);
     clean = false;
   }
+  if (!blist.empty())
+    bh_write_scattered(blist);
   return clean;
 }
 
@@ -1436,22 +1649,30 @@ bool ObjectCacher::flush_set(ObjectSet *oset, Context *onfinish)
   // we'll need to wait for all objects to flush!
   C_GatherBuilder gather(cct, onfinish);
 
+  // only objects with dirty or tx bhs need looking at.  each object's
+  // dirty bhs go out together once we're past them.
   bool safe = true;
-  for (xlist<Object*>::iterator i = oset->objects.begin();
-       !i.end(); ++i) {
-    Object *ob = *i;
+  set<BufferHead*, BufferHead::ptr_lt>::iterator p = oset->dirty_or_tx_bh.begin();
+  while (p != oset->dirty_or_tx_bh.end()) {
+    Object *ob = (*p)->ob;
+    list<BufferHead*> blist;
+    for (; p != oset->dirty_or_tx_bh.end() && (*p)->ob == ob; ++p) {
+      ldout(cct, 20) << "flush_set  " << **p << dendl;
+      if ((*p)->is_dirty())
+	blist.push_back(*p);
+    }
+    if (!blist.empty())
+      bh_write_scattered(blist);
 
-    if (!flush(ob, 0, 0)) {
-      // we'll need to gather...
-      safe = false;
+    // we'll need to gather...
+    safe = false;
 
-      ldout(cct, 10) << "flush_set " << oset << " will wait for ack tid " 
-               << ob->last_write_tid 
-               << " on " << *ob
-               << dendl;
-      if (onfinish != NULL)
-        ob->waitfor_commit[ob->last_write_tid].push_back(gather.new_sub());
-    }
+    ldout(cct, 10) << "flush_set " << oset << " will wait for ack tid " 
+	     << ob->last_write_tid 
+	     << " on " << *ob
+	     << dendl;
+    if (onfinish != NULL)
+      ob->waitfor_commit[ob->last_write_tid].push_back(gather.new_sub());
   }
   if (onfinish != NULL)
     gather.activate();
@@ -1692,6 +1913,7 @@ void ObjectCacher::discard_set(ObjectSet *oset, vector<ObjectExtent>& exls)
   ldout(cct, 10) << "discard_set " << oset << dendl;
 
   bool were_dirty = oset->dirty_or_tx > 0;
+  list<Context*> waiters;
 
   for (vector<ObjectExtent>::iterator p = exls.begin();
        p != exls.end();
@@ -1702,7 +1924,7 @@ void ObjectCacher::discard_set(ObjectSet *oset, vector<ObjectExtent>& exls)
       continue;
     Object *ob = objects[oset->poolid][soid];
     
-    ob->discard(ex.offset, ex.length);
+    ob->discard(ex.offset, ex.length, waiters);
 
     if (ob->can_close()) {
       ldout(cct, 10) << " closing " << *ob << dendl;
@@ -1714,6 +1936,9 @@ void ObjectCacher::discard_set(ObjectSet *oset, vector<ObjectExtent>& exls)
   if (flush_set_callback &&
       were_dirty && oset->dirty_or_tx == 0)
     flush_set_callback(flush_set_callback_arg, oset);
+
+  // reads that were waiting on discarded bhs start over
+  finish_contexts(cct, waiters);
 }
 
 void ObjectCacher::verify_stats() const
@@ -1826,29 +2051,36 @@ void ObjectCacher::bh_set_state(BufferHead *bh, int s)
   if (s == BufferHead::STATE_DIRTY && bh->get_state() != BufferHead::STATE_DIRTY) {
     lru_rest.lru_remove(bh);
     lru_dirty.lru_insert_top(bh);
-    dirty_bh.insert(bh);
   }
   if (s != BufferHead::STATE_DIRTY && bh->get_state() == BufferHead::STATE_DIRTY) {
     lru_dirty.lru_remove(bh);
     lru_rest.lru_insert_top(bh);
-    dirty_bh.erase(bh);
   }
 
+  // in or out of the set's dirty|tx index?
+  bool was = bh->is_dirty() || bh->is_tx();
+  bool will = s == BufferHead::STATE_DIRTY || s == BufferHead::STATE_TX;
+  if (will && !was)
+    bh->ob->oset->dirty_or_tx_bh.insert(bh);
+  if (was && !will)
+    bh->ob->oset->dirty_or_tx_bh.erase(bh);
+
   // set state
   bh_stat_sub(bh);
   bh->set_state(s);
   bh_stat_add(bh);
 }
 
-void ObjectCacher::bh_add(Object *ob, BufferHead *bh)
+void ObjectCacher::bh_add(Object *ob, BufferHead *bh, BufferHead *beside)
 {
   ob->add_bh(bh);
-  if (bh->is_dirty()) {
-    lru_dirty.lru_insert_top(bh);
-    dirty_bh.insert(bh);
-  } else {
-    lru_rest.lru_insert_top(bh);
-  }
+  LRU& lru = bh->is_dirty() ? lru_dirty : lru_rest;
+  if (beside)
+    lru.lru_insert_beside(bh, beside);
+  else
+    lru.lru_insert_top(bh);
+  if (bh->is_dirty() || bh->is_tx())
+    ob->oset->dirty_or_tx_bh.insert(bh);
   bh_stat_add(bh);
 }
 
@@ -1857,10 +2089,11 @@ void ObjectCacher::bh_remove(Object *ob, BufferHead *bh)
   ob->remove_bh(bh);
   if (bh->is_dirty()) {
     lru_dirty.lru_remove(bh);
-    dirty_bh.erase(bh);
   } else {
     lru_rest.lru_remove(bh);
   }
+  if (bh->is_dirty() || bh->is_tx())
+    ob->oset->dirty_or_tx_bh.erase(bh);
   bh_stat_sub(bh);
 }
 
@@ -36,6 +36,13 @@ enum {
   l_objectcacher_write_bytes_blocked, // total number of write bytes we delayed due to dirty limits
   l_objectcacher_write_time_blocked, // total time in seconds spent blocking a write due to dirty limits
 
+  l_objectcacher_readahead_bytes, // bytes prefetched for sequential streams
+  l_objectcacher_readahead_hit_bytes, // bytes read out of prefetched buffers
+  l_objectcacher_readahead_wasted_bytes, // prefetched bytes trimmed before anyone read them
+
+  l_objectcacher_dirty_bytes, // dirty bytes in the cache
+  l_objectcacher_flush_latency, // time from issuing a write to its commit
+
   l_objectcacher_last,
 };
 
@@ -102,6 +109,7 @@ class ObjectCacher {
     tid_t last_write_tid;  // version of bh (if non-zero)
     utime_t last_write;
     SnapContext snapc;
+    bool readahead;  // prefetched, and not read through yet
     
     map< loff_t, list<Context*> > waitfor_read;
     
@@ -111,7 +119,8 @@ class ObjectCacher {
       state(STATE_MISSING),
       ref(0),
       ob(o),
-      last_write_tid(0) {}
+      last_write_tid(0),
+      readahead(false) {}
   
     // extent
     loff_t start() const { return ex.start; }
@@ -134,6 +143,17 @@ class ObjectCacher {
     bool is_clean() { return state == STATE_CLEAN; }
     bool is_tx() { return state == STATE_TX; }
     bool is_rx() { return state == STATE_RX; }
+
+    // orders an ObjectSet's dirty and tx bhs by object, then offset
+    struct ptr_lt {
+      bool operator()(const BufferHead *l, const BufferHead *r) const {
+	if (l->ob != r->ob)
+	  return l->ob < r->ob;
+	if (l->start() != r->start())
+	  return l->start() < r->start();
+	return l < r;
+      }
+    };
     
     // reference counting
     int get() {
@@ -266,7 +286,7 @@ class ObjectCacher {
     BufferHead *map_write(OSDWrite *wr);
     
     void truncate(loff_t s);
-    void discard(loff_t off, loff_t len);
+    void discard(loff_t off, loff_t len, list<Context*>& waiters);
   };
   
 
@@ -280,10 +300,22 @@ class ObjectCacher {
     xlist<Object*> objects;
 
     int dirty_or_tx;
+    set<BufferHead*, BufferHead::ptr_lt> dirty_or_tx_bh;
+
+    // sequential read detection.  readahead stays within objects of
+    // object_size bytes; 0 means no readahead for this set.
+    uint64_t object_size;
+    sobject_t ra_last_oid;
+    loff_t ra_last_end;     // where the last read ended
+    loff_t ra_end;          // prefetched up to here in ra_last_oid
+    unsigned ra_nr_consec;  // sequential reads in a row
+    uint64_t ra_window;
 
     ObjectSet(void *p, int64_t _poolid, inodeno_t i)
       : parent(p), ino(i), truncate_seq(0),
-	truncate_size(0), poolid(_poolid), dirty_or_tx(0) {}
+	truncate_size(0), poolid(_poolid), dirty_or_tx(0),
+	object_size(0), ra_last_end(0), ra_end(0), ra_nr_consec(0),
+	ra_window(0) {}
   };
 
 
@@ -297,14 +329,16 @@ class ObjectCacher {
   
   int64_t max_dirty, target_dirty, max_size;
   utime_t max_dirty_age;
+  uint64_t readahead_max;
+  unsigned readahead_trigger;
 
   flush_set_callback_t flush_set_callback;
   void *flush_set_callback_arg;
 
   vector<hash_map<sobject_t, Object*> > objects; // indexed by pool_id
 
-  set<BufferHead*>    dirty_bh;
-  LRU   lru_dirty, lru_rest;
+  LRU   lru_dirty;   // in the order they were last written
+  LRU   lru_rest;
 
   Cond flusher_cond;
   bool flusher_stop;
@@ -354,9 +388,9 @@ class ObjectCacher {
   loff_t get_stat_clean() { return stat_clean; }
 
   void touch_bh(BufferHead *bh) {
-    if (bh->is_dirty())
-      lru_dirty.lru_touch(bh);
-    else
+    // reads don't reorder dirty bhs, so the flusher can stop at the
+    // first one that is too young
+    if (!bh->is_dirty())
       lru_rest.lru_touch(bh);
   }
 
@@ -376,12 +410,16 @@ class ObjectCacher {
     //bh->set_dirty_stamp(ceph_clock_now(g_ceph_context));
   };
 
-  void bh_add(Object *ob, BufferHead *bh);
+  void bh_add(Object *ob, BufferHead *bh, BufferHead *beside=0);
   void bh_remove(Object *ob, BufferHead *bh);
 
   // io
   void bh_read(BufferHead *bh);
   void bh_write(BufferHead *bh);
+  void bh_write_scattered(list<BufferHead*>& blist);
+  void bh_write_extents(list<BufferHead*>& blist);
+  loff_t bh_write_adjacencies(BufferHead *bh, utime_t cutoff, loff_t max);
+  void readahead(OSDRead *rd, ObjectSet *oset);
 
   void trim(loff_t max=-1);
   void flush(loff_t amount=0);
@@ -409,8 +447,9 @@ class ObjectCacher {
  public:
   void bh_read_finish(int64_t poolid, sobject_t oid, loff_t offset,
 		      uint64_t length, bufferlist &bl, int r);
-  void bh_write_commit(int64_t poolid, sobject_t oid, loff_t offset,
-		       uint64_t length, tid_t t, int r);
+  void bh_write_commit(int64_t poolid, sobject_t oid,
+		       vector<pair<loff_t, uint64_t> >& ranges,
+		       tid_t t, int r, utime_t issued);
   void lock_ack(int64_t poolid, list<sobject_t>& oids, tid_t tid);
 
   class C_ReadFinish : public Context {
@@ -432,14 +471,19 @@ class ObjectCacher {
     ObjectCacher *oc;
     int64_t poolid;
     sobject_t oid;
-    loff_t start;
-    uint64_t length;
+    utime_t issued;
   public:
+    vector<pair<loff_t, uint64_t> > ranges;  // written by one op
     tid_t tid;
-    C_WriteCommit(ObjectCacher *c, int64_t _poolid, sobject_t o, loff_t s, uint64_t l) :
-      oc(c), poolid(_poolid), oid(o), start(s), length(l) {}
+    C_WriteCommit(ObjectCacher *c, int64_t _poolid, sobject_t o, loff_t s, uint64_t l,
+		  utime_t i=utime_t()) :
+      oc(c), poolid(_poolid), oid(o), issued(i) {
+      ranges.push_back(make_pair(s, l));
+    }
+    C_WriteCommit(ObjectCacher *c, int64_t _poolid, sobject_t o, utime_t i) :
+      oc(c), poolid(_poolid), oid(o), issued(i) {}
     void finish(int r) {
-      oc->bh_write_commit(poolid, oid, start, length, tid, r);
+      oc->bh_write_commit(poolid, oid, ranges, tid, r, issued);
     }
   };
 
@@ -489,7 +533,7 @@ class ObjectCacher {
   public:
     C_RetryRead(ObjectCacher *_oc, OSDRead *r, ObjectSet *os, Context *c) : oc(_oc), rd(r), oset(os), onfinish(c) {}
     void finish(int) {
-      int r = oc->readx(rd, oset, onfinish);
+      int r = oc->_readx(rd, oset, onfinish, false);
       if (r > 0 && onfinish) {
         onfinish->finish(r);
         delete onfinish;
@@ -505,6 +549,11 @@ class ObjectCacher {
   bool is_cached(ObjectSet *oset, vector<ObjectExtent>& extents, snapid_t snapid);
 
 private:
+  // external_call is false for retries, so each read is only counted
+  // once towards readahead
+  int _readx(OSDRead *rd, ObjectSet *oset, Context *onfinish,
+	     bool external_call);
+
   // write blocking
   int _wait_for_write(OSDWrite *wr, uint64_t len, ObjectSet *oset, Mutex& lock);
   
@@ -538,6 +587,16 @@ public:
   void set_max_dirty_age(double a) {
     max_dirty_age.set_from_double(a);
   }
+  /**
+   * prefetch for sequential streams
+   *
+   * @param max largest readahead window in bytes, 0 to disable
+   * @param trigger sequential reads before readahead starts
+   */
+  void set_readahead(uint64_t max, unsigned trigger) {
+    readahead_max = max;
+    readahead_trigger = trigger;
+  }
 
   // file functions
 
@@ -36,9 +36,11 @@
 #include "messages/MOSDFailure.h"
 
 #include <errno.h>
+#include <limits.h>
 
 #include "common/config.h"
 #include "common/perf_counters.h"
+#include "include/str_list.h"
 
 
 #define dout_subsys ceph_subsys_objecter
@@ -55,6 +57,12 @@ enum {
   l_osdc_op_resend,
   l_osdc_op_ack,
   l_osdc_op_commit,
+  l_osdc_op_queued,
+  l_osdc_op_queue_drain,
+  l_osdc_op_replica,
+  l_osdc_op_replica_retry,
+  l_osdc_op_window_wait,
+  l_osdc_window_decrease,
 
   l_osdc_op,
   l_osdc_op_r,
@@ -135,6 +143,12 @@ void Objecter::init()
     pcb.add_u64_counter(l_osdc_op_resend, "op_resend");
     pcb.add_u64_counter(l_osdc_op_ack, "op_ack");
     pcb.add_u64_counter(l_osdc_op_commit, "op_commit");
+    pcb.add_u64_counter(l_osdc_op_queued, "op_queued");   // ops submitted via op_submit_queued
+    pcb.add_u64_counter(l_osdc_op_queue_drain, "op_queue_drain");   // batches drained from the submit queue
+    pcb.add_u64_counter(l_osdc_op_replica, "op_replica");   // reads sent to a replica
+    pcb.add_u64_counter(l_osdc_op_replica_retry, "op_replica_retry");   // ... that the replica bounced
+    pcb.add_u64_counter(l_osdc_op_window_wait, "op_window_wait");   // ops held back by an osd's window
+    pcb.add_u64_counter(l_osdc_window_decrease, "window_decrease");   // osd windows cut on slow replies
 
     pcb.add_u64_counter(l_osdc_op, "op");
     pcb.add_u64_counter(l_osdc_op_r, "op_r");
@@ -209,6 +223,17 @@ void Objecter::init()
 	       << cpp_strerror(-ret) << dendl;
   }
 
+  list<string> loc;
+  get_str_list(cct->_conf->objecter_crush_location, loc);
+  for (list<string>::iterator p = loc.begin(); p != loc.end(); ++p) {
+    size_t eq = p->find('=');
+    if (eq == string::npos) {
+      lderr(cct) << "ignoring bad objecter_crush_location item '" << *p << "'" << dendl;
+      continue;
+    }
+    crush_location[p->substr(0, eq)] = p->substr(eq + 1);
+  }
+
   schedule_tick();
   maybe_request_map();
 
@@ -554,6 +579,12 @@ void Objecter::handle_osd_map(MOSDMap *m)
     }
   }
 
+  // ops that moved away may have made room
+  for (map<int,OSDSession*>::iterator p = osd_sessions.begin();
+       p != osd_sessions.end();
+       ++p)
+    _window_kick(p->second);
+
   dump_active();
   
   // finish any Contexts that were waiting on a map update
@@ -599,6 +630,8 @@ void Objecter::C_Op_Map_Latest::finish(int r)
       op->oncommit->complete(-ENOENT);
     }
     op->session_item.remove_myself();
+    objecter->_window_release(op);
+    objecter->_put_write_in_flight(op);
     objecter->ops.erase(op->tid);
     delete op;
   }
@@ -672,7 +705,12 @@ Objecter::OSDSession *Objecter::get_session(int osd)
   map<int,OSDSession*>::iterator p = osd_sessions.find(osd);
   if (p != osd_sessions.end())
     return p->second;
-  OSDSession *s = new OSDSession(osd);
+  md_config_t *conf = cct->_conf;
+  OSDSession *s = new OSDSession(osd, OpWindow(conf->objecter_window_initial,
+					       conf->objecter_window_min,
+					       conf->objecter_window_max,
+					       conf->objecter_window_latency_ratio,
+					       conf->objecter_window_latency_floor));
   osd_sessions[osd] = s;
   s->con = messenger->get_connection(osdmap->get_inst(osd));
   logger->inc(l_osdc_osd_session_open);
@@ -702,6 +740,10 @@ void Objecter::close_session(OSDSession *s)
     s->con->put();
     logger->inc(l_osdc_osd_session_close);
   }
+  for (xlist<Op*>::iterator p = s->ops.begin(); !p.end(); ++p)
+    if ((*p)->window_session == s)
+      (*p)->window_session = NULL;
+  s->window_waiting.clear();
   s->ops.clear();
   s->linger_ops.clear();
   osd_sessions.erase(s->osd);
@@ -787,7 +829,7 @@ void Objecter::tick()
        p != ops.end();
        p++) {
     Op *op = p->second;
-    if (op->session && op->stamp < cutoff) {
+    if (op->session && !op->window_item.is_on_list() && op->stamp < cutoff) {
       ldout(cct, 2) << " tid " << p->first << " on osd." << op->session->osd << " is laggy" << dendl;
       toping.insert(op->session);
       ++laggy_ops;
@@ -807,6 +849,15 @@ void Objecter::tick()
   logger->set(l_osdc_op_laggy, laggy_ops);
   logger->set(l_osdc_osd_laggy, toping.size());
 
+  // let the latency baseline drift up, so an osd that is slower for
+  // good is eventually treated as normal
+  for (map<int,OSDSession*>::iterator p = osd_sessions.begin();
+       p != osd_sessions.end();
+       ++p) {
+    p->second->window.tick();
+    _window_kick(p->second);
+  }
+
   if (num_homeless_ops || !toping.empty())
     maybe_request_map();
 
@@ -861,6 +912,9 @@ tid_t Objecter::op_submit(Op *op, OSDSession *s)
   assert(client_lock.is_locked());
   assert(initialized);
 
+  // anything queued earlier goes first
+  _flush_submit_queue();
+
   assert(op->ops.size() == op->out_bl.size());
   assert(op->ops.size() == op->out_rval.size());
   assert(op->ops.size() == op->out_handler.size());
@@ -872,6 +926,104 @@ tid_t Objecter::op_submit(Op *op, OSDSession *s)
   return _op_submit(op, s);
 }
 
+void Objecter::op_submit_queued(Op *op)
+{
+  list<Op*> ls;
+  ls.push_back(op);
+  op_submit_queued(ls);
+}
+
+void Objecter::op_submit_queued(list<Op*>& ls)
+{
+  assert(initialized);
+
+  /*
+   * take the budget one op at a time.  if we have to wait for it, send
+   * what we already hold budget for first: its replies are what will
+   * free the budget up, so a batch bigger than the throttle (or two
+   * batches racing for it) can't wait on itself.
+   */
+  list<Op*> ready;
+  while (!ls.empty()) {
+    Op *op = ls.front();
+    assert(op->ops.size() == op->out_bl.size());
+    assert(op->ops.size() == op->out_rval.size());
+    assert(op->ops.size() == op->out_handler.size());
+
+    int op_budget = calc_op_budget(op);
+    if (keep_balanced_budget) {
+      if (!op_throttle_bytes.get_or_fail(op_budget)) {
+	_queue_submit(ready);
+	op_throttle_bytes.get(op_budget);
+      }
+      if (!op_throttle_ops.get_or_fail(1)) {
+	_queue_submit(ready);
+	op_throttle_ops.get(1);
+      }
+    } else {
+      op_throttle_bytes.take(op_budget);
+      op_throttle_ops.take(1);
+    }
+    op->budgeted = true;
+    ready.splice(ready.end(), ls, ls.begin());
+  }
+  _queue_submit(ready);
+}
+
+/*
+ * queue ops we already hold budget for, and send them unless another
+ * submitter is already draining the queue.  no locks held.
+ */
+void Objecter::_queue_submit(list<Op*>& ls)
+{
+  if (ls.empty())
+    return;
+
+  simple_spin_lock(&submit_queue_lock);
+  submit_queue.splice(submit_queue.end(), ls);
+  bool drain = !submit_draining;
+  submit_draining = true;
+  simple_spin_unlock(&submit_queue_lock);
+
+  if (!drain)
+    return;   // the current drainer will pick it up
+
+  // we are the drainer until we find the queue empty
+  client_lock.Lock();
+  _flush_submit_queue(true);
+  client_lock.Unlock();
+}
+
+/*
+ * send everything in submit_queue.  we only take ops off the queue
+ * while holding client_lock, so once a caller holds client_lock every
+ * op queued before it has either been sent or is still in the queue.
+ *
+ * the drainer gives up the role in the same critical section where it
+ * finds the queue empty, so a racing op_submit_queued either lands in
+ * a batch we send or becomes the next drainer.
+ */
+void Objecter::_flush_submit_queue(bool drainer)
+{
+  assert(client_lock.is_locked());
+  while (true) {
+    list<Op*> ls;
+    simple_spin_lock(&submit_queue_lock);
+    ls.swap(submit_queue);
+    if (ls.empty() && drainer)
+      submit_draining = false;
+    simple_spin_unlock(&submit_queue_lock);
+    if (ls.empty())
+      break;
+
+    ldout(cct, 15) << "_flush_submit_queue " << ls.size() << " ops" << dendl;
+    logger->inc(l_osdc_op_queue_drain);
+    logger->inc(l_osdc_op_queued, ls.size());
+    for (list<Op*>::iterator p = ls.begin(); p != ls.end(); ++p)
+      _op_submit(*p, NULL);
+  }
+}
+
 tid_t Objecter::_op_submit(Op *op, OSDSession *s)
 {
   // pick tid
@@ -879,6 +1031,9 @@ tid_t Objecter::_op_submit(Op *op, OSDSession *s)
   op->tid = mytid;
   assert(client_inc >= 0);
 
+  if (op->flags & CEPH_OSD_FLAG_WRITE)
+    writes_in_flight[make_pair(op->oloc.pool, op->oid)]++;
+
   // pick target
   bool check_for_latest_map = false;
   if (s) {
@@ -973,7 +1128,15 @@ tid_t Objecter::_op_submit(Op *op, OSDSession *s)
     op->paused = true;
     maybe_request_map();
   } else if (op->session) {
-    send_op(op);
+    if (_window_full(op->session)) {
+      ldout(cct, 10) << " osd." << op->session->osd << " window full ("
+		     << op->session->window.inflight << "/" << op->session->window.window
+		     << "), holding tid " << op->tid << dendl;
+      op->session->window_waiting.push_back(&op->window_item);
+      logger->inc(l_osdc_op_window_wait);
+    } else {
+      send_op(op);
+    }
   } else {
     maybe_request_map();
   }
@@ -987,6 +1150,65 @@ tid_t Objecter::_op_submit(Op *op, OSDSession *s)
   return op->tid;
 }
 
+/*
+ * adaptive per-osd windows
+ *
+ * each session lets at most 'window' ops be in flight to its osd; the
+ * rest wait, in order, on window_waiting.  OpWindow moves the window
+ * with the osd's reply latency.  a slow osd's queue thus stays short,
+ * and the backlog waits here, where it is cheap, instead.
+ */
+bool Objecter::_window_full(OSDSession *s)
+{
+  if (!cct->_conf->objecter_adaptive_window)
+    return false;
+  return !s->window_waiting.empty() || !s->window.has_room();
+}
+
+void Objecter::_window_release(Op *op)
+{
+  op->window_item.remove_myself();
+  if (op->window_session) {
+    op->window_session->window.inflight--;
+    op->window_session = NULL;
+  }
+}
+
+void Objecter::_window_reply(Op *op)
+{
+  OSDSession *s = op->window_session;
+  if (!s)
+    return;   // already heard back for this attempt
+  _window_release(op);
+
+  utime_t now = ceph_clock_now(cct);
+  double lat = (double)(now - op->stamp);
+  if (s->window.reply(now, lat)) {
+    logger->inc(l_osdc_window_decrease);
+    ldout(cct, 10) << "osd." << s->osd << " reply took " << lat << " (base "
+		   << s->window.lat_base << "), window now " << s->window.window << dendl;
+  }
+
+  _window_kick(s);
+}
+
+void Objecter::_window_kick(OSDSession *s)
+{
+  bool pauserd = osdmap->test_flag(CEPH_OSDMAP_PAUSERD);
+  bool pausewr = osdmap->test_flag(CEPH_OSDMAP_PAUSEWR) || osdmap->test_flag(CEPH_OSDMAP_FULL);
+  while (!s->window_waiting.empty() &&
+	 (!cct->_conf->objecter_adaptive_window || s->window.has_room())) {
+    Op *op = s->window_waiting.front();
+    op->window_item.remove_myself();
+    if (((op->flags & CEPH_OSD_FLAG_READ) && pauserd) ||
+	((op->flags & CEPH_OSD_FLAG_WRITE) && pausewr)) {
+      op->paused = true;   // resent when the map unpauses us
+      continue;
+    }
+    send_op(op);
+  }
+}
+
 bool Objecter::is_pg_changed(vector<int>& o, vector<int>& n, bool any_change)
 {
   if (o.empty() && n.empty())
@@ -1022,6 +1244,12 @@ int Objecter::recalc_op_target(Op *op)
     if (acting.size()) {
       int osd;
       bool read = (op->flags & CEPH_OSD_FLAG_READ) && (op->flags & CEPH_OSD_FLAG_WRITE) == 0;
+      if (read && (op->flags & (CEPH_OSD_FLAG_BALANCE_READS|CEPH_OSD_FLAG_LOCALIZE_READS)) &&
+	  writes_in_flight.count(make_pair(op->oloc.pool, op->oid))) {
+	// a replica may not have our write yet
+	ldout(cct, 10) << " write in flight on " << op->oid << ", reading from primary" << dendl;
+	read = false;
+      }
       if (read && (op->flags & CEPH_OSD_FLAG_BALANCE_READS)) {
 	int p = rand() % acting.size();
 	if (p)
@@ -1029,28 +1257,22 @@ int Objecter::recalc_op_target(Op *op)
 	osd = acting[p];
 	ldout(cct, 10) << " chose random osd." << osd << " of " << acting << dendl;
       } else if (read && (op->flags & CEPH_OSD_FLAG_LOCALIZE_READS)) {
-	// look for a local replica
-	int i;
-	/* loop through the OSD replicas and see if any are local to read from.
-	 * We don't need to check the primary since we default to it. (Be
-         * careful to preserve that default, which is why we iterate in reverse
-         * order.) */
-	for (i = acting.size()-1; i > 0; --i) {
-	  if (osdmap->get_addr(acting[i]).is_same_host(messenger->get_myaddr())) {
-	    op->used_replica = true;
-	    ldout(cct, 10) << " chose local osd." << acting[i] << " of " << acting << dendl;
-	    break;
-	  }
-	}
+	int i = pick_nearest_replica(acting);
+	if (i)
+	  op->used_replica = true;
 	osd = acting[i];
+	ldout(cct, 10) << " chose nearest osd." << osd << " of " << acting << dendl;
       } else
 	osd = acting[0];
+      if (op->used_replica)
+	logger->inc(l_osdc_op_replica);
       s = get_session(osd);
     }
 
     if (op->session != s) {
       if (!op->session)
 	num_homeless_ops--;
+      _window_release(op);
       op->session_item.remove_myself();
       op->session = s;
       if (s)
@@ -1063,6 +1285,61 @@ int Objecter::recalc_op_target(Op *op)
   return RECALC_OP_TARGET_NO_ACTION;
 }
 
+/*
+ * a replica on our host always wins.  otherwise, if we know where we
+ * are in the crush hierarchy, prefer the replica that shares the
+ * smallest bucket with us.  ties go to the lower position in acting,
+ * so the primary is preferred when nothing is nearer.
+ */
+int Objecter::pick_nearest_replica(vector<int>& acting)
+{
+  if (!crush_location.empty() && osd_locality_epoch != osdmap->get_epoch())
+    _update_osd_locality();
+
+  int best = 0;
+  int best_dist = INT_MAX;
+  for (unsigned i = 0; i < acting.size(); i++) {
+    int dist;
+    if (osdmap->get_addr(acting[i]).is_same_host(messenger->get_myaddr()))
+      dist = 0;
+    else if (acting[i] < (int)osd_locality.size())
+      dist = osd_locality[acting[i]];
+    else
+      dist = INT_MAX;
+    if (dist < best_dist) {
+      best = i;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+void Objecter::_update_osd_locality()
+{
+  osd_locality.assign(osdmap->get_max_osd(), INT_MAX);
+  for (int i = 0; i < osdmap->get_max_osd(); i++) {
+    if (!osdmap->exists(i))
+      continue;
+    int type = osdmap->crush->get_item_locality(i, crush_location);
+    if (type > 0)
+      osd_locality[i] = type;
+  }
+  osd_locality_epoch = osdmap->get_epoch();
+  ldout(cct, 10) << "_update_osd_locality e" << osd_locality_epoch
+		 << " " << osd_locality << dendl;
+}
+
+void Objecter::_put_write_in_flight(Op *op)
+{
+  if ((op->flags & CEPH_OSD_FLAG_WRITE) == 0)
+    return;
+  map<pair<int64_t, object_t>, int>::iterator p =
+    writes_in_flight.find(make_pair(op->oloc.pool, op->oid));
+  assert(p != writes_in_flight.end());
+  if (--p->second == 0)
+    writes_in_flight.erase(p);
+}
+
 bool Objecter::recalc_linger_op_target(LingerOp *linger_op)
 {
   vector<int> acting;
@@ -1103,6 +1380,11 @@ void Objecter::send_op(Op *op)
 
   assert(op->session->con);
 
+  // count it against the window of the session it goes to
+  _window_release(op);
+  op->window_session = op->session;
+  op->session->window.inflight++;
+
   // preallocated rx buffer?
   if (op->con) {
     ldout(cct, 20) << " revoking rx buffer for " << op->tid << " on " << op->con << dendl;
@@ -1222,15 +1504,22 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
   Context *onack = 0;
   Context *oncommit = 0;
 
+  _window_reply(op);
+
   int rc = m->get_result();
 
   if (rc == -EAGAIN) {
-    ldout(cct, 7) << " got -EAGAIN, resubmitting" << dendl;
-    if (op->onack)
-      num_unacked--;
-    if (op->oncommit)
-      num_uncommitted--;
-    op_submit(op);
+    // the osd could not serve this from a replica; go to the primary
+    ldout(cct, 7) << " got -EAGAIN, resending to primary" << dendl;
+    if (op->used_replica)
+      logger->inc(l_osdc_op_replica_retry);
+    op->flags &= ~(CEPH_OSD_FLAG_BALANCE_READS | CEPH_OSD_FLAG_LOCALIZE_READS);
+    op->acting.clear();   // force a new target
+    recalc_op_target(op);
+    if (op->session)
+      send_op(op);
+    else
+      maybe_request_map();
     m->put();
     return;
   }
@@ -1301,6 +1590,8 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     ldout(cct, 15) << "handle_osd_op_reply completed tid " << tid << dendl;
     if (op->budgeted)
       put_op_budget(op);
+    _window_release(op);
+    _put_write_in_flight(op);
     ops.erase(tid);
     logger->set(l_osdc_op_active, ops.size());
     if (op->con)
@@ -1926,9 +2217,29 @@ void Objecter::dump_requests(Formatter& fmt) const
   dump_pool_ops(fmt);
   dump_pool_stat_ops(fmt);
   dump_statfs_ops(fmt);
+  dump_sessions(fmt);
   fmt.close_section(); // requests object
 }
 
+void Objecter::dump_sessions(Formatter& fmt) const
+{
+  fmt.open_array_section("osd_sessions");
+  for (map<int,OSDSession*>::const_iterator p = osd_sessions.begin();
+       p != osd_sessions.end();
+       ++p) {
+    const OSDSession *s = p->second;
+    fmt.open_object_section("session");
+    fmt.dump_int("osd", s->osd);
+    fmt.dump_float("window", s->window.window);
+    fmt.dump_int("inflight", s->window.inflight);
+    fmt.dump_unsigned("waiting", s->window_waiting.size());
+    fmt.dump_float("latency_avg", s->window.lat_avg);
+    fmt.dump_float("latency_base", s->window.lat_base);
+    fmt.close_section();
+  }
+  fmt.close_section();
+}
+
 void Objecter::dump_ops(Formatter& fmt) const
 {
   fmt.open_array_section("ops");
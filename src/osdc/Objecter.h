@@ -18,12 +18,15 @@
 #include "include/types.h"
 #include "include/buffer.h"
 #include "include/xlist.h"
+#include "include/rados/rados_types.hpp"
 
 #include "osd/OSDMap.h"
 #include "messages/MOSDOp.h"
 
 #include "common/admin_socket.h"
 #include "common/Timer.h"
+#include "common/simple_spin.h"
+#include "osdc/OpWindow.h"
 
 #include <list>
 #include <map>
@@ -246,6 +249,10 @@ struct ObjectOperation {
     bufferlist bl;
     add_data(CEPH_OSD_OP_DELETE, 0, 0, bl);
   }
+  void rollback(snapid_t snapid) {
+    OSDOp& osd_op = add_op(CEPH_OSD_OP_ROLLBACK);
+    osd_op.op.snap.snapid = snapid;
+  }
   void mapext(uint64_t off, uint64_t len) {
     bufferlist bl;
     add_data(CEPH_OSD_OP_MAPEXT, off, len, bl);
@@ -254,6 +261,62 @@ struct ObjectOperation {
     bufferlist bl;
     add_data(CEPH_OSD_OP_SPARSE_READ, off, len, bl);
   }
+  void checksum(uint8_t type, uint64_t off, uint64_t len, uint32_t chunk_size,
+		bufferlist *pbl, int *prval) {
+    OSDOp& osd_op = add_op(CEPH_OSD_OP_CHECKSUM);
+    osd_op.op.checksum.offset = off;
+    osd_op.op.checksum.length = len;
+    osd_op.op.checksum.type = type;
+    osd_op.op.checksum.chunk_size = chunk_size;
+    unsigned p = ops.size() - 1;
+    out_bl[p] = pbl;
+    out_rval[p] = prval;
+  }
+
+  struct C_ObjectOperation_decodesnaps : public Context {
+    bufferlist bl;
+    librados::snap_set_t *psnaps;
+    int *prval;
+    C_ObjectOperation_decodesnaps(librados::snap_set_t *ps, int *pr)
+      : psnaps(ps), prval(pr) {}
+    void finish(int r) {
+      if (r >= 0) {
+	bufferlist::iterator p = bl.begin();
+	try {
+	  obj_list_snap_response_t resp;
+	  ::decode(resp, p);
+	  if (psnaps) {
+	    psnaps->clones.clear();
+	    for (vector<clone_info>::iterator ci = resp.clones.begin();
+		 ci != resp.clones.end();
+		 ++ci) {
+	      librados::clone_info_t clone;
+	      clone.cloneid = ci->cloneid;
+	      clone.snaps.assign(ci->snaps.begin(), ci->snaps.end());
+	      clone.overlap = ci->overlap;
+	      clone.size = ci->size;
+	      psnaps->clones.push_back(clone);
+	    }
+	    psnaps->seq = resp.seq;
+	  }
+	}
+	catch (buffer::error& e) {
+	  if (prval)
+	    *prval = -EIO;
+	}
+      }
+    }
+  };
+  void list_snaps(librados::snap_set_t *psnaps, int *prval) {
+    add_op(CEPH_OSD_OP_LIST_SNAPS);
+    if (psnaps || prval) {
+      unsigned p = ops.size() - 1;
+      C_ObjectOperation_decodesnaps *h = new C_ObjectOperation_decodesnaps(psnaps, prval);
+      out_handler[p] = h;
+      out_bl[p] = &h->bl;
+      out_rval[p] = prval;
+    }
+  }
 
   void clone_range(const object_t& src_oid, uint64_t src_offset, uint64_t len, uint64_t dst_offset) {
     add_clone_range(CEPH_OSD_OP_CLONERANGE, dst_offset, len, src_oid, src_offset, CEPH_NOSNAP);
@@ -455,6 +518,13 @@ struct ObjectOperation {
   void call(const char *cname, const char *method, bufferlist &indata) {
     add_call(CEPH_OSD_OP_CALL, cname, method, indata);
   }
+  void call(const char *cname, const char *method, bufferlist &indata,
+	    bufferlist *outbl, int *prval) {
+    add_call(CEPH_OSD_OP_CALL, cname, method, indata);
+    unsigned p = ops.size() - 1;
+    out_bl[p] = outbl;
+    out_rval[p] = prval;
+  }
 
   // watch/notify
   void watch(uint64_t cookie, uint64_t ver, bool set) {
@@ -563,6 +633,9 @@ public:
     OSDSession *session;
     xlist<Op*>::item session_item;
     int incarnation;
+
+    OSDSession *window_session;      ///< session whose window we count against
+    xlist<Op*>::item window_item;    ///< on session->window_waiting
     
     object_t oid;
     object_locator_t oloc;
@@ -605,6 +678,7 @@ public:
     Op(const object_t& o, const object_locator_t& ol, vector<OSDOp>& op,
        int f, Context *ac, Context *co, eversion_t *ov) :
       session(NULL), session_item(this), incarnation(0),
+      window_session(NULL), window_item(this),
       oid(o), oloc(ol),
       used_replica(false), con(NULL),
       snapid(CEPH_NOSNAP),
@@ -835,7 +909,12 @@ public:
     int incarnation;
     Connection *con;
 
-    OSDSession(int o) : osd(o), incarnation(0), con(NULL) {}
+    // adaptive window: how many ops we let in flight to this osd
+    OpWindow window;
+    xlist<Op*> window_waiting;   ///< held back by the window
+
+    OSDSession(int o, const OpWindow& w) : osd(o), incarnation(0), con(NULL),
+					   window(w) {}
   };
   map<int,OSDSession*> osd_sessions;
 
@@ -856,7 +935,20 @@ public:
 
   map<epoch_t,list< pair<Context*, int> > > waiting_for_map;
 
+  // balanced/localized reads
+  map<pair<int64_t, object_t>, int> writes_in_flight;   ///< (pool, oid); reads of these go to the primary
+  map<string, string> crush_location;          ///< where we are, e.g. host=foo rack=bar
+  vector<int> osd_locality;                    ///< per osd; lower is nearer
+  epoch_t osd_locality_epoch;
+  void _update_osd_locality();
+  int pick_nearest_replica(vector<int>& acting);
+  void _put_write_in_flight(Op *op);
+
   void send_op(Op *op);
+  bool _window_full(OSDSession *s);
+  void _window_release(Op *op);
+  void _window_reply(Op *op);
+  void _window_kick(OSDSession *s);
   bool is_pg_changed(vector<int>& a, vector<int>& b, bool any_change=false);
   enum recalc_op_target_result {
     RECALC_OP_TARGET_NO_ACTION = 0,
@@ -912,6 +1004,13 @@ public:
   }
   Throttle op_throttle_bytes, op_throttle_ops;
 
+  // ops submitted without client_lock, waiting to be sent
+  simple_spinlock_t submit_queue_lock;
+  list<Op*> submit_queue;
+  bool submit_draining;   ///< someone is draining submit_queue
+  void _flush_submit_queue(bool drainer=false);
+  void _queue_submit(list<Op*>& ls);
+
  public:
   Objecter(CephContext *cct_, Messenger *m, MonClient *mc,
 	   OSDMap *om, Mutex& l, SafeTimer& t) : 
@@ -927,8 +1026,10 @@ public:
     logger(NULL), tick_event(NULL),
     m_request_state_hook(NULL),
     num_homeless_ops(0),
+    osd_locality_epoch(0),
     op_throttle_bytes(cct, "objecter_bytes", cct->_conf->objecter_inflight_op_bytes),
-    op_throttle_ops(cct, "objecter_ops", cct->_conf->objecter_inflight_ops)
+    op_throttle_ops(cct, "objecter_ops", cct->_conf->objecter_inflight_ops),
+    submit_queue_lock(SIMPLE_SPINLOCK_INITIALIZER), submit_draining(false)
   { }
   ~Objecter() {
     assert(!tick_event);
@@ -964,6 +1065,21 @@ private:
   tid_t op_submit(Op *op, OSDSession *s = NULL);
   tid_t _op_submit(Op *op, OSDSession *s);
 
+ public:
+  /**
+   * submit an op built with one of the prepare_*_op helpers, WITHOUT
+   * holding client_lock.
+   *
+   * The op is queued and sent by whichever submitter gets to the queue
+   * first, so a burst of submitting threads takes client_lock once per
+   * batch rather than once per op.  Ops are sent in the order they were
+   * queued, and before anything later passed to the locked helpers.
+   */
+  void op_submit_queued(Op *op);
+  /// queue several ops at once; they go out back to back, in list order,
+  /// as budget for them becomes available
+  void op_submit_queued(list<Op*>& ls);
+
   // public interface
  public:
   bool is_active() {
@@ -975,6 +1091,7 @@ private:
    */
   void dump_active();
   void dump_requests(Formatter& fmt) const;
+  void dump_sessions(Formatter& fmt) const;
   void dump_ops(Formatter& fmt) const;
   void dump_linger_ops(Formatter& fmt) const;
   void dump_pool_ops(Formatter& fmt) const;
@@ -997,20 +1114,27 @@ private:
   void clear_global_op_flag(int flags) { global_op_flags &= ~flags; }
 
   // mid-level helpers
-  tid_t mutate(const object_t& oid, const object_locator_t& oloc, 
-	       ObjectOperation& op,
-	       const SnapContext& snapc, utime_t mtime, int flags,
-	       Context *onack, Context *oncommit, eversion_t *objver = NULL) {
+  Op *prepare_mutate_op(const object_t& oid, const object_locator_t& oloc,
+			ObjectOperation& op,
+			const SnapContext& snapc, utime_t mtime, int flags,
+			Context *onack, Context *oncommit, eversion_t *objver = NULL) {
     Op *o = new Op(oid, oloc, op.ops, flags | global_op_flags | CEPH_OSD_FLAG_WRITE, onack, oncommit, objver);
     o->priority = op.priority;
     o->mtime = mtime;
     o->snapc = snapc;
-    return op_submit(o);
+    return o;
   }
-  tid_t read(const object_t& oid, const object_locator_t& oloc,
-	     ObjectOperation& op,
-	     snapid_t snapid, bufferlist *pbl, int flags,
-	     Context *onack, eversion_t *objver = NULL) {
+  tid_t mutate(const object_t& oid, const object_locator_t& oloc, 
+	       ObjectOperation& op,
+	       const SnapContext& snapc, utime_t mtime, int flags,
+	       Context *onack, Context *oncommit, eversion_t *objver = NULL) {
+    return op_submit(prepare_mutate_op(oid, oloc, op, snapc, mtime, flags,
+				       onack, oncommit, objver));
+  }
+  Op *prepare_read_op(const object_t& oid, const object_locator_t& oloc,
+		      ObjectOperation& op,
+		      snapid_t snapid, bufferlist *pbl, int flags,
+		      Context *onack, eversion_t *objver = NULL) {
     Op *o = new Op(oid, oloc, op.ops, flags | global_op_flags | CEPH_OSD_FLAG_READ, onack, NULL, objver);
     o->priority = op.priority;
     o->snapid = snapid;
@@ -1018,7 +1142,14 @@ private:
     o->out_bl.swap(op.out_bl);
     o->out_handler.swap(op.out_handler);
     o->out_rval.swap(op.out_rval);
-    return op_submit(o);
+    return o;
+  }
+  tid_t read(const object_t& oid, const object_locator_t& oloc,
+	     ObjectOperation& op,
+	     snapid_t snapid, bufferlist *pbl, int flags,
+	     Context *onack, eversion_t *objver = NULL) {
+    return op_submit(prepare_read_op(oid, oloc, op, snapid, pbl, flags,
+				     onack, objver));
   }
   tid_t linger(const object_t& oid, const object_locator_t& oloc, 
 	       ObjectOperation& op,
@@ -1068,10 +1199,10 @@ private:
     return op_submit(o);
   }
 
-  tid_t read(const object_t& oid, const object_locator_t& oloc, 
-	     uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
-	     Context *onfinish,
-	     eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+  Op *prepare_read_op(const object_t& oid, const object_locator_t& oloc,
+		      uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
+		      Context *onfinish,
+		      eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
     vector<OSDOp> ops;
     int i = init_ops(ops, 1, extra_ops);
     ops[i].op.op = CEPH_OSD_OP_READ;
@@ -1082,7 +1213,14 @@ private:
     Op *o = new Op(oid, oloc, ops, flags | global_op_flags | CEPH_OSD_FLAG_READ, onfinish, 0, objver);
     o->snapid = snap;
     o->outbl = pbl;
-    return op_submit(o);
+    return o;
+  }
+  tid_t read(const object_t& oid, const object_locator_t& oloc, 
+	     uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
+	     Context *onfinish,
+	     eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+    return op_submit(prepare_read_op(oid, oloc, off, len, snap, pbl, flags,
+				     onfinish, objver, extra_ops));
   }
 
   tid_t read_trunc(const object_t& oid, const object_locator_t& oloc, 
@@ -1118,10 +1256,10 @@ private:
     o->outbl = pbl;
     return op_submit(o);
   }
-  tid_t sparse_read(const object_t& oid, const object_locator_t& oloc,
-	     uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
-	     Context *onfinish,
-	     eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+  Op *prepare_sparse_read_op(const object_t& oid, const object_locator_t& oloc,
+			     uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
+			     Context *onfinish,
+			     eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
     vector<OSDOp> ops;
     int i = init_ops(ops, 1, extra_ops);
     ops[i].op.op = CEPH_OSD_OP_SPARSE_READ;
@@ -1132,7 +1270,14 @@ private:
     Op *o = new Op(oid, oloc, ops, flags | global_op_flags | CEPH_OSD_FLAG_READ, onfinish, 0, objver);
     o->snapid = snap;
     o->outbl = pbl;
-    return op_submit(o);
+    return o;
+  }
+  tid_t sparse_read(const object_t& oid, const object_locator_t& oloc,
+	     uint64_t off, uint64_t len, snapid_t snap, bufferlist *pbl, int flags,
+	     Context *onfinish,
+	     eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+    return op_submit(prepare_sparse_read_op(oid, oloc, off, len, snap, pbl, flags,
+					    onfinish, objver, extra_ops));
   }
 
   tid_t getxattr(const object_t& oid, const object_locator_t& oloc,
@@ -1184,11 +1329,11 @@ private:
     o->snapc = snapc;
     return op_submit(o);
   }
-  tid_t write(const object_t& oid, const object_locator_t& oloc,
-	      uint64_t off, uint64_t len, const SnapContext& snapc, const bufferlist &bl,
-	      utime_t mtime, int flags,
-	      Context *onack, Context *oncommit,
-	      eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+  Op *prepare_write_op(const object_t& oid, const object_locator_t& oloc,
+		       uint64_t off, uint64_t len, const SnapContext& snapc, const bufferlist &bl,
+		       utime_t mtime, int flags,
+		       Context *onack, Context *oncommit,
+		       eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
     vector<OSDOp> ops;
     int i = init_ops(ops, 1, extra_ops);
     ops[i].op.op = CEPH_OSD_OP_WRITE;
@@ -1200,13 +1345,21 @@ private:
     Op *o = new Op(oid, oloc, ops, flags | global_op_flags | CEPH_OSD_FLAG_WRITE, onack, oncommit, objver);
     o->mtime = mtime;
     o->snapc = snapc;
-    return op_submit(o);
+    return o;
   }
-  tid_t append(const object_t& oid, const object_locator_t& oloc,
-	       uint64_t len, const SnapContext& snapc, const bufferlist &bl,
-	       utime_t mtime, int flags,
-	       Context *onack, Context *oncommit,
-	       eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+  tid_t write(const object_t& oid, const object_locator_t& oloc,
+	      uint64_t off, uint64_t len, const SnapContext& snapc, const bufferlist &bl,
+	      utime_t mtime, int flags,
+	      Context *onack, Context *oncommit,
+	      eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+    return op_submit(prepare_write_op(oid, oloc, off, len, snapc, bl, mtime, flags,
+				      onack, oncommit, objver, extra_ops));
+  }
+  Op *prepare_append_op(const object_t& oid, const object_locator_t& oloc,
+			uint64_t len, const SnapContext& snapc, const bufferlist &bl,
+			utime_t mtime, int flags,
+			Context *onack, Context *oncommit,
+			eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
     vector<OSDOp> ops;
     int i = init_ops(ops, 1, extra_ops);
     ops[i].op.op = CEPH_OSD_OP_APPEND;
@@ -1218,7 +1371,15 @@ private:
     Op *o = new Op(oid, oloc, ops, flags | global_op_flags | CEPH_OSD_FLAG_WRITE, onack, oncommit, objver);
     o->mtime = mtime;
     o->snapc = snapc;
-    return op_submit(o);
+    return o;
+  }
+  tid_t append(const object_t& oid, const object_locator_t& oloc,
+	       uint64_t len, const SnapContext& snapc, const bufferlist &bl,
+	       utime_t mtime, int flags,
+	       Context *onack, Context *oncommit,
+	       eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+    return op_submit(prepare_append_op(oid, oloc, len, snapc, bl, mtime, flags,
+				       onack, oncommit, objver, extra_ops));
   }
   tid_t write_trunc(const object_t& oid, const object_locator_t& oloc,
 	      uint64_t off, uint64_t len, const SnapContext& snapc, const bufferlist &bl,
@@ -1239,10 +1400,10 @@ private:
     o->snapc = snapc;
     return op_submit(o);
   }
-  tid_t write_full(const object_t& oid, const object_locator_t& oloc,
-		   const SnapContext& snapc, const bufferlist &bl, utime_t mtime, int flags,
-		   Context *onack, Context *oncommit,
-		   eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+  Op *prepare_write_full_op(const object_t& oid, const object_locator_t& oloc,
+			    const SnapContext& snapc, const bufferlist &bl, utime_t mtime, int flags,
+			    Context *onack, Context *oncommit,
+			    eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
     vector<OSDOp> ops;
     int i = init_ops(ops, 1, extra_ops);
     ops[i].op.op = CEPH_OSD_OP_WRITEFULL;
@@ -1252,7 +1413,14 @@ private:
     Op *o = new Op(oid, oloc, ops, flags | global_op_flags | CEPH_OSD_FLAG_WRITE, onack, oncommit, objver);
     o->mtime = mtime;
     o->snapc = snapc;
-    return op_submit(o);
+    return o;
+  }
+  tid_t write_full(const object_t& oid, const object_locator_t& oloc,
+		   const SnapContext& snapc, const bufferlist &bl, utime_t mtime, int flags,
+		   Context *onack, Context *oncommit,
+		   eversion_t *objver = NULL, ObjectOperation *extra_ops = NULL) {
+    return op_submit(prepare_write_full_op(oid, oloc, snapc, bl, mtime, flags,
+					   onack, oncommit, objver, extra_ops));
   }
   tid_t trunc(const object_t& oid, const object_locator_t& oloc,
 	      const SnapContext& snapc,
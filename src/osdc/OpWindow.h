@@ -0,0 +1,69 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSDC_OPWINDOW_H
+#define CEPH_OSDC_OPWINDOW_H
+
+#include "include/utime.h"
+
+/**
+ * OpWindow - AIMD limit on the ops in flight to one osd
+ *
+ * The window grows by one op per window's worth of replies, up to max.
+ * It halves, at most once per round trip and no lower than min, when a
+ * reply is slower than floor and more than ratio times the best latency
+ * seen lately.  That baseline drifts up on each tick(), so an osd that
+ * stays slow is eventually treated as normal.
+ */
+struct OpWindow {
+  double window;
+  int inflight;          ///< sent, no reply yet
+  double lat_avg;        ///< smoothed reply latency
+  double lat_base;       ///< best reply latency lately
+  utime_t last_decrease;
+
+  double min, max, ratio, floor;
+
+  OpWindow(double initial, double mn, double mx, double r, double f)
+    : window(initial), inflight(0), lat_avg(0), lat_base(0),
+      min(mn), max(mx), ratio(r), floor(f) {}
+
+  bool has_room() const {
+    return inflight < (int)window;
+  }
+
+  /// account a reply that took lat seconds; true if that cut the window
+  bool reply(utime_t now, double lat) {
+    lat_avg = lat_avg ? lat_avg * .9 + lat * .1 : lat;
+    if (!lat_base || lat < lat_base)
+      lat_base = lat;
+
+    if (lat > floor && lat > lat_base * ratio) {
+      if ((double)(now - last_decrease) > lat_avg) {
+	window = window / 2 > min ? window / 2 : min;
+	last_decrease = now;
+	return true;
+      }
+    } else {
+      window = window + 1.0 / window < max ? window + 1.0 / window : max;
+    }
+    return false;
+  }
+
+  void tick() {
+    lat_base *= 1.1;
+  }
+};
+
+#endif
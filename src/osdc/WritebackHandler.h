@@ -20,6 +20,12 @@ class WritebackHandler {
 		      uint64_t off, uint64_t len, const SnapContext& snapc,
 		      const bufferlist &bl, utime_t mtime, uint64_t trunc_size,
 		      __u32 trunc_seq, Context *oncommit) = 0;
+  /// write several extents (offset -> data) of one object in one op
+  virtual tid_t write_extents(const object_t& oid, const object_locator_t& oloc,
+			      const map<uint64_t, bufferlist>& extents,
+			      const SnapContext& snapc, utime_t mtime,
+			      uint64_t trunc_size, __u32 trunc_seq,
+			      Context *oncommit) = 0;
   virtual tid_t lock(const object_t& oid, const object_locator_t& oloc, int op,
 		     int flags, Context *onack, Context *oncommit) {
     assert(0 == "this WritebackHandler does not support the lock operation");
@@ -30,6 +30,7 @@
 #include "include/compat.h"
 #include "common/blkdev.h"
 
+#include <deque>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -73,13 +74,23 @@ void usage()
        << "  export <--snap=name> [image-name] [path]  export image to file\n"
        << "  import [path] [dst-image]                 import image from file (dest defaults\n"
        << "                                            as the filename part of file)\n"
+       << "  export-diff <--from-snap=name> <--snap=name> [image-name] [path]\n"
+       << "                                            export the changes to an image since\n"
+       << "                                            from-snap (or all its data) to file\n"
+       << "  import-diff [path] [image-name]           apply an exported diff to an image\n"
        << "  <cp | copy> <--snap=name> [src] [dest]    copy src image to dest\n"
        << "  <mv | rename> [src] [dest]                rename src image to dest\n"
+       << "  clone <--snap=name> [parent] [dest]       clone a protected snapshot of\n"
+       << "                                            parent to dest, in the same pool\n"
        << "  snap ls [image-name]                      dump list of image snapshots\n"
        << "  snap create <--snap=name> [image-name]    create a snapshot\n"
        << "  snap rollback <--snap=name> [image-name]  rollback image head to snapshot\n"
        << "  snap rm <--snap=name> [image-name]        deletes a snapshot\n"
        << "  snap purge [image-name]                   deletes all snapshots\n"
+       << "  snap protect <--snap=name> [image-name]   prevent a snapshot from being\n"
+       << "                                            deleted, so it can be cloned\n"
+       << "  snap unprotect <--snap=name> [image-name] allow a snapshot with no clones\n"
+       << "                                            to be deleted\n"
        << "  watch [image-name]                        watch events on image\n"
        << "  map [image-name]                          map the image to a block device\n"
        << "                                            using the kernel\n"
@@ -93,6 +104,7 @@ void usage()
        << "  --image <image-name>         image name\n"
        << "  --dest <name>                destination [pool and] image name\n"
        << "  --snap <snapname>            specify snapshot name\n"
+       << "  --from-snap <snapname>       snapshot a diff starts from\n"
        << "  --dest-pool <name>           destination pool name\n"
        << "  --path <path-name>           path name for import/export (if not specified)\n"
        << "  --size <size in MB>          size parameter for create and resize commands\n"
@@ -183,6 +195,16 @@ static int do_rename(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   return 0;
 }
 
+static int do_clone(librbd::RBD &rbd, librados::IoCtx& io_ctx,
+		    const char *imgname, const char *snapname,
+		    const char *destname, int *order)
+{
+  int r = rbd.clone(io_ctx, imgname, snapname, destname, order);
+  if (r < 0)
+    return r;
+  return 0;
+}
+
 static int do_show_info(const char *imgname, librbd::Image& image)
 {
   librbd::image_info_t info;
@@ -191,6 +213,12 @@ static int do_show_info(const char *imgname, librbd::Image& image)
     return r;
 
   print_info(imgname, info);
+
+  string parent_name, parent_snapname;
+  r = image.parent_info(&parent_name, &parent_snapname);
+  if (r == 0)
+    cout << "\tparent snapshot: " << parent_name << "@" << parent_snapname
+	 << std::endl;
   return 0;
 }
 
@@ -249,6 +277,24 @@ static int do_remove_snap(librbd::Image& image, const char *snapname)
   return 0;
 }
 
+static int do_protect_snap(librbd::Image& image, const char *snapname)
+{
+  int r = image.snap_protect(snapname);
+  if (r < 0)
+    return r;
+
+  return 0;
+}
+
+static int do_unprotect_snap(librbd::Image& image, const char *snapname)
+{
+  int r = image.snap_unprotect(snapname);
+  if (r < 0)
+    return r;
+
+  return 0;
+}
+
 static int do_rollback_snap(librbd::Image& image, const char *snapname)
 {
   MyProgressContext pc("Rolling back to snapshot");
@@ -401,6 +447,18 @@ done_img:
   update_snap_name(*new_img, snap);
 }
 
+static int wait_for_write(deque<librbd::RBD::AioCompletion *>& in_flight)
+{
+  librbd::RBD::AioCompletion *completion = in_flight.front();
+  in_flight.pop_front();
+  completion->wait_for_complete();
+  int r = completion->get_return_value();
+  completion->release();
+  if (r < 0)
+    cerr << "error writing to image block" << std::endl;
+  return r;
+}
+
 static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
 		     const char *imgname, int *order, const char *path)
 {
@@ -411,6 +469,9 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   string md_oid;
   struct fiemap *fiemap;
   MyProgressContext pc("Importing image");
+  // keep a window of writes in flight, oldest first
+  deque<librbd::RBD::AioCompletion *> in_flight;
+  size_t max_in_flight = MAX(1, g_conf->rbd_concurrent_management_ops);
 
   if (fd < 0) {
     r = -errno;
@@ -518,21 +579,22 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
         }
         bufferlist bl;
         bl.append(p);
+        while (in_flight.size() >= max_in_flight) {
+	  r = wait_for_write(in_flight);
+	  if (r < 0)
+	    goto done;
+        }
         librbd::RBD::AioCompletion *completion = new librbd::RBD::AioCompletion(NULL, NULL);
         if (!completion) {
           r = -ENOMEM;
           goto done;
         }
         r = image.aio_write(file_pos, len, bl, completion);
-        if (r < 0)
-          goto done;
-	completion->wait_for_complete();
-	r = completion->get_return_value();
-	completion->release();
         if (r < 0) {
-          cerr << "error writing to image block" << std::endl;
+	  completion->release();
           goto done;
-        }
+	}
+	in_flight.push_back(completion);
 
         file_pos += len;
         cur_seg -= len;
@@ -544,6 +606,11 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   r = 0;
 
  done:
+  while (!in_flight.empty()) {
+    int wr = wait_for_write(in_flight);
+    if (r == 0)
+      r = wr;
+  }
   if (r < 0)
     pc.fail();
   else
@@ -553,6 +620,309 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   return r;
 }
 
+/*
+ * A diff is a header line followed by tagged records, little endian,
+ * strings as a 32 bit length and the bytes:
+ *
+ *   'f' <from snap name>   the image must have this snapshot
+ *   't' <to snap name>     taken once the diff is applied
+ *   's' <u64 size>         image size at the end
+ *   'w' <u64 off> <u64 len> <data>
+ *   'z' <u64 off> <u64 len>  zeroed
+ *   'e'                    end
+ */
+#define RBD_DIFF_BANNER "rbd diff v1\n"
+
+struct ExportDiffContext {
+  librbd::Image *image;
+  int fd;
+  uint64_t totalsize;
+  MyProgressContext pc;
+
+  ExportDiffContext(librbd::Image *i, int f, uint64_t t)
+    : image(i), fd(f), totalsize(t), pc("Exporting image") {}
+};
+
+static int export_diff_cb(uint64_t ofs, size_t len, int exists, void *arg)
+{
+  ExportDiffContext *edc = (ExportDiffContext *)arg;
+
+  __u8 tag = exists ? 'w' : 'z';
+  bufferlist bl;
+  ::encode(tag, bl);
+  ::encode(ofs, bl);
+  uint64_t l = len;
+  ::encode(l, bl);
+  if (exists) {
+    bufferlist data;
+    ssize_t r = edc->image->read(ofs, len, data);
+    if (r < 0)
+      return r;
+    if ((size_t)r != len)
+      return -EIO;
+    bl.claim_append(data);
+  }
+  int r = bl.write_fd(edc->fd);
+  if (r < 0)
+    return r;
+
+  if (edc->fd != 1)
+    edc->pc.update_progress(ofs, edc->totalsize);
+  return 0;
+}
+
+static int do_export_diff(librbd::Image& image, const char *fromsnapname,
+			  const char *endsnapname, const char *path)
+{
+  int r;
+  librbd::image_info_t info;
+  int fd;
+
+  r = image.stat(info, sizeof(info));
+  if (r < 0)
+    return r;
+
+  if (strcmp(path, "-") == 0)
+    fd = 1;
+  else
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return -errno;
+
+  ExportDiffContext edc(&image, fd, info.size);
+  {
+    bufferlist bl;
+    bl.append(RBD_DIFF_BANNER, strlen(RBD_DIFF_BANNER));
+
+    __u8 tag;
+    if (fromsnapname) {
+      tag = 'f';
+      ::encode(tag, bl);
+      string from(fromsnapname);
+      ::encode(from, bl);
+    }
+    if (endsnapname) {
+      tag = 't';
+      ::encode(tag, bl);
+      string to(endsnapname);
+      ::encode(to, bl);
+    }
+    tag = 's';
+    ::encode(tag, bl);
+    uint64_t endsize = info.size;
+    ::encode(endsize, bl);
+
+    r = bl.write_fd(fd);
+    if (r < 0)
+      goto out;
+  }
+
+  r = image.diff_iterate(fromsnapname, 0, info.size, export_diff_cb, (void *)&edc);
+  if (r < 0)
+    goto out;
+
+  {
+    __u8 tag = 'e';
+    bufferlist bl;
+    ::encode(tag, bl);
+    r = bl.write_fd(fd);
+  }
+
+ out:
+  if (fd != 1) {
+    close(fd);
+    if (r < 0)
+      edc.pc.fail();
+    else
+      edc.pc.finish();
+  }
+  return r;
+}
+
+static int read_diff(int fd, size_t len, bufferlist& bl)
+{
+  bufferptr p(len);
+  int r = safe_read_exact(fd, p.c_str(), len);
+  if (r < 0)
+    return r;
+  bl.append(p);
+  return 0;
+}
+
+static int read_diff_u64(int fd, uint64_t *val)
+{
+  bufferlist bl;
+  int r = read_diff(fd, sizeof(*val), bl);
+  if (r < 0)
+    return r;
+  bufferlist::iterator p = bl.begin();
+  ::decode(*val, p);
+  return 0;
+}
+
+static int read_diff_string(int fd, string *s)
+{
+  bufferlist bl;
+  int r = read_diff(fd, sizeof(__u32), bl);
+  if (r < 0)
+    return r;
+  __u32 len;
+  bufferlist::iterator p = bl.begin();
+  ::decode(len, p);
+  bl.clear();
+  r = read_diff(fd, len, bl);
+  if (r < 0)
+    return r;
+  s->assign(bl.c_str(), len);
+  return 0;
+}
+
+static bool image_has_snap(librbd::Image& image, const string& name)
+{
+  std::vector<librbd::snap_info_t> snaps;
+  if (image.snap_list(snaps) < 0)
+    return false;
+  for (std::vector<librbd::snap_info_t>::iterator p = snaps.begin();
+       p != snaps.end();
+       ++p)
+    if (p->name == name)
+      return true;
+  return false;
+}
+
+static int do_import_diff(librbd::Image &image, const char *path)
+{
+  int fd, r;
+  string from, to;
+  uint64_t size = 0;
+  deque<librbd::RBD::AioCompletion *> in_flight;
+  size_t max_in_flight = MAX(1, g_conf->rbd_concurrent_management_ops);
+  MyProgressContext pc("Importing image diff");
+
+  if (strcmp(path, "-") == 0)
+    fd = 0;
+  else
+    fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    r = -errno;
+    cerr << "error opening " << path << std::endl;
+    return r;
+  }
+
+  {
+    bufferlist bl;
+    r = read_diff(fd, strlen(RBD_DIFF_BANNER), bl);
+    if (r < 0 || memcmp(bl.c_str(), RBD_DIFF_BANNER, strlen(RBD_DIFF_BANNER))) {
+      cerr << "invalid banner '" << string(bl.c_str(), bl.length())
+	   << "', expected '" << RBD_DIFF_BANNER << "'" << std::endl;
+      r = -EINVAL;
+      goto done;
+    }
+  }
+
+  while (true) {
+    __u8 tag;
+    r = safe_read_exact(fd, &tag, 1);
+    if (r < 0)
+      goto done;
+
+    if (tag == 'e') {
+      break;
+    } else if (tag == 'f') {
+      r = read_diff_string(fd, &from);
+      if (r < 0)
+	goto done;
+      if (!image_has_snap(image, from)) {
+	cerr << "start snapshot '" << from << "' does not exist in the image"
+	     << std::endl;
+	r = -ENOENT;
+	goto done;
+      }
+    } else if (tag == 't') {
+      r = read_diff_string(fd, &to);
+      if (r < 0)
+	goto done;
+      if (image_has_snap(image, to)) {
+	cerr << "end snapshot '" << to << "' already exists, aborting" << std::endl;
+	r = -EEXIST;
+	goto done;
+      }
+    } else if (tag == 's') {
+      r = read_diff_u64(fd, &size);
+      if (r < 0)
+	goto done;
+      librbd::image_info_t info;
+      r = image.stat(info, sizeof(info));
+      if (r < 0)
+	goto done;
+      uint64_t cur_size = info.size;
+      if (size != cur_size) {
+	cerr << "resizing image from " << cur_size << " to " << size << std::endl;
+	r = image.resize(size);
+	if (r < 0)
+	  goto done;
+      }
+    } else if (tag == 'w' || tag == 'z') {
+      uint64_t off, len;
+      r = read_diff_u64(fd, &off);
+      if (r == 0)
+	r = read_diff_u64(fd, &len);
+      if (r < 0)
+	goto done;
+      bufferlist data;
+      if (tag == 'w') {
+	r = read_diff(fd, len, data);
+	if (r < 0)
+	  goto done;
+      }
+      while (in_flight.size() >= max_in_flight) {
+	r = wait_for_write(in_flight);
+	if (r < 0)
+	  goto done;
+      }
+      librbd::RBD::AioCompletion *completion = new librbd::RBD::AioCompletion(NULL, NULL);
+      if (tag == 'w')
+	r = image.aio_write(off, len, data, completion);
+      else
+	r = image.aio_discard(off, len, completion);
+      if (r < 0) {
+	completion->release();
+	goto done;
+      }
+      in_flight.push_back(completion);
+      if (size)
+	pc.update_progress(off, size);
+    } else {
+      cerr << "unrecognized tag byte " << (int)tag << " in stream" << std::endl;
+      r = -EINVAL;
+      goto done;
+    }
+  }
+
+  while (!in_flight.empty()) {
+    r = wait_for_write(in_flight);
+    if (r < 0)
+      goto done;
+  }
+  r = image.flush();
+  if (r == 0 && to.length())
+    r = image.snap_create(to.c_str());
+
+ done:
+  while (!in_flight.empty()) {
+    int wr = wait_for_write(in_flight);
+    if (r == 0)
+      r = wr;
+  }
+  if (r < 0)
+    pc.fail();
+  else
+    pc.finish();
+  if (fd != 0)
+    close(fd);
+  return r;
+}
+
 static int do_copy(librbd::Image &src, librados::IoCtx& dest_pp,
 		   const char *destname)
 {
@@ -837,13 +1207,18 @@ enum {
   OPT_RM,
   OPT_EXPORT,
   OPT_IMPORT,
+  OPT_EXPORT_DIFF,
+  OPT_IMPORT_DIFF,
   OPT_COPY,
   OPT_RENAME,
+  OPT_CLONE,
   OPT_SNAP_CREATE,
   OPT_SNAP_ROLLBACK,
   OPT_SNAP_REMOVE,
   OPT_SNAP_LIST,
   OPT_SNAP_PURGE,
+  OPT_SNAP_PROTECT,
+  OPT_SNAP_UNPROTECT,
   OPT_WATCH,
   OPT_MAP,
   OPT_UNMAP,
@@ -868,12 +1243,18 @@ static int get_cmd(const char *cmd, bool snapcmd)
       return OPT_EXPORT;
     if (strcmp(cmd, "import") == 0)
       return OPT_IMPORT;
+    if (strcmp(cmd, "export-diff") == 0)
+      return OPT_EXPORT_DIFF;
+    if (strcmp(cmd, "import-diff") == 0)
+      return OPT_IMPORT_DIFF;
     if (strcmp(cmd, "copy") == 0 ||
         strcmp(cmd, "cp") == 0)
       return OPT_COPY;
     if (strcmp(cmd, "rename") == 0 ||
         strcmp(cmd, "mv") == 0)
       return OPT_RENAME;
+    if (strcmp(cmd, "clone") == 0)
+      return OPT_CLONE;
     if (strcmp(cmd, "watch") == 0)
       return OPT_WATCH;
     if (strcmp(cmd, "map") == 0)
@@ -897,6 +1278,10 @@ static int get_cmd(const char *cmd, bool snapcmd)
       return OPT_SNAP_LIST;
     if (strcmp(cmd, "purge") == 0)
       return OPT_SNAP_PURGE;
+    if (strcmp(cmd, "protect") == 0)
+      return OPT_SNAP_PROTECT;
+    if (strcmp(cmd, "unprotect") == 0)
+      return OPT_SNAP_UNPROTECT;
   }
 
   return OPT_NO_CMD;
@@ -932,6 +1317,7 @@ int main(int argc, const char **argv)
   uint64_t size = 0;  // in bytes
   int order = 0;
   const char *imgname = NULL, *snapname = NULL, *destname = NULL, *dest_poolname = NULL, *path = NULL, *secretfile = NULL, *user = NULL, *devpath = NULL;
+  const char *fromsnapname = NULL;
 
   std::string val;
   std::ostringstream err;
@@ -949,6 +1335,8 @@ int main(int argc, const char **argv)
       dest_poolname = strdup(val.c_str());
     } else if (ceph_argparse_witharg(args, i, &val, "--snap", (char*)NULL)) {
       snapname = strdup(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--from-snap", (char*)NULL)) {
+      fromsnapname = strdup(val.c_str());
     } else if (ceph_argparse_witharg(args, i, &val, "-i", "--image", (char*)NULL)) {
       imgname = strdup(val.c_str());
     } else if (ceph_argparse_withlonglong(args, i, &sizell, &err, "-s", "--size", (char*)NULL)) {
@@ -1011,6 +1399,8 @@ int main(int argc, const char **argv)
       case OPT_SNAP_REMOVE:
       case OPT_SNAP_LIST:
       case OPT_SNAP_PURGE:
+      case OPT_SNAP_PROTECT:
+      case OPT_SNAP_UNPROTECT:
       case OPT_WATCH:
       case OPT_MAP:
 	set_conf_param(v, &imgname, NULL);
@@ -1019,13 +1409,18 @@ int main(int argc, const char **argv)
 	set_conf_param(v, &devpath, NULL);
 	break;
       case OPT_EXPORT:
+      case OPT_EXPORT_DIFF:
 	set_conf_param(v, &imgname, &path);
 	break;
       case OPT_IMPORT:
 	set_conf_param(v, &path, &destname);
 	break;
+      case OPT_IMPORT_DIFF:
+	set_conf_param(v, &path, &imgname);
+	break;
       case OPT_COPY:
       case OPT_RENAME:
+      case OPT_CLONE:
 	set_conf_param(v, &imgname, &destname);
 	break;
       case OPT_SHOWMAPPED:
@@ -1044,6 +1439,11 @@ int main(int argc, const char **argv)
     usage_exit();
   }
 
+  if (opt_cmd == OPT_IMPORT_DIFF && !path) {
+    cerr << "error: path was not specified" << std::endl;
+    usage_exit();
+  }
+
   if (opt_cmd == OPT_IMPORT && !path) {
     cerr << "error: path was not specified" << std::endl;
     usage_exit();
@@ -1064,13 +1464,15 @@ int main(int argc, const char **argv)
 		      (char **)&imgname, (char **)&snapname);
   if (snapname && opt_cmd != OPT_SNAP_CREATE && opt_cmd != OPT_SNAP_ROLLBACK &&
       opt_cmd != OPT_SNAP_REMOVE && opt_cmd != OPT_INFO &&
-      opt_cmd != OPT_EXPORT && opt_cmd != OPT_COPY &&
-      opt_cmd != OPT_MAP) {
+      opt_cmd != OPT_EXPORT && opt_cmd != OPT_EXPORT_DIFF && opt_cmd != OPT_COPY &&
+      opt_cmd != OPT_MAP && opt_cmd != OPT_CLONE &&
+      opt_cmd != OPT_SNAP_PROTECT && opt_cmd != OPT_SNAP_UNPROTECT) {
     cerr << "error: snapname specified for a command that doesn't use it" << std::endl;
     usage_exit();
   }
   if ((opt_cmd == OPT_SNAP_CREATE || opt_cmd == OPT_SNAP_ROLLBACK ||
-       opt_cmd == OPT_SNAP_REMOVE) && !snapname) {
+       opt_cmd == OPT_SNAP_REMOVE || opt_cmd == OPT_CLONE ||
+       opt_cmd == OPT_SNAP_PROTECT || opt_cmd == OPT_SNAP_UNPROTECT) && !snapname) {
     cerr << "error: snap name was not specified" << std::endl;
     usage_exit();
   }
@@ -1082,16 +1484,27 @@ int main(int argc, const char **argv)
   if (!dest_poolname)
     dest_poolname = poolname;
 
+  if (fromsnapname && opt_cmd != OPT_EXPORT_DIFF) {
+    cerr << "error: from-snap specified for a command that doesn't use it" << std::endl;
+    usage_exit();
+  }
+
   if (opt_cmd == OPT_EXPORT && !path)
     path = imgname;
 
-  if (opt_cmd == OPT_COPY && !destname ) {
+  if (opt_cmd == OPT_EXPORT_DIFF && !path) {
+    cerr << "error: path was not specified" << std::endl;
+    usage_exit();
+  }
+
+  if ((opt_cmd == OPT_COPY || opt_cmd == OPT_CLONE) && !destname ) {
     cerr << "error: destination image name was not specified" << std::endl;
     usage_exit();
   }
 
-  if ((opt_cmd == OPT_RENAME) && (strcmp(poolname, dest_poolname) != 0)) {
-    cerr << "error: mv/rename across pools not supported" << std::endl;
+  if ((opt_cmd == OPT_RENAME || opt_cmd == OPT_CLONE) &&
+      (strcmp(poolname, dest_poolname) != 0)) {
+    cerr << "error: mv/rename/clone across pools not supported" << std::endl;
     cerr << "source pool: " << poolname << " dest pool: " << dest_poolname
       << std::endl;
     exit(EXIT_FAILURE);
@@ -1123,7 +1536,9 @@ int main(int argc, const char **argv)
       (opt_cmd == OPT_RESIZE || opt_cmd == OPT_INFO || opt_cmd == OPT_SNAP_LIST ||
        opt_cmd == OPT_SNAP_CREATE || opt_cmd == OPT_SNAP_ROLLBACK ||
        opt_cmd == OPT_SNAP_REMOVE || opt_cmd == OPT_SNAP_PURGE ||
-       opt_cmd == OPT_EXPORT || opt_cmd == OPT_WATCH || opt_cmd == OPT_COPY)) {
+       opt_cmd == OPT_SNAP_PROTECT || opt_cmd == OPT_SNAP_UNPROTECT ||
+       opt_cmd == OPT_EXPORT || opt_cmd == OPT_EXPORT_DIFF ||
+       opt_cmd == OPT_IMPORT_DIFF || opt_cmd == OPT_WATCH || opt_cmd == OPT_COPY)) {
     r = rbd.open(io_ctx, image, imgname);
     if (r < 0) {
       cerr << "error opening image " << imgname << ": " << cpp_strerror(-r) << std::endl;
@@ -1132,7 +1547,8 @@ int main(int argc, const char **argv)
   }
 
   if (snapname && talk_to_cluster &&
-      (opt_cmd == OPT_INFO || opt_cmd == OPT_EXPORT || opt_cmd == OPT_COPY)) {
+      (opt_cmd == OPT_INFO || opt_cmd == OPT_EXPORT || opt_cmd == OPT_EXPORT_DIFF ||
+       opt_cmd == OPT_COPY)) {
     r = image.snap_set(snapname);
     if (r < 0) {
       cerr << "error setting snapshot context: " << cpp_strerror(-r) << std::endl;
@@ -1189,6 +1605,23 @@ int main(int argc, const char **argv)
     }
     break;
 
+  case OPT_CLONE:
+    if (order && (order < 12 || order > 25)) {
+      cerr << "order must be between 12 (4 KB) and 25 (32 MB)" << std::endl;
+      usage();
+      exit(1);
+    }
+    r = do_clone(rbd, io_ctx, imgname, snapname, destname, &order);
+    if (r < 0) {
+      if (r == -EINVAL)
+	cerr << "clone error: the parent snapshot must be protected first"
+	     << " with 'rbd snap protect'" << std::endl;
+      else
+	cerr << "clone error: " << cpp_strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
   case OPT_INFO:
     r = do_show_info(imgname, image);
     if (r < 0) {
@@ -1286,6 +1719,26 @@ int main(int argc, const char **argv)
     }
     break;
 
+  case OPT_SNAP_PROTECT:
+    r = do_protect_snap(image, snapname);
+    if (r < 0) {
+      cerr << "protecting snap failed: " << cpp_strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
+  case OPT_SNAP_UNPROTECT:
+    r = do_unprotect_snap(image, snapname);
+    if (r < 0) {
+      if (r == -EBUSY)
+	cerr << "unprotecting snap failed: the snapshot still has clones"
+	     << std::endl;
+      else
+	cerr << "unprotecting snap failed: " << cpp_strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
   case OPT_EXPORT:
     if (!path) {
       cerr << "pathname should be specified" << std::endl;
@@ -1310,6 +1763,22 @@ int main(int argc, const char **argv)
     }
     break;
 
+  case OPT_EXPORT_DIFF:
+    r = do_export_diff(image, fromsnapname, snapname, path);
+    if (r < 0) {
+      cerr << "export-diff error: " << cpp_strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
+  case OPT_IMPORT_DIFF:
+    r = do_import_diff(image, path);
+    if (r < 0) {
+      cerr << "import-diff failed: " << cpp_strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
   case OPT_COPY:
     r = do_copy(image, dest_io_ctx, destname);
     if (r < 0) {
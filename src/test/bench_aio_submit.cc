@@ -0,0 +1,153 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Many application threads sharing one librados handle, each keeping a
+ * window of small aio_writes in flight.  Measures how well the client
+ * side submission and completion paths scale with threads.
+ *
+ *   bench_aio_submit <pool> [threads] [seconds] [window] [size]
+ */
+
+#include "include/rados/librados.hpp"
+#include "include/utime.h"
+#include "common/Clock.h"
+#include "common/Thread.h"
+
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace librados;
+using std::string;
+
+struct Writer : public Thread {
+  IoCtx& io;
+  int id;
+  double seconds;
+  unsigned window;
+  bufferlist data;
+  uint64_t done;
+  int err;
+
+  Writer(IoCtx& i, int n, double s, unsigned w, int size)
+    : io(i), id(n), seconds(s), window(w), done(0), err(0) {
+    data.append(string(size, 'x'));
+  }
+
+  void *entry() {
+    std::deque<AioCompletion*> q;
+    utime_t end = ceph_clock_now(NULL);
+    end += seconds;
+    uint64_t n = 0;
+    while (ceph_clock_now(NULL) < end) {
+      while (q.size() < window) {
+	std::ostringstream oid;
+	oid << "aio_submit_" << id << "_" << (n++ % 16);
+	AioCompletion *c = Rados::aio_create_completion();
+	int r = io.aio_write(oid.str(), c, data, data.length(), 0);
+	if (r < 0) {
+	  err = r;
+	  c->release();
+	  break;
+	}
+	q.push_back(c);
+      }
+      if (q.empty())
+	break;
+      q.front()->wait_for_complete();
+      if (q.front()->get_return_value() < 0)
+	err = q.front()->get_return_value();
+      q.front()->release();
+      q.pop_front();
+      done++;
+    }
+    while (!q.empty()) {
+      q.front()->wait_for_complete();
+      q.front()->release();
+      q.pop_front();
+      done++;
+    }
+    return 0;
+  }
+};
+
+int main(int argc, const char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+	      << " <pool> [threads] [seconds] [window] [size]" << std::endl;
+    return 1;
+  }
+  string pool = argv[1];
+  int nthreads = argc > 2 ? atoi(argv[2]) : 32;
+  double seconds = argc > 3 ? atof(argv[3]) : 10;
+  unsigned window = argc > 4 ? atoi(argv[4]) : 4;
+  int size = argc > 5 ? atoi(argv[5]) : 4096;
+
+  Rados cluster;
+  int r = cluster.init(getenv("CEPH_CLIENT_ID"));
+  if (r == 0)
+    r = cluster.conf_read_file(NULL);
+  if (r == 0)
+    r = cluster.conf_parse_env(NULL);
+  if (r == 0)
+    r = cluster.connect();
+  if (r < 0) {
+    std::cerr << "failed to connect to cluster: " << r << std::endl;
+    return 1;
+  }
+  IoCtx io;
+  r = cluster.ioctx_create(pool.c_str(), io);
+  if (r < 0) {
+    std::cerr << "failed to open pool " << pool << ": " << r << std::endl;
+    return 1;
+  }
+
+  std::vector<Writer*> writers;
+  utime_t start = ceph_clock_now(NULL);
+  for (int i = 0; i < nthreads; i++) {
+    writers.push_back(new Writer(io, i, seconds, window, size));
+    writers.back()->create();
+  }
+  uint64_t total = 0;
+  int ret = 0;
+  for (int i = 0; i < nthreads; i++) {
+    writers[i]->join();
+    total += writers[i]->done;
+    if (writers[i]->err) {
+      std::cerr << "thread " << i << " got error " << writers[i]->err << std::endl;
+      ret = 1;
+    }
+    delete writers[i];
+  }
+  double elapsed = (double)(ceph_clock_now(NULL) - start);
+
+  std::cout << nthreads << " threads x " << window << " in flight, "
+	    << size << " byte writes: " << total << " ops in " << elapsed
+	    << " sec = " << (double)total / elapsed << " ops/sec" << std::endl;
+
+  for (int i = 0; i < nthreads; i++) {
+    for (int j = 0; j < 16; j++) {
+      std::ostringstream oid;
+      oid << "aio_submit_" << i << "_" << j;
+      io.remove(oid.str());
+    }
+  }
+  cluster.shutdown();
+  return ret;
+}
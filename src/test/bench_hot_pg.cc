@@ -0,0 +1,153 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Hammer a single pg with ops on many objects and report how throughput
+ * scales with the number of ops in flight.  All objects share a locator
+ * key, so they land in the same pg.
+ *
+ *   bench_hot_pg <pool> [read|write|mixed] [objects] [seconds] [max_inflight] [size]
+ */
+
+#include "include/rados/librados.hpp"
+#include "include/utime.h"
+#include "common/Clock.h"
+
+#include <deque>
+#include <errno.h>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+
+using namespace librados;
+using std::string;
+
+static string obj_name(int i)
+{
+  std::ostringstream ss;
+  ss << "hot_pg_" << i;
+  return ss.str();
+}
+
+static double run(IoCtx& io, const string& mode, int objects, double seconds,
+		  unsigned inflight, int size, bufferlist& data)
+{
+  std::deque<AioCompletion*> q;
+  std::deque<bufferlist*> bufs;
+  uint64_t done = 0;
+  int next = 0;
+  utime_t start = ceph_clock_now(NULL);
+  utime_t end = start;
+  end += seconds;
+
+  while (true) {
+    while (q.size() < inflight) {
+      AioCompletion *c = Rados::aio_create_completion();
+      bufferlist *bl = new bufferlist;
+      string oid = obj_name(next++ % objects);
+      bool write = mode == "write" || (mode == "mixed" && next % 2);
+      int r;
+      if (write)
+	r = io.aio_write(oid, c, data, size, 0);
+      else
+	r = io.aio_read(oid, c, bl, size, 0);
+      if (r < 0) {
+	std::cerr << "aio submit failed: " << r << std::endl;
+	exit(1);
+      }
+      q.push_back(c);
+      bufs.push_back(bl);
+    }
+    AioCompletion *c = q.front();
+    c->wait_for_complete();
+    if (c->get_return_value() < 0) {
+      std::cerr << "aio failed: " << c->get_return_value() << std::endl;
+      exit(1);
+    }
+    c->release();
+    delete bufs.front();
+    q.pop_front();
+    bufs.pop_front();
+    done++;
+    if (ceph_clock_now(NULL) > end)
+      break;
+  }
+  while (!q.empty()) {
+    q.front()->wait_for_complete();
+    q.front()->release();
+    delete bufs.front();
+    q.pop_front();
+    bufs.pop_front();
+  }
+  return (double)done / (double)(ceph_clock_now(NULL) - start);
+}
+
+int main(int argc, const char **argv)
+{
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+	      << " <pool> [read|write|mixed] [objects] [seconds] [max_inflight] [size]"
+	      << std::endl;
+    return 1;
+  }
+  string pool = argv[1];
+  string mode = argc > 2 ? argv[2] : "read";
+  int objects = argc > 3 ? atoi(argv[3]) : 64;
+  double seconds = argc > 4 ? atof(argv[4]) : 10;
+  unsigned max_inflight = argc > 5 ? atoi(argv[5]) : 64;
+  int size = argc > 6 ? atoi(argv[6]) : 4096;
+
+  Rados cluster;
+  int r = cluster.init(getenv("CEPH_CLIENT_ID"));
+  if (r == 0)
+    r = cluster.conf_read_file(NULL);
+  if (r == 0)
+    r = cluster.conf_parse_env(NULL);
+  if (r == 0)
+    r = cluster.connect();
+  if (r < 0) {
+    std::cerr << "failed to connect to cluster: " << r << std::endl;
+    return 1;
+  }
+  IoCtx io;
+  r = cluster.ioctx_create(pool.c_str(), io);
+  if (r < 0) {
+    std::cerr << "failed to open pool " << pool << ": " << r << std::endl;
+    return 1;
+  }
+  io.locator_set_key("hot_pg");
+
+  bufferlist data;
+  data.append(string(size, 'x'));
+  for (int i = 0; i < objects; i++) {
+    r = io.write_full(obj_name(i), data);
+    if (r < 0) {
+      std::cerr << "failed to create " << obj_name(i) << ": " << r << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << "# " << mode << " " << objects << " objects, " << size
+	    << " bytes, one pg" << std::endl;
+  std::cout << "inflight\tops/sec" << std::endl;
+  for (unsigned inflight = 1; inflight <= max_inflight; inflight *= 2)
+    std::cout << inflight << "\t" << run(io, mode, objects, seconds, inflight, size, data)
+	      << std::endl;
+
+  for (int i = 0; i < objects; i++)
+    io.remove(obj_name(i));
+  cluster.shutdown();
+  return 0;
+}
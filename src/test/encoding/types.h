@@ -54,8 +54,11 @@ TYPE(pg_create_t)
 TYPE(watch_info_t)
 TYPE(object_info_t)
 TYPE(SnapSet)
+TYPE(clone_info)
+TYPE(obj_list_snap_response_t)
 TYPE(ObjectRecoveryInfo)
 TYPE(ObjectRecoveryProgress)
+TYPE(PushOp)
 TYPE(ScrubMap::object)
 TYPE(ScrubMap)
 TYPE(osd_peer_stat_t)
@@ -2,6 +2,8 @@
 #include "include/rados/librados.h"
 #include "include/rados/librados.hpp"
 #include "test/rados-api/test.h"
+#include "common/Clock.h"
+#include "include/utime.h"
 
 #include <semaphore.h>
 #include <errno.h>
@@ -11,6 +13,7 @@
 #include <string>
 #include <stdlib.h>
 #include <unistd.h>
+#include <vector>
 
 using namespace librados;
 using ceph::buffer;
@@ -29,22 +32,9 @@ public:
     }
 };
 
-int main(int args, char **argv)
+static int connect(Rados& cluster, const char *id)
 {
-  if (args < 3) {
-    std::cerr << "Error: " << argv[0] << " pool_name obj_name" << std::endl;
-    return 1;
-  }
-
-  std::string pool_name(argv[1]);
-  std::string obj_name(argv[2]);
-  std::cerr << "pool_name, obj_name are " << pool_name << ", " << obj_name << std::endl;
-
-  char *id = getenv("CEPH_CLIENT_ID");
-  if (id) std::cerr << "Client id is: " << id << std::endl;
-  Rados cluster;
-  int ret;
-  ret = cluster.init(id);
+  int ret = cluster.init(id);
   if (ret) {
     std::cerr << "Error " << ret << " in cluster.init" << std::endl;
     return ret;
@@ -59,7 +49,75 @@ int main(int args, char **argv)
     std::cerr << "Error " << ret << " in cluster.conf_read_env" << std::endl;
     return ret;
   }
-  cluster.connect();
+  return cluster.connect();
+}
+
+/*
+ * many clients watching one object; every notify has to reach all of
+ * them.  this is what a popular rbd header looks like to the osd.
+ */
+static int fan_out(const string& pool_name, const string& obj_name, const char *id,
+		   IoCtx& ioctx, int watchers, int iterations)
+{
+  std::vector<Rados*> clusters;
+  std::vector<IoCtx*> ioctxs;
+  std::vector<uint64_t> handles(watchers);
+  WatchNotifyTestCtx ctx;
+  for (int i = 0; i < watchers; ++i) {
+    clusters.push_back(new Rados);
+    int ret = connect(*clusters.back(), id);
+    if (ret)
+      return ret;
+    ioctxs.push_back(new IoCtx);
+    clusters.back()->ioctx_create(pool_name.c_str(), *ioctxs.back());
+    ret = ioctxs.back()->watch(obj_name, 0, &handles[i], &ctx);
+    assert(!ret);
+  }
+  std::cerr << watchers << " watchers registered" << std::endl;
+
+  utime_t start = ceph_clock_now(NULL);
+  for (int i = 0; i < iterations; ++i) {
+    std::cerr << "Iteration " << i << std::endl;
+    bufferlist bl2;
+    int ret = ioctx.notify(obj_name, 0, bl2);
+    assert(!ret);
+    TestAlarm alarm;
+    for (int j = 0; j < watchers; ++j)
+      sem_wait(&sem);
+  }
+  double elapsed = (double)(ceph_clock_now(NULL) - start);
+  std::cerr << iterations << " notifies to " << watchers << " watchers in "
+	    << elapsed << " sec" << std::endl;
+
+  for (int i = 0; i < watchers; ++i) {
+    ioctxs[i]->unwatch(obj_name, handles[i]);
+    ioctxs[i]->close();
+    delete ioctxs[i];
+    clusters[i]->shutdown();
+    delete clusters[i];
+  }
+  return 0;
+}
+
+int main(int args, char **argv)
+{
+  if (args < 3) {
+    std::cerr << "Error: " << argv[0] << " pool_name obj_name [watchers] [iterations]" << std::endl;
+    return 1;
+  }
+
+  std::string pool_name(argv[1]);
+  std::string obj_name(argv[2]);
+  int watchers = args > 3 ? atoi(argv[3]) : 1;
+  int iterations = args > 4 ? atoi(argv[4]) : 10000;
+  std::cerr << "pool_name, obj_name are " << pool_name << ", " << obj_name << std::endl;
+
+  char *id = getenv("CEPH_CLIENT_ID");
+  if (id) std::cerr << "Client id is: " << id << std::endl;
+  Rados cluster;
+  int ret = connect(cluster, id);
+  if (ret)
+    return ret;
 
   // May already exist
   cluster.pool_create(pool_name.c_str());
@@ -69,22 +127,25 @@ int main(int args, char **argv)
 
   ioctx.create(obj_name, false);
 
-  
-  for (int i = 0; i < 10000; ++i) {
-    std::cerr << "Iteration " << i << std::endl;
-    uint64_t handle;
-    WatchNotifyTestCtx ctx;
-    ret = ioctx.watch(obj_name, 0, &handle, &ctx);
-    assert(!ret);
-    bufferlist bl2;
-    ret = ioctx.notify(obj_name, 0, bl2);
-    assert(!ret);
-    TestAlarm alarm;
-    sem_wait(&sem);
-    ioctx.unwatch(obj_name, handle);
+  if (watchers > 1) {
+    ret = fan_out(pool_name, obj_name, id, ioctx, watchers, iterations);
+  } else {
+    for (int i = 0; i < iterations; ++i) {
+      std::cerr << "Iteration " << i << std::endl;
+      uint64_t handle;
+      WatchNotifyTestCtx ctx;
+      ret = ioctx.watch(obj_name, 0, &handle, &ctx);
+      assert(!ret);
+      bufferlist bl2;
+      ret = ioctx.notify(obj_name, 0, bl2);
+      assert(!ret);
+      TestAlarm alarm;
+      sem_wait(&sem);
+      ioctx.unwatch(obj_name, handle);
+    }
   }
 
   ioctx.close();
   sem_destroy(&sem);
-  return 0;
+  return ret;
 }
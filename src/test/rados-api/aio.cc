@@ -888,3 +888,114 @@ TEST(LibRadosAio, OmapPP) {
 
   ioctx.remove("test_obj");
 }
+
+TEST(LibRadosAio, OperateBatchPP) {
+  Rados cluster;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, cluster));
+  IoCtx ioctx;
+  cluster.ioctx_create(pool_name.c_str(), ioctx);
+
+  const int num = 20;
+  std::vector<string> oids;
+  for (int i = 0; i < num; i++) {
+    ostringstream oss;
+    oss << "batch_" << i;
+    oids.push_back(oss.str());
+  }
+
+  {
+    std::vector<ObjectWriteOperation*> wops;
+    std::vector<std::pair<string, ObjectWriteOperation*> > batch;
+    for (int i = 0; i < num; i++) {
+      bufferlist bl;
+      bl.append(oids[i]);
+      wops.push_back(new ObjectWriteOperation);
+      wops.back()->write_full(bl);
+      batch.push_back(std::make_pair(oids[i], wops.back()));
+    }
+    boost::scoped_ptr<AioCompletion> my_completion(cluster.aio_create_completion(0, 0, 0));
+    std::vector<int> rvals;
+    ASSERT_EQ(0, ioctx.aio_operate_batch(batch, my_completion.get(), &rvals));
+    {
+      TestAlarm alarm;
+      ASSERT_EQ(0, my_completion->wait_for_safe());
+    }
+    ASSERT_EQ(0, my_completion->get_return_value());
+    ASSERT_EQ((unsigned)num, rvals.size());
+    for (int i = 0; i < num; i++) {
+      ASSERT_EQ(0, rvals[i]);
+      delete wops[i];
+    }
+  }
+
+  {
+    // one of the items does not exist; the rest still succeed
+    std::vector<ObjectReadOperation*> rops;
+    std::vector<std::pair<string, ObjectReadOperation*> > batch;
+    std::vector<bufferlist> bls(num + 1);
+    for (int i = 0; i <= num; i++) {
+      rops.push_back(new ObjectReadOperation);
+      rops.back()->read(0, 0, &bls[i], NULL);
+      batch.push_back(std::make_pair(i < num ? oids[i] : string("batch_missing"),
+				     rops.back()));
+    }
+    boost::scoped_ptr<AioCompletion> my_completion(cluster.aio_create_completion(0, 0, 0));
+    std::vector<int> rvals;
+    ASSERT_EQ(0, ioctx.aio_operate_batch(batch, my_completion.get(), &rvals));
+    {
+      TestAlarm alarm;
+      ASSERT_EQ(0, my_completion->wait_for_complete());
+    }
+    ASSERT_EQ(-ENOENT, my_completion->get_return_value());
+    ASSERT_EQ((unsigned)num + 1, rvals.size());
+    for (int i = 0; i < num; i++) {
+      ASSERT_EQ(0, rvals[i]);
+      ASSERT_EQ(oids[i], string(bls[i].c_str(), bls[i].length()));
+    }
+    ASSERT_EQ(-ENOENT, rvals[num]);
+    for (int i = 0; i <= num; i++)
+      delete rops[i];
+  }
+
+  {
+    // more items than objecter_inflight_ops; the batch must go out as
+    // budget frees up rather than wait for all of it up front
+    const int many = 1500;
+    std::vector<ObjectWriteOperation*> wops;
+    std::vector<std::pair<string, ObjectWriteOperation*> > batch;
+    bufferlist bl;
+    bl.append("x");
+    for (int i = 0; i < many; i++) {
+      ostringstream oss;
+      oss << "batch_many_" << i;
+      wops.push_back(new ObjectWriteOperation);
+      wops.back()->write_full(bl);
+      batch.push_back(std::make_pair(oss.str(), wops.back()));
+    }
+    boost::scoped_ptr<AioCompletion> my_completion(cluster.aio_create_completion(0, 0, 0));
+    std::vector<int> rvals;
+    ASSERT_EQ(0, ioctx.aio_operate_batch(batch, my_completion.get(), &rvals));
+    {
+      TestAlarm alarm;
+      ASSERT_EQ(0, my_completion->wait_for_safe());
+    }
+    ASSERT_EQ(0, my_completion->get_return_value());
+    ASSERT_EQ((unsigned)many, rvals.size());
+    for (int i = 0; i < many; i++) {
+      ASSERT_EQ(0, rvals[i]);
+      delete wops[i];
+    }
+  }
+
+  {
+    // an empty batch completes right away
+    std::vector<std::pair<string, ObjectWriteOperation*> > batch;
+    boost::scoped_ptr<AioCompletion> my_completion(cluster.aio_create_completion(0, 0, 0));
+    ASSERT_EQ(0, ioctx.aio_operate_batch(batch, my_completion.get(), NULL));
+    ASSERT_TRUE(my_completion->is_safe());
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
+}
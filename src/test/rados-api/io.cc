@@ -2,10 +2,13 @@
 #include "include/rados/librados.hpp"
 #include "test/rados-api/test.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <errno.h>
+#include <sstream>
 #include "gtest/gtest.h"
 
 using namespace librados;
+using std::ostringstream;
 using std::string;
 
 TEST(LibRadosIo, SimpleWrite) {
@@ -455,3 +458,75 @@ TEST(LibRadosIo, XattrListPP) {
   ioctx.close();
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
 }
+
+TEST(LibRadosIo, ReadPolicyPP) {
+  Rados cluster;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, cluster));
+  std::string pool_name2 = get_temp_pool_name();
+  ASSERT_EQ(0, cluster.pool_create(pool_name2.c_str()));
+  IoCtx ioctx, ioctx2;
+  cluster.ioctx_create(pool_name.c_str(), ioctx);
+  cluster.ioctx_create(pool_name2.c_str(), ioctx2);
+
+  ASSERT_EQ(-EINVAL, ioctx.set_read_policy(42));
+
+  int policies[] = { LIBRADOS_READ_PRIMARY, LIBRADOS_READ_RANDOM, LIBRADOS_READ_NEAREST };
+  for (unsigned k = 0; k < sizeof(policies) / sizeof(policies[0]); k++) {
+    ASSERT_EQ(0, ioctx.set_read_policy(policies[k]));
+    ASSERT_EQ(0, ioctx2.set_read_policy(policies[k]));
+
+    // the same names in both pools, with different contents.  the
+    // pools are new, so some replica reads may find their pg not yet
+    // readable and bounce to the primary; either way the data is right.
+    for (int i = 0; i < 32; i++) {
+      ostringstream oss;
+      oss << "policy_" << i;
+      bufferlist bl, bl2;
+      bl.append(pool_name + oss.str());
+      bl2.append(pool_name2 + oss.str());
+      ASSERT_EQ(0, ioctx.write_full(oss.str(), bl));
+      ASSERT_EQ(0, ioctx2.write_full(oss.str(), bl2));
+      bufferlist out, out2;
+      ASSERT_EQ((int)bl.length(), ioctx.read(oss.str(), out, 0, 0));
+      ASSERT_EQ((int)bl2.length(), ioctx2.read(oss.str(), out2, 0, 0));
+      ASSERT_TRUE(bl.contents_equal(out));
+      ASSERT_TRUE(bl2.contents_equal(out2));
+    }
+
+    // a read issued while a write to the same object is still in
+    // flight goes to the primary and sees the write, even with writes
+    // to that name in flight in another pool
+    for (int i = 0; i < 32; i++) {
+      ostringstream oss;
+      oss << "policy_inflight_" << k << "_" << i;
+      bufferlist bl, bl2;
+      bl.append(pool_name + oss.str());
+      bl2.append(pool_name2 + oss.str());
+      boost::scoped_ptr<AioCompletion> w(cluster.aio_create_completion(0, 0, 0));
+      boost::scoped_ptr<AioCompletion> w2(cluster.aio_create_completion(0, 0, 0));
+      boost::scoped_ptr<AioCompletion> r(cluster.aio_create_completion(0, 0, 0));
+      bufferlist out;
+      ASSERT_EQ(0, ioctx.aio_write_full(oss.str(), w.get(), bl));
+      ASSERT_EQ(0, ioctx2.aio_write_full(oss.str(), w2.get(), bl2));
+      ASSERT_EQ(0, ioctx.aio_read(oss.str(), r.get(), &out, bl.length(), 0));
+      {
+	TestAlarm alarm;
+	ASSERT_EQ(0, r->wait_for_complete());
+	ASSERT_EQ(0, w->wait_for_safe());
+	ASSERT_EQ(0, w2->wait_for_safe());
+      }
+      ASSERT_EQ((int)bl.length(), r->get_return_value());
+      ASSERT_TRUE(bl.contents_equal(out));
+    }
+
+    // missing objects are missing wherever we read them
+    bufferlist out;
+    ASSERT_EQ(-ENOENT, ioctx.read("policy_missing", out, 0, 0));
+  }
+
+  ioctx.close();
+  ioctx2.close();
+  ASSERT_EQ(0, cluster.pool_delete(pool_name2.c_str()));
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
+}
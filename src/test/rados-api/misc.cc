@@ -306,6 +306,107 @@ TEST(LibRadosMisc, CloneRangePP) {
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
 }
 
+TEST(LibRadosMisc, ChecksumPP) {
+  Rados cluster;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, cluster));
+  IoCtx ioctx;
+  ASSERT_EQ(0, cluster.ioctx_create(pool_name.c_str(), ioctx));
+
+  bufferlist bl;
+  for (int i = 0; i < 3000; i++)
+    bl.append((char)(i * 7));
+  ASSERT_EQ(0, ioctx.write_full("foo", bl));
+  ASSERT_EQ(0, ioctx.write_full("bar", bl));
+
+  // crc32c of the whole object matches what we compute here
+  {
+    ObjectReadOperation op;
+    bufferlist digests;
+    int rval = 1;
+    op.checksum(LIBRADOS_CHECKSUM_CRC32C, 0, 0, 0, &digests, &rval);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, NULL));
+    ASSERT_EQ(0, rval);
+    ASSERT_EQ(4u, digests.length());
+    bufferlist::iterator p = digests.begin();
+    __u32 crc;
+    ::decode(crc, p);
+    ASSERT_EQ(bl.crc32c(-1), crc);
+  }
+
+  // per-chunk crcs, with a short last chunk and the range clipped at eof
+  {
+    ObjectReadOperation op;
+    bufferlist digests;
+    int rval = 1;
+    op.checksum(LIBRADOS_CHECKSUM_CRC32C, 1000, 4000, 1024, &digests, &rval);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, NULL));
+    ASSERT_EQ(0, rval);
+    ASSERT_EQ(8u, digests.length());
+    bufferlist::iterator p = digests.begin();
+    for (unsigned off = 1000; off < 3000; off += 1024) {
+      bufferlist chunk;
+      chunk.substr_of(bl, off, MIN(1024, 3000 - off));
+      __u32 crc;
+      ::decode(crc, p);
+      ASSERT_EQ(chunk.crc32c(-1), crc);
+    }
+  }
+
+  // a length that wraps around when added to the offset is clipped at
+  // eof like any other, and small chunks come out of the same reads
+  {
+    ObjectReadOperation op;
+    bufferlist digests;
+    int rval = 1;
+    op.checksum(LIBRADOS_CHECKSUM_CRC32C, 1000, (uint64_t)-1, 7, &digests, &rval);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, NULL));
+    ASSERT_EQ(0, rval);
+    ASSERT_EQ(4u * ((2000 + 6) / 7), digests.length());
+    bufferlist::iterator p = digests.begin();
+    for (unsigned off = 1000; off < 3000; off += 7) {
+      bufferlist chunk;
+      chunk.substr_of(bl, off, MIN(7, 3000 - off));
+      __u32 crc;
+      ::decode(crc, p);
+      ASSERT_EQ(chunk.crc32c(-1), crc);
+    }
+  }
+
+  // sha1 and sha256 agree for identical objects and differ otherwise
+  int types[2] = { LIBRADOS_CHECKSUM_SHA1, LIBRADOS_CHECKSUM_SHA256 };
+  unsigned sizes[2] = { 20, 32 };
+  bufferlist other;
+  other.append(bl);
+  other.append("x");
+  ASSERT_EQ(0, ioctx.write_full("baz", other));
+  for (int i = 0; i < 2; i++) {
+    bufferlist foo, bar, baz;
+    ObjectReadOperation op1, op2, op3;
+    op1.checksum(types[i], 0, 0, 0, &foo, NULL);
+    op2.checksum(types[i], 0, 0, 0, &bar, NULL);
+    op3.checksum(types[i], 0, 0, 0, &baz, NULL);
+    ASSERT_EQ(0, ioctx.operate("foo", &op1, NULL));
+    ASSERT_EQ(0, ioctx.operate("bar", &op2, NULL));
+    ASSERT_EQ(0, ioctx.operate("baz", &op3, NULL));
+    ASSERT_EQ(sizes[i], foo.length());
+    ASSERT_TRUE(foo.contents_equal(bar));
+    ASSERT_FALSE(foo.contents_equal(baz));
+  }
+
+  ObjectReadOperation bad;
+  bufferlist digests;
+  bad.checksum(99, 0, 0, 0, &digests, NULL);
+  ASSERT_EQ(-EINVAL, ioctx.operate("foo", &bad, NULL));
+
+  ObjectReadOperation missing;
+  missing.checksum(LIBRADOS_CHECKSUM_CRC32C, 0, 0, 0, &digests, NULL);
+  ASSERT_EQ(-ENOENT, ioctx.operate("nonexistent", &missing, NULL));
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
+}
+
 TEST(LibRadosMisc, CloneRange) {
   char buf[128];
   rados_t cluster;
@@ -348,3 +348,128 @@ TEST(LibRadosSnapshots, SelfManagedSnapRollbackPP) {
   ioctx.close();
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
 }
+
+TEST(LibRadosSnapshots, SelfManagedSnapListSnapsPP) {
+  std::vector<uint64_t> my_snaps;
+  Rados cluster;
+  IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, cluster));
+  ASSERT_EQ(0, cluster.ioctx_create(pool_name.c_str(), ioctx));
+
+  my_snaps.push_back(-2);
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_create(&my_snaps.back()));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_set_write_ctx(my_snaps[0], my_snaps));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  char buf[128];
+  memset(buf, 0xcc, sizeof(buf));
+  bufferlist bl1;
+  bl1.append(buf, sizeof(buf));
+  ASSERT_EQ((int)sizeof(buf), ioctx.write("foo", bl1, sizeof(buf), 0));
+
+  // just the head so far
+  snap_set_t ss;
+  int rval = -1;
+  ObjectReadOperation op;
+  op.list_snaps(&ss, &rval);
+  bufferlist outbl;
+  ASSERT_EQ(0, ioctx.operate("foo", &op, &outbl));
+  ASSERT_EQ(0, rval);
+  ASSERT_EQ(1u, ss.clones.size());
+  ASSERT_EQ((snap_t)SNAP_HEAD, ss.clones[0].cloneid);
+  ASSERT_EQ(sizeof(buf), ss.clones[0].size);
+
+  my_snaps.push_back(-2);
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_create(&my_snaps.back()));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_set_write_ctx(my_snaps[0], my_snaps));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  char buf2[sizeof(buf) / 2];
+  memset(buf2, 0xdd, sizeof(buf2));
+  bufferlist bl2;
+  bl2.append(buf2, sizeof(buf2));
+  ASSERT_EQ((int)sizeof(buf2), ioctx.write("foo", bl2, sizeof(buf2), 0));
+
+  // a clone for the second snap, sharing the half that was not written
+  ObjectReadOperation op2;
+  op2.list_snaps(&ss, &rval);
+  ASSERT_EQ(0, ioctx.operate("foo", &op2, &outbl));
+  ASSERT_EQ(0, rval);
+  ASSERT_EQ(my_snaps[1], ss.seq);
+  ASSERT_EQ(2u, ss.clones.size());
+  ASSERT_EQ(my_snaps[1], ss.clones[0].cloneid);
+  ASSERT_EQ(1u, ss.clones[0].snaps.size());
+  ASSERT_EQ(my_snaps[1], ss.clones[0].snaps[0]);
+  ASSERT_EQ(sizeof(buf), ss.clones[0].size);
+  ASSERT_EQ(1u, ss.clones[0].overlap.size());
+  ASSERT_EQ(sizeof(buf2), ss.clones[0].overlap[0].first);
+  ASSERT_EQ(sizeof(buf) - sizeof(buf2), ss.clones[0].overlap[0].second);
+  ASSERT_EQ((snap_t)SNAP_HEAD, ss.clones[1].cloneid);
+
+  ObjectReadOperation op3;
+  op3.list_snaps(&ss, &rval);
+  ASSERT_EQ(-ENOENT, ioctx.operate("bar", &op3, &outbl));
+
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_remove(my_snaps.back()));
+  my_snaps.pop_back();
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_remove(my_snaps.back()));
+  my_snaps.pop_back();
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
+}
+
+TEST(LibRadosSnapshots, SelfManagedSnapAioRollbackPP) {
+  std::vector<uint64_t> my_snaps;
+  Rados cluster;
+  IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, cluster));
+  ASSERT_EQ(0, cluster.ioctx_create(pool_name.c_str(), ioctx));
+
+  my_snaps.push_back(-2);
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_create(&my_snaps.back()));
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_set_write_ctx(my_snaps[0], my_snaps));
+  char buf[128];
+  memset(buf, 0xcc, sizeof(buf));
+  bufferlist bl1;
+  bl1.append(buf, sizeof(buf));
+  ASSERT_EQ((int)sizeof(buf), ioctx.write("foo", bl1, sizeof(buf), 0));
+
+  my_snaps.push_back(-2);
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_create(&my_snaps.back()));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_set_write_ctx(my_snaps[0], my_snaps));
+  ::std::reverse(my_snaps.begin(), my_snaps.end());
+  char buf2[sizeof(buf)];
+  memset(buf2, 0xdd, sizeof(buf2));
+  bufferlist bl2;
+  bl2.append(buf2, sizeof(buf2));
+  ASSERT_EQ((int)sizeof(buf2), ioctx.write("foo", bl2, sizeof(buf2), 0));
+
+  // a missing object rolls back to ENOENT
+  ObjectWriteOperation op1, op2;
+  op1.selfmanaged_snap_rollback(my_snaps[1]);
+  op2.selfmanaged_snap_rollback(my_snaps[1]);
+  AioCompletion *c1 = cluster.aio_create_completion();
+  AioCompletion *c2 = cluster.aio_create_completion();
+  ASSERT_EQ(0, ioctx.aio_operate("foo", c1, &op1));
+  ASSERT_EQ(0, ioctx.aio_operate("nosuchobject", c2, &op2));
+  c1->wait_for_safe();
+  c2->wait_for_safe();
+  ASSERT_EQ(0, c1->get_return_value());
+  ASSERT_EQ(-ENOENT, c2->get_return_value());
+  c1->release();
+  c2->release();
+
+  bufferlist bl3;
+  ASSERT_EQ((int)sizeof(buf), ioctx.read("foo", bl3, sizeof(buf), 0));
+  ASSERT_EQ(0, memcmp(bl3.c_str(), buf, sizeof(buf)));
+
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_remove(my_snaps.back()));
+  my_snaps.pop_back();
+  ASSERT_EQ(0, ioctx.selfmanaged_snap_remove(my_snaps.back()));
+  my_snaps.pop_back();
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, cluster));
+}
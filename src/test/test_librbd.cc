@@ -15,6 +15,7 @@
 #include "include/rados/librados.h"
 #include "include/rbd/librbd.h"
 #include "include/rbd/librbd.hpp"
+#include "include/rbd_types.h"
 
 #include "gtest/gtest.h"
 
@@ -88,6 +89,43 @@ TEST(LibRBD, CreateAndStatPP)
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+TEST(LibRBD, OpenAio)
+{
+  rados_t cluster;
+  rados_ioctx_t ioctx;
+  string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool(pool_name, &cluster));
+  ASSERT_EQ(0, rados_ioctx_create(cluster, pool_name.c_str(), &ioctx));
+
+  rbd_image_info_t info;
+  rbd_image_t image;
+  int order = 0;
+  const char *name = "testimg";
+  uint64_t size = 2 << 20;
+  rbd_completion_t comp;
+
+  ASSERT_EQ(0, rbd_create(ioctx, name, size, &order));
+  ASSERT_EQ(0, rbd_aio_create_completion(NULL, NULL, &comp));
+  ASSERT_EQ(0, rbd_aio_open(ioctx, name, &image, NULL, comp));
+  ASSERT_EQ(0, rbd_aio_wait_for_complete(comp));
+  ASSERT_EQ(0, rbd_aio_get_return_value(comp));
+  rbd_aio_release(comp);
+  ASSERT_EQ(0, rbd_stat(image, &info, sizeof(info)));
+  ASSERT_EQ(info.size, size);
+  ASSERT_EQ(info.order, order);
+  ASSERT_EQ(0, rbd_close(image));
+
+  ASSERT_EQ(0, rbd_aio_create_completion(NULL, NULL, &comp));
+  ASSERT_EQ(0, rbd_aio_open(ioctx, "nosuchimg", &image, NULL, comp));
+  ASSERT_EQ(0, rbd_aio_wait_for_complete(comp));
+  ASSERT_EQ(-ENOENT, rbd_aio_get_return_value(comp));
+  ASSERT_TRUE(image == NULL);
+  rbd_aio_release(comp);
+
+  rados_ioctx_destroy(ioctx);
+  ASSERT_EQ(0, destroy_one_pool(pool_name, &cluster));
+}
+
 TEST(LibRBD, ResizeAndStat)
 {
   rados_t cluster;
@@ -365,6 +403,83 @@ TEST(LibRBD, TestCopyPP)
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+struct IterateCheck {
+  uint64_t next;     // where the next extent must start
+  uint64_t data;     // bytes that came back as data, not holes
+  vector<uint64_t> marks;
+  IterateCheck() : next(0), data(0) {}
+};
+
+static int iterate_check_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
+{
+  IterateCheck *ic = (IterateCheck *)arg;
+  if (ofs != ic->next)
+    return -EDOM;
+  ic->next += len;
+  if (buf) {
+    ic->data += len;
+    for (size_t i = 0; i < len; i++)
+      if (buf[i])
+	ic->marks.push_back(ofs + i);
+  }
+  return 0;
+}
+
+TEST(LibRBD, TestReadIterateOrderPP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    librbd::Image image;
+    int order = 16;
+    const char *name = "testimg";
+    const char *name2 = "testimg2";
+    uint64_t obj = 1 << order;
+    uint64_t size = obj * 64;   // well past one window of objects
+
+    ASSERT_EQ(0, rbd.create(ioctx, name, size, &order));
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    // one marker byte in every third object, the rest left as holes
+    vector<uint64_t> expected;
+    for (uint64_t o = 0; o < size / obj; o += 3) {
+      uint64_t ofs = o * obj + (o % 7) * 100;
+      bufferlist bl;
+      bl.append('x');
+      ASSERT_EQ(1, image.write(ofs, 1, bl));
+      expected.push_back(ofs);
+    }
+
+    IterateCheck ic;
+    ASSERT_EQ((int64_t)size, image.read_iterate(0, size, iterate_check_cb, &ic));
+    ASSERT_EQ(size, ic.next);
+    ASSERT_TRUE(expected == ic.marks);
+
+    // part way in, across object boundaries; offsets are relative
+    IterateCheck ic2;
+    ASSERT_EQ((int64_t)(obj * 10), image.read_iterate(obj / 2, obj * 10, iterate_check_cb, &ic2));
+    ASSERT_EQ(obj * 10, ic2.next);
+    ASSERT_EQ(3u, ic2.marks.size());
+    ASSERT_EQ(expected[1] - obj / 2, ic2.marks[0]);
+
+    ASSERT_EQ(0, image.copy(ioctx, name2));
+    librbd::Image image2;
+    ASSERT_EQ(0, rbd.open(ioctx, image2, name2, NULL));
+    IterateCheck ic3;
+    ASSERT_EQ((int64_t)size, image2.read_iterate(0, size, iterate_check_cb, &ic3));
+    ASSERT_TRUE(expected == ic3.marks);
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 int test_ls_snaps(rbd_image_t image, int num_expected, ...)
 {
   rbd_snap_info_t *snaps;
@@ -408,6 +523,507 @@ int test_ls_snaps(rbd_image_t image, int num_expected, ...)
   return num_snaps;
 }
 
+TEST(LibRBD, TestObjectMapPP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ASSERT_EQ(0, rados.conf_set("rbd_object_map", "true"));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *name = "testimg";
+    uint64_t obj = 1 << order;
+    string map_oid;
+
+    ASSERT_EQ(0, rbd.create(ioctx, name, obj * 8, &order));
+    {
+      librbd::Image image;
+      ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+      librbd::image_info_t info;
+      ASSERT_EQ(0, image.stat(info, sizeof(info)));
+      map_oid = string(info.block_name_prefix) + ".object_map";
+
+      bufferlist bl;
+      bl.append('x');
+      ASSERT_EQ(1, image.write(obj + 10, 1, bl));
+      ASSERT_EQ(1, image.write(obj * 5 + 10, 1, bl));
+
+      // two bits per object: objects 1 and 5 exist
+      bufferlist map;
+      ASSERT_EQ(2, ioctx.read(map_oid, map, 0, 0));
+      ASSERT_EQ(0x04, map[0]);
+      ASSERT_EQ(0x04, map[1]);
+
+      bufferlist data;
+      ASSERT_EQ((ssize_t)(obj * 8), image.read(0, obj * 8, data));
+      for (uint64_t i = 0; i < obj * 8; i++)
+        ASSERT_EQ((i == obj + 10 || i == obj * 5 + 10) ? 'x' : 0, data[i]);
+
+      // the map is rolled back with the data
+      ASSERT_EQ(0, image.snap_create("snap"));
+      ASSERT_EQ(1, image.write(obj * 3, 1, bl));
+      map.clear();
+      ASSERT_EQ(2, ioctx.read(map_oid, map, 0, 0));
+      ASSERT_EQ(0x44, map[0]);
+      ASSERT_EQ(0, image.snap_rollback("snap"));
+      map.clear();
+      ASSERT_EQ(2, ioctx.read(map_oid, map, 0, 0));
+      ASSERT_EQ(0x04, map[0]);
+      data.clear();
+      ASSERT_EQ(1, image.read(obj * 3, 1, data));
+      ASSERT_EQ(0, data[0]);
+      ASSERT_EQ(0, image.snap_remove("snap"));
+
+      // a second client sees objects the first one creates
+      {
+	librbd::Image other;
+	ASSERT_EQ(0, rbd.open(ioctx, other, name, NULL));
+	data.clear();
+	ASSERT_EQ(1, other.read(obj * 6, 1, data));
+	ASSERT_EQ(0, data[0]);
+	ASSERT_EQ(1, image.write(obj * 6, 1, bl));
+	// the other client hears about the new object in the background
+	for (int i = 0; i < 100; i++) {
+	  data.clear();
+	  ASSERT_EQ(1, other.read(obj * 6, 1, data));
+	  if (data[0] == 'x')
+	    break;
+	  usleep(100000);
+	}
+	ASSERT_EQ('x', data[0]);
+	ASSERT_EQ(0, other.discard(obj * 6, 1));
+      }
+
+      // shrinking drops the entries past the end
+      ASSERT_EQ(0, image.resize(obj * 2));
+      map.clear();
+      ASSERT_EQ(1, ioctx.read(map_oid, map, 0, 0));
+      ASSERT_EQ(0x04, map[0]);
+      ASSERT_EQ(0, image.resize(obj * 8));
+      data.clear();
+      ASSERT_EQ(1, image.read(obj * 5 + 10, 1, data));
+      ASSERT_EQ(0, data[0]);
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, name));
+    ASSERT_EQ(-ENOENT, ioctx.stat(map_oid, NULL, NULL));
+  }
+
+  ASSERT_EQ(0, rados.conf_set("rbd_object_map", "false"));
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+static string block_oid(librbd::Image& image, uint64_t num)
+{
+  librbd::image_info_t info;
+  image.stat(info, sizeof(info));
+  char buf[RBD_MAX_BLOCK_NAME_SIZE + 16];
+  snprintf(buf, sizeof(buf), "%s.%012llx", info.block_name_prefix,
+	   (unsigned long long)num);
+  return buf;
+}
+
+TEST(LibRBD, TestWriteAroundPP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", "true"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_write_around_bytes", "8192"));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    uint64_t obj = 1 << order;
+    ASSERT_EQ(0, rbd.create(ioctx, "testimg", obj * 2, &order));
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, "testimg", NULL));
+
+    // small writes and reads go through the cache
+    bufferlist a, data;
+    a.append(string(4096, 'a'));
+    ASSERT_EQ(4096, image.write(0, 4096, a));
+    ASSERT_EQ(obj, (uint64_t)image.read(0, obj, data));
+    ASSERT_EQ(string(4096, 'a'), string(data.c_str(), 4096));
+
+    // a large write goes around it, and the cache doesn't keep the old data
+    bufferlist b;
+    b.append(string(16384, 'b'));
+    ASSERT_EQ(16384, image.write(0, 16384, b));
+    data.clear();
+    ASSERT_EQ(16384, image.read(0, 16384, data));
+    ASSERT_EQ(string(16384, 'b'), string(data.c_str(), data.length()));
+    bufferlist raw;
+    ASSERT_EQ(16384, ioctx.read(block_oid(image, 0), raw, 16384, 0));
+    ASSERT_EQ(string(16384, 'b'), string(raw.c_str(), raw.length()));
+
+    // the same through aio, over a cached small write
+    ASSERT_EQ(10, image.write(100, 10, a));
+    bufferlist c;
+    c.append(string(16384, 'c'));
+    librbd::RBD::AioCompletion *comp =
+      new librbd::RBD::AioCompletion(NULL, NULL);
+    ASSERT_EQ(0, image.aio_write(0, 16384, c, comp));
+    comp->wait_for_complete();
+    ASSERT_EQ(0, comp->get_return_value());
+    comp->release();
+    data.clear();
+    ASSERT_EQ(16384, image.read(0, 16384, data));
+    ASSERT_EQ(string(16384, 'c'), string(data.c_str(), data.length()));
+  }
+
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_write_around_bytes", "0"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", "false"));
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, TestWritethroughUntilFlushPP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", "true"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_writethrough_until_flush", "true"));
+  // so nothing is written back on its own while we look
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_max_dirty_age", "600"));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    ASSERT_EQ(0, rbd.create(ioctx, "testimg", 1 << order, &order));
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, "testimg", NULL));
+    string oid = block_oid(image, 0);
+
+    // until the first flush, a write is on the osds when it returns
+    bufferlist a, raw;
+    a.append(string(10, 'a'));
+    ASSERT_EQ(10, image.write(0, 10, a));
+    ASSERT_EQ(10, ioctx.read(oid, raw, 10, 0));
+    ASSERT_EQ(string(10, 'a'), string(raw.c_str(), raw.length()));
+
+    // after it, writes stay in the cache until flushed
+    ASSERT_EQ(0, image.flush());
+    bufferlist b, data;
+    b.append(string(10, 'b'));
+    ASSERT_EQ(10, image.write(0, 10, b));
+    ASSERT_EQ(10, image.read(0, 10, data));
+    ASSERT_EQ(string(10, 'b'), string(data.c_str(), data.length()));
+    raw.clear();
+    ASSERT_EQ(10, ioctx.read(oid, raw, 10, 0));
+    ASSERT_EQ(string(10, 'a'), string(raw.c_str(), raw.length()));
+    ASSERT_EQ(0, image.flush());
+    raw.clear();
+    ASSERT_EQ(10, ioctx.read(oid, raw, 10, 0));
+    ASSERT_EQ(string(10, 'b'), string(raw.c_str(), raw.length()));
+  }
+
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_max_dirty_age", "1"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache_writethrough_until_flush", "false"));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", "false"));
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, TestFeaturesPP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    const char *plain = "plain";
+    const char *mapped = "mapped";
+    struct rbd_obj_header_ondisk h;
+
+    // no features: old clients can still open it
+    ASSERT_EQ(0, rbd.create(ioctx, plain, 1 << order, &order));
+    bufferlist bl;
+    ASSERT_EQ((int)sizeof(h), ioctx.read(string(plain) + RBD_SUFFIX, bl, sizeof(h), 0));
+    memcpy(&h, bl.c_str(), sizeof(h));
+    ASSERT_EQ(0, h.options.features);
+    ASSERT_EQ(0, memcmp(RBD_HEADER_TEXT, h.text, sizeof(RBD_HEADER_TEXT)));
+
+    // features: marked so old clients refuse it
+    ASSERT_EQ(0, rados.conf_set("rbd_object_map", "true"));
+    ASSERT_EQ(0, rbd.create(ioctx, mapped, 1 << order, &order));
+    ASSERT_EQ(0, rados.conf_set("rbd_object_map", "false"));
+    string oid = string(mapped) + RBD_SUFFIX;
+    bl.clear();
+    ASSERT_EQ((int)sizeof(h), ioctx.read(oid, bl, sizeof(h), 0));
+    memcpy(&h, bl.c_str(), sizeof(h));
+    ASSERT_EQ(RBD_FEATURE_OBJECT_MAP, h.options.features);
+    ASSERT_EQ(0, memcmp(RBD_HEADER_TEXT_FEATURES, h.text,
+			sizeof(RBD_HEADER_TEXT_FEATURES)));
+    {
+      librbd::Image image;
+      ASSERT_EQ(0, rbd.open(ioctx, image, mapped, NULL));
+    }
+
+    // and we refuse features we don't know about
+    h.options.features |= 0x80;
+    bl.clear();
+    bl.append((const char *)&h, sizeof(h));
+    ASSERT_EQ(0, ioctx.write(oid, bl, bl.length(), 0));
+    {
+      librbd::Image image;
+      ASSERT_EQ(-ENOSYS, rbd.open(ioctx, image, mapped, NULL));
+    }
+    h.options.features &= ~0x80;
+    bl.clear();
+    bl.append((const char *)&h, sizeof(h));
+    ASSERT_EQ(0, ioctx.write(oid, bl, bl.length(), 0));
+
+    ASSERT_EQ(0, rbd.remove(ioctx, plain));
+    ASSERT_EQ(0, rbd.remove(ioctx, mapped));
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+struct diff_extent {
+  uint64_t offset;
+  uint64_t length;
+  bool exists;
+  diff_extent(uint64_t o, uint64_t l, bool e) : offset(o), length(l), exists(e) {}
+  bool operator==(const diff_extent& o) const {
+    return offset == o.offset && length == o.length && exists == o.exists;
+  }
+};
+
+static ostream& operator<<(ostream& out, const diff_extent& e)
+{
+  return out << e.offset << "~" << e.length << (e.exists ? " data" : " zero");
+}
+
+static int diff_cb(uint64_t off, size_t len, int exists, void *arg)
+{
+  vector<diff_extent> *diff = (vector<diff_extent> *)arg;
+  diff->push_back(diff_extent(off, len, exists));
+  return 0;
+}
+
+TEST(LibRBD, TestDiffIteratePP)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  {
+    librbd::RBD rbd;
+    librbd::Image image;
+    int order = 16;
+    const char *name = "testimg";
+    uint64_t obj = 1 << order;
+    uint64_t size = obj * 4;
+
+    ASSERT_EQ(0, rbd.create(ioctx, name, size, &order));
+    ASSERT_EQ(0, rbd.open(ioctx, image, name, NULL));
+
+    bufferlist x;
+    x.append(string(200, 'x'));
+    ASSERT_EQ(11, image.write(obj, 11, x));
+    ASSERT_EQ(200, image.write(obj * 3, 200, x));
+
+    vector<diff_extent> diff;
+    ASSERT_EQ(0, image.diff_iterate(NULL, 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(2u, diff.size());
+    ASSERT_EQ(diff_extent(obj, 11, true), diff[0]);
+    ASSERT_EQ(diff_extent(obj * 3, 200, true), diff[1]);
+
+    ASSERT_EQ(0, image.snap_create("one"));
+
+    // remove object 1, create object 2, overwrite part of object 3
+    ASSERT_EQ(0, image.discard(obj, obj));
+    bufferlist y;
+    y.append(string(10, 'y'));
+    ASSERT_EQ(10, image.write(obj * 2 + 100, 10, y));
+    ASSERT_EQ(10, image.write(obj * 3 + 50, 10, y));
+
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate("one", 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(3u, diff.size());
+    ASSERT_EQ(diff_extent(obj, 11, false), diff[0]);
+    ASSERT_EQ(diff_extent(obj * 2, 110, true), diff[1]);
+    ASSERT_EQ(diff_extent(obj * 3 + 50, 10, true), diff[2]);
+
+    // just part of the image
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate("one", obj * 3, obj, diff_cb, (void *)&diff));
+    ASSERT_EQ(1u, diff.size());
+    ASSERT_EQ(diff_extent(obj * 3 + 50, 10, true), diff[0]);
+
+    // ending at a later snapshot, which must be newer than the start
+    ASSERT_EQ(0, image.snap_create("two"));
+    ASSERT_EQ(0, image.snap_set("two"));
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate("one", 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(3u, diff.size());
+    ASSERT_EQ(-EINVAL, image.diff_iterate("two", 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(-ENOENT, image.diff_iterate("nosuch", 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(0, image.snap_set(NULL));
+
+    diff.clear();
+    ASSERT_EQ(0, image.diff_iterate("two", 0, size, diff_cb, (void *)&diff));
+    ASSERT_EQ(0u, diff.size());
+
+    ASSERT_EQ(0, image.snap_remove("one"));
+    ASSERT_EQ(0, image.snap_remove("two"));
+  }
+
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+/*
+ * run once with the cache and once without: the cache reads a missing
+ * clone object as zeros, not as the parent's data.
+ */
+static void clone_test(const char *cache)
+{
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  string pool_name = get_temp_pool_name();
+
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", cache));
+
+  {
+    librbd::RBD rbd;
+    int order = 16;
+    uint64_t obj = 1 << order;
+    uint64_t size = obj * 4;
+
+    ASSERT_EQ(0, rbd.create(ioctx, "parent", size, &order));
+    {
+      librbd::Image parent;
+      ASSERT_EQ(0, rbd.open(ioctx, parent, "parent", NULL));
+      bufferlist bl;
+      bl.append(string(size, 'p'));
+      ASSERT_EQ((ssize_t)size, parent.write(0, size, bl));
+      ASSERT_EQ(0, parent.snap_create("snap"));
+
+      // only protected snapshots can be cloned
+      int c_order = 0;
+      ASSERT_EQ(-EINVAL, rbd.clone(ioctx, "parent", "snap", "child", &c_order));
+      bool is_protected;
+      ASSERT_EQ(0, parent.snap_is_protected("snap", &is_protected));
+      ASSERT_FALSE(is_protected);
+      ASSERT_EQ(0, parent.snap_protect("snap"));
+      ASSERT_EQ(0, parent.snap_is_protected("snap", &is_protected));
+      ASSERT_TRUE(is_protected);
+      ASSERT_EQ(0, rbd.clone(ioctx, "parent", "snap", "child", &c_order));
+      ASSERT_EQ(order, c_order);
+
+      // clients that don't know about layering can't open the clone
+      struct rbd_obj_header_ondisk h;
+      bufferlist hbl;
+      ASSERT_EQ((int)sizeof(h), ioctx.read(string("child") + RBD_SUFFIX, hbl,
+					   sizeof(h), 0));
+      memcpy(&h, hbl.c_str(), sizeof(h));
+      ASSERT_TRUE(h.options.features & RBD_FEATURE_LAYERING);
+      ASSERT_EQ(0, memcmp(RBD_HEADER_TEXT_FEATURES, h.text,
+			  sizeof(RBD_HEADER_TEXT_FEATURES)));
+
+      // later writes to the parent's head don't show through
+      bufferlist q;
+      q.append(string(obj, 'q'));
+      ASSERT_EQ((ssize_t)obj, parent.write(0, obj, q));
+
+      {
+	librbd::Image child;
+	ASSERT_EQ(0, rbd.open(ioctx, child, "child", NULL));
+	string p_name, p_snapname;
+	ASSERT_EQ(0, child.parent_info(&p_name, &p_snapname));
+	ASSERT_EQ("parent", p_name);
+	ASSERT_EQ("snap", p_snapname);
+
+	bufferlist data;
+	ASSERT_EQ((ssize_t)size, child.read(0, size, data));
+	ASSERT_EQ(string(size, 'p'), string(data.c_str(), data.length()));
+
+	// a partial write copies the rest of the object up first
+	bufferlist c;
+	c.append("cc");
+	ASSERT_EQ(2, child.write(obj + 10, 2, c));
+	data.clear();
+	ASSERT_EQ((ssize_t)obj, child.read(obj, obj, data));
+	string expect(obj, 'p');
+	expect.replace(10, 2, "cc");
+	ASSERT_EQ(expect, string(data.c_str(), data.length()));
+
+	// discarding a whole object hides the parent's data
+	ASSERT_EQ((int)obj, child.discard(obj * 2, obj));
+	data.clear();
+	ASSERT_EQ((ssize_t)obj, child.read(obj * 2, obj, data));
+	ASSERT_EQ(string(obj, '\0'), string(data.c_str(), data.length()));
+
+	// shrinking and growing doesn't uncover the parent either
+	ASSERT_EQ(0, child.resize(obj * 3 + 100));
+	ASSERT_EQ(0, child.resize(size));
+	data.clear();
+	ASSERT_EQ((ssize_t)obj, child.read(obj * 3, obj, data));
+	expect = string(obj, '\0');
+	expect.replace(0, 100, string(100, 'p'));
+	ASSERT_EQ(expect, string(data.c_str(), data.length()));
+      }
+
+      // the parent snapshot itself is untouched
+      ASSERT_EQ(0, parent.snap_set("snap"));
+      bufferlist data;
+      ASSERT_EQ((ssize_t)size, parent.read(0, size, data));
+      ASSERT_EQ(string(size, 'p'), string(data.c_str(), data.length()));
+      ASSERT_EQ(0, parent.snap_set(NULL));
+
+      // the snapshot is pinned while the clone exists
+      ASSERT_EQ(-EBUSY, parent.snap_unprotect("snap"));
+      ASSERT_EQ(-EBUSY, parent.snap_remove("snap"));
+      ASSERT_EQ(-EBUSY, rbd.rename(ioctx, "parent", "parent2"));
+      ASSERT_EQ(0, rbd.rename(ioctx, "child", "child2"));
+      ASSERT_EQ(0, rbd.remove(ioctx, "child2"));
+      ASSERT_EQ(0, parent.snap_unprotect("snap"));
+      ASSERT_EQ(0, parent.snap_remove("snap"));
+    }
+    ASSERT_EQ(0, rbd.remove(ioctx, "parent"));
+  }
+
+  ASSERT_EQ(0, rados.conf_set("rbd_cache", "false"));
+  ioctx.close();
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibRBD, TestClonePP)
+{
+  clone_test("false");
+}
+
+TEST(LibRBD, TestCloneCachePP)
+{
+  clone_test("true");
+}
+
 TEST(LibRBD, TestCreateLsDeleteSnap)
 {
   rados_t cluster;
@@ -0,0 +1,76 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "messages/MOSDPGScan.h"
+#include "test/unit.h"
+
+/*
+ * Encode m as a sender of the given header version would, and decode it
+ * into a fresh message.
+ */
+static MOSDPGScan *reencode(MOSDPGScan *m, int version)
+{
+  m->encode_payload(0);
+  bufferlist bl = m->get_payload();
+  if (version < 2) {
+    // a v1 sender stops before max
+    bufferlist t;
+    t.substr_of(bl, 0, bl.length() - sizeof(__u32));
+    bl.swap(t);
+  }
+  MOSDPGScan *r = new MOSDPGScan;
+  ceph_msg_header h = r->get_header();
+  h.version = version;
+  r->set_header(h);
+  r->set_payload(bl);
+  r->decode_payload();
+  return r;
+}
+
+TEST(MOSDPGScan, MaxHint)
+{
+  hobject_t begin(object_t("foo"), "", CEPH_NOSNAP, 1);
+  MOSDPGScan *m = new MOSDPGScan(MOSDPGScan::OP_SCAN_GET_DIGEST, 3, 3,
+				 pg_t(1, 1, -1), begin, hobject_t(), 100);
+  MOSDPGScan *r = reencode(m, 2);
+  __u32 max = r->max;
+  hobject_t got = r->begin;
+  unsigned under = r->get_max(512);
+  unsigned over = r->get_max(64);
+  r->put();
+  m->put();
+
+  ASSERT_EQ(100u, max);
+  ASSERT_EQ(begin, got);
+  ASSERT_EQ(100u, under);   // the hint, when it is within our limit
+  ASSERT_EQ(64u, over);     // never more than our limit
+}
+
+TEST(MOSDPGScan, NoHint)
+{
+  // a v2 primary that sends no hint, and a v1 primary that can't
+  for (int v = 1; v <= 2; v++) {
+    MOSDPGScan *m = new MOSDPGScan(MOSDPGScan::OP_SCAN_GET_DIGEST, 3, 3,
+				   pg_t(1, 1, -1), hobject_t(), hobject_t(),
+				   v < 2 ? 100 : 0);
+    MOSDPGScan *r = reencode(m, v);
+    __u32 max = r->max;
+    unsigned got = r->get_max(512);
+    r->put();
+    m->put();
+
+    ASSERT_EQ(0u, max);
+    ASSERT_EQ(512u, got);
+  }
+}
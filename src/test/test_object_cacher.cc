@@ -0,0 +1,220 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/Mutex.h"
+#include "osdc/ObjectCacher.h"
+#include "osdc/WritebackHandler.h"
+#include "test/unit.h"
+
+/*
+ * A writeback handler that holds on to every write until the test
+ * commits it.  Nothing here reads from it.
+ */
+struct HeldWriteback : public WritebackHandler {
+  struct Write {
+    object_t oid;
+    map<uint64_t, bufferlist> extents;
+    Context *oncommit;
+  };
+  list<Write> writes;
+  tid_t last_tid;
+
+  HeldWriteback() : last_tid(0) {}
+
+  tid_t read(const object_t& oid, const object_locator_t& oloc,
+	     uint64_t off, uint64_t len, snapid_t snapid,
+	     bufferlist *pbl, uint64_t trunc_size,  __u32 trunc_seq,
+	     Context *onfinish) {
+    assert(0 == "no reads expected");
+    return 0;
+  }
+  tid_t write(const object_t& oid, const object_locator_t& oloc,
+	      uint64_t off, uint64_t len, const SnapContext& snapc,
+	      const bufferlist &bl, utime_t mtime, uint64_t trunc_size,
+	      __u32 trunc_seq, Context *oncommit) {
+    map<uint64_t, bufferlist> extents;
+    extents[off] = bl;
+    return write_extents(oid, oloc, extents, snapc, mtime, trunc_size,
+			 trunc_seq, oncommit);
+  }
+  tid_t write_extents(const object_t& oid, const object_locator_t& oloc,
+		      const map<uint64_t, bufferlist>& extents,
+		      const SnapContext& snapc, utime_t mtime,
+		      uint64_t trunc_size, __u32 trunc_seq,
+		      Context *oncommit) {
+    Write w;
+    w.oid = oid;
+    w.extents = extents;
+    w.oncommit = oncommit;
+    writes.push_back(w);
+    return ++last_tid;
+  }
+
+  // call with the cache lock held, as the real handlers do
+  void commit_all() {
+    while (!writes.empty()) {
+      Context *c = writes.front().oncommit;
+      writes.pop_front();
+      c->complete(0);
+    }
+  }
+};
+
+class ObjectCacherTest : public ::testing::Test {
+protected:
+  Mutex lock;
+  HeldWriteback wb;
+  ObjectCacher oc;
+  ObjectCacher::ObjectSet oset;
+
+  ObjectCacherTest()
+    : lock("ObjectCacherTest::lock"),
+      oc(g_ceph_context, "test", wb, lock, NULL, NULL,
+	 1 << 30, 1 << 30, 1 << 29, 1000),
+      oset(NULL, 0, 0) {}
+
+  ~ObjectCacherTest() {
+    lock.Lock();
+    oc.flush_set(&oset);
+    wb.commit_all();
+    oc.release_set(&oset);
+    lock.Unlock();
+  }
+
+  void write(const char *oid, uint64_t off, uint64_t len, char c) {
+    bufferlist bl;
+    bl.append(string(len, c));
+    ObjectCacher::OSDWrite *wr = oc.prepare_write(SnapContext(), bl,
+						  utime_t(), 0);
+    ObjectExtent extent(object_t(oid), off, len);
+    extent.oloc.pool = 0;
+    extent.buffer_extents[0] = len;
+    wr->extents.push_back(extent);
+    oc.writex(wr, &oset, lock);
+  }
+
+  void discard(const char *oid, uint64_t off, uint64_t len) {
+    vector<ObjectExtent> v;
+    v.push_back(ObjectExtent(object_t(oid), off, len));
+    v.back().oloc.pool = 0;
+    oc.discard_set(&oset, v);
+  }
+
+  /*
+   * walk every bh of every object, and check that the set's index of
+   * dirty and tx bhs holds exactly those
+   */
+  void check_index() {
+    set<ObjectCacher::BufferHead*> scanned;
+    loff_t bytes = 0;
+    for (xlist<ObjectCacher::Object*>::iterator p = oset.objects.begin();
+	 !p.end(); ++p) {
+      ObjectCacher::Object *ob = *p;
+      for (map<loff_t, ObjectCacher::BufferHead*>::iterator q = ob->data.begin();
+	   q != ob->data.end();
+	   ++q) {
+	ObjectCacher::BufferHead *bh = q->second;
+	if (bh->is_dirty() || bh->is_tx()) {
+	  scanned.insert(bh);
+	  bytes += bh->length();
+	}
+      }
+    }
+    set<ObjectCacher::BufferHead*> indexed(oset.dirty_or_tx_bh.begin(),
+					   oset.dirty_or_tx_bh.end());
+    ASSERT_EQ(scanned, indexed);
+    ASSERT_EQ(bytes, (loff_t)oset.dirty_or_tx);
+    ASSERT_EQ(!scanned.empty(), oc.set_is_dirty_or_committing(&oset));
+  }
+
+  unsigned count(const char *oid) {
+    unsigned n = 0;
+    for (xlist<ObjectCacher::Object*>::iterator p = oset.objects.begin();
+	 !p.end(); ++p)
+      if ((*p)->get_oid() == object_t(oid))
+	n += (*p)->data.size();
+    return n;
+  }
+};
+
+TEST_F(ObjectCacherTest, DirtyIndex)
+{
+  Mutex::Locker l(lock);
+  check_index();
+
+  // two apart, then the gap between them: all three merge
+  write("a", 0, 4096, 'a');
+  write("a", 8192, 4096, 'b');
+  ASSERT_EQ(2u, count("a"));
+  check_index();
+  write("a", 4096, 4096, 'c');
+  ASSERT_EQ(1u, count("a"));
+  check_index();
+
+  // a second object, and a hole discarded from the middle of the first
+  write("b", 0, 4096, 'd');
+  discard("a", 2048, 4096);
+  ASSERT_EQ(2u, count("a"));
+  check_index();
+
+  // everything goes tx, one write per object
+  oc.flush_set(&oset);
+  ASSERT_EQ(2u, wb.writes.size());
+  for (list<HeldWriteback::Write>::iterator p = wb.writes.begin();
+       p != wb.writes.end();
+       ++p)
+    ASSERT_EQ(p->oid == object_t("a") ? 2u : 1u, p->extents.size());
+  check_index();
+
+  // overwriting part of a tx bh splits it
+  write("a", 1024, 512, 'e');
+  check_index();
+
+  // the commits clean what they wrote, but not the newer write
+  wb.commit_all();
+  check_index();
+  ASSERT_TRUE(oc.set_is_dirty_or_committing(&oset));
+
+  oc.flush_set(&oset);
+  check_index();
+  wb.commit_all();
+  check_index();
+  ASSERT_FALSE(oc.set_is_dirty_or_committing(&oset));
+
+  // discarding dirty data takes it out of the index too
+  write("b", 100, 100, 'f');
+  check_index();
+  discard("b", 0, 4096);
+  check_index();
+  ASSERT_FALSE(oc.set_is_dirty_or_committing(&oset));
+}
+
+TEST_F(ObjectCacherTest, SplitKeepsAge)
+{
+  Mutex::Locker l(lock);
+  write("a", 0, 8192, 'a');
+  ObjectCacher::Object *ob = *oset.objects.begin();
+  utime_t first = ob->data.begin()->second->last_write;
+
+  // both halves left by a discard are as old as the write
+  discard("a", 2048, 1024);
+  ASSERT_EQ(2u, ob->data.size());
+  for (map<loff_t, ObjectCacher::BufferHead*>::iterator p = ob->data.begin();
+       p != ob->data.end();
+       ++p) {
+    ASSERT_TRUE(p->second->is_dirty());
+    ASSERT_EQ(first, p->second->last_write);
+  }
+  check_index();
+}
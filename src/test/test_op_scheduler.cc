@@ -0,0 +1,253 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "osd/OpScheduler.h"
+#include "gtest/gtest.h"
+
+#include <map>
+
+/*
+ * Replay synthetic op streams against a scheduler in virtual time.  The
+ * "server" completes capacity ops/sec; every client keeps depth ops
+ * queued at all times.
+ */
+
+struct TestPolicy : public OpQoSPolicy<int> {
+  std::map<int, OpQoS> qos;
+  OpQoS get_qos(const int &k) {
+    return qos[k];
+  }
+};
+
+static void simulate(OpScheduler<int, int> *s, std::map<int, OpQoS> &qos,
+		     double capacity, double seconds,
+		     std::map<int, int> *served, int depth = 8)
+{
+  double now = 1000;
+  for (std::map<int, OpQoS>::iterator p = qos.begin(); p != qos.end(); ++p)
+    for (int i = 0; i < depth; i++)
+      s->enqueue(p->first, 1, p->first, now);
+
+  double end = now + seconds;
+  for (; now < end; now += 1.0 / capacity) {
+    int k;
+    if (!s->dequeue(now, &k))
+      continue;   // everyone is over their limit; the server idles
+    (*served)[k]++;
+    s->enqueue(k, 1, k, now);
+  }
+}
+
+TEST(OpScheduler, Fifo)
+{
+  TestPolicy pol;
+  FifoScheduler<int, int> s(&pol);
+  for (int i = 0; i < 10; i++)
+    s.enqueue(i % 3, 1, i, 0);
+  s.enqueue_front(1, 1, -1, 0);
+  ASSERT_EQ(11u, s.length());
+  int v;
+  ASSERT_TRUE(s.dequeue(0, &v));
+  ASSERT_EQ(-1, v);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(s.dequeue(0, &v));
+    ASSERT_EQ(i, v);
+  }
+  ASSERT_TRUE(s.empty());
+  ASSERT_FALSE(s.dequeue(0, &v));
+}
+
+TEST(OpScheduler, PerKeyOrder)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 0);
+  pol.qos[1] = OpQoS(0, 5, 0);
+  mClockScheduler<int, int> s(&pol);
+  for (int i = 0; i < 100; i++)
+    s.enqueue(i % 2, 1, i, 0);
+  s.enqueue_front(0, 1, -2, 0);
+
+  int last[2] = { -1000, -1000 };
+  int v;
+  while (s.dequeue(0, &v)) {
+    int k = v < 0 ? 0 : v % 2;
+    ASSERT_GT(v, last[k]);
+    last[k] = v;
+  }
+  ASSERT_TRUE(s.empty());
+}
+
+TEST(OpScheduler, Weight)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 0);
+  pol.qos[1] = OpQoS(0, 3, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served);
+
+  double ratio = (double)served[1] / (double)served[0];
+  ASSERT_NEAR(3.0, ratio, 0.1);
+  ASSERT_NEAR(10000, served[0] + served[1], 10);
+}
+
+TEST(OpScheduler, Reservation)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(300, 1, 0);   // small weight, but a reservation
+  pol.qos[1] = OpQoS(0, 100, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served);
+
+  // weight alone would give client 0 ~1%; the reservation gives it 30%
+  ASSERT_GE(served[0], 2950);
+  ASSERT_LE(served[0], 3200);
+}
+
+TEST(OpScheduler, Limit)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 10, 100);
+  pol.qos[1] = OpQoS(0, 1, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served);
+
+  // the heavy-weight client is capped; the other gets the rest
+  ASSERT_LE(served[0], 1010);
+  ASSERT_GE(served[0], 950);
+  ASSERT_GE(served[1], 8900);
+}
+
+TEST(OpScheduler, LimitDepthOne)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 10, 100);
+  pol.qos[1] = OpQoS(0, 1, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served, 1);
+
+  // with nothing left queued after each op, the client's tags still
+  // carry over to its next one
+  ASSERT_LE(served[0], 1010);
+  ASSERT_GE(served[0], 950);
+  ASSERT_GE(served[1], 8900);
+}
+
+TEST(OpScheduler, ReservationDepthOne)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(300, 1, 0);
+  pol.qos[1] = OpQoS(0, 100, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served, 1);
+
+  ASSERT_GE(served[0], 2950);
+  ASSERT_LE(served[0], 3200);
+}
+
+TEST(OpScheduler, IdleExpiry)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 10);
+  mClockScheduler<int, int> s(&pol, 60);
+  int v;
+  s.enqueue(0, 1, 0, 1000);
+  ASSERT_TRUE(s.dequeue(1000, &v));
+
+  // an idle key keeps its qos (and tags) for a while...
+  pol.qos[0] = OpQoS(0, 1, 0);
+  s.enqueue(0, 1, 0, 1030);
+  ASSERT_TRUE(s.dequeue(1030, &v));
+  s.enqueue(0, 1, 0, 1030);
+  ASSERT_FALSE(s.dequeue(1030, &v));   // still limited to 10/s
+  ASSERT_TRUE(s.dequeue(1031, &v));
+
+  // ...and is forgotten once idle long enough, picking up the new qos
+  s.enqueue(0, 1, 0, 1200);
+  ASSERT_TRUE(s.dequeue(1200, &v));
+  s.enqueue(0, 1, 0, 1200);
+  ASSERT_TRUE(s.dequeue(1200, &v));
+}
+
+TEST(OpScheduler, LimitIdle)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 10);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 10, &served);
+
+  // a lone limited client does not get more just because we are idle
+  ASSERT_LE(served[0], 101);
+  ASSERT_FALSE(s.empty());
+
+  // ...unless we ask to drain
+  int v;
+  double now = 0;
+  ASSERT_FALSE(s.dequeue(now, &v));
+  ASSERT_TRUE(s.dequeue(now, &v, true));
+  ASSERT_EQ(0, v);
+}
+
+TEST(OpScheduler, RefreshQoS)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 0);
+  pol.qos[1] = OpQoS(0, 1, 0);
+  mClockScheduler<int, int> s(&pol);
+  std::map<int, int> served;
+  simulate(&s, pol.qos, 1000, 5, &served);
+  ASSERT_NEAR(1.0, (double)served[1] / (double)served[0], 0.05);
+
+  // keys still queued keep their old qos until refreshed
+  pol.qos[1] = OpQoS(0, 1, 50);
+  s.refresh_qos();
+  served.clear();
+  double now = 2000;
+  for (int i = 0; i < 10000; i++, now += 0.001) {
+    int k;
+    if (!s.dequeue(now, &k))
+      continue;
+    served[k]++;
+    s.enqueue(k, 1, k, now);
+  }
+  ASSERT_LE(served[1], 510);
+  ASSERT_GE(served[0], 9000);
+}
+
+TEST(OpScheduler, Cost)
+{
+  TestPolicy pol;
+  pol.qos[0] = OpQoS(0, 1, 0);
+  pol.qos[1] = OpQoS(0, 1, 0);
+  mClockScheduler<int, int> s(&pol);
+
+  // client 1's ops are 4x as expensive; it gets a quarter as many
+  int served[2] = { 0, 0 };
+  for (int i = 0; i < 8; i++) {
+    s.enqueue(0, 1, 0, 0);
+    s.enqueue(1, 4, 1, 0);
+  }
+  for (int i = 0; i < 5000; i++) {
+    int k;
+    ASSERT_TRUE(s.dequeue(0, &k));
+    served[k]++;
+    s.enqueue(k, k ? 4 : 1, k, 0);
+  }
+  ASSERT_NEAR(4.0, (double)served[0] / (double)served[1], 0.1);
+}
@@ -0,0 +1,100 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "osdc/OpWindow.h"
+#include "gtest/gtest.h"
+
+// initial 8, min 2, max 16, ratio 4, floor 10ms
+static OpWindow make_window()
+{
+  return OpWindow(8, 2, 16, 4, .01);
+}
+
+TEST(OpWindow, Room)
+{
+  OpWindow w = make_window();
+  for (int i = 0; i < 8; i++) {
+    ASSERT_TRUE(w.has_room());
+    w.inflight++;
+  }
+  ASSERT_FALSE(w.has_room());
+
+  // a reply frees a slot for the next waiter
+  w.inflight--;
+  ASSERT_FALSE(w.reply(utime_t(1, 0), .001));
+  ASSERT_TRUE(w.has_room());
+}
+
+TEST(OpWindow, Grow)
+{
+  OpWindow w = make_window();
+  utime_t now(1, 0);
+
+  // about one op per window's worth of fast replies
+  for (int i = 0; i < 8; i++)
+    ASSERT_FALSE(w.reply(now, .001));
+  ASSERT_GT(w.window, 8.9);
+  ASSERT_LT(w.window, 9.0);
+
+  // and no further than max
+  for (int i = 0; i < 1000; i++)
+    w.reply(now, .001);
+  ASSERT_EQ(16.0, w.window);
+}
+
+TEST(OpWindow, Shrink)
+{
+  OpWindow w = make_window();
+  utime_t now(1, 0);
+  w.reply(now, .005);
+  ASSERT_EQ(.005, w.lat_base);
+
+  // slow, but under the floor: still grows
+  double before = w.window;
+  ASSERT_FALSE(w.reply(now, .009));
+  ASSERT_GT(w.window, before);
+
+  // over the floor and ratio times the base: halves
+  now += 1;
+  before = w.window;
+  ASSERT_TRUE(w.reply(now, .1));
+  ASSERT_EQ(before / 2, w.window);
+
+  // at most once per round trip
+  ASSERT_FALSE(w.reply(now, .1));
+  ASSERT_EQ(before / 2, w.window);
+
+  // and never below min
+  for (int i = 0; i < 10; i++) {
+    now += 1;
+    w.reply(now, 1);
+  }
+  ASSERT_EQ(2.0, w.window);
+}
+
+TEST(OpWindow, BaseDrifts)
+{
+  OpWindow w = make_window();
+  utime_t now(1, 0);
+  w.reply(now, .02);
+
+  // .1 is a slow reply against a .02 base
+  ASSERT_GT(.1, w.lat_base * w.ratio);
+  for (int i = 0; i < 20; i++)
+    w.tick();
+  // ... but not once the base has drifted up
+  ASSERT_LT(.1, w.lat_base * w.ratio);
+  now += 1;
+  ASSERT_FALSE(w.reply(now, .1));
+}
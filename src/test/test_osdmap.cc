@@ -0,0 +1,199 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "osd/OSDMap.h"
+#include "test/unit.h"
+
+static const int num_osds = 12;
+
+static void build_map(OSDMap& m)
+{
+  uuid_d fsid;
+  m.build_simple(g_ceph_context, 1, fsid, num_osds, 4, 4);
+  for (int i = 0; i < num_osds; i++) {
+    m.set_state(i, CEPH_OSD_EXISTS | CEPH_OSD_UP);
+    m.set_weight(i, CEPH_OSD_IN);
+  }
+}
+
+// what crush says, without the cache
+static void calc_up(const OSDMap& m, pg_t pg, vector<int>& up)
+{
+  const pg_pool_t *pool = m.get_pg_pool(pg.pool());
+  vector<__u32> weights;
+  for (int i = 0; i < m.get_max_osd(); i++)
+    weights.push_back(m.get_weight(i));
+  int ruleno = m.crush->find_rule(pool->get_crush_ruleset(), pool->get_type(),
+				  pool->get_size());
+  vector<int> raw;
+  m.crush->do_rule(ruleno, pool->raw_pg_to_pps(pg), raw, pool->get_size(), weights);
+  up.clear();
+  for (unsigned i = 0; i < raw.size(); i++)
+    if (m.is_up(raw[i]))
+      up.push_back(raw[i]);
+}
+
+static void check_all(const OSDMap& m)
+{
+  for (int64_t pool = 0; pool < 3; pool++) {
+    unsigned pg_num = m.get_pg_pool(pool)->get_pg_num();
+    // raw pgs beyond pg_num fold onto the same seeds
+    for (unsigned ps = 0; ps < pg_num * 2; ps++) {
+      pg_t pg(ps, pool, -1);
+      vector<int> up, acting, expect;
+      m.pg_to_up_acting_osds(pg, up, acting);
+      calc_up(m, pg, expect);
+      ASSERT_EQ(expect, up);
+      ASSERT_EQ(expect, acting);
+    }
+  }
+}
+
+TEST(OSDMap, MappingMatchesCrush)
+{
+  OSDMap m;
+  build_map(m);
+  check_all(m);
+  check_all(m);   // again, from the cache
+}
+
+TEST(OSDMap, MappingParallelBuild)
+{
+  OSDMap m;
+  build_map(m);
+  m.build_pg_mappings(4);
+  check_all(m);
+}
+
+TEST(OSDMap, MappingInvalidate)
+{
+  OSDMap m;
+  build_map(m);
+  check_all(m);
+
+  // mark osd.0 down in place
+  m.set_state(0, CEPH_OSD_EXISTS);
+  check_all(m);
+
+  // and osd.1 down via an incremental
+  OSDMap::Incremental inc(m.get_epoch() + 1);
+  inc.fsid = m.get_fsid();
+  inc.new_state[1] = CEPH_OSD_UP;
+  m.apply_incremental(inc);
+  ASSERT_FALSE(m.is_up(1));
+  check_all(m);
+
+  for (int64_t pool = 0; pool < 3; pool++) {
+    for (unsigned ps = 0; ps < 16; ps++) {
+      vector<int> up, acting;
+      m.pg_to_up_acting_osds(pg_t(ps, pool, -1), up, acting);
+      for (unsigned i = 0; i < up.size(); i++) {
+	ASSERT_NE(0, up[i]);
+	ASSERT_NE(1, up[i]);
+      }
+    }
+  }
+}
+
+TEST(OSDMap, MappingCopyAndDedup)
+{
+  // round trip so the pool masks are filled in the way the osd sees them
+  OSDMap a;
+  {
+    OSDMap t;
+    build_map(t);
+    bufferlist bl;
+    t.encode(bl);
+    a.decode(bl);
+  }
+  check_all(a);
+
+  // a copy modified in place must not disturb the original
+  OSDMap b = a;
+  b.set_weight(2, CEPH_OSD_OUT);
+  check_all(a);
+  check_all(b);
+
+  // the next epoch, decoded from scratch, picks up a's tables
+  OSDMap next = a;
+  OSDMap::Incremental inc(a.get_epoch() + 1);
+  inc.fsid = a.get_fsid();
+  inc.new_up_thru[0] = a.get_epoch();
+  next.apply_incremental(inc);
+  bufferlist bl;
+  next.encode(bl);
+  OSDMap c;
+  c.decode(bl);
+  OSDMap::dedup(&a, &c);
+  ASSERT_EQ(a.crush, c.crush);
+  for (int64_t pool = 0; pool < 3; pool++)
+    ASSERT_TRUE(c.shares_pool_mapping(a, pool));
+  check_all(c);
+  for (int64_t pool = 0; pool < 3; pool++)
+    ASSERT_TRUE(c.shares_pool_mapping(a, pool));
+
+  // b was modified in place, so it must have its own tables
+  for (int64_t pool = 0; pool < 3; pool++)
+    ASSERT_FALSE(b.shares_pool_mapping(a, pool));
+}
+
+TEST(OSDMap, DeepishCopy)
+{
+  OSDMap a;
+  build_map(a);
+  OSDMap b;
+  b.deepish_copy_from(a);
+
+  // applying an incremental to the copy leaves the original alone
+  OSDMap::Incremental inc(b.get_epoch() + 1);
+  inc.fsid = b.get_fsid();
+  pg_t pg(0, 0, -1);
+  inc.new_pg_temp[pg].push_back(3);
+  b.apply_incremental(inc);
+
+  vector<int> up, acting;
+  b.pg_to_up_acting_osds(pg, up, acting);
+  ASSERT_EQ(vector<int>(1, 3), acting);
+  check_all(a);
+}
+
+TEST(OSDMap, CrushLocality)
+{
+  OSDMap m;
+  build_map(m);
+  CrushWrapper& c = *m.crush;
+
+  // move the last osd to a host of its own in the same rack
+  ASSERT_EQ(0, c.remove_item(g_ceph_context, num_osds - 1));
+  map<string,string> loc;
+  loc["host"] = "otherhost";
+  loc["rack"] = "localrack";
+  loc["pool"] = "default";
+  ASSERT_EQ(0, c.insert_item(g_ceph_context, num_osds - 1, 1.0, "osd.11", loc));
+
+  map<string,string> here;
+  here["host"] = "localhost";
+  here["rack"] = "localrack";
+  ASSERT_EQ(1, c.get_item_locality(0, here));
+  ASSERT_EQ(2, c.get_item_locality(num_osds - 1, here));
+
+  map<string,string> rack;
+  rack["rack"] = "localrack";
+  ASSERT_EQ(2, c.get_item_locality(0, rack));
+
+  map<string,string> nowhere;
+  nowhere["host"] = "nosuchhost";
+  ASSERT_EQ(-1, c.get_item_locality(0, nowhere));
+  ASSERT_EQ(-1, c.get_item_locality(0, map<string,string>()));
+}
@@ -0,0 +1,147 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "common/Mutex.h"
+#include "osd/PGLoader.h"
+#include "test/unit.h"
+
+/*
+ * stands in for a pg: its "on-disk" info and log are a string in a
+ * shared, read-only store, and loading it reads that and derives the
+ * past intervals from it, as OSD::load_pg_state does.
+ */
+struct FakePG {
+  unsigned id;
+  std::string info;
+  std::vector<unsigned> past_intervals;
+  int loads;
+  FakePG(unsigned i) : id(i), loads(0) {}
+};
+
+struct FakeLoader {
+  const std::map<unsigned, std::string>& store;
+  Mutex lock;
+  int in_flight, max_in_flight;  // protected by lock
+
+  FakeLoader(const std::map<unsigned, std::string>& s)
+    : store(s), lock("FakeLoader::lock"), in_flight(0), max_in_flight(0) {}
+
+  void operator()(FakePG *pg) {
+    lock.Lock();
+    if (++in_flight > max_in_flight)
+      max_in_flight = in_flight;
+    lock.Unlock();
+
+    pg->loads++;
+    pg->info = store.find(pg->id)->second;
+    unsigned h = pg->id;
+    for (unsigned i = 0; i < pg->info.size(); i++) {
+      h = h * 31 + pg->info[i];
+      if (h % 3 == 0)
+	pg->past_intervals.push_back(h);
+    }
+    usleep(1000);  // the disk
+
+    lock.Lock();
+    in_flight--;
+    lock.Unlock();
+  }
+};
+
+static void make_store(unsigned n, std::map<unsigned, std::string> *store)
+{
+  for (unsigned i = 0; i < n; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "pg %u ", i);
+    std::string s;
+    for (unsigned j = 0; j <= i % 7; j++)
+      s += buf;
+    (*store)[i] = s;
+  }
+}
+
+static void load(const std::map<unsigned, std::string>& store,
+		 unsigned nthreads, std::vector<FakePG*> *pgs, int *max_in_flight)
+{
+  for (std::map<unsigned, std::string>::const_iterator p = store.begin();
+       p != store.end();
+       ++p)
+    pgs->push_back(new FakePG(p->first));
+  FakeLoader loader(store);
+  PGLoader<FakePG*, FakeLoader>(*pgs, loader).run(nthreads);
+  if (max_in_flight)
+    *max_in_flight = loader.max_in_flight;
+}
+
+static void put(std::vector<FakePG*>& pgs)
+{
+  for (unsigned i = 0; i < pgs.size(); i++)
+    delete pgs[i];
+  pgs.clear();
+}
+
+TEST(PGLoader, ParallelMatchesSerial)
+{
+  std::map<unsigned, std::string> store;
+  make_store(64, &store);
+
+  std::vector<FakePG*> serial;
+  int serial_max;
+  load(store, 1, &serial, &serial_max);
+  ASSERT_EQ(1, serial_max);
+
+  std::vector<FakePG*> parallel;
+  int parallel_max;
+  load(store, 4, &parallel, &parallel_max);
+  ASSERT_LT(1, parallel_max);
+  ASSERT_GE(4, parallel_max);
+
+  ASSERT_EQ(serial.size(), parallel.size());
+  for (unsigned i = 0; i < serial.size(); i++) {
+    ASSERT_EQ(1, serial[i]->loads);
+    ASSERT_EQ(1, parallel[i]->loads);
+    ASSERT_EQ(serial[i]->id, parallel[i]->id);
+    ASSERT_EQ(serial[i]->info, parallel[i]->info);
+    ASSERT_EQ(serial[i]->past_intervals, parallel[i]->past_intervals);
+  }
+  put(serial);
+  put(parallel);
+}
+
+TEST(PGLoader, MoreThreadsThanPGs)
+{
+  std::map<unsigned, std::string> store;
+  make_store(3, &store);
+  std::vector<FakePG*> pgs;
+  int max_in_flight;
+  load(store, 16, &pgs, &max_in_flight);
+  ASSERT_GE(3, max_in_flight);
+  for (unsigned i = 0; i < pgs.size(); i++)
+    ASSERT_EQ(1, pgs[i]->loads);
+  put(pgs);
+}
+
+TEST(PGLoader, NoPGs)
+{
+  std::map<unsigned, std::string> store;
+  std::vector<FakePG*> pgs;
+  int max_in_flight;
+  load(store, 4, &pgs, &max_in_flight);
+  ASSERT_EQ(0, max_in_flight);
+}
@@ -0,0 +1,186 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/Clock.h"
+#include "common/Mutex.h"
+#include "common/TimerWheel.h"
+#include "include/Context.h"
+#include "test/unit.h"
+
+#include <unistd.h>
+#include <vector>
+
+static Mutex wheel_lock("test_timer_wheel");
+
+struct C_Record : public Context {
+  std::vector<int> *fired;
+  int n;
+  C_Record(std::vector<int> *f, int n_) : fired(f), n(n_) {}
+  void finish(int r) {
+    assert(wheel_lock.is_locked());
+    fired->push_back(n);
+  }
+};
+
+struct C_Cancel : public Context {
+  TimerWheel *w;
+  Context *victim;
+  bool *cancelled;
+  C_Cancel(TimerWheel *w_, Context *v, bool *c) : w(w_), victim(v), cancelled(c) {}
+  void finish(int r) {
+    *cancelled = w->cancel_event(victim);
+  }
+};
+
+/*
+ * These drive the wheel by hand with advance_to() rather than starting
+ * its thread, and only assert once the lock is dropped.
+ */
+
+TEST(TimerWheel, FiresInOrder)
+{
+  TimerWheel w(g_ceph_context, wheel_lock, .01, 8);
+  std::vector<int> fired;
+
+  wheel_lock.Lock();
+  utime_t now = ceph_clock_now(g_ceph_context);
+  // past a few revolutions of the wheel, out of order
+  for (int i = 5; i > 0; i--) {
+    utime_t when = now;
+    when += .03 * i;
+    w.add_event_at(when, new C_Record(&fired, i));
+  }
+  unsigned pending = w.size();
+
+  utime_t t = now;
+  t += .045;
+  w.advance_to(t);
+  std::vector<int> first = fired;
+
+  // one jump over more than a revolution
+  t = now;
+  t += 1;
+  w.advance_to(t);
+  std::vector<int> all = fired;
+  unsigned left = w.size();
+
+  // already due
+  w.add_event_at(now, new C_Record(&fired, 6));
+  w.advance_to(t);
+  size_t after = fired.size();
+
+  w.shutdown();
+  wheel_lock.Unlock();
+
+  ASSERT_EQ(5u, pending);
+  ASSERT_EQ(1u, first.size());
+  ASSERT_EQ(1, first[0]);
+  ASSERT_EQ(0u, left);
+  ASSERT_EQ(5u, all.size());
+  for (int i = 0; i < 5; i++)
+    ASSERT_EQ(i + 1, all[i]);
+  ASSERT_EQ(6u, after);
+}
+
+TEST(TimerWheel, Cancel)
+{
+  TimerWheel w(g_ceph_context, wheel_lock, .01);
+  std::vector<int> fired;
+
+  wheel_lock.Lock();
+  utime_t now = ceph_clock_now(g_ceph_context);
+  Context *a = new C_Record(&fired, 1);
+  Context *b = new C_Record(&fired, 2);
+  utime_t when = now;
+  when += .05;
+  w.add_event_at(when, a);
+  w.add_event_at(when, b);
+  bool first_cancel = w.cancel_event(a);
+  bool second_cancel = w.cancel_event(a);
+
+  // a callback cancelling an event that is due at the same tick
+  Context *c = new C_Record(&fired, 3);
+  bool cancelled = false;
+  when += .05;
+  w.add_event_at(when, new C_Cancel(&w, c, &cancelled));
+  w.add_event_at(when, c);
+
+  when += 1;
+  w.advance_to(when);
+  unsigned left = w.size();
+
+  w.shutdown();
+  wheel_lock.Unlock();
+
+  ASSERT_TRUE(first_cancel);
+  ASSERT_FALSE(second_cancel);
+  ASSERT_EQ(1u, fired.size());
+  ASSERT_EQ(2, fired[0]);
+  ASSERT_TRUE(cancelled);
+  ASSERT_EQ(0u, left);
+}
+
+TEST(TimerWheel, Many)
+{
+  TimerWheel w(g_ceph_context, wheel_lock, .25);
+  std::vector<int> fired;
+
+  wheel_lock.Lock();
+  std::vector<Context*> cs;
+  for (int i = 0; i < 100000; i++) {
+    cs.push_back(new C_Record(&fired, i));
+    w.add_event_after(30 + (i % 600), cs.back());
+  }
+  unsigned added = w.size();
+  int failed = 0;
+  for (int i = 0; i < 100000; i += 2)
+    if (!w.cancel_event(cs[i]))
+      failed++;
+  unsigned left = w.size();
+  w.shutdown();   // cancels the rest
+  unsigned after = w.size();
+  wheel_lock.Unlock();
+
+  ASSERT_EQ(100000u, added);
+  ASSERT_EQ(0, failed);
+  ASSERT_EQ(50000u, left);
+  ASSERT_EQ(0u, after);
+  ASSERT_TRUE(fired.empty());
+}
+
+TEST(TimerWheel, Thread)
+{
+  TimerWheel w(g_ceph_context, wheel_lock, .01);
+  w.init();
+  std::vector<int> fired;
+
+  wheel_lock.Lock();
+  w.add_event_after(.02, new C_Record(&fired, 1));
+  wheel_lock.Unlock();
+
+  // generous, so a loaded machine does not fail it
+  size_t n = 0;
+  for (int i = 0; i < 1000 && n == 0; i++) {
+    usleep(10000);
+    wheel_lock.Lock();
+    n = fired.size();
+    wheel_lock.Unlock();
+  }
+
+  wheel_lock.Lock();
+  w.shutdown();
+  wheel_lock.Unlock();
+
+  ASSERT_EQ(1u, n);
+}
@@ -0,0 +1,62 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2012 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/TokenBucket.h"
+#include "gtest/gtest.h"
+
+TEST(TokenBucket, Unlimited)
+{
+  TokenBucket b;
+  utime_t now(100, 0);
+  ASSERT_TRUE(b.is_unlimited());
+  b.take(now, 1000000);
+  ASSERT_TRUE(b.may_start(now));
+  ASSERT_EQ(0.0, b.get_wait(now));
+}
+
+TEST(TokenBucket, Debt)
+{
+  TokenBucket b;
+  utime_t now(100, 0);
+  b.set_rate(1000);
+  b.refill(now);
+  ASSERT_TRUE(b.may_start(now));
+
+  // overdraw by one second's worth
+  b.take(now, 2000);
+  ASSERT_FALSE(b.may_start(now));
+  ASSERT_EQ(1.0, b.get_wait(now));
+
+  // half a second later we are still in debt
+  now += 0.5;
+  ASSERT_FALSE(b.may_start(now));
+
+  // and after the debt is repaid we may start again
+  now += 0.6;
+  ASSERT_TRUE(b.may_start(now));
+}
+
+TEST(TokenBucket, Burst)
+{
+  TokenBucket b;
+  utime_t now(100, 0);
+  b.set_rate(100, 500);
+  b.refill(now);
+  now += 60.0;
+  ASSERT_EQ(500.0, b.get_tokens(now));
+
+  // lowering the burst clamps the balance
+  b.set_rate(100, 50);
+  ASSERT_EQ(50.0, b.get_tokens(now));
+}